@@ -45,6 +45,7 @@
 #include "qemu/guest-random.h"
 #include "sysemu/hw_accel.h"
 #include "kvm-cpus.h"
+#include "sysemu/dirtylimit.h"
 
 #include "hw/boards.h"
 
@@ -636,6 +637,69 @@ static void kvm_slot_reset_dirty_pages(KVMSlot *slot)
     memset(slot->dirty_bmap, 0, slot->dirty_bmap_size);
 }
 
+/*
+ * Past that many pages, walking the whole dirty bitmap of the slot costs
+ * about as much as walking the queue of dirty pages.
+ */
+static uint64_t kvm_slot_dirty_queue_max(KVMSlot *slot)
+{
+    return MAX(slot->memory_size / qemu_real_host_page_size / BITS_PER_LONG,
+               BITS_PER_LONG);
+}
+
+/* Should be with all slots_lock held for the address spaces. */
+static void kvm_slot_dirty_queue_add(KVMSlot *slot, uint64_t offset)
+{
+    if (slot->dirty_queue_overflow) {
+        return;
+    }
+    if (slot->dirty_queue_len == slot->dirty_queue_size) {
+        if (slot->dirty_queue_size == kvm_slot_dirty_queue_max(slot)) {
+            slot->dirty_queue_overflow = true;
+            return;
+        }
+        slot->dirty_queue_size = MIN(MAX(slot->dirty_queue_size * 2, 1024),
+                                     kvm_slot_dirty_queue_max(slot));
+        slot->dirty_queue = g_renew(uint64_t, slot->dirty_queue,
+                                    slot->dirty_queue_size);
+    }
+    slot->dirty_queue[slot->dirty_queue_len++] = offset;
+}
+
+/*
+ * Sync the pages collected from the dirty rings into the slot's bitmap to
+ * qemu's bitmap, and clear them.  Only the words of the bitmap where the
+ * pages are queued are looked at, so that the cost depends on the number
+ * of dirty pages rather than on the size of the slot.
+ */
+static void kvm_slot_sync_dirty_ring(KVMSlot *slot)
+{
+    ram_addr_t word_size = qemu_real_host_page_size * BITS_PER_LONG;
+    uint64_t i;
+
+    if (slot->dirty_queue_overflow) {
+        kvm_slot_sync_dirty_pages(slot);
+        kvm_slot_reset_dirty_pages(slot);
+    } else {
+        for (i = 0; i < slot->dirty_queue_len; i++) {
+            unsigned long word = BIT_WORD(slot->dirty_queue[i]);
+            unsigned long bits = slot->dirty_bmap[word];
+
+            /* Already done with an earlier page in the same word */
+            if (!bits) {
+                continue;
+            }
+            slot->dirty_bmap[word] = 0;
+            cpu_physical_memory_set_dirty_lebitmap(&bits,
+                slot->ram_start_offset + word * word_size, BITS_PER_LONG);
+        }
+    }
+    trace_kvm_slot_sync_dirty_ring(slot->slot, slot->dirty_queue_len,
+                                   slot->dirty_queue_overflow);
+    slot->dirty_queue_len = 0;
+    slot->dirty_queue_overflow = false;
+}
+
 #define ALIGN(x, y)  (((x)+(y)-1) & ~((y)-1))
 
 /* Allocate the dirty bitmap for a slot  */
@@ -711,7 +775,10 @@ static void kvm_dirty_ring_mark_page(KVMState *s, uint32_t as_id,
         return;
     }
 
-    set_bit(offset, mem->dirty_bmap);
+    if (!test_bit(offset, mem->dirty_bmap)) {
+        set_bit(offset, mem->dirty_bmap);
+        kvm_slot_dirty_queue_add(mem, offset);
+    }
 }
 
 static bool dirty_gfn_is_dirtied(struct kvm_dirty_gfn *gfn)
@@ -755,18 +822,24 @@ static uint32_t kvm_dirty_ring_reap_one(KVMState *s, CPUState *cpu)
     return count;
 }
 
-/* Must be with slots_lock held */
-static uint64_t kvm_dirty_ring_reap_locked(KVMState *s)
+/*
+ * Must be with slots_lock held.  Reap the ring of @cpu only, or the rings
+ * of all vcpus if it is NULL.
+ */
+static uint64_t kvm_dirty_ring_reap_locked(KVMState *s, CPUState *cpu)
 {
     int ret;
-    CPUState *cpu;
     uint64_t total = 0;
     int64_t stamp;
 
     stamp = get_clock();
 
-    CPU_FOREACH(cpu) {
-        total += kvm_dirty_ring_reap_one(s, cpu);
+    if (cpu) {
+        total = kvm_dirty_ring_reap_one(s, cpu);
+    } else {
+        CPU_FOREACH(cpu) {
+            total += kvm_dirty_ring_reap_one(s, cpu);
+        }
     }
 
     if (total) {
@@ -787,7 +860,7 @@ static uint64_t kvm_dirty_ring_reap_locked(KVMState *s)
  * Currently for simplicity, we must hold BQL before calling this.  We can
  * consider to drop the BQL if we're clear with all the race conditions.
  */
-static uint64_t kvm_dirty_ring_reap(KVMState *s)
+static uint64_t kvm_dirty_ring_reap(KVMState *s, CPUState *cpu)
 {
     uint64_t total;
 
@@ -807,7 +880,7 @@ static uint64_t kvm_dirty_ring_reap(KVMState *s)
      *     reset below.
      */
     kvm_slots_lock();
-    total = kvm_dirty_ring_reap_locked(s);
+    total = kvm_dirty_ring_reap_locked(s, cpu);
     kvm_slots_unlock();
 
     return total;
@@ -854,7 +927,7 @@ static void kvm_dirty_ring_flush(void)
      * vcpus out in a synchronous way.
      */
     kvm_cpu_synchronize_kick_all();
-    kvm_dirty_ring_reap(kvm_state);
+    kvm_dirty_ring_reap(kvm_state, NULL);
     trace_kvm_dirty_ring_flush(1);
 }
 
@@ -1398,16 +1471,21 @@ static void kvm_set_phys_mem(KVMMemoryListener *kml,
                  * Not easy.  Let's cross the fingers until it's fixed.
                  */
                 if (kvm_state->kvm_dirty_ring_size) {
-                    kvm_dirty_ring_reap_locked(kvm_state);
+                    kvm_dirty_ring_reap_locked(kvm_state, NULL);
+                    kvm_slot_sync_dirty_ring(mem);
                 } else {
                     kvm_slot_get_dirty_log(kvm_state, mem);
+                    kvm_slot_sync_dirty_pages(mem);
                 }
-                kvm_slot_sync_dirty_pages(mem);
             }
 
             /* unregister the slot */
             g_free(mem->dirty_bmap);
             mem->dirty_bmap = NULL;
+            g_free(mem->dirty_queue);
+            mem->dirty_queue = NULL;
+            mem->dirty_queue_len = mem->dirty_queue_size = 0;
+            mem->dirty_queue_overflow = false;
             mem->memory_size = 0;
             mem->flags = 0;
             err = kvm_set_user_memory_region(kml, mem, false);
@@ -1466,11 +1544,19 @@ static void *kvm_dirty_ring_reaper_thread(void *data)
          */
         sleep(1);
 
+        /*
+         * Dirty limits throttle vcpus when their ring is full, which
+         * reaping them behind their back would prevent.
+         */
+        if (dirtylimit_in_service()) {
+            continue;
+        }
+
         trace_kvm_dirty_ring_reaper("wakeup");
         r->reaper_state = KVM_DIRTY_RING_REAPER_REAPING;
 
         qemu_mutex_lock_iothread();
-        kvm_dirty_ring_reap(s);
+        kvm_dirty_ring_reap(s, NULL);
         qemu_mutex_unlock_iothread();
 
         r->reaper_iteration++;
@@ -1540,13 +1626,11 @@ static void kvm_log_sync_global(MemoryListener *l)
     for (i = 0; i < s->nr_slots; i++) {
         mem = &kml->slots[i];
         if (mem->memory_size && mem->flags & KVM_MEM_LOG_DIRTY_PAGES) {
-            kvm_slot_sync_dirty_pages(mem);
             /*
-             * This is not needed by KVM_GET_DIRTY_LOG because the
-             * ioctl will unconditionally overwrite the whole region.
-             * However kvm dirty ring has no such side effect.
+             * Unlike KVM_GET_DIRTY_LOG, which overwrites the whole region,
+             * the dirty ring only sets bits, which must be cleared here.
              */
-            kvm_slot_reset_dirty_pages(mem);
+            kvm_slot_sync_dirty_ring(mem);
         }
     }
     kvm_slots_unlock();
@@ -2310,6 +2394,11 @@ bool kvm_dirty_ring_enabled(void)
     return kvm_state->kvm_dirty_ring_size ? true : false;
 }
 
+uint32_t kvm_dirty_ring_size(void)
+{
+    return kvm_state->kvm_dirty_ring_size;
+}
+
 static int kvm_init(MachineState *ms)
 {
     MachineClass *mc = MACHINE_GET_CLASS(ms);
@@ -2957,8 +3046,15 @@ int kvm_cpu_exec(CPUState *cpu)
              */
             trace_kvm_dirty_ring_full(cpu->cpu_index);
             qemu_mutex_lock_iothread();
-            kvm_dirty_ring_reap(kvm_state);
+            /*
+             * With dirty limits, only reap the ring that is full: reaping
+             * all of them would keep the other vcpus from ever filling
+             * theirs, and from being throttled.
+             */
+            kvm_dirty_ring_reap(kvm_state,
+                                dirtylimit_in_service() ? cpu : NULL);
             qemu_mutex_unlock_iothread();
+            dirtylimit_vcpu_execute(cpu);
             ret = 0;
             break;
         case KVM_EXIT_SYSTEM_EVENT:
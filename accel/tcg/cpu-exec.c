@@ -44,6 +44,7 @@
 #include "sysemu/tcg.h"
 #include "exec/helper-proto.h"
 #include "tb-hash.h"
+#include "tb-jmp-cache.h"
 #include "tb-context.h"
 #include "internal.h"
 
@@ -176,28 +177,43 @@ static inline TranslationBlock *tb_lookup(CPUState *cpu, target_ulong pc,
                                           target_ulong cs_base,
                                           uint32_t flags, uint32_t cflags)
 {
+    CPUJumpCache *jc = cpu->tb_jmp_cache;
+    CPUJumpCacheEntry *set;
     TranslationBlock *tb;
-    uint32_t hash;
+    uint32_t gen = qatomic_read(&jc->gen);
+    int i;
 
     /* we should never be trying to look up an INVALID tb */
     tcg_debug_assert(!(cflags & CF_INVALID));
 
-    hash = tb_jmp_cache_hash_func(pc);
-    tb = qatomic_rcu_read(&cpu->tb_jmp_cache[hash]);
-
-    if (likely(tb &&
-               tb->pc == pc &&
-               tb->cs_base == cs_base &&
-               tb->flags == flags &&
-               tb->trace_vcpu_dstate == *cpu->trace_dstate &&
-               tb_cflags(tb) == cflags)) {
-        return tb;
+    set = tb_jmp_cache_set(jc, pc);
+    for (i = 0; i < TB_JMP_CACHE_WAYS; i++) {
+        tb = qatomic_rcu_read(&set[i].tb);
+        if (likely(tb &&
+                   set[i].gen == gen &&
+                   tb->pc == pc &&
+                   tb->cs_base == cs_base &&
+                   tb->flags == flags &&
+                   tb->trace_vcpu_dstate == *cpu->trace_dstate &&
+                   tb_cflags(tb) == cflags)) {
+            tb_jmp_cache_count(cpu, jc, true);
+            return tb;
+        }
     }
     tb = tb_htable_lookup(cpu, pc, cs_base, flags, cflags);
     if (tb == NULL) {
         return NULL;
     }
-    qatomic_set(&cpu->tb_jmp_cache[hash], tb);
+    /*
+     * A TB translated in the background is only reachable from here until
+     * it gets into a jump cache or is chained to, so it is checked once.
+     */
+    if (unlikely(qatomic_read(&tb->worker_unchecked)) &&
+        !tb_worker_check(tb)) {
+        return NULL;
+    }
+    tb_jmp_cache_insert(cpu, pc, tb);
+    tb_jmp_cache_count(cpu, jc, false);
     return tb;
 }
 
@@ -863,8 +879,15 @@ static inline void cpu_loop_exec_tb(CPUState *cpu, TranslationBlock *tb,
         return;
     }
 
+    /*
+     * Without icount, the TB exited because it became hot; see
+     * gen_tb_start().  cpu_exec() retranslates it as a trace.
+     */
+    if (!icount_enabled()) {
+        return;
+    }
+
     /* Instruction counter expired.  */
-    assert(icount_enabled());
 #ifndef CONFIG_USER_ONLY
     /* Ensure global icount has gone forward */
     icount_update(cpu);
@@ -984,7 +1007,12 @@ int cpu_exec(CPUState *cpu)
                  * We add the TB in the virtual pc hash table
                  * for the fast lookup
                  */
-                qatomic_set(&cpu->tb_jmp_cache[tb_jmp_cache_hash_func(pc)], tb);
+                tb_jmp_cache_insert(cpu, pc, tb);
+            } else if (unlikely(tb_trace_hot(tb))) {
+                mmap_lock();
+                tb = tb_gen_trace(cpu, tb);
+                mmap_unlock();
+                tb_jmp_cache_insert(cpu, pc, tb);
             }
 
 #ifndef CONFIG_USER_ONLY
@@ -1027,6 +1055,7 @@ void tcg_exec_realizefn(CPUState *cpu, Error **errp)
         tcg_target_initialized = true;
     }
     tlb_init(cpu);
+    tb_jmp_cache_init(cpu);
     qemu_plugin_vcpu_init_hook(cpu);
 
 #ifndef CONFIG_USER_ONLY
@@ -1042,6 +1071,7 @@ void tcg_exec_unrealizefn(CPUState *cpu)
 #endif /* !CONFIG_USER_ONLY */
 
     qemu_plugin_vcpu_exit_hook(cpu);
+    tb_jmp_cache_free(cpu);
     tlb_destroy(cpu);
 }
 
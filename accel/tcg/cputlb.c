@@ -35,6 +35,7 @@
 #include "exec/translate-all.h"
 #include "trace/trace-root.h"
 #include "tb-hash.h"
+#include "tb-jmp-cache.h"
 #include "internal.h"
 #ifdef CONFIG_PLUGIN
 #include "qemu/plugin-memory.h"
@@ -98,15 +99,6 @@ static void tlb_window_reset(CPUTLBDesc *desc, int64_t ns,
     desc->window_max_entries = max_entries;
 }
 
-static void tb_jmp_cache_clear_page(CPUState *cpu, target_ulong page_addr)
-{
-    unsigned int i, i0 = tb_jmp_cache_hash_page(page_addr);
-
-    for (i = 0; i < TB_JMP_PAGE_SIZE; i++) {
-        qatomic_set(&cpu->tb_jmp_cache[i0 + i], NULL);
-    }
-}
-
 static void tb_flush_jmp_cache(CPUState *cpu, target_ulong addr)
 {
     /* Discard jump cache entries for any tb which might potentially
@@ -784,10 +776,11 @@ static void tlb_flush_range_by_mmuidx_async_0(CPUState *cpu,
     qemu_spin_unlock(&env_tlb(env)->c.lock);
 
     /*
-     * If the length is larger than the jump cache size, then it will take
-     * longer to clear each entry individually than it will to clear it all.
+     * If the range covers every group of sets that pages map to, then it
+     * will take longer to clear each page individually than to clear it
+     * all, which only starts a new generation of the jump cache.
      */
-    if (d.len >= (TARGET_PAGE_SIZE * TB_JMP_CACHE_SIZE)) {
+    if ((d.len >> TARGET_PAGE_BITS) >= tb_jmp_cache_page_slots(cpu)) {
         cpu_tb_jmp_cache_clear(cpu);
         return;
     }
@@ -2575,7 +2568,10 @@ void cpu_stq_le_mmu(CPUArchState *env, target_ulong addr, uint64_t val,
 #include "atomic_template.h"
 #endif
 
-/* Code access functions.  */
+/*
+ * Code access functions.  Background translations have no TLB to go
+ * through, they read from the page they were given, see tb_worker_code().
+ */
 
 static uint64_t full_ldub_code(CPUArchState *env, target_ulong addr,
                                MemOpIdx oi, uintptr_t retaddr)
@@ -2585,7 +2581,12 @@ static uint64_t full_ldub_code(CPUArchState *env, target_ulong addr,
 
 uint32_t cpu_ldub_code(CPUArchState *env, abi_ptr addr)
 {
-    MemOpIdx oi = make_memop_idx(MO_UB, cpu_mmu_index(env, true));
+    MemOpIdx oi;
+
+    if (unlikely(tb_worker_page)) {
+        return ldub_p(tb_worker_code(addr, 1));
+    }
+    oi = make_memop_idx(MO_UB, cpu_mmu_index(env, true));
     return full_ldub_code(env, addr, oi, 0);
 }
 
@@ -2597,7 +2598,12 @@ static uint64_t full_lduw_code(CPUArchState *env, target_ulong addr,
 
 uint32_t cpu_lduw_code(CPUArchState *env, abi_ptr addr)
 {
-    MemOpIdx oi = make_memop_idx(MO_TEUW, cpu_mmu_index(env, true));
+    MemOpIdx oi;
+
+    if (unlikely(tb_worker_page)) {
+        return lduw_p(tb_worker_code(addr, 2));
+    }
+    oi = make_memop_idx(MO_TEUW, cpu_mmu_index(env, true));
     return full_lduw_code(env, addr, oi, 0);
 }
 
@@ -2609,7 +2615,12 @@ static uint64_t full_ldl_code(CPUArchState *env, target_ulong addr,
 
 uint32_t cpu_ldl_code(CPUArchState *env, abi_ptr addr)
 {
-    MemOpIdx oi = make_memop_idx(MO_TEUL, cpu_mmu_index(env, true));
+    MemOpIdx oi;
+
+    if (unlikely(tb_worker_page)) {
+        return ldl_p(tb_worker_code(addr, 4));
+    }
+    oi = make_memop_idx(MO_TEUL, cpu_mmu_index(env, true));
     return full_ldl_code(env, addr, oi, 0);
 }
 
@@ -2621,6 +2632,11 @@ static uint64_t full_ldq_code(CPUArchState *env, target_ulong addr,
 
 uint64_t cpu_ldq_code(CPUArchState *env, abi_ptr addr)
 {
-    MemOpIdx oi = make_memop_idx(MO_TEUQ, cpu_mmu_index(env, true));
+    MemOpIdx oi;
+
+    if (unlikely(tb_worker_page)) {
+        return ldq_p(tb_worker_code(addr, 8));
+    }
+    oi = make_memop_idx(MO_TEUQ, cpu_mmu_index(env, true));
     return full_ldq_code(env, addr, oi, 0);
 }
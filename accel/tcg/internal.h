@@ -14,9 +14,95 @@
 TranslationBlock *tb_gen_code(CPUState *cpu, target_ulong pc,
                               target_ulong cs_base, uint32_t flags,
                               int cflags);
+TranslationBlock *tb_gen_code_trace(CPUState *cpu, TranslationBlock *head);
 
 void QEMU_NORETURN cpu_io_recompile(CPUState *cpu, uintptr_t retaddr);
 void page_init(void);
 void tb_htable_init(void);
 
+extern uint32_t tb_trace_threshold;
+
+bool tb_trace_enabled(CPUState *cpu, uint32_t cflags);
+void tb_trace_gen(CPUState *cpu, TranslationBlock *tb, TranslationBlock *head,
+                  int max_insns);
+TranslationBlock *tb_gen_trace(CPUState *cpu, TranslationBlock *head);
+void tb_trace_dump_info(GString *buf);
+
+/* Whether @tb ran often enough to be retranslated by tb_gen_trace() */
+static inline bool tb_trace_hot(TranslationBlock *tb)
+{
+    return tb_trace_threshold && qatomic_read(&tb->exec_count) <= 0;
+}
+
+/*
+ * Guest code page that a background translation reads from, see
+ * tb_worker_thread().  @code is a private copy of the page, so that
+ * the translator sees the same bytes that are checked before the TB
+ * is published.
+ */
+typedef struct TBWorkerPage {
+    const uint8_t *code;
+    const uint8_t *host;
+    tb_page_addr_t phys;
+    target_ulong vaddr;
+} TBWorkerPage;
+
+#ifdef CONFIG_SOFTMMU
+extern __thread const TBWorkerPage *tb_worker_page;
+
+void tb_worker_init(unsigned int n);
+const void *tb_worker_code(target_ulong addr, int size);
+bool tb_worker_publish(TranslationBlock *tb);
+bool tb_worker_check(TranslationBlock *tb);
+void tb_worker_prefetch(CPUState *cpu, TranslationBlock *tb,
+                        const void *host_pc);
+void tb_worker_pause(void);
+void tb_worker_resume(void);
+void tb_worker_dump_info(GString *buf);
+#else
+/* There are no background translations in user mode */
+#define tb_worker_page ((const TBWorkerPage *)NULL)
+
+static inline bool tb_worker_publish(TranslationBlock *tb)
+{
+    return true;
+}
+
+static inline bool tb_worker_check(TranslationBlock *tb)
+{
+    return true;
+}
+
+static inline void tb_worker_prefetch(CPUState *cpu, TranslationBlock *tb,
+                                      const void *host_pc)
+{
+}
+
+static inline void tb_worker_pause(void)
+{
+}
+
+static inline void tb_worker_resume(void)
+{
+}
+#endif
+
+#ifdef CONFIG_SOFTMMU
+void tb_cache_init(const char *path, Error **errp);
+bool tb_cache_load(CPUState *cpu, TranslationBlock *tb, const void *host_pc,
+                   int max_insns);
+void tb_cache_store(TranslationBlock *tb, const void *host_pc);
+void tb_cache_dump_info(GString *buf);
+#else
+static inline bool tb_cache_load(CPUState *cpu, TranslationBlock *tb,
+                                 const void *host_pc, int max_insns)
+{
+    return false;
+}
+
+static inline void tb_cache_store(TranslationBlock *tb, const void *host_pc)
+{
+}
+#endif
+
 #endif /* ACCEL_TCG_INTERNAL_H */
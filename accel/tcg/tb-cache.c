@@ -0,0 +1,601 @@
+/*
+ * Persistent translation block cache
+ *
+ * Translations are saved to a file as optimized TCG ops, together with
+ * the lookup fields of their TB and the guest code they were generated
+ * from.  Another run of the same QEMU binary, with the same machine and
+ * CPU configuration, loads them back and skips the frontend and the
+ * optimizer for guest code that did not change.  Host code is not saved,
+ * because it embeds addresses of helpers, TBs and the epilogue that
+ * differ from one run to the next.
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or later.
+ * See the COPYING file in the top-level directory.
+ */
+
+#include "qemu/osdep.h"
+#include "qemu/crc32c.h"
+#include "qemu/cutils.h"
+#include "qemu/error-report.h"
+#include "qemu/notify.h"
+#include "qemu/plugin.h"
+#include "qemu/qht.h"
+#include "qemu/units.h"
+#include "qemu/xxhash.h"
+#include "qapi/error.h"
+#include "qom/object.h"
+#include "exec/exec-all.h"
+#include "hw/boards.h"
+#include "semihosting/semihost.h"
+#include "sysemu/sysemu.h"
+#include "tcg/tcg.h"
+#include "trace.h"
+#include "internal.h"
+
+#define TB_CACHE_MAGIC      0x31434254554d4551ULL /* "QEMUTBC1" */
+
+/*
+ * Some frontends look past the end of the TB to decide where it ends,
+ * e.g. to check whether the next instruction crosses a page; check a
+ * few more bytes than were translated.
+ */
+#define TB_CACHE_CODE_SLACK 16
+
+/* Records are written out in batches of this size */
+#define TB_CACHE_BATCH      (64 * KiB)
+
+/*
+ * Once the file reaches this size, new translations are only kept in
+ * memory, and on exit the file is rewritten with the translations that
+ * were used by this run.
+ */
+#define TB_CACHE_MAX_SIZE   (256 * MiB)
+
+typedef struct TBCacheHeader {
+    uint64_t magic;
+    uint32_t fingerprint_len;
+    uint32_t reserved;
+    /* followed by the fingerprint, see tb_cache_fingerprint() */
+} TBCacheHeader;
+
+typedef struct TBCacheRecord {
+    uint32_t len;               /* of the record, this header included */
+    uint32_t crc;               /* crc32c of what follows this field */
+    uint64_t pc;
+    uint64_t cs_base;
+    uint32_t flags;
+    uint32_t cflags;
+    uint32_t trace_vcpu_dstate;
+    uint16_t size;
+    uint16_t icount;
+    uint32_t code_len;
+    uint32_t ir_len;
+    /* followed by code_len bytes of guest code, then ir_len bytes of ops */
+} TBCacheRecord;
+
+typedef struct TBCacheEntry {
+    target_ulong pc;
+    target_ulong cs_base;
+    uint32_t flags;
+    uint32_t cflags;
+    uint32_t trace_vcpu_dstate;
+    uint16_t size;
+    uint16_t icount;
+    uint32_t code_len;
+    uint32_t ir_len;
+    bool used;                  /* hit or stored by this run */
+    uint8_t data[];             /* guest code, then ops */
+} TBCacheEntry;
+
+typedef struct TBCacheLookup {
+    const TranslationBlock *tb;
+    const void *host_pc;
+    int max_insns;
+} TBCacheLookup;
+
+static struct {
+    char *path;
+    int fd;
+    bool enabled;
+    struct qht htable;
+    Notifier machine_ready;
+    Notifier exit;
+
+    /* protects pending, file_end and full */
+    QemuMutex lock;
+    GByteArray *pending;        /* records not written yet */
+    off_t hdr_len;
+    off_t file_end;
+    bool full;                  /* the file reached TB_CACHE_MAX_SIZE */
+
+    /* statistics */
+    size_t loaded;
+    size_t hits;
+    size_t misses;
+    size_t stored;
+    size_t uncacheable;
+    size_t bad;
+} tb_cache = {
+    .fd = -1,
+};
+
+/* Ops and guest code of the translation in progress on this thread */
+static __thread GByteArray *tb_cache_ir;
+static __thread GByteArray *tb_cache_code;
+
+static uint32_t tb_cache_hash(target_ulong pc, target_ulong cs_base,
+                              uint32_t flags, uint32_t cflags,
+                              uint32_t trace_vcpu_dstate)
+{
+    return qemu_xxhash7(pc, cs_base, flags, cflags, trace_vcpu_dstate);
+}
+
+static bool tb_cache_cmp(const void *ap, const void *bp)
+{
+    const TBCacheEntry *a = ap;
+    const TBCacheEntry *b = bp;
+
+    return a->pc == b->pc &&
+        a->cs_base == b->cs_base &&
+        a->flags == b->flags &&
+        a->cflags == b->cflags &&
+        a->trace_vcpu_dstate == b->trace_vcpu_dstate &&
+        a->code_len == b->code_len &&
+        !memcmp(a->data, b->data, a->code_len);
+}
+
+static bool tb_cache_lookup_cmp(const void *p, const void *userp)
+{
+    const TBCacheEntry *e = p;
+    const TBCacheLookup *desc = userp;
+    const TranslationBlock *tb = desc->tb;
+
+    return e->pc == tb->pc &&
+        e->cs_base == tb->cs_base &&
+        e->flags == tb->flags &&
+        e->cflags == tb->cflags &&
+        e->trace_vcpu_dstate == tb->trace_vcpu_dstate &&
+        e->icount <= desc->max_insns &&
+        !memcmp(e->data, desc->host_pc, e->code_len);
+}
+
+static size_t tb_cache_page_left(target_ulong pc)
+{
+    return TARGET_PAGE_SIZE - (pc & ~TARGET_PAGE_MASK);
+}
+
+bool tb_cache_load(CPUState *cpu, TranslationBlock *tb, const void *host_pc,
+                   int max_insns)
+{
+    TBCacheLookup desc = {
+        .tb = tb,
+        .host_pc = host_pc,
+        .max_insns = max_insns,
+    };
+    TBCacheEntry *e;
+    uint32_t h;
+
+    tcg_ctx->ir_save = NULL;
+    if (!qatomic_read(&tb_cache.enabled) || !host_pc) {
+        return false;
+    }
+#ifdef CONFIG_PLUGIN
+    /* Plugins must see, and may instrument, every translation */
+    if (test_bit(QEMU_PLUGIN_EV_VCPU_TB_TRANS, cpu->plugin_mask)) {
+        return false;
+    }
+#endif
+
+    h = tb_cache_hash(tb->pc, tb->cs_base, tb->flags, tb->cflags,
+                      tb->trace_vcpu_dstate);
+    e = qht_lookup_custom(&tb_cache.htable, &desc, h, tb_cache_lookup_cmp);
+    if (e) {
+        if (tcg_ir_load(tcg_ctx, tb, e->data + e->code_len, e->ir_len)) {
+            tb->size = e->size;
+            tb->icount = e->icount;
+            qatomic_set(&e->used, true);
+            trace_tb_cache_hit(tb->pc, qatomic_fetch_inc(&tb_cache.hits) + 1);
+            return true;
+        }
+        qatomic_inc(&tb_cache.bad);
+        tcg_func_start(tcg_ctx);
+    }
+    qatomic_inc(&tb_cache.misses);
+
+    /*
+     * Snapshot the guest code now, so that tb_cache_store() can tell
+     * whether it was modified while being translated.
+     */
+    if (!tb_cache_ir) {
+        tb_cache_ir = g_byte_array_new();
+        tb_cache_code = g_byte_array_new();
+    }
+    g_byte_array_set_size(tb_cache_code, 0);
+    g_byte_array_append(tb_cache_code, host_pc, tb_cache_page_left(tb->pc));
+    tcg_ctx->ir_save = tb_cache_ir;
+    return false;
+}
+
+/* Called with tb_cache.lock held */
+static void tb_cache_flush_locked(void)
+{
+    GByteArray *pending = tb_cache.pending;
+
+    if (!pending->len) {
+        return;
+    }
+    if (tb_cache.file_end + pending->len > TB_CACHE_MAX_SIZE) {
+        trace_tb_cache_full(tb_cache.path);
+        tb_cache.full = true;
+        g_byte_array_set_size(pending, 0);
+        return;
+    }
+    if (pwrite(tb_cache.fd, pending->data, pending->len,
+               tb_cache.file_end) != pending->len) {
+        warn_report("tb-cache: cannot write to '%s': %s; "
+                    "new translations will not be saved",
+                    tb_cache.path, strerror(errno));
+        close(tb_cache.fd);
+        tb_cache.fd = -1;
+    }
+    tb_cache.file_end += pending->len;
+    g_byte_array_set_size(pending, 0);
+}
+
+/* Called with tb_cache.lock held */
+static void tb_cache_append_locked(const TBCacheEntry *e)
+{
+    TBCacheRecord rec = {
+        .len = sizeof(rec) + e->code_len + e->ir_len,
+        .pc = e->pc,
+        .cs_base = e->cs_base,
+        .flags = e->flags,
+        .cflags = e->cflags,
+        .trace_vcpu_dstate = e->trace_vcpu_dstate,
+        .size = e->size,
+        .icount = e->icount,
+        .code_len = e->code_len,
+        .ir_len = e->ir_len,
+    };
+    size_t crc_start = offsetof(TBCacheRecord, pc);
+    GByteArray *pending = tb_cache.pending;
+    size_t start;
+
+    if (tb_cache.fd < 0 || tb_cache.full) {
+        return;
+    }
+    start = pending->len;
+    g_byte_array_append(pending, (uint8_t *)&rec, sizeof(rec));
+    g_byte_array_append(pending, e->data, e->code_len + e->ir_len);
+    rec.crc = crc32c(0xffffffff, pending->data + start + crc_start,
+                     rec.len - crc_start);
+    memcpy(pending->data + start + offsetof(TBCacheRecord, crc),
+           &rec.crc, sizeof(rec.crc));
+    if (pending->len >= TB_CACHE_BATCH) {
+        tb_cache_flush_locked();
+    }
+}
+
+void tb_cache_store(TranslationBlock *tb, const void *host_pc)
+{
+    GByteArray *ir = tcg_ctx->ir_save;
+    size_t page_left, code_len;
+    TBCacheEntry *e;
+    uint32_t h;
+
+    if (!ir) {
+        return;
+    }
+    tcg_ctx->ir_save = NULL;
+
+    page_left = tb_cache_page_left(tb->pc);
+    code_len = MIN(tb->size + TB_CACHE_CODE_SLACK, page_left);
+    if (!ir->len || tb->size > page_left ||
+        memcmp(tb_cache_code->data, host_pc, code_len)) {
+        qatomic_inc(&tb_cache.uncacheable);
+        return;
+    }
+
+    e = g_malloc(sizeof(*e) + code_len + ir->len);
+    e->pc = tb->pc;
+    e->cs_base = tb->cs_base;
+    e->flags = tb->flags;
+    e->cflags = tb->cflags;
+    e->trace_vcpu_dstate = tb->trace_vcpu_dstate;
+    e->size = tb->size;
+    e->icount = tb->icount;
+    e->code_len = code_len;
+    e->ir_len = ir->len;
+    e->used = true;
+    memcpy(e->data, tb_cache_code->data, code_len);
+    memcpy(e->data + code_len, ir->data, ir->len);
+
+    h = tb_cache_hash(e->pc, e->cs_base, e->flags, e->cflags,
+                      e->trace_vcpu_dstate);
+    if (!qht_insert(&tb_cache.htable, e, h, NULL)) {
+        /* another vCPU translated the same code */
+        g_free(e);
+        return;
+    }
+    qatomic_inc(&tb_cache.stored);
+
+    qemu_mutex_lock(&tb_cache.lock);
+    tb_cache_append_locked(e);
+    qemu_mutex_unlock(&tb_cache.lock);
+}
+
+static bool tb_cache_prop_is_scalar(const char *type)
+{
+    return !strcmp(type, "bool") || !strcmp(type, "str") ||
+        strstart(type, "int", NULL) || strstart(type, "uint", NULL);
+}
+
+static gint tb_cache_str_cmp(gconstpointer a, gconstpointer b)
+{
+    return strcmp(*(const char * const *)a, *(const char * const *)b);
+}
+
+/*
+ * Describe everything besides the TB lookup fields that the translation
+ * depends on: the binary, the machine and the configuration of the CPUs.
+ */
+static char *tb_cache_fingerprint(Error **errp)
+{
+    GString *fp = g_string_new(TARGET_NAME);
+    struct stat st;
+    CPUState *cpu;
+
+    if (stat("/proc/self/exe", &st) < 0) {
+        error_setg_errno(errp, errno, "cannot identify the QEMU binary");
+        g_string_free(fp, true);
+        return NULL;
+    }
+    g_string_append_printf(fp, " exe=%" PRIu64 ":%" PRIu64 ":%" PRId64,
+                           (uint64_t)st.st_ino, (uint64_t)st.st_size,
+                           (int64_t)st.st_mtime);
+    g_string_append_printf(fp, " machine=%s semihosting=%d",
+                           MACHINE_GET_CLASS(current_machine)->name,
+                           semihosting_enabled());
+
+    CPU_FOREACH(cpu) {
+        g_autoptr(GPtrArray) props = g_ptr_array_new_with_free_func(g_free);
+        ObjectPropertyIterator iter;
+        ObjectProperty *prop;
+        int i;
+
+        object_property_iter_init(&iter, OBJECT(cpu));
+        while ((prop = object_property_iter_next(&iter))) {
+            char *val;
+
+            if (!prop->get || !tb_cache_prop_is_scalar(prop->type)) {
+                continue;
+            }
+            val = object_property_print(OBJECT(cpu), prop->name, false, NULL);
+            if (val) {
+                g_ptr_array_add(props, g_strdup_printf("%s=%s",
+                                                       prop->name, val));
+                g_free(val);
+            }
+        }
+        g_ptr_array_sort(props, tb_cache_str_cmp);
+
+        g_string_append_printf(fp, " cpu%d=%s", cpu->cpu_index,
+                               object_get_typename(OBJECT(cpu)));
+        for (i = 0; i < props->len; i++) {
+            g_string_append_printf(fp, ",%s", (char *)props->pdata[i]);
+        }
+    }
+    return g_string_free(fp, false);
+}
+
+/* Add the records at @buf to the cache; returns how many bytes are valid */
+static size_t tb_cache_parse(const uint8_t *buf, size_t len)
+{
+    size_t crc_start = offsetof(TBCacheRecord, pc);
+    size_t off = 0;
+
+    while (len - off >= sizeof(TBCacheRecord)) {
+        TBCacheRecord rec;
+        TBCacheEntry *e;
+        uint32_t h;
+
+        memcpy(&rec, buf + off, sizeof(rec));
+        if (rec.len < sizeof(rec) || rec.len > len - off ||
+            rec.len - sizeof(rec) != (uint64_t)rec.code_len + rec.ir_len ||
+            crc32c(0xffffffff, buf + off + crc_start,
+                   rec.len - crc_start) != rec.crc) {
+            break;
+        }
+
+        e = g_malloc(sizeof(*e) + rec.code_len + rec.ir_len);
+        e->pc = rec.pc;
+        e->cs_base = rec.cs_base;
+        e->flags = rec.flags;
+        e->cflags = rec.cflags;
+        e->trace_vcpu_dstate = rec.trace_vcpu_dstate;
+        e->size = rec.size;
+        e->icount = rec.icount;
+        e->code_len = rec.code_len;
+        e->ir_len = rec.ir_len;
+        e->used = false;
+        memcpy(e->data, buf + off + sizeof(rec), rec.code_len + rec.ir_len);
+
+        h = tb_cache_hash(e->pc, e->cs_base, e->flags, e->cflags,
+                          e->trace_vcpu_dstate);
+        if (qht_insert(&tb_cache.htable, e, h, NULL)) {
+            tb_cache.loaded++;
+        } else {
+            g_free(e);
+        }
+        off += rec.len;
+    }
+    return off;
+}
+
+static int tb_cache_open(Error **errp)
+{
+    g_autofree char *fp = tb_cache_fingerprint(errp);
+    g_autofree uint8_t *buf = NULL;
+    TBCacheHeader hdr;
+    size_t hdr_len, fp_len;
+    struct stat st;
+
+    if (!fp) {
+        return -1;
+    }
+    fp_len = strlen(fp);
+    hdr_len = sizeof(hdr) + fp_len;
+    tb_cache.hdr_len = hdr_len;
+
+    if (fstat(tb_cache.fd, &st) < 0) {
+        error_setg_errno(errp, errno, "cannot stat '%s'", tb_cache.path);
+        return -1;
+    }
+    if (st.st_size >= hdr_len) {
+        buf = g_malloc(st.st_size);
+        if (pread(tb_cache.fd, buf, st.st_size, 0) != st.st_size) {
+            error_setg_errno(errp, errno, "cannot read '%s'", tb_cache.path);
+            return -1;
+        }
+        memcpy(&hdr, buf, sizeof(hdr));
+        if (hdr.magic == TB_CACHE_MAGIC && hdr.fingerprint_len == fp_len &&
+            !memcmp(buf + sizeof(hdr), fp, fp_len)) {
+            tb_cache.file_end = hdr_len + tb_cache_parse(buf + hdr_len,
+                                                         st.st_size - hdr_len);
+            tb_cache.full = tb_cache.file_end + TB_CACHE_BATCH >
+                            TB_CACHE_MAX_SIZE;
+            trace_tb_cache_open(tb_cache.path, tb_cache.loaded);
+        }
+    }
+
+    if (!tb_cache.file_end) {
+        /* new file, or one written by another binary or configuration */
+        trace_tb_cache_reset(tb_cache.path);
+        hdr = (TBCacheHeader) {
+            .magic = TB_CACHE_MAGIC,
+            .fingerprint_len = fp_len,
+        };
+        if (ftruncate(tb_cache.fd, 0) < 0 ||
+            pwrite(tb_cache.fd, &hdr, sizeof(hdr), 0) != sizeof(hdr) ||
+            pwrite(tb_cache.fd, fp, fp_len, sizeof(hdr)) != fp_len) {
+            error_setg_errno(errp, errno, "cannot write '%s'", tb_cache.path);
+            return -1;
+        }
+        tb_cache.file_end = hdr_len;
+        tb_cache.full = false;
+    } else if (tb_cache.file_end < st.st_size &&
+               ftruncate(tb_cache.fd, tb_cache.file_end) < 0) {
+        /* drop a record that was cut short by a crash */
+        error_setg_errno(errp, errno, "cannot truncate '%s'", tb_cache.path);
+        return -1;
+    }
+    return 0;
+}
+
+/* The CPUs only exist, and can be described, once the machine is created */
+static void tb_cache_machine_ready(Notifier *n, void *opaque)
+{
+    Error *err = NULL;
+
+    if (tb_cache_open(&err) < 0) {
+        warn_report_err(err);
+        close(tb_cache.fd);
+        tb_cache.fd = -1;
+        return;
+    }
+    qatomic_set(&tb_cache.enabled, true);
+}
+
+static void tb_cache_compact_entry(void *p, uint32_t h, void *userp)
+{
+    TBCacheEntry *e = p;
+
+    if (qatomic_read(&e->used)) {
+        tb_cache_append_locked(e);
+    }
+}
+
+/*
+ * Rewrite a full file with the translations used by this run, dropping
+ * those of guest code that was not run again, or that changed since.
+ * Called with tb_cache.lock held.
+ */
+static void tb_cache_compact_locked(void)
+{
+    size_t before = tb_cache.file_end;
+
+    g_byte_array_set_size(tb_cache.pending, 0);
+    if (ftruncate(tb_cache.fd, tb_cache.hdr_len) < 0) {
+        warn_report("tb-cache: cannot truncate '%s': %s",
+                    tb_cache.path, strerror(errno));
+        return;
+    }
+    tb_cache.file_end = tb_cache.hdr_len;
+    tb_cache.full = false;
+    qht_iter(&tb_cache.htable, tb_cache_compact_entry, NULL);
+    if (tb_cache.fd >= 0) {
+        tb_cache_flush_locked();
+    }
+    trace_tb_cache_compact(tb_cache.path, before, tb_cache.file_end);
+}
+
+static void tb_cache_exit(Notifier *n, void *opaque)
+{
+    qemu_mutex_lock(&tb_cache.lock);
+    if (tb_cache.fd >= 0 && tb_cache.full) {
+        tb_cache_compact_locked();
+    } else if (tb_cache.fd >= 0) {
+        tb_cache_flush_locked();
+    }
+    qemu_mutex_unlock(&tb_cache.lock);
+}
+
+void tb_cache_init(const char *path, Error **errp)
+{
+    int fd = qemu_create(path, O_RDWR, 0644, errp);
+
+    if (fd < 0) {
+        return;
+    }
+    /* Another QEMU appending to the same file would corrupt it */
+    if (qemu_lock_fd(fd, 0, 0, true)) {
+        warn_report("tb-cache: '%s' is used by another QEMU process, "
+                    "translations will not be cached", path);
+        close(fd);
+        return;
+    }
+    tb_cache.path = g_strdup(path);
+    tb_cache.fd = fd;
+    tb_cache.pending = g_byte_array_new();
+    qemu_mutex_init(&tb_cache.lock);
+    qht_init(&tb_cache.htable, tb_cache_cmp, 1 << 15, QHT_MODE_AUTO_RESIZE);
+
+    tb_cache.machine_ready.notify = tb_cache_machine_ready;
+    qemu_add_machine_init_done_notifier(&tb_cache.machine_ready);
+    tb_cache.exit.notify = tb_cache_exit;
+    qemu_add_exit_notifier(&tb_cache.exit);
+}
+
+void tb_cache_dump_info(GString *buf)
+{
+    size_t hits, misses;
+
+    if (!qatomic_read(&tb_cache.enabled)) {
+        return;
+    }
+    hits = qatomic_read(&tb_cache.hits);
+    misses = qatomic_read(&tb_cache.misses);
+
+    g_string_append_printf(buf, "\nPersistent TB cache: %s\n", tb_cache.path);
+    g_string_append_printf(buf, "TB cache entries    %zu loaded, "
+                           "%zu stored\n",
+                           tb_cache.loaded, qatomic_read(&tb_cache.stored));
+    g_string_append_printf(buf, "TB cache lookups    %zu hits, %zu misses "
+                           "(%0.1f%% hits)\n", hits, misses,
+                           hits + misses ?
+                           (double)hits / (hits + misses) * 100 : 0);
+    g_string_append_printf(buf, "TB cache skipped    %zu uncacheable, "
+                           "%zu bad entries\n",
+                           qatomic_read(&tb_cache.uncacheable),
+                           qatomic_read(&tb_cache.bad));
+}
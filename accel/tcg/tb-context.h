@@ -34,6 +34,8 @@ struct TBContext {
 
     /* statistics */
     unsigned tb_flush_count;
+    unsigned tb_evict_count;
+    size_t tb_evict_regions;
     unsigned tb_phys_invalidate_count;
 };
 
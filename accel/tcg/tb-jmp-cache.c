@@ -0,0 +1,159 @@
+/*
+ * Per-CPU cache of TBs by guest virtual pc
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or later.
+ * See the COPYING file in the top-level directory.
+ */
+
+#include "qemu/osdep.h"
+#include "qemu/rcu.h"
+#include "exec/exec-all.h"
+#include "hw/core/cpu.h"
+#include "tb-jmp-cache.h"
+
+/* Size of new jump caches, as log2 of their number of entries */
+unsigned int tb_jmp_cache_bits = 12;
+
+static CPUJumpCache *tb_jmp_cache_new(unsigned int bits)
+{
+    size_t sets = (size_t)1 << bits;
+    CPUJumpCache *jc;
+
+    jc = g_malloc0(sizeof(*jc) + sets * sizeof(jc->set[0]));
+    jc->bits = bits;
+    jc->gen = 1;
+    return jc;
+}
+
+void tb_jmp_cache_init(CPUState *cpu)
+{
+    unsigned int bits = tb_jmp_cache_bits - ctz32(TB_JMP_CACHE_WAYS);
+
+    cpu->tb_jmp_cache = tb_jmp_cache_new(bits);
+}
+
+void tb_jmp_cache_free(CPUState *cpu)
+{
+    CPUJumpCache *jc = cpu->tb_jmp_cache;
+
+    qatomic_rcu_set(&cpu->tb_jmp_cache, NULL);
+    if (jc) {
+        g_free_rcu(jc, rcu);
+    }
+}
+
+/*
+ * Replace the jump cache of @cpu with one twice as large.  The entries
+ * are not carried over, TBs are put back in the new cache as they are
+ * looked up.  Other threads may still be clearing entries of the old
+ * cache, so it is freed after an RCU grace period.
+ * Called from the vCPU thread.
+ */
+void tb_jmp_cache_resize(CPUState *cpu)
+{
+    CPUJumpCache *old = cpu->tb_jmp_cache;
+    CPUJumpCache *jc = tb_jmp_cache_new(old->bits + 1);
+
+    jc->hits = old->hits;
+    jc->misses = old->misses;
+    qatomic_rcu_set(&cpu->tb_jmp_cache, jc);
+    g_free_rcu(old, rcu);
+}
+
+/*
+ * Remove @tb from the jump cache of @cpu.
+ * Called from any thread, within an RCU read-side critical section.
+ */
+void tb_jmp_cache_remove(CPUState *cpu, TranslationBlock *tb)
+{
+    CPUJumpCache *jc = qatomic_rcu_read(&cpu->tb_jmp_cache);
+    CPUJumpCacheEntry *set;
+    int i;
+
+    if (!jc) {
+        return;
+    }
+    set = tb_jmp_cache_set(jc, tb->pc);
+    for (i = 0; i < TB_JMP_CACHE_WAYS; i++) {
+        if (qatomic_read(&set[i].tb) == tb) {
+            qatomic_set(&set[i].tb, NULL);
+        }
+    }
+}
+
+/*
+ * Empty the jump cache of @cpu.  Call from the vCPU thread, or while
+ * the vCPU is not running.
+ */
+void cpu_tb_jmp_cache_clear(CPUState *cpu)
+{
+    CPUJumpCache *jc = cpu->tb_jmp_cache;
+
+    if (!jc) {
+        return;
+    }
+    /* Once in a while, the generation wraps; clear for real then */
+    if (unlikely(jc->gen == UINT32_MAX)) {
+        size_t i, sets = (size_t)1 << jc->bits;
+        int j;
+
+        for (i = 0; i < sets; i++) {
+            for (j = 0; j < TB_JMP_CACHE_WAYS; j++) {
+                qatomic_set(&jc->set[i][j].tb, NULL);
+                jc->set[i][j].gen = 0;
+            }
+        }
+        qatomic_set(&jc->gen, 1);
+    } else {
+        qatomic_set(&jc->gen, jc->gen + 1);
+    }
+}
+
+#ifdef CONFIG_SOFTMMU
+/* Empty the sets of the jump cache of @cpu that TBs of a page can be in */
+void tb_jmp_cache_clear_page(CPUState *cpu, target_ulong page_addr)
+{
+    CPUJumpCache *jc = cpu->tb_jmp_cache;
+    unsigned int i, j, i0 = tb_jmp_cache_hash_page(page_addr, jc->bits);
+
+    for (i = 0; i < (1u << tb_jmp_page_bits(jc->bits)); i++) {
+        for (j = 0; j < TB_JMP_CACHE_WAYS; j++) {
+            qatomic_set(&jc->set[i0 + i][j].tb, NULL);
+        }
+    }
+}
+
+/* Number of distinct groups of sets that pages map to */
+unsigned int tb_jmp_cache_page_slots(CPUState *cpu)
+{
+    CPUJumpCache *jc = cpu->tb_jmp_cache;
+
+    return 1u << (jc->bits - tb_jmp_page_bits(jc->bits));
+}
+#endif
+
+void tb_jmp_cache_dump_info(GString *buf)
+{
+    size_t hits = 0, misses = 0, entries = 0;
+    CPUState *cpu;
+
+    WITH_RCU_READ_LOCK_GUARD() {
+        CPU_FOREACH(cpu) {
+            CPUJumpCache *jc = qatomic_rcu_read(&cpu->tb_jmp_cache);
+
+            if (jc) {
+                hits += qatomic_read(&jc->hits);
+                misses += qatomic_read(&jc->misses);
+                entries += ((size_t)TB_JMP_CACHE_WAYS << jc->bits);
+            }
+        }
+    }
+
+    g_string_append_printf(buf, "\nJump cache (%d-way):\n",
+                           TB_JMP_CACHE_WAYS);
+    g_string_append_printf(buf, "jump cache entries  %zu\n", entries);
+    g_string_append_printf(buf, "jump cache lookups  %zu hits, %zu misses "
+                           "(%0.1f%% hits)\n", hits, misses,
+                           hits + misses ?
+                           (double)hits / (hits + misses) * 100 : 0);
+}
@@ -0,0 +1,117 @@
+/*
+ * Per-CPU cache of TBs by guest virtual pc
+ *
+ * The jump cache is what the execution loop and lookup_tb_ptr check
+ * before going to the TB hash table.  It is set-associative, with
+ * TB_JMP_CACHE_WAYS TBs per set; a TB goes in way 0 and pushes the
+ * others down, and a hit leaves the set alone so as not to write to it.
+ * It starts with 1 << tb_jmp_cache_bits entries and doubles in size, up
+ * to TB_JMP_CACHE_MAX_BITS, while too many lookups miss it and find the
+ * TB in the hash table instead.
+ *
+ * Entries are tagged with the generation of the cache when they were
+ * inserted, so that clearing the whole cache is just a matter of
+ * starting a new generation.
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or later.
+ * See the COPYING file in the top-level directory.
+ */
+
+#ifndef ACCEL_TCG_TB_JMP_CACHE_H
+#define ACCEL_TCG_TB_JMP_CACHE_H
+
+#include "qemu/rcu.h"
+#include "exec/exec-all.h"
+#include "tb-hash.h"
+
+#define TB_JMP_CACHE_WAYS       2
+
+/* Limits of the number of entries, log2 */
+#define TB_JMP_CACHE_MIN_BITS   8
+#define TB_JMP_CACHE_MAX_BITS   16
+
+/*
+ * The cache grows when more than 1 / TB_JMP_CACHE_MISS_RATIO of the
+ * lookups of a window of TB_JMP_CACHE_WINDOW lookups miss.
+ */
+#define TB_JMP_CACHE_WINDOW     (1 << 16)
+#define TB_JMP_CACHE_MISS_RATIO 8
+
+typedef struct CPUJumpCacheEntry {
+    /* Accessed in parallel; all accesses must be atomic */
+    TranslationBlock *tb;
+    /* Only accessed by the vCPU thread */
+    uint32_t gen;
+} CPUJumpCacheEntry;
+
+struct CPUJumpCache {
+    struct rcu_head rcu;
+    unsigned int bits;          /* log2 of the number of sets */
+    uint32_t gen;               /* generation of valid entries, never 0 */
+
+    /* statistics, only updated by the vCPU thread */
+    size_t hits;
+    size_t misses;              /* lookups that found the TB in the qht */
+    unsigned int window_lookups;
+    unsigned int window_misses;
+
+    CPUJumpCacheEntry set[][TB_JMP_CACHE_WAYS];
+};
+
+extern unsigned int tb_jmp_cache_bits;
+
+void tb_jmp_cache_init(CPUState *cpu);
+void tb_jmp_cache_free(CPUState *cpu);
+void tb_jmp_cache_resize(CPUState *cpu);
+void tb_jmp_cache_remove(CPUState *cpu, TranslationBlock *tb);
+void tb_jmp_cache_dump_info(GString *buf);
+#ifdef CONFIG_SOFTMMU
+void tb_jmp_cache_clear_page(CPUState *cpu, target_ulong page_addr);
+unsigned int tb_jmp_cache_page_slots(CPUState *cpu);
+#endif
+
+/* Return the set of the jump cache of @cpu that @pc maps to */
+static inline CPUJumpCacheEntry *tb_jmp_cache_set(CPUJumpCache *jc,
+                                                  target_ulong pc)
+{
+    return jc->set[tb_jmp_cache_hash_func(pc, jc->bits)];
+}
+
+/* Account for a lookup in the jump cache of @cpu, from the vCPU thread */
+static inline void tb_jmp_cache_count(CPUState *cpu, CPUJumpCache *jc,
+                                      bool hit)
+{
+    if (hit) {
+        qatomic_set(&jc->hits, jc->hits + 1);
+    } else {
+        qatomic_set(&jc->misses, jc->misses + 1);
+        jc->window_misses++;
+    }
+    if (unlikely(++jc->window_lookups == TB_JMP_CACHE_WINDOW)) {
+        if (jc->window_misses > TB_JMP_CACHE_WINDOW / TB_JMP_CACHE_MISS_RATIO &&
+            jc->bits + 1 < TB_JMP_CACHE_MAX_BITS) {
+            tb_jmp_cache_resize(cpu);
+            return;
+        }
+        jc->window_lookups = 0;
+        jc->window_misses = 0;
+    }
+}
+
+/* Insert @tb as the newest TB of the set of @pc, from the vCPU thread */
+static inline void tb_jmp_cache_insert(CPUState *cpu, target_ulong pc,
+                                       TranslationBlock *tb)
+{
+    CPUJumpCache *jc = cpu->tb_jmp_cache;
+    CPUJumpCacheEntry *set = tb_jmp_cache_set(jc, pc);
+    int i;
+
+    for (i = TB_JMP_CACHE_WAYS - 1; i > 0; i--) {
+        set[i].gen = set[i - 1].gen;
+        qatomic_set(&set[i].tb, qatomic_read(&set[i - 1].tb));
+    }
+    set[0].gen = qatomic_read(&jc->gen);
+    qatomic_set(&set[0].tb, tb);
+}
+
+#endif /* ACCEL_TCG_TB_JMP_CACHE_H */
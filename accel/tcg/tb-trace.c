@@ -0,0 +1,329 @@
+/*
+ * Hot traces
+ *
+ * When enabled with "-accel tcg,trace-threshold=N", TBs count their own
+ * executions.  Once a TB has run N times it goes back to the execution
+ * loop, which retranslates it as the head of a trace: the frontend is
+ * run again for the TB and then for the successors it is chained to,
+ * and the ops of each successor replace the goto_tb exit leading to it.
+ * The result is a single TB, so that the optimizer, liveness analysis
+ * and register allocation work across what used to be block boundaries.
+ *
+ * Following a chained exit is only as safe as chaining itself: targets
+ * only use goto_tb when the CPU state that selects a TB cannot change,
+ * so the successor's flags are still those of the chained TB.
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or later.
+ * See the COPYING file in the top-level directory.
+ */
+
+#include "qemu/osdep.h"
+#include "qemu/plugin.h"
+#include "exec/exec-all.h"
+#include "exec/translator.h"
+#include "tcg/tcg.h"
+#include "tcg/tcg-op.h"
+#include "trace.h"
+#include "internal.h"
+
+/* Number of guest blocks a trace is made of, at most */
+#define TB_TRACE_MAX_BLOCKS 4
+
+/*
+ * A hot TB that cannot be extended is profiled again, this many times
+ * longer, in case its successors get chained in the meantime.
+ */
+#define TB_TRACE_BACKOFF    16
+
+uint32_t tb_trace_threshold;
+
+static struct {
+    size_t hot;             /* TBs that reached the threshold */
+    size_t traces;          /* traces of more than one block */
+    size_t blocks;          /* blocks in those traces */
+    size_t insns;           /* guest instructions in those traces */
+    size_t unchained;       /* trace exits turned into lookup_tb_ptr */
+    size_t not_extended;    /* hot TBs with no successor to append */
+} tb_trace_stats;
+
+bool tb_trace_enabled(CPUState *cpu, uint32_t cflags)
+{
+    if (!tb_trace_threshold ||
+        (cflags & (CF_COUNT_MASK | CF_NO_GOTO_TB | CF_USE_ICOUNT |
+                   CF_NOIRQ))) {
+        return false;
+    }
+#ifdef CONFIG_PLUGIN
+    /* Plugins expect one translation per guest block */
+    if (test_bit(QEMU_PLUGIN_EV_VCPU_TB_TRANS, cpu->plugin_mask)) {
+        return false;
+    }
+#endif
+    return true;
+}
+
+/*
+ * Return the TB that exit @n of @tb is chained to, if it can be appended
+ * to the trace headed by @head.  The trace stays on the page of its head
+ * and does not go below it, so that its pc and size cover all the guest
+ * code it was translated from.
+ */
+static TranslationBlock *tb_trace_next(TranslationBlock *head,
+                                       TranslationBlock *tb, int n)
+{
+    uintptr_t dest = qatomic_read(&tb->jmp_dest[n]);
+    TranslationBlock *next = (TranslationBlock *)(dest & ~(uintptr_t)1);
+
+    if (!next || (dest & 1) ||
+        tb_cflags(next) != tb_cflags(head) ||
+        next->cs_base != head->cs_base ||
+        next->trace_vcpu_dstate != head->trace_vcpu_dstate ||
+        next->pc < head->pc ||
+        ((next->pc ^ head->pc) & TARGET_PAGE_MASK) ||
+        next->page_addr[0] != head->page_addr[0] ||
+        next->page_addr[1] != -1) {
+        return NULL;
+    }
+    return next;
+}
+
+/* How many times @tb ran, as far as its counter tells */
+static int64_t tb_trace_execs(TranslationBlock *tb)
+{
+    return (int64_t)tb_trace_threshold - qatomic_read(&tb->exec_count);
+}
+
+/*
+ * Pick the exit of @tb, among those in @exits, whose successor is
+ * appended to the trace: the successor that ran most often.
+ */
+static int tb_trace_pick(TranslationBlock *head, TranslationBlock *tb,
+                         TCGOp **exits, TranslationBlock **pnext)
+{
+    int n, best = -1;
+
+    for (n = 0; n <= TB_EXIT_IDXMAX; n++) {
+        TranslationBlock *next;
+
+        if (!exits[n]) {
+            continue;
+        }
+        next = tb_trace_next(head, tb, n);
+        if (next &&
+            (best < 0 || tb_trace_execs(next) > tb_trace_execs(*pnext))) {
+            best = n;
+            *pnext = next;
+        }
+    }
+    return best;
+}
+
+/* Find the exit_tb with value @val that follows the goto_tb @op */
+static TCGOp *tb_trace_find_exit(TCGOp *op, uintptr_t val)
+{
+    while ((op = QTAILQ_NEXT(op, link)) != NULL) {
+        if (op->opc == INDEX_op_exit_tb && op->args[0] == val) {
+            return op;
+        }
+    }
+    return NULL;
+}
+
+/* Move the ops emitted after @last to just before @op */
+static void tb_trace_move_ops(TCGContext *s, TCGOp *last, TCGOp *op)
+{
+    TCGOp *next;
+
+    while ((next = QTAILQ_NEXT(last, link)) != NULL) {
+        QTAILQ_REMOVE(&s->ops, next, link);
+        QTAILQ_INSERT_BEFORE(op, next, link);
+    }
+}
+
+/* Record the goto_tb ops emitted after @last in @gotos, by exit number */
+static void tb_trace_find_gotos(TCGOp *last, TCGOp **gotos)
+{
+    TCGOp *op = last;
+
+    while ((op = QTAILQ_NEXT(op, link)) != NULL) {
+        if (op->opc == INDEX_op_goto_tb) {
+            gotos[op->args[0]] = op;
+        }
+    }
+}
+
+/*
+ * A TB only has TB_EXIT_IDXMAX + 1 chained exits, which blocks appended
+ * to a trace may compete for.  Turn the goto_tb @op of a block that
+ * lost, and the exit_tb @exit_op that follows it, into a lookup_tb_ptr.
+ */
+static void tb_trace_unchain(TCGContext *s, TCGOp *op, TCGOp *exit_op)
+{
+    TCGOp *last = tcg_last_op();
+
+    tcg_gen_lookup_and_goto_ptr();
+    tb_trace_move_ops(s, last, exit_op);
+    tcg_op_remove(s, op);
+    tcg_op_remove(s, exit_op);
+    qatomic_inc(&tb_trace_stats.unchained);
+}
+
+void tb_trace_gen(CPUState *cpu, TranslationBlock *tb, TranslationBlock *head,
+                  int max_insns)
+{
+    TCGContext *s = tcg_ctx;
+    uintptr_t tb_rx = (uintptr_t)tcg_splitwx_to_rx(tb);
+    TCGOp *exits[TB_EXIT_IDXMAX + 1] = { };
+    bool used[TB_EXIT_IDXMAX + 1];
+    TranslationBlock *cur = head;
+    target_ulong pc = tb->pc, end;
+    uint32_t flags = tb->flags;
+    int n, icount, blocks = 1;
+
+    gen_intermediate_code(cpu, tb, max_insns);
+    end = pc + tb->size;
+    icount = tb->icount;
+
+    tb_trace_find_gotos(QTAILQ_FIRST(&s->ops), exits);
+    for (n = 0; n <= TB_EXIT_IDXMAX; n++) {
+        used[n] = exits[n] != NULL;
+    }
+    /* The chained exits of @head only tell about the same translation */
+    if (tb->size != head->size || tb->icount != head->icount) {
+        memset(exits, 0, sizeof(exits));
+    }
+
+    s->trace_cont = true;
+    while (blocks < TB_TRACE_MAX_BLOCKS && icount < max_insns) {
+        TCGOp *gotos[TB_EXIT_IDXMAX + 1] = { };
+        TCGOp *ends[TB_EXIT_IDXMAX + 1] = { };
+        TCGOp *last, *exit_op;
+        TranslationBlock *next = NULL;
+        int k;
+
+        k = tb_trace_pick(head, cur, exits, &next);
+        if (k < 0) {
+            break;
+        }
+        exit_op = tb_trace_find_exit(exits[k], tb_rx + k);
+        if (!exit_op) {
+            break;
+        }
+
+        last = tcg_last_op();
+#ifdef CONFIG_DEBUG_TCG
+        s->goto_tb_issue_mask = 0;
+#endif
+        tb->pc = next->pc;
+        tb->flags = next->flags;
+        gen_intermediate_code(cpu, tb, max_insns - icount);
+        tb->pc = pc;
+        tb->flags = flags;
+
+        /*
+         * The block may end on the next page, if its last instruction
+         * crosses it.  Also make sure that each goto_tb of the block is
+         * followed by its exit_tb before changing anything.
+         */
+        tb_trace_find_gotos(last, gotos);
+        for (n = 0; n <= TB_EXIT_IDXMAX; n++) {
+            if (gotos[n]) {
+                ends[n] = tb_trace_find_exit(gotos[n], tb_rx + n);
+                if (!ends[n]) {
+                    break;
+                }
+            }
+        }
+        if (n <= TB_EXIT_IDXMAX ||
+            ((next->pc + tb->size - 1) ^ pc) & TARGET_PAGE_MASK) {
+            tcg_remove_ops_after(last);
+            break;
+        }
+
+        /*
+         * The exit to @next is free again.  The exits of the new block
+         * keep their number, unless another block of the trace uses it.
+         */
+        used[k] = false;
+        for (n = 0; n <= TB_EXIT_IDXMAX; n++) {
+            if (!gotos[n]) {
+                continue;
+            }
+            if (used[n]) {
+                tb_trace_unchain(s, gotos[n], ends[n]);
+                gotos[n] = NULL;
+            } else {
+                used[n] = true;
+            }
+        }
+
+        /* Put the new block in place of the exit to @next */
+        tb_trace_move_ops(s, last, exit_op);
+        tcg_op_remove(s, exits[k]);
+        tcg_op_remove(s, exit_op);
+
+        /* Same as above, for the chained exits of @next */
+        if (tb->size == next->size && tb->icount == next->icount) {
+            memcpy(exits, gotos, sizeof(exits));
+        } else {
+            memset(exits, 0, sizeof(exits));
+        }
+        end = MAX(end, next->pc + tb->size);
+        icount += tb->icount;
+        blocks++;
+        cur = next;
+    }
+    s->trace_cont = false;
+
+    tb->size = end - pc;
+    tb->icount = icount;
+
+    if (blocks > 1) {
+        trace_tb_trace_gen(pc, blocks, icount);
+        qatomic_inc(&tb_trace_stats.traces);
+        qatomic_add(&tb_trace_stats.blocks, blocks);
+        qatomic_add(&tb_trace_stats.insns, icount);
+    }
+}
+
+TranslationBlock *tb_gen_trace(CPUState *cpu, TranslationBlock *head)
+{
+    int32_t backoff = MIN((int64_t)tb_trace_threshold * TB_TRACE_BACKOFF,
+                          INT32_MAX);
+
+    qatomic_inc(&tb_trace_stats.hot);
+
+    /* Only extend a TB that is chained to something that can follow it */
+    if (head->page_addr[1] != -1 ||
+        !tb_trace_enabled(cpu, tb_cflags(head)) ||
+        (!tb_trace_next(head, head, 0) && !tb_trace_next(head, head, 1))) {
+        qatomic_set(&head->exec_count, backoff);
+        qatomic_inc(&tb_trace_stats.not_extended);
+        return head;
+    }
+    return tb_gen_code_trace(cpu, head);
+}
+
+void tb_trace_dump_info(GString *buf)
+{
+    size_t traces = qatomic_read(&tb_trace_stats.traces);
+
+    if (!tb_trace_threshold) {
+        return;
+    }
+    g_string_append_printf(buf, "\nHot traces (threshold %u):\n",
+                           tb_trace_threshold);
+    g_string_append_printf(buf, "hot TB count        %zu "
+                           "(%zu not extended)\n",
+                           qatomic_read(&tb_trace_stats.hot),
+                           qatomic_read(&tb_trace_stats.not_extended));
+    g_string_append_printf(buf, "trace count         %zu\n", traces);
+    g_string_append_printf(buf, "trace avg length    %0.1f blocks, "
+                           "%0.1f insns\n",
+                           traces ? (double)qatomic_read(
+                               &tb_trace_stats.blocks) / traces : 0,
+                           traces ? (double)qatomic_read(
+                               &tb_trace_stats.insns) / traces : 0);
+    g_string_append_printf(buf, "unchained exits     %zu\n",
+                           qatomic_read(&tb_trace_stats.unchained));
+}
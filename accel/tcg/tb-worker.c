@@ -0,0 +1,466 @@
+/*
+ * Background translation
+ *
+ * With "-accel tcg,thread=multi,translate-threads=N", N threads translate
+ * ahead of the vCPUs.  Whenever a vCPU translates a TB, the destinations
+ * of its direct jumps (which are usually the fall-through and the taken
+ * side of a branch) are queued, and a worker translates them into its own
+ * region of the code buffer and publishes them in the TB hash table, so
+ * that the vCPU finds them there when it gets to them.  Each new TB queues
+ * its own successors, up to TB_WORKER_MAX_DEPTH levels away from the TB
+ * that a vCPU translated, which helps to warm up quickly after a flush.
+ *
+ * A worker does not have a vCPU to translate with, so it uses a copy of
+ * the CPU state that the translator reads, taken by the vCPU right after
+ * it translated the TB; goto_tb is only used when the CPU state that
+ * selects a TB does not change, so the copy is good for the successors
+ * as well.  Guest code is read from a copy of the guest page made by the
+ * worker, see tb_worker_code(), and the translation is dropped if it runs
+ * off that page, or if the guest page changed by the time the TB is
+ * published.  As a store to guest code may still be in flight then, the
+ * first vCPU that finds the TB checks its guest code again.
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or later.
+ * See the COPYING file in the top-level directory.
+ */
+
+#include "qemu/osdep.h"
+#include "qemu/bitmap.h"
+#include "qemu/crc32c.h"
+#include "qemu/plugin.h"
+#include "qemu/qht.h"
+#include "qemu/queue.h"
+#include "qemu/rcu.h"
+#include "qemu/thread.h"
+#include "exec/exec-all.h"
+#include "exec/memory.h"
+#include "hw/core/tcg-cpu-ops.h"
+#include "sysemu/cpus.h"
+#include "tcg/tcg.h"
+#include "tb-hash.h"
+#include "tb-context.h"
+#include "internal.h"
+
+/* Jobs waiting for a worker, at most; the oldest ones are dropped */
+#define TB_WORKER_MAX_QUEUE 256
+
+/* How far from a TB translated by a vCPU the workers go */
+#define TB_WORKER_MAX_DEPTH 2
+
+/* A TB with these flags is not worth translating ahead of time */
+#define TB_WORKER_CF_SKIP \
+    (CF_COUNT_MASK | CF_NO_GOTO_TB | CF_SINGLE_STEP | CF_LAST_IO | \
+     CF_USE_ICOUNT | CF_NOIRQ)
+
+/* Copy of a vCPU for the translator, shared by the jobs of the same TB */
+typedef struct TBWorkerCPU {
+    int refcount;
+    ArchCPU cpu;
+} TBWorkerCPU;
+
+typedef struct TBWorkerJob {
+    TBWorkerCPU *wcpu;
+    const uint8_t *host;        /* guest page in RAM */
+    tb_page_addr_t phys;
+    target_ulong pc;
+    target_ulong cs_base;
+    uint32_t flags;
+    uint32_t cflags;
+    uint32_t trace_vcpu_dstate;
+    int depth;
+    QSIMPLEQ_ENTRY(TBWorkerJob) next;
+} TBWorkerJob;
+
+static struct {
+    unsigned int nb_threads;
+    QemuMutex lock;
+    QemuCond cond;              /* a job was queued, or workers resumed */
+    QemuCond idle;              /* no worker is translating */
+    QSIMPLEQ_HEAD(, TBWorkerJob) queue;
+    unsigned int queued;
+    unsigned int busy;
+    bool paused;
+} tb_worker;
+
+static struct {
+    size_t requested;           /* jobs queued */
+    size_t dropped;             /* jobs dropped from a full queue or a flush */
+    size_t existing;            /* jobs whose TB was already there */
+    size_t translated;          /* TBs published by a worker */
+    size_t aborted;             /* translations that could not be used */
+    size_t stale;               /* TBs found stale by tb_worker_check() */
+} tb_worker_stats;
+
+__thread const TBWorkerPage *tb_worker_page;
+
+/* The job that the current worker thread is translating */
+static __thread TBWorkerJob *tb_worker_job;
+
+static void tb_worker_cpu_unref(TBWorkerCPU *wcpu)
+{
+    if (qatomic_fetch_dec(&wcpu->refcount) == 1) {
+        qemu_vfree(wcpu);
+    }
+}
+
+static void tb_worker_job_free(TBWorkerJob *job)
+{
+    tb_worker_cpu_unref(job->wcpu);
+    g_free(job);
+}
+
+/*
+ * Make a copy of @cpu that is just enough to translate with.  The generic
+ * code reads the class, env_ptr and the tracing state of the CPUState,
+ * and the target copies the state that its translator reads.  The rest of
+ * the vCPU, with its locks, lists and caches, is not copied.
+ */
+static TBWorkerCPU *tb_worker_cpu_new(CPUState *cpu)
+{
+    TBWorkerCPU *wcpu = qemu_memalign(MAX(__alignof__(TBWorkerCPU),
+                                          sizeof(void *)), sizeof(*wcpu));
+    CPUState *copy = &wcpu->cpu.parent_obj;
+
+    memset(wcpu, 0, sizeof(*wcpu));
+    OBJECT(copy)->class = OBJECT(cpu)->class;
+    copy->cpu_index = cpu->cpu_index;
+    copy->cluster_index = cpu->cluster_index;
+    copy->singlestep_enabled = cpu->singlestep_enabled;
+    bitmap_copy(copy->trace_dstate, cpu->trace_dstate,
+                CPU_TRACE_DSTATE_MAX_EVENTS);
+    cpu_set_cpustate_pointers(&wcpu->cpu);
+    CPU_GET_CLASS(cpu)->tcg_ops->copy_for_translation(copy, cpu);
+    return wcpu;
+}
+
+/* Called with tb_worker.lock held */
+static void tb_worker_drop_jobs(void)
+{
+    TBWorkerJob *job;
+
+    while ((job = QSIMPLEQ_FIRST(&tb_worker.queue)) != NULL) {
+        QSIMPLEQ_REMOVE_HEAD(&tb_worker.queue, next);
+        tb_worker.queued--;
+        tb_worker_job_free(job);
+        qatomic_inc(&tb_worker_stats.dropped);
+    }
+}
+
+static bool tb_worker_cmp(const void *p, const void *d)
+{
+    const TranslationBlock *tb = p;
+    const TBWorkerJob *job = d;
+
+    /*
+     * Without a TLB there is no telling which page follows the job's
+     * page, so a TB that spans two pages counts as a match.
+     */
+    return tb->pc == job->pc &&
+           tb->page_addr[0] == job->phys &&
+           tb->cs_base == job->cs_base &&
+           tb->flags == job->flags &&
+           tb->trace_vcpu_dstate == job->trace_vcpu_dstate &&
+           tb_cflags(tb) == job->cflags;
+}
+
+/* Whether the TB that @job would translate is in the hash table already */
+static bool tb_worker_exists(const TBWorkerJob *job)
+{
+    tb_page_addr_t phys_pc = job->phys | (job->pc & ~TARGET_PAGE_MASK);
+    uint32_t h;
+
+    h = tb_hash_func(phys_pc, job->pc, job->flags, job->cflags,
+                     job->trace_vcpu_dstate);
+    return qht_lookup_custom(&tb_ctx.htable, job, h, tb_worker_cmp) != NULL;
+}
+
+static void tb_worker_queue(TBWorkerJob *job)
+{
+    qemu_mutex_lock(&tb_worker.lock);
+    if (tb_worker.paused) {
+        qemu_mutex_unlock(&tb_worker.lock);
+        tb_worker_job_free(job);
+        qatomic_inc(&tb_worker_stats.dropped);
+        return;
+    }
+    if (tb_worker.queued == TB_WORKER_MAX_QUEUE) {
+        /* The newest jobs are the most likely to be useful */
+        TBWorkerJob *old = QSIMPLEQ_FIRST(&tb_worker.queue);
+
+        QSIMPLEQ_REMOVE_HEAD(&tb_worker.queue, next);
+        tb_worker.queued--;
+        tb_worker_job_free(old);
+        qatomic_inc(&tb_worker_stats.dropped);
+    }
+    QSIMPLEQ_INSERT_TAIL(&tb_worker.queue, job, next);
+    tb_worker.queued++;
+    qatomic_inc(&tb_worker_stats.requested);
+    qemu_cond_signal(&tb_worker.cond);
+    qemu_mutex_unlock(&tb_worker.lock);
+}
+
+/*
+ * Queue the direct jump destinations of @tb, which was just published.
+ * @host_pc is where the guest code of @tb was read from.
+ */
+void tb_worker_prefetch(CPUState *cpu, TranslationBlock *tb,
+                        const void *host_pc)
+{
+    TCGContext *s = tcg_ctx;
+    TBWorkerJob *parent = tb_worker_job;
+    TBWorkerCPU *wcpu = NULL;
+    int i;
+
+    if (!tb_worker.nb_threads || !s->nb_goto_tb_dest || !host_pc ||
+        (tb_cflags(tb) & TB_WORKER_CF_SKIP) ||
+        !CPU_GET_CLASS(cpu)->tcg_ops->copy_for_translation ||
+        (parent && parent->depth == TB_WORKER_MAX_DEPTH)) {
+        return;
+    }
+#ifdef CONFIG_PLUGIN
+    /* Plugins expect to see TBs translated as the vCPU gets to them */
+    if (test_bit(QEMU_PLUGIN_EV_VCPU_TB_TRANS, cpu->plugin_mask)) {
+        return;
+    }
+#endif
+
+    for (i = 0; i < s->nb_goto_tb_dest; i++) {
+        TBWorkerJob job = {
+            .host = parent ? parent->host :
+                    (const uint8_t *)host_pc - (tb->pc & ~TARGET_PAGE_MASK),
+            .phys = tb->page_addr[0],
+            .pc = s->goto_tb_dest[i],
+            .cs_base = tb->cs_base,
+            .flags = tb->flags,
+            .cflags = tb_cflags(tb),
+            .trace_vcpu_dstate = tb->trace_vcpu_dstate,
+            .depth = parent ? parent->depth + 1 : 1,
+        };
+
+        if (tb_worker_exists(&job)) {
+            qatomic_inc(&tb_worker_stats.existing);
+            continue;
+        }
+
+        /* Copy the vCPU only once there is something to translate */
+        if (!wcpu) {
+            wcpu = parent ? parent->wcpu : tb_worker_cpu_new(cpu);
+            /* Hold a reference while queueing, jobs may be freed right away */
+            qatomic_inc(&wcpu->refcount);
+        }
+        qatomic_inc(&wcpu->refcount);
+        job.wcpu = wcpu;
+        tb_worker_queue(g_memdup2(&job, sizeof(job)));
+    }
+    if (wcpu) {
+        tb_worker_cpu_unref(wcpu);
+    }
+}
+
+/*
+ * Return where the @size bytes of guest code at @addr can be read from
+ * by a background translation.  The translation is given up if they are
+ * not on the page being translated: the next page may not be mapped.
+ */
+const void *tb_worker_code(target_ulong addr, int size)
+{
+    const TBWorkerPage *page = tb_worker_page;
+    target_ulong offset = addr - page->vaddr;
+
+    if (offset > TARGET_PAGE_SIZE - size) {
+        siglongjmp(tcg_ctx->jmp_trans, -3);
+    }
+    return page->code + offset;
+}
+
+/*
+ * Whether @tb can be published: its guest code must not have changed
+ * since it was copied for the translation.  Called with the page of @tb
+ * locked, so that the check and the publication of @tb are atomic with
+ * respect to invalidations.
+ *
+ * That is not enough, though: a store to guest code invalidates the TBs
+ * of the page before it is done, so @tb may be published in between.
+ * Leave a checksum of the code for tb_worker_check().
+ */
+bool tb_worker_publish(TranslationBlock *tb)
+{
+    const TBWorkerPage *page = tb_worker_page;
+    target_ulong offset = tb->pc - page->vaddr;
+
+    if (memcmp(page->code + offset, page->host + offset, tb->size)) {
+        return false;
+    }
+    tb->worker_crc = crc32c(0xffffffff, page->code + offset, tb->size);
+    tb->worker_unchecked = true;
+    return true;
+}
+
+/*
+ * Check the guest code of @tb, translated in the background, against
+ * guest memory when a vCPU first finds it.  A store that the vCPU did is
+ * complete by then, so this catches those that were in flight when @tb
+ * was published.  Returns false, with @tb invalidated, if it is stale.
+ */
+bool tb_worker_check(TranslationBlock *tb)
+{
+    target_ulong offset = tb->pc & ~TARGET_PAGE_MASK;
+    uint32_t crc;
+
+    WITH_RCU_READ_LOCK_GUARD() {
+        const uint8_t *host = qemu_map_ram_ptr(NULL, tb->page_addr[0]);
+
+        crc = crc32c(0xffffffff, host + offset, tb->size);
+    }
+    if (crc == tb->worker_crc) {
+        qatomic_set(&tb->worker_unchecked, false);
+        return true;
+    }
+    tb_phys_invalidate(tb, -1);
+    qatomic_inc(&tb_worker_stats.stale);
+    return false;
+}
+
+static void tb_worker_run(TBWorkerJob *job, uint8_t *code)
+{
+    CPUState *cpu = &job->wcpu->cpu.parent_obj;
+    TBWorkerPage page = {
+        .code = code,
+        .host = job->host,
+        .phys = job->phys,
+        .vaddr = job->pc & TARGET_PAGE_MASK,
+    };
+    TranslationBlock *tb = NULL;
+
+    if (tb_worker_exists(job)) {
+        qatomic_inc(&tb_worker_stats.existing);
+        return;
+    }
+
+    /* The RAM block may have gone away since the job was queued */
+    WITH_RCU_READ_LOCK_GUARD() {
+        if (qemu_ram_addr_from_host((void *)job->host) != job->phys) {
+            qatomic_inc(&tb_worker_stats.aborted);
+            return;
+        }
+        memcpy(code, job->host, TARGET_PAGE_SIZE);
+
+        mmap_lock();
+        tb_worker_page = &page;
+        tb_worker_job = job;
+        tb = tb_gen_code(cpu, job->pc, job->cs_base, job->flags,
+                         job->cflags);
+        tb_worker_job = NULL;
+        tb_worker_page = NULL;
+        mmap_unlock();
+    }
+
+    if (tb) {
+        qatomic_inc(&tb_worker_stats.translated);
+    } else {
+        qatomic_inc(&tb_worker_stats.aborted);
+    }
+}
+
+static void *tb_worker_thread(void *arg)
+{
+    uint8_t *code = g_malloc(TARGET_PAGE_SIZE);
+
+    rcu_register_thread();
+    tcg_register_thread();
+
+    qemu_mutex_lock(&tb_worker.lock);
+    for (;;) {
+        TBWorkerJob *job;
+
+        while (tb_worker.paused || QSIMPLEQ_EMPTY(&tb_worker.queue)) {
+            qemu_cond_wait(&tb_worker.cond, &tb_worker.lock);
+        }
+        job = QSIMPLEQ_FIRST(&tb_worker.queue);
+        QSIMPLEQ_REMOVE_HEAD(&tb_worker.queue, next);
+        tb_worker.queued--;
+        tb_worker.busy++;
+        qemu_mutex_unlock(&tb_worker.lock);
+
+        tb_worker_run(job, code);
+        tb_worker_job_free(job);
+
+        qemu_mutex_lock(&tb_worker.lock);
+        if (--tb_worker.busy == 0 && tb_worker.paused) {
+            qemu_cond_broadcast(&tb_worker.idle);
+        }
+    }
+    return NULL;
+}
+
+/*
+ * Stop the workers, and drop the jobs that they did not start.  Used
+ * by tb_flush(), which resets the regions the workers translate into.
+ */
+void tb_worker_pause(void)
+{
+    if (!tb_worker.nb_threads) {
+        return;
+    }
+    qemu_mutex_lock(&tb_worker.lock);
+    tb_worker.paused = true;
+    tb_worker_drop_jobs();
+    while (tb_worker.busy) {
+        qemu_cond_wait(&tb_worker.idle, &tb_worker.lock);
+    }
+    qemu_mutex_unlock(&tb_worker.lock);
+}
+
+void tb_worker_resume(void)
+{
+    if (!tb_worker.nb_threads) {
+        return;
+    }
+    qemu_mutex_lock(&tb_worker.lock);
+    tb_worker.paused = false;
+    qemu_cond_broadcast(&tb_worker.cond);
+    qemu_mutex_unlock(&tb_worker.lock);
+}
+
+/*
+ * Start @n workers.  tcg_init() must have made room for their TCG
+ * contexts, besides those of the vCPUs.
+ */
+void tb_worker_init(unsigned int n)
+{
+    unsigned int i;
+
+    qemu_mutex_init(&tb_worker.lock);
+    qemu_cond_init(&tb_worker.cond);
+    qemu_cond_init(&tb_worker.idle);
+    QSIMPLEQ_INIT(&tb_worker.queue);
+    tb_worker.nb_threads = n;
+
+    for (i = 0; i < n; i++) {
+        QemuThread *thread = g_new0(QemuThread, 1);
+        char name[VCPU_THREAD_NAME_SIZE];
+
+        snprintf(name, VCPU_THREAD_NAME_SIZE, "Translate %u/TCG", i);
+        qemu_thread_create(thread, name, tb_worker_thread, NULL,
+                           QEMU_THREAD_DETACHED);
+    }
+}
+
+void tb_worker_dump_info(GString *buf)
+{
+    if (!tb_worker.nb_threads) {
+        return;
+    }
+    g_string_append_printf(buf, "\nBackground translation (%u threads):\n",
+                           tb_worker.nb_threads);
+    g_string_append_printf(buf, "TB requests         %zu queued, "
+                           "%zu dropped, %zu already translated\n",
+                           qatomic_read(&tb_worker_stats.requested),
+                           qatomic_read(&tb_worker_stats.dropped),
+                           qatomic_read(&tb_worker_stats.existing));
+    g_string_append_printf(buf, "TBs translated      %zu "
+                           "(%zu aborted, %zu stale)\n",
+                           qatomic_read(&tb_worker_stats.translated),
+                           qatomic_read(&tb_worker_stats.aborted),
+                           qatomic_read(&tb_worker_stats.stale));
+}
@@ -37,6 +37,7 @@
 #include "hw/boards.h"
 #endif
 #include "internal.h"
+#include "tb-jmp-cache.h"
 
 struct TCGState {
     AccelState parent_obj;
@@ -44,11 +45,17 @@ struct TCGState {
     bool mttcg_enabled;
     int splitwx_enabled;
     unsigned long tb_size;
+    uint32_t trace_threshold;
+    uint32_t jmp_cache_bits;
+    char *tb_cache;
+    uint32_t translate_threads;
 };
 typedef struct TCGState TCGState;
 
 #define TYPE_TCG_ACCEL ACCEL_CLASS_NAME("tcg")
 
+#define TCG_MAX_TRANSLATE_THREADS 64
+
 DECLARE_INSTANCE_CHECKER(TCGState, TCG_STATE,
                          TYPE_TCG_ACCEL)
 
@@ -99,6 +106,7 @@ static void tcg_accel_instance_init(Object *obj)
     TCGState *s = TCG_STATE(obj);
 
     s->mttcg_enabled = default_mttcg_enabled();
+    s->jmp_cache_bits = tb_jmp_cache_bits;
 
     /* If debugging enabled, default "auto on", otherwise off. */
 #if defined(CONFIG_DEBUG_TCG) && !defined(CONFIG_USER_ONLY)
@@ -113,6 +121,7 @@ bool mttcg_enabled;
 static int tcg_init_machine(MachineState *ms)
 {
     TCGState *s = TCG_STATE(current_accel());
+    unsigned translate_threads = 0;
 #ifdef CONFIG_USER_ONLY
     unsigned max_cpus = 1;
 #else
@@ -122,9 +131,21 @@ static int tcg_init_machine(MachineState *ms)
     tcg_allowed = true;
     mttcg_enabled = s->mttcg_enabled;
 
+#if defined(CONFIG_SOFTMMU)
+    if (s->translate_threads && !mttcg_enabled) {
+        warn_report("translate-threads needs thread=multi, ignoring it");
+    } else {
+        translate_threads = s->translate_threads;
+    }
+#endif
+
     page_init();
     tb_htable_init();
-    tcg_init(s->tb_size * MiB, s->splitwx_enabled, max_cpus);
+    /* Translation threads have a TCG context, like vCPU threads */
+    tcg_init(s->tb_size * MiB, s->splitwx_enabled,
+             max_cpus + translate_threads);
+    tb_trace_threshold = s->trace_threshold;
+    tb_jmp_cache_bits = s->jmp_cache_bits;
 
 #if defined(CONFIG_SOFTMMU)
     /*
@@ -132,6 +153,20 @@ static int tcg_init_machine(MachineState *ms)
      * initialize the prologue now.
      */
     tcg_prologue_init(tcg_ctx);
+
+    if (translate_threads) {
+        tb_worker_init(translate_threads);
+    }
+
+    if (s->tb_cache) {
+        Error *err = NULL;
+
+        tb_cache_init(s->tb_cache, &err);
+        if (err) {
+            /* The cache only speeds things up, run without it */
+            warn_report_err(err);
+        }
+    }
 #endif
 
     return 0;
@@ -196,6 +231,63 @@ static void tcg_set_tb_size(Object *obj, Visitor *v,
     s->tb_size = value;
 }
 
+static void tcg_get_trace_threshold(Object *obj, Visitor *v,
+                                    const char *name, void *opaque,
+                                    Error **errp)
+{
+    TCGState *s = TCG_STATE(obj);
+    uint32_t value = s->trace_threshold;
+
+    visit_type_uint32(v, name, &value, errp);
+}
+
+static void tcg_set_trace_threshold(Object *obj, Visitor *v,
+                                    const char *name, void *opaque,
+                                    Error **errp)
+{
+    TCGState *s = TCG_STATE(obj);
+    uint32_t value;
+
+    if (!visit_type_uint32(v, name, &value, errp)) {
+        return;
+    }
+    if (value > INT32_MAX) {
+        error_setg(errp, "trace-threshold must be at most %d", INT32_MAX);
+        return;
+    }
+
+    s->trace_threshold = value;
+}
+
+static void tcg_get_jmp_cache_bits(Object *obj, Visitor *v,
+                                   const char *name, void *opaque,
+                                   Error **errp)
+{
+    TCGState *s = TCG_STATE(obj);
+    uint32_t value = s->jmp_cache_bits;
+
+    visit_type_uint32(v, name, &value, errp);
+}
+
+static void tcg_set_jmp_cache_bits(Object *obj, Visitor *v,
+                                   const char *name, void *opaque,
+                                   Error **errp)
+{
+    TCGState *s = TCG_STATE(obj);
+    uint32_t value;
+
+    if (!visit_type_uint32(v, name, &value, errp)) {
+        return;
+    }
+    if (value < TB_JMP_CACHE_MIN_BITS || value > TB_JMP_CACHE_MAX_BITS) {
+        error_setg(errp, "jmp-cache-bits must be between %d and %d",
+                   TB_JMP_CACHE_MIN_BITS, TB_JMP_CACHE_MAX_BITS);
+        return;
+    }
+
+    s->jmp_cache_bits = value;
+}
+
 static bool tcg_get_splitwx(Object *obj, Error **errp)
 {
     TCGState *s = TCG_STATE(obj);
@@ -208,6 +300,52 @@ static void tcg_set_splitwx(Object *obj, bool value, Error **errp)
     s->splitwx_enabled = value;
 }
 
+#if !defined(CONFIG_USER_ONLY)
+static char *tcg_get_tb_cache(Object *obj, Error **errp)
+{
+    TCGState *s = TCG_STATE(obj);
+
+    return g_strdup(s->tb_cache);
+}
+
+static void tcg_set_tb_cache(Object *obj, const char *value, Error **errp)
+{
+    TCGState *s = TCG_STATE(obj);
+
+    g_free(s->tb_cache);
+    s->tb_cache = g_strdup(value);
+}
+
+static void tcg_get_translate_threads(Object *obj, Visitor *v,
+                                      const char *name, void *opaque,
+                                      Error **errp)
+{
+    TCGState *s = TCG_STATE(obj);
+    uint32_t value = s->translate_threads;
+
+    visit_type_uint32(v, name, &value, errp);
+}
+
+static void tcg_set_translate_threads(Object *obj, Visitor *v,
+                                      const char *name, void *opaque,
+                                      Error **errp)
+{
+    TCGState *s = TCG_STATE(obj);
+    uint32_t value;
+
+    if (!visit_type_uint32(v, name, &value, errp)) {
+        return;
+    }
+    if (value > TCG_MAX_TRANSLATE_THREADS) {
+        error_setg(errp, "translate-threads must be at most %d",
+                   TCG_MAX_TRANSLATE_THREADS);
+        return;
+    }
+
+    s->translate_threads = value;
+}
+#endif
+
 static void tcg_accel_class_init(ObjectClass *oc, void *data)
 {
     AccelClass *ac = ACCEL_CLASS(oc);
@@ -229,6 +367,32 @@ static void tcg_accel_class_init(ObjectClass *oc, void *data)
         tcg_get_splitwx, tcg_set_splitwx);
     object_class_property_set_description(oc, "split-wx",
         "Map jit pages into separate RW and RX regions");
+
+    object_class_property_add(oc, "trace-threshold", "int",
+        tcg_get_trace_threshold, tcg_set_trace_threshold,
+        NULL, NULL);
+    object_class_property_set_description(oc, "trace-threshold",
+        "Executions after which a TB is retranslated as a trace "
+        "(0 to disable)");
+
+    object_class_property_add(oc, "jmp-cache-bits", "int",
+        tcg_get_jmp_cache_bits, tcg_set_jmp_cache_bits,
+        NULL, NULL);
+    object_class_property_set_description(oc, "jmp-cache-bits",
+        "Initial size of the per-vCPU jump cache, as log2 of its entries");
+
+#if !defined(CONFIG_USER_ONLY)
+    object_class_property_add_str(oc, "tb-cache",
+        tcg_get_tb_cache, tcg_set_tb_cache);
+    object_class_property_set_description(oc, "tb-cache",
+        "File in which translations are kept across runs");
+
+    object_class_property_add(oc, "translate-threads", "int",
+        tcg_get_translate_threads, tcg_set_translate_threads,
+        NULL, NULL);
+    object_class_property_set_description(oc, "translate-threads",
+        "Threads translating ahead of the vCPUs (needs thread=multi)");
+#endif
 }
 
 static const TypeInfo tcg_accel_type = {
@@ -59,6 +59,7 @@
 #include "qapi/error.h"
 #include "hw/core/tcg-cpu-ops.h"
 #include "tb-hash.h"
+#include "tb-jmp-cache.h"
 #include "tb-context.h"
 #include "internal.h"
 
@@ -985,6 +986,9 @@ static void do_tb_flush(CPUState *cpu, run_on_cpu_data tb_flush_count)
                tcg_code_size(), nb_tbs, nb_tbs > 0 ? host_size / nb_tbs : 0);
     }
 
+    /* The regions of the translation threads are reset too */
+    tb_worker_pause();
+
     CPU_FOREACH(cpu) {
         cpu_tb_jmp_cache_clear(cpu);
     }
@@ -993,6 +997,7 @@ static void do_tb_flush(CPUState *cpu, run_on_cpu_data tb_flush_count)
     page_flush_tb();
 
     tcg_region_reset_all();
+    tb_worker_resume();
     /* XXX: flush processor icache at this point if cache flush is
        expensive */
     qatomic_mb_set(&tb_ctx.tb_flush_count, tb_ctx.tb_flush_count + 1);
@@ -1018,6 +1023,58 @@ void tb_flush(CPUState *cpu)
     }
 }
 
+static gboolean tb_evict_iter(gpointer key, gpointer value, gpointer data)
+{
+    TranslationBlock *tb = value;
+
+    tb_phys_invalidate(tb, -1);
+    return false;
+}
+
+/* evict the oldest translation blocks, or flush them all if need be */
+static void do_tb_evict(CPUState *cpu, run_on_cpu_data data)
+{
+    CPUState *other;
+    int n;
+
+    mmap_lock();
+    tb_worker_pause();
+    n = tcg_region_evict(tb_evict_iter, NULL);
+    tb_worker_resume();
+    if (n > 0) {
+        /*
+         * A vCPU may have cached a TB in its jump cache just as it was
+         * invalidated, before the eviction; its memory is reused now.
+         */
+        CPU_FOREACH(other) {
+            cpu_tb_jmp_cache_clear(other);
+        }
+        qatomic_set(&tb_ctx.tb_evict_regions, tb_ctx.tb_evict_regions + n);
+        qatomic_mb_set(&tb_ctx.tb_evict_count, tb_ctx.tb_evict_count + 1);
+    }
+    mmap_unlock();
+
+    if (n > 0) {
+        qemu_plugin_flush_cb();
+    } else if (n < 0) {
+        do_tb_flush(cpu, RUN_ON_CPU_HOST_INT(
+                        qatomic_mb_read(&tb_ctx.tb_flush_count)));
+    }
+}
+
+/*
+ * Make room in code_gen_buffer once it is full.  Unlike tb_flush(), this
+ * keeps the most recent translations unless there is nothing else to drop.
+ */
+static void tb_evict(CPUState *cpu)
+{
+    if (cpu_in_exclusive_context(cpu)) {
+        do_tb_evict(cpu, RUN_ON_CPU_NULL);
+    } else {
+        async_safe_run_on_cpu(cpu, do_tb_evict, RUN_ON_CPU_NULL);
+    }
+}
+
 /*
  * Formerly ifdef DEBUG_TB_CHECK. These debug functions are user-mode-only,
  * so in order to prevent bit rot we compile them unconditionally in user-mode,
@@ -1206,11 +1263,8 @@ static void do_tb_phys_invalidate(TranslationBlock *tb, bool rm_from_page_list)
     }
 
     /* remove the TB from the hash list */
-    h = tb_jmp_cache_hash_func(tb->pc);
     CPU_FOREACH(cpu) {
-        if (qatomic_read(&cpu->tb_jmp_cache[h]) == tb) {
-            qatomic_set(&cpu->tb_jmp_cache[h], NULL);
-        }
+        tb_jmp_cache_remove(cpu, tb);
     }
 
     /* suppress this TB from the two jump lists */
@@ -1342,6 +1396,13 @@ tb_link_page(TranslationBlock *tb, tb_page_addr_t phys_pc,
      * we can only insert TBs that are fully initialized.
      */
     page_lock_pair(&p, phys_pc, &p2, phys_page2, 1);
+
+    /* Don't publish a background translation of stale guest code */
+    if (unlikely(tb_worker_page) && !tb_worker_publish(tb)) {
+        page_unlock(p);
+        return NULL;
+    }
+
     tb_page_add(p, tb, 0, phys_pc & TARGET_PAGE_MASK);
     if (p2) {
         tb_page_add(p2, tb, 1, phys_page2);
@@ -1378,10 +1439,14 @@ tb_link_page(TranslationBlock *tb, tb_page_addr_t phys_pc,
     return tb;
 }
 
-/* Called with mmap_lock held for user mode emulation.  */
-TranslationBlock *tb_gen_code(CPUState *cpu,
-                              target_ulong pc, target_ulong cs_base,
-                              uint32_t flags, int cflags)
+/*
+ * Called with mmap_lock held for user mode emulation.
+ * If @head is not NULL, the TB replaces it as the head of a trace.
+ */
+static TranslationBlock *do_tb_gen_code(CPUState *cpu,
+                                        target_ulong pc, target_ulong cs_base,
+                                        uint32_t flags, int cflags,
+                                        TranslationBlock *head)
 {
     CPUArchState *env = cpu->env_ptr;
     TranslationBlock *tb, *existing_tb;
@@ -1389,6 +1454,7 @@ TranslationBlock *tb_gen_code(CPUState *cpu,
     target_ulong virt_page2;
     tcg_insn_unit *gen_code_buf;
     int gen_code_size, search_size, max_insns;
+    void *host_pc;
 #ifdef CONFIG_PROFILER
     TCGProfile *prof = &tcg_ctx->prof;
     int64_t ti;
@@ -1397,7 +1463,13 @@ TranslationBlock *tb_gen_code(CPUState *cpu,
     assert_memory_lock();
     qemu_thread_jit_write();
 
-    phys_pc = get_page_addr_code(env, pc);
+    if (unlikely(tb_worker_page)) {
+        /* Background translation, see tb_worker_run() */
+        phys_pc = tb_worker_page->phys | (pc & ~TARGET_PAGE_MASK);
+        host_pc = (void *)tb_worker_page->code + (pc & ~TARGET_PAGE_MASK);
+    } else {
+        phys_pc = get_page_addr_code_hostp(env, pc, &host_pc);
+    }
 
     if (phys_pc == -1) {
         /* Generate a one-shot TB with 1 insn in it */
@@ -1412,9 +1484,13 @@ TranslationBlock *tb_gen_code(CPUState *cpu,
 
  buffer_overflow:
     tb = tcg_tb_alloc(tcg_ctx);
+    if (unlikely(!tb) && tb_worker_page) {
+        /* Leave the flush to the vCPUs */
+        return NULL;
+    }
     if (unlikely(!tb)) {
-        /* flush must be done */
-        tb_flush(cpu);
+        /* flush, or evicting old TBs, must be done */
+        tb_evict(cpu);
         mmap_unlock();
         /* Make the execution loop process the flush as soon as possible.  */
         cpu->exception_index = EXCP_INTERRUPT;
@@ -1429,6 +1505,10 @@ TranslationBlock *tb_gen_code(CPUState *cpu,
     tb->cflags = cflags;
     tb->trace_vcpu_dstate = *cpu->trace_dstate;
     tcg_ctx->tb_cflags = cflags;
+    tcg_ctx->trace_profile = !head && phys_pc != -1 &&
+                             tb_trace_enabled(cpu, cflags);
+    tb->exec_count = tcg_ctx->trace_profile ? tb_trace_threshold : INT32_MAX;
+    tb->worker_unchecked = false;
  tb_overflow:
 
 #ifdef CONFIG_PROFILER
@@ -1445,7 +1525,13 @@ TranslationBlock *tb_gen_code(CPUState *cpu,
     tcg_func_start(tcg_ctx);
 
     tcg_ctx->cpu = env_cpu(env);
-    gen_intermediate_code(cpu, tb, max_insns);
+    if (head) {
+        /* Traces are not kept in the persistent TB cache */
+        tcg_ctx->ir_save = NULL;
+        tb_trace_gen(cpu, tb, head, max_insns);
+    } else if (!tb_cache_load(cpu, tb, host_pc, max_insns)) {
+        gen_intermediate_code(cpu, tb, max_insns);
+    }
     assert(tb->size != 0);
     tcg_ctx->cpu = NULL;
     max_insns = tb->icount;
@@ -1508,6 +1594,15 @@ TranslationBlock *tb_gen_code(CPUState *cpu,
                           max_insns);
             goto tb_overflow;
 
+        case -3:
+            /*
+             * A background translation ran off the page it was given.
+             * Give the TB back, a vCPU will translate it if it needs it.
+             */
+            tcg_ctx->cpu = NULL;
+            qatomic_set(&tcg_ctx->code_gen_ptr, (void *)tb);
+            return NULL;
+
         default:
             g_assert_not_reached();
         }
@@ -1517,6 +1612,7 @@ TranslationBlock *tb_gen_code(CPUState *cpu,
         goto buffer_overflow;
     }
     tb->tc.size = gen_code_size;
+    tb_cache_store(tb, host_pc);
 
 #ifdef CONFIG_PROFILER
     qatomic_set(&prof->code_time, prof->code_time + profile_getclock() - ti);
@@ -1632,10 +1728,17 @@ TranslationBlock *tb_gen_code(CPUState *cpu,
      */
     tcg_tb_insert(tb);
 
+    /* The trace takes the place of its head in the lookup table */
+    if (head) {
+        tb_phys_invalidate(head, -1);
+    }
+
     /* check next page if needed */
     virt_page2 = (pc + tb->size - 1) & TARGET_PAGE_MASK;
     phys_page2 = -1;
     if ((pc & TARGET_PAGE_MASK) != virt_page2) {
+        /* tb_worker_code() keeps background translations on one page */
+        g_assert(!tb_worker_page);
         phys_page2 = get_page_addr_code(env, virt_page2);
     }
     /*
@@ -1643,7 +1746,16 @@ TranslationBlock *tb_gen_code(CPUState *cpu,
      * TB visible in a consistent state.
      */
     existing_tb = tb_link_page(tb, phys_pc, phys_page2);
-    /* if the TB already exists, discard what we just translated */
+    /* A TB that a worker published first may be of stale code */
+    while (unlikely(existing_tb != tb) && !tb_worker_page &&
+           qatomic_read(&existing_tb->worker_unchecked) &&
+           !tb_worker_check(existing_tb)) {
+        existing_tb = tb_link_page(tb, phys_pc, phys_page2);
+    }
+    /*
+     * if the TB already exists, discard what we just translated; a
+     * background translation may also have been of stale code
+     */
     if (unlikely(existing_tb != tb)) {
         uintptr_t orig_aligned = (uintptr_t)gen_code_buf;
 
@@ -1652,9 +1764,27 @@ TranslationBlock *tb_gen_code(CPUState *cpu,
         tcg_tb_remove(tb);
         return existing_tb;
     }
+
+    /* Get the blocks this one jumps to translated in the background */
+    if (!head) {
+        tb_worker_prefetch(cpu, tb, host_pc);
+    }
     return tb;
 }
 
+TranslationBlock *tb_gen_code(CPUState *cpu,
+                              target_ulong pc, target_ulong cs_base,
+                              uint32_t flags, int cflags)
+{
+    return do_tb_gen_code(cpu, pc, cs_base, flags, cflags, NULL);
+}
+
+TranslationBlock *tb_gen_code_trace(CPUState *cpu, TranslationBlock *head)
+{
+    return do_tb_gen_code(cpu, head->pc, head->cs_base, head->flags,
+                          tb_cflags(head) & ~CF_INVALID, head);
+}
+
 /*
  * @p must be non-NULL.
  * user-mode: call with mmap_lock held.
@@ -2109,6 +2239,9 @@ void dump_exec_info(GString *buf)
     g_string_append_printf(buf, "\nStatistics:\n");
     g_string_append_printf(buf, "TB flush count      %u\n",
                            qatomic_read(&tb_ctx.tb_flush_count));
+    g_string_append_printf(buf, "TB evict count      %u (%zu regions)\n",
+                           qatomic_read(&tb_ctx.tb_evict_count),
+                           qatomic_read(&tb_ctx.tb_evict_regions));
     g_string_append_printf(buf, "TB invalidate count %u\n",
                            qatomic_read(&tb_ctx.tb_phys_invalidate_count));
 
@@ -2117,6 +2250,10 @@ void dump_exec_info(GString *buf)
     g_string_append_printf(buf, "TLB partial flushes %zu\n", flush_part);
     g_string_append_printf(buf, "TLB elided flushes  %zu\n", flush_elide);
     tcg_dump_info(buf);
+    tb_cache_dump_info(buf);
+    tb_trace_dump_info(buf);
+    tb_jmp_cache_dump_info(buf);
+    tb_worker_dump_info(buf);
 }
 
 void dump_opcount_info(GString *buf)
@@ -33,13 +33,29 @@ void translator_loop_temp_check(DisasContextBase *db)
 
 bool translator_use_goto_tb(DisasContextBase *db, target_ulong dest)
 {
+    TCGContext *s = tcg_ctx;
+    int i;
+
     /* Suppress goto_tb if requested. */
     if (tb_cflags(db->tb) & CF_NO_GOTO_TB) {
         return false;
     }
 
     /* Check for the dest on the same page as the start of the TB.  */
-    return ((db->pc_first ^ dest) & TARGET_PAGE_MASK) == 0;
+    if ((db->pc_first ^ dest) & TARGET_PAGE_MASK) {
+        return false;
+    }
+
+    /* Remember the destination as a likely next block to translate */
+    for (i = 0; i < s->nb_goto_tb_dest; i++) {
+        if (s->goto_tb_dest[i] == dest) {
+            return true;
+        }
+    }
+    if (s->nb_goto_tb_dest < ARRAY_SIZE(s->goto_tb_dest)) {
+        s->goto_tb_dest[s->nb_goto_tb_dest++] = dest;
+    }
+    return true;
 }
 
 static inline void translator_page_protect(DisasContextBase *dcbase,
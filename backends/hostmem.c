@@ -20,6 +20,8 @@
 #include "qom/object_interfaces.h"
 #include "qemu/mmap-alloc.h"
 #include "qemu/madvise.h"
+#include "qemu/error-report.h"
+#include "qemu/main-loop.h"
 
 #ifdef CONFIG_NUMA
 #include <numaif.h>
@@ -204,6 +206,130 @@ static void host_memory_backend_set_dump(Object *obj, bool value, Error **errp)
     }
 }
 
+/*
+ * Host CPUs for the preallocation threads: those of the host nodes the
+ * memory is bound to, so that each page is cleared by a CPU close to it.
+ */
+static unsigned long *host_memory_backend_prealloc_cpus(
+    HostMemoryBackend *backend)
+{
+    unsigned long *cpus;
+
+    if (backend->policy == HOST_MEM_POLICY_DEFAULT) {
+        return NULL;
+    }
+
+    cpus = bitmap_new(NUMA_MAX_HOST_CPUS);
+    if (!numa_host_nodes_get_cpus(backend->host_nodes, cpus)) {
+        g_free(cpus);
+        return NULL;
+    }
+    return cpus;
+}
+
+static void host_memory_backend_do_prealloc(HostMemoryBackend *backend,
+                                            Error **errp)
+{
+    g_autofree unsigned long *cpus =
+        host_memory_backend_prealloc_cpus(backend);
+
+    os_mem_prealloc(memory_region_get_fd(&backend->mr),
+                    memory_region_get_ram_ptr(&backend->mr),
+                    memory_region_size(&backend->mr),
+                    backend->prealloc_threads, cpus,
+                    cpus ? NUMA_MAX_HOST_CPUS : 0, errp);
+}
+
+bool host_memory_backend_prealloc_wait(HostMemoryBackend *backend,
+                                       Error **errp)
+{
+    MemPreallocJob *job = backend->prealloc_job;
+    bool ret;
+
+    if (!job) {
+        return true;
+    }
+    backend->prealloc_job = NULL;
+    ret = os_mem_prealloc_finish(job, errp);
+    ram_block_uncoordinated_discard_disable(false);
+    return ret;
+}
+
+static void host_memory_backend_prealloc_bh(void *opaque)
+{
+    HostMemoryBackend *backend = opaque;
+    Error *local_err = NULL;
+
+    if (!host_memory_backend_prealloc_wait(backend, &local_err)) {
+        /* The remaining pages are faulted in on access, which may fail */
+        error_reportf_err(local_err, "memory backend '%s': ",
+                          object_get_canonical_path_component(OBJECT(backend)));
+    }
+    object_unref(OBJECT(backend));
+}
+
+/* Called by the last preallocation thread */
+static void host_memory_backend_prealloc_done(void *opaque)
+{
+    aio_bh_schedule_oneshot(qemu_get_aio_context(),
+                            host_memory_backend_prealloc_bh, opaque);
+}
+
+static void host_memory_backend_start_prealloc(HostMemoryBackend *backend,
+                                               Error **errp)
+{
+    g_autofree unsigned long *cpus =
+        host_memory_backend_prealloc_cpus(backend);
+
+    /*
+     * Pages that virtio-balloon discards while the job runs would be
+     * populated again by the prealloc threads.  Keep the balloon from
+     * discarding until host_memory_backend_prealloc_wait(), or preallocate
+     * up front if discards cannot be disabled.
+     */
+    if (ram_block_uncoordinated_discard_disable(true)) {
+        host_memory_backend_do_prealloc(backend, errp);
+        return;
+    }
+
+    /* Dropped by host_memory_backend_prealloc_bh() */
+    object_ref(OBJECT(backend));
+    backend->prealloc_job =
+        os_mem_prealloc_start(memory_region_get_fd(&backend->mr),
+                              memory_region_get_ram_ptr(&backend->mr),
+                              memory_region_size(&backend->mr),
+                              backend->prealloc_threads, cpus,
+                              cpus ? NUMA_MAX_HOST_CPUS : 0,
+                              host_memory_backend_prealloc_done, backend,
+                              errp);
+    if (!backend->prealloc_job) {
+        ram_block_uncoordinated_discard_disable(false);
+        object_unref(OBJECT(backend));
+    }
+}
+
+static int host_memory_backend_prealloc_wait_one(Object *obj, void *opaque)
+{
+    HostMemoryBackend *backend =
+        (HostMemoryBackend *)object_dynamic_cast(obj, TYPE_MEMORY_BACKEND);
+    Error **errp = opaque;
+
+    if (backend && !host_memory_backend_prealloc_wait(backend, errp)) {
+        return -1;
+    }
+    return 0;
+}
+
+/*
+ * Wait for the background preallocation of all memory backends, for users
+ * that must not race with it, such as discarding RAM for postcopy.
+ */
+bool host_memory_backend_prealloc_wait_all(Error **errp)
+{
+    return !object_child_foreach(object_get_objects_root(),
+                                 host_memory_backend_prealloc_wait_one, errp);
+}
+
 static bool host_memory_backend_get_prealloc(Object *obj, Error **errp)
 {
     HostMemoryBackend *backend = MEMORY_BACKEND(obj);
@@ -228,11 +354,7 @@ static void host_memory_backend_set_prealloc(Object *obj, bool value,
     }
 
     if (value && !backend->prealloc) {
-        int fd = memory_region_get_fd(&backend->mr);
-        void *ptr = memory_region_get_ram_ptr(&backend->mr);
-        uint64_t sz = memory_region_size(&backend->mr);
-
-        os_mem_prealloc(fd, ptr, sz, backend->prealloc_threads, &local_err);
+        host_memory_backend_do_prealloc(backend, &local_err);
         if (local_err) {
             error_propagate(errp, local_err);
             return;
@@ -265,6 +387,25 @@ static void host_memory_backend_set_prealloc_threads(Object *obj, Visitor *v,
     backend->prealloc_threads = value;
 }
 
+static bool host_memory_backend_get_prealloc_async(Object *obj, Error **errp)
+{
+    HostMemoryBackend *backend = MEMORY_BACKEND(obj);
+
+    return backend->prealloc_async;
+}
+
+static void host_memory_backend_set_prealloc_async(Object *obj, bool value,
+                                                   Error **errp)
+{
+    HostMemoryBackend *backend = MEMORY_BACKEND(obj);
+
+    if (host_memory_backend_mr_inited(backend)) {
+        error_setg(errp, "cannot change property value");
+        return;
+    }
+    backend->prealloc_async = value;
+}
+
 static void host_memory_backend_init(Object *obj)
 {
     HostMemoryBackend *backend = MEMORY_BACKEND(obj);
@@ -392,12 +533,10 @@ host_memory_backend_memory_complete(UserCreatable *uc, Error **errp)
          * This is necessary to guarantee memory is allocated with
          * specified NUMA policy in place.
          */
-        if (backend->prealloc) {
-            os_mem_prealloc(memory_region_get_fd(&backend->mr), ptr, sz,
-                            backend->prealloc_threads, &local_err);
-            if (local_err) {
-                goto out;
-            }
+        if (backend->prealloc && backend->prealloc_async) {
+            host_memory_backend_start_prealloc(backend, &local_err);
+        } else if (backend->prealloc) {
+            host_memory_backend_do_prealloc(backend, &local_err);
         }
     }
 out:
@@ -502,6 +641,11 @@ host_memory_backend_class_init(ObjectClass *oc, void *data)
         NULL, NULL);
     object_class_property_set_description(oc, "prealloc-threads",
         "Number of CPU threads to use for prealloc");
+    object_class_property_add_bool(oc, "prealloc-async",
+        host_memory_backend_get_prealloc_async,
+        host_memory_backend_set_prealloc_async);
+    object_class_property_set_description(oc, "prealloc-async",
+        "Let prealloc continue in the background while the guest runs");
     object_class_property_add(oc, "size", "int",
         host_memory_backend_get_size,
         host_memory_backend_set_size,
@@ -260,6 +260,22 @@ void block_acct_merge_done(BlockAcctStats *stats, enum BlockAcctType type,
     qemu_mutex_unlock(&stats->lock);
 }
 
+/*
+ * Record that a device submitted @num_requests requests of @type together,
+ * before merging.  Together with the merge counters this gives the merge
+ * rate and the average batch size.
+ */
+void block_acct_batch_done(BlockAcctStats *stats, enum BlockAcctType type,
+                           int num_requests)
+{
+    assert(type < BLOCK_MAX_IOTYPE);
+
+    qemu_mutex_lock(&stats->lock);
+    stats->batches[type]++;
+    stats->batched[type] += num_requests;
+    qemu_mutex_unlock(&stats->lock);
+}
+
 int64_t block_acct_idle_time_ns(BlockAcctStats *stats)
 {
     return qemu_clock_get_ns(clock_type) - stats->last_access_time_ns;
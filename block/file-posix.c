@@ -158,12 +158,19 @@ typedef struct BDRVRawState {
     bool discard_zeroes:1;
     bool use_linux_aio:1;
     bool use_linux_io_uring:1;
+    bool use_io_uring_fixed:1;
+    bool use_io_uring_sqpoll:1;
+    bool use_io_uring_iopoll:1;
     int page_cache_inconsistent; /* errno from fdatasync failure */
     bool has_fallocate;
     bool needs_alignment;
     bool force_alignment;
     bool drop_cache;
     bool check_cache_dropped;
+
+    /* Buffers passed to .bdrv_register_buf, as struct iovec */
+    GArray *io_uring_bufs;
+
     struct {
         uint64_t discard_nb_ok;
         uint64_t discard_nb_failed;
@@ -551,6 +558,23 @@ static QemuOptsList raw_runtime_opts = {
             .type = QEMU_OPT_NUMBER,
             .help = "AIO max batch size (0 = auto handled by AIO backend, default: 0)",
         },
+        {
+            .name = "io-uring-fixed",
+            .type = QEMU_OPT_BOOL,
+            .help = "register file and buffers with io_uring (default: off)",
+        },
+        {
+            .name = "io-uring-sqpoll",
+            .type = QEMU_OPT_BOOL,
+            .help = "use a kernel thread to poll the io_uring submission "
+                    "queue (default: off)",
+        },
+        {
+            .name = "io-uring-iopoll",
+            .type = QEMU_OPT_BOOL,
+            .help = "reap io_uring completions by polling the device, "
+                    "requires cache.direct=on (default: off)",
+        },
         {
             .name = "locking",
             .type = QEMU_OPT_STRING,
@@ -579,6 +603,106 @@ static QemuOptsList raw_runtime_opts = {
 
 static const char *const mutable_opts[] = { "x-check-cache-dropped", NULL };
 
+#ifdef CONFIG_LINUX_IO_URING
+static unsigned int raw_luring_flags(BDRVRawState *s)
+{
+    return (s->use_io_uring_sqpoll ? LURING_SETUP_SQPOLL : 0) |
+           (s->use_io_uring_iopoll ? LURING_SETUP_IOPOLL : 0);
+}
+
+static LuringState *raw_get_luring(BlockDriverState *bs)
+{
+    BDRVRawState *s = bs->opaque;
+
+    return aio_get_linux_io_uring(bdrv_get_aio_context(bs),
+                                  raw_luring_flags(s));
+}
+
+static LuringState *raw_setup_luring(BlockDriverState *bs, AioContext *ctx,
+                                     Error **errp)
+{
+    BDRVRawState *s = bs->opaque;
+    LuringState *aio;
+
+    aio = aio_setup_linux_io_uring(ctx, raw_luring_flags(s), errp);
+    if (aio && s->use_io_uring_sqpoll &&
+        !(luring_get_setup_flags(aio) & LURING_SETUP_SQPOLL)) {
+        warn_report("io-uring-sqpoll=on ignored for '%s': the io_uring "
+                    "instance of the AioContext was created without it or "
+                    "the host does not allow it", bs->filename);
+    }
+    return aio;
+}
+
+/*
+ * The ring refers to registered files by fd number, so the fd must be
+ * unregistered before it is closed or replaced.
+ */
+static void raw_luring_register_fd(BlockDriverState *bs, AioContext *ctx)
+{
+    BDRVRawState *s = bs->opaque;
+
+    if (s->use_linux_io_uring && s->use_io_uring_fixed && s->fd >= 0) {
+        luring_register_fd(aio_get_linux_io_uring(ctx, raw_luring_flags(s)),
+                           s->fd);
+    }
+}
+
+static void raw_luring_unregister_fd(BlockDriverState *bs, AioContext *ctx)
+{
+    BDRVRawState *s = bs->opaque;
+
+    if (s->use_linux_io_uring && s->use_io_uring_fixed && s->fd >= 0) {
+        luring_unregister_fd(aio_get_linux_io_uring(ctx, raw_luring_flags(s)),
+                             s->fd);
+    }
+}
+
+/*
+ * Registers the image fd, the buffers from .bdrv_register_buf and guest RAM
+ * with the io_uring instance of @ctx.  Everything must be unregistered with
+ * raw_luring_unregister() before the node is closed or @ctx changes.
+ */
+static void raw_luring_register(BlockDriverState *bs, AioContext *ctx)
+{
+    BDRVRawState *s = bs->opaque;
+    LuringState *aio;
+    guint i;
+
+    if (!s->use_linux_io_uring || !s->use_io_uring_fixed) {
+        return;
+    }
+
+    aio = aio_get_linux_io_uring(ctx, raw_luring_flags(s));
+    raw_luring_register_fd(bs, ctx);
+    for (i = 0; s->io_uring_bufs && i < s->io_uring_bufs->len; i++) {
+        struct iovec *iov = &g_array_index(s->io_uring_bufs, struct iovec, i);
+        luring_register_buf(aio, iov->iov_base, iov->iov_len);
+    }
+    luring_register_guest_ram(aio);
+}
+
+static void raw_luring_unregister(BlockDriverState *bs, AioContext *ctx)
+{
+    BDRVRawState *s = bs->opaque;
+    LuringState *aio;
+    guint i;
+
+    if (!s->use_linux_io_uring || !s->use_io_uring_fixed) {
+        return;
+    }
+
+    aio = aio_get_linux_io_uring(ctx, raw_luring_flags(s));
+    raw_luring_unregister_fd(bs, ctx);
+    for (i = 0; s->io_uring_bufs && i < s->io_uring_bufs->len; i++) {
+        struct iovec *iov = &g_array_index(s->io_uring_bufs, struct iovec, i);
+        luring_unregister_buf(aio, iov->iov_base);
+    }
+    luring_unregister_guest_ram(aio);
+}
+#endif
+
+
 static int raw_open_common(BlockDriverState *bs, QDict *options,
                            int bdrv_flags, int open_flags,
                            bool device, Error **errp)
@@ -632,6 +756,18 @@ static int raw_open_common(BlockDriverState *bs, QDict *options,
 
     s->aio_max_batch = qemu_opt_get_number(opts, "aio-max-batch", 0);
 
+    s->use_io_uring_fixed = qemu_opt_get_bool(opts, "io-uring-fixed", false);
+    s->use_io_uring_sqpoll = qemu_opt_get_bool(opts, "io-uring-sqpoll", false);
+    s->use_io_uring_iopoll = qemu_opt_get_bool(opts, "io-uring-iopoll", false);
+    if ((s->use_io_uring_fixed || s->use_io_uring_sqpoll ||
+         s->use_io_uring_iopoll) &&
+        aio != BLOCKDEV_AIO_OPTIONS_IO_URING) {
+        error_setg(errp, "io-uring-fixed, io-uring-sqpoll and io-uring-iopoll "
+                   "require aio=io_uring");
+        ret = -EINVAL;
+        goto fail;
+    }
+
     locking = qapi_enum_parse(&OnOffAuto_lookup,
                               qemu_opt_get(opts, "locking"),
                               ON_OFF_AUTO_AUTO, &local_err);
@@ -725,8 +861,15 @@ static int raw_open_common(BlockDriverState *bs, QDict *options,
 #endif /* !defined(CONFIG_LINUX_AIO) */
 
 #ifdef CONFIG_LINUX_IO_URING
+    /* Polled I/O only works for files opened with O_DIRECT */
+    if (s->use_io_uring_iopoll && !(s->open_flags & O_DIRECT)) {
+        error_setg(errp, "io-uring-iopoll=on was specified, but it requires "
+                         "cache.direct=on, which was not specified.");
+        ret = -EINVAL;
+        goto fail;
+    }
     if (s->use_linux_io_uring) {
-        if (!aio_setup_linux_io_uring(bdrv_get_aio_context(bs), errp)) {
+        if (!raw_setup_luring(bs, bdrv_get_aio_context(bs), errp)) {
             error_prepend(errp, "Unable to use io_uring: ");
             goto fail;
         }
@@ -805,6 +948,11 @@ static int raw_open_common(BlockDriverState *bs, QDict *options,
         /* When extending regular files, we get zeros from the OS */
         bs->supported_truncate_flags = BDRV_REQ_ZERO_WRITE;
     }
+
+#ifdef CONFIG_LINUX_IO_URING
+    /* Only now that nothing can fail anymore, see raw_close() */
+    raw_luring_register(bs, bdrv_get_aio_context(bs));
+#endif
     ret = 0;
 fail:
     if (ret < 0 && s->fd != -1) {
@@ -1121,6 +1269,12 @@ static int raw_reopen_prepare(BDRVReopenState *state,
     rs->check_cache_dropped =
         qemu_opt_get_bool_del(opts, "x-check-cache-dropped", false);
 
+    if (s->use_io_uring_iopoll && !(state->flags & BDRV_O_NOCACHE)) {
+        error_setg(errp, "Cannot disable cache.direct with io-uring-iopoll=on");
+        ret = -EINVAL;
+        goto out;
+    }
+
     /* This driver's reopen function doesn't currently allow changing
      * other options, so let's put them back in the original QDict and
      * bdrv_reopen_prepare() will detect changes and complain. */
@@ -2066,7 +2220,7 @@ static int coroutine_fn raw_co_prw(BlockDriverState *bs, uint64_t offset,
         type |= QEMU_AIO_MISALIGNED;
 #ifdef CONFIG_LINUX_IO_URING
     } else if (s->use_linux_io_uring) {
-        LuringState *aio = aio_get_linux_io_uring(bdrv_get_aio_context(bs));
+        LuringState *aio = raw_get_luring(bs);
         assert(qiov->size == bytes);
         return luring_co_submit(bs, aio, s->fd, offset, qiov, type);
 #endif
@@ -2121,7 +2275,7 @@ static void raw_aio_plug(BlockDriverState *bs)
 #endif
 #ifdef CONFIG_LINUX_IO_URING
     if (s->use_linux_io_uring) {
-        LuringState *aio = aio_get_linux_io_uring(bdrv_get_aio_context(bs));
+        LuringState *aio = raw_get_luring(bs);
         luring_io_plug(bs, aio);
     }
 #endif
@@ -2138,7 +2292,7 @@ static void raw_aio_unplug(BlockDriverState *bs)
 #endif
 #ifdef CONFIG_LINUX_IO_URING
     if (s->use_linux_io_uring) {
-        LuringState *aio = aio_get_linux_io_uring(bdrv_get_aio_context(bs));
+        LuringState *aio = raw_get_luring(bs);
         luring_io_unplug(bs, aio);
     }
 #endif
@@ -2162,8 +2316,9 @@ static int raw_co_flush_to_disk(BlockDriverState *bs)
     };
 
 #ifdef CONFIG_LINUX_IO_URING
-    if (s->use_linux_io_uring) {
-        LuringState *aio = aio_get_linux_io_uring(bdrv_get_aio_context(bs));
+    /* Polled rings cannot fsync, use the thread pool for those */
+    if (s->use_linux_io_uring && !s->use_io_uring_iopoll) {
+        LuringState *aio = raw_get_luring(bs);
         return luring_co_submit(bs, aio, s->fd, 0, NULL, QEMU_AIO_FLUSH);
     }
 #endif
@@ -2187,19 +2342,71 @@ static void raw_aio_attach_aio_context(BlockDriverState *bs,
 #ifdef CONFIG_LINUX_IO_URING
     if (s->use_linux_io_uring) {
         Error *local_err = NULL;
-        if (!aio_setup_linux_io_uring(new_context, &local_err)) {
+        if (!raw_setup_luring(bs, new_context, &local_err)) {
             error_reportf_err(local_err, "Unable to use linux io_uring, "
                                          "falling back to thread pool: ");
             s->use_linux_io_uring = false;
         }
+        raw_luring_register(bs, new_context);
     }
 #endif
 }
 
+#ifdef CONFIG_LINUX_IO_URING
+static void raw_aio_detach_aio_context(BlockDriverState *bs)
+{
+    raw_luring_unregister(bs, bdrv_get_aio_context(bs));
+}
+
+static void raw_register_buf(BlockDriverState *bs, void *host, size_t size)
+{
+    BDRVRawState *s = bs->opaque;
+    struct iovec iov = {
+        .iov_base = host,
+        .iov_len = size,
+    };
+
+    if (!s->use_linux_io_uring || !s->use_io_uring_fixed) {
+        return;
+    }
+
+    if (!s->io_uring_bufs) {
+        s->io_uring_bufs = g_array_new(false, false, sizeof(struct iovec));
+    }
+    g_array_append_val(s->io_uring_bufs, iov);
+    luring_register_buf(raw_get_luring(bs), host, size);
+}
+
+static void raw_unregister_buf(BlockDriverState *bs, void *host)
+{
+    BDRVRawState *s = bs->opaque;
+    guint i;
+
+    for (i = 0; s->io_uring_bufs && i < s->io_uring_bufs->len; i++) {
+        struct iovec *iov = &g_array_index(s->io_uring_bufs, struct iovec, i);
+
+        if (iov->iov_base == host) {
+            g_array_remove_index_fast(s->io_uring_bufs, i);
+            if (s->use_linux_io_uring) {
+                luring_unregister_buf(raw_get_luring(bs), host);
+            }
+            return;
+        }
+    }
+}
+#endif
+
 static void raw_close(BlockDriverState *bs)
 {
     BDRVRawState *s = bs->opaque;
 
+#ifdef CONFIG_LINUX_IO_URING
+    raw_luring_unregister(bs, bdrv_get_aio_context(bs));
+    if (s->io_uring_bufs) {
+        g_array_free(s->io_uring_bufs, true);
+        s->io_uring_bufs = NULL;
+    }
+#endif
     if (s->fd >= 0) {
         qemu_close(s->fd);
         s->fd = -1;
@@ -3196,9 +3403,15 @@ static void raw_set_perm(BlockDriverState *bs, uint64_t perm, uint64_t shared)
     /* For reopen, we have already switched to the new fd (.bdrv_set_perm is
      * called after .bdrv_reopen_commit) */
     if (s->perm_change_fd && s->fd != s->perm_change_fd) {
+#ifdef CONFIG_LINUX_IO_URING
+        raw_luring_unregister_fd(bs, bdrv_get_aio_context(bs));
+#endif
         qemu_close(s->fd);
         s->fd = s->perm_change_fd;
         s->open_flags = s->perm_change_flags;
+#ifdef CONFIG_LINUX_IO_URING
+        raw_luring_register_fd(bs, bdrv_get_aio_context(bs));
+#endif
     }
     s->perm_change_fd = 0;
 
@@ -3298,6 +3511,11 @@ BlockDriver bdrv_file = {
     .bdrv_io_plug = raw_aio_plug,
     .bdrv_io_unplug = raw_aio_unplug,
     .bdrv_attach_aio_context = raw_aio_attach_aio_context,
+#ifdef CONFIG_LINUX_IO_URING
+    .bdrv_detach_aio_context = raw_aio_detach_aio_context,
+    .bdrv_register_buf = raw_register_buf,
+    .bdrv_unregister_buf = raw_unregister_buf,
+#endif
 
     .bdrv_co_truncate = raw_co_truncate,
     .bdrv_getlength = raw_getlength,
@@ -3670,6 +3888,11 @@ static BlockDriver bdrv_host_device = {
     .bdrv_io_plug = raw_aio_plug,
     .bdrv_io_unplug = raw_aio_unplug,
     .bdrv_attach_aio_context = raw_aio_attach_aio_context,
+#ifdef CONFIG_LINUX_IO_URING
+    .bdrv_detach_aio_context = raw_aio_detach_aio_context,
+    .bdrv_register_buf = raw_register_buf,
+    .bdrv_unregister_buf = raw_unregister_buf,
+#endif
 
     .bdrv_co_truncate       = raw_co_truncate,
     .bdrv_getlength	= raw_getlength,
@@ -3794,6 +4017,9 @@ static BlockDriver bdrv_host_cdrom = {
     .bdrv_io_plug = raw_aio_plug,
     .bdrv_io_unplug = raw_aio_unplug,
     .bdrv_attach_aio_context = raw_aio_attach_aio_context,
+#ifdef CONFIG_LINUX_IO_URING
+    .bdrv_detach_aio_context = raw_aio_detach_aio_context,
+#endif
 
     .bdrv_co_truncate    = raw_co_truncate,
     .bdrv_getlength      = raw_getlength,
@@ -3924,6 +4150,9 @@ static BlockDriver bdrv_host_cdrom = {
     .bdrv_io_plug = raw_aio_plug,
     .bdrv_io_unplug = raw_aio_unplug,
     .bdrv_attach_aio_context = raw_aio_attach_aio_context,
+#ifdef CONFIG_LINUX_IO_URING
+    .bdrv_detach_aio_context = raw_aio_detach_aio_context,
+#endif
 
     .bdrv_co_truncate    = raw_co_truncate,
     .bdrv_getlength      = raw_getlength,
@@ -10,18 +10,36 @@
  */
 #include "qemu/osdep.h"
 #include <liburing.h>
+#include <sys/syscall.h>
 #include "qemu-common.h"
 #include "block/aio.h"
 #include "qemu/queue.h"
 #include "block/block.h"
 #include "block/raw-aio.h"
 #include "qemu/coroutine.h"
+#include "qemu/memalign.h"
+#include "qemu/error-report.h"
+#include "qemu/units.h"
 #include "qapi/error.h"
+#include "exec/cpu-common.h"
+#include "exec/ramlist.h"
 #include "trace.h"
 
 /* io_uring ring size */
 #define MAX_ENTRIES 128
 
+/* Idle time in milliseconds before the SQPOLL kernel thread goes to sleep */
+#define SQPOLL_IDLE_MS 1000
+
+/*
+ * Interval at which a polled ring is reaped once aio_poll() stopped polling,
+ * see luring_process_completions()
+ */
+#define IOPOLL_TIMER_NS (20 * SCALE_US)
+
+/* The kernel refuses to register larger buffers, guest RAM is split up */
+#define MAX_FIXED_BUF_SIZE (1 * GiB)
+
 typedef struct LuringAIOCB {
     Coroutine *co;
     struct io_uring_sqe sqeq;
@@ -56,6 +74,38 @@ typedef struct LuringState {
 
     /* I/O completion processing.  Only runs in I/O thread.  */
     QEMUBH *completion_bh;
+    QEMUTimer iopoll_timer;
+
+    /* LURING_SETUP_* flags the ring was actually created with */
+    unsigned int setup_flags;
+
+    /*
+     * Registered file table.  Slots hold the fd registered with the kernel,
+     * or -1 if unused.  @fixed_files_ok is false if the kernel refused the
+     * sparse table, in which case all requests use plain fds.
+     */
+    bool fixed_files_ok;
+    int fixed_fds[LURING_MAX_FIXED_FILES];
+    unsigned int nb_fixed_fds;
+
+    /*
+     * Registered buffer table.  If @fixed_bufs_sparse, the kernel has a
+     * table of LURING_MAX_FIXED_BUFS slots, unused ones empty, and single
+     * slots are updated in place.  Older kernels only allow replacing the
+     * table as a whole, so slot indexes stay stable for queued requests by
+     * filling released slots with @fixed_buf_dummy.  @nb_fixed_bufs is one
+     * past the last slot in use.
+     */
+    bool fixed_bufs_sparse;
+    struct iovec fixed_bufs[LURING_MAX_FIXED_BUFS];
+    unsigned int fixed_buf_refs[LURING_MAX_FIXED_BUFS];
+    unsigned int nb_fixed_bufs;
+    void *fixed_buf_dummy;
+
+    /* Guest RAM registration, see luring_register_guest_ram() */
+    RAMBlockNotifier ram_notifier;
+    unsigned int guest_ram_users;
+    bool guest_ram_registered;
 } LuringState;
 
 /**
@@ -89,9 +139,18 @@ static void luring_resubmit_short_read(LuringState *s, LuringAIOCB *luringcb,
     trace_luring_resubmit_short_read(s, luringcb, nread);
 
     /* Update read position */
-    luringcb->total_read = nread;
+    luringcb->total_read += nread;
     remaining = luringcb->qiov->size - luringcb->total_read;
 
+    if (luringcb->sqeq.opcode == IORING_OP_READ_FIXED) {
+        /* A fixed read covers a single buffer, just advance into it */
+        luringcb->sqeq.off += nread;
+        luringcb->sqeq.addr += nread;
+        luringcb->sqeq.len = remaining;
+        luring_resubmit(s, luringcb);
+        return;
+    }
+
     /* Shorten qiov */
     resubmit_qiov = &luringcb->resubmit_qiov;
     if (resubmit_qiov->iov == NULL) {
@@ -103,13 +162,31 @@ static void luring_resubmit_short_read(LuringState *s, LuringAIOCB *luringcb,
                       remaining);
 
     /* Update sqe */
-    luringcb->sqeq.off = nread;
+    luringcb->sqeq.off += nread;
     luringcb->sqeq.addr = (__u64)(uintptr_t)luringcb->resubmit_qiov.iov;
     luringcb->sqeq.len = luringcb->resubmit_qiov.niov;
 
     luring_resubmit(s, luringcb);
 }
 
+/*
+ * Rings created with LURING_SETUP_IOPOLL get no completion interrupts, the
+ * kernel only finds finished requests when asked to poll the device.
+ */
+static void luring_iopoll_reap(LuringState *s)
+{
+    int ret;
+
+    if (!(s->setup_flags & LURING_SETUP_IOPOLL) || !s->io_q.in_flight ||
+        io_uring_cq_ready(&s->ring)) {
+        return;
+    }
+
+    ret = syscall(__NR_io_uring_enter, s->ring.ring_fd, 0, 0,
+                  IORING_ENTER_GETEVENTS, NULL, _NSIG / 8);
+    trace_luring_iopoll_reap(s, s->io_q.in_flight, ret < 0 ? -errno : ret);
+}
+
 /**
  * luring_process_completions:
  * @s: AIO state
@@ -127,6 +204,7 @@ static void luring_process_completions(LuringState *s)
 {
     struct io_uring_cqe *cqes;
     int total_bytes;
+    unsigned int consumed = 0;
     /*
      * Request completion callbacks can run the nested event loop.
      * Schedule ourselves so the nested event loop will "see" remaining
@@ -144,6 +222,8 @@ static void luring_process_completions(LuringState *s)
      */
     qemu_bh_schedule(s->completion_bh);
 
+    luring_iopoll_reap(s);
+
     while (io_uring_peek_cqe(&s->ring, &cqes) == 0) {
         LuringAIOCB *luringcb;
         int ret;
@@ -156,6 +236,7 @@ static void luring_process_completions(LuringState *s)
         ret = cqes->res;
         io_uring_cqe_seen(&s->ring, cqes);
         cqes = NULL;
+        consumed++;
 
         /* Change counters one-by-one because we can be nested. */
         s->io_q.in_flight--;
@@ -218,6 +299,24 @@ end:
             aio_co_wake(luringcb->co);
         }
     }
+
+    /*
+     * A polled ring never makes its fd readable.  While completions keep
+     * coming, leave the BH scheduled so that the next ones are reaped right
+     * away.  Otherwise adaptive polling in aio_poll() reaps them through
+     * qemu_luring_poll_cb(), and once its time budget is used up the timer
+     * catches requests still in flight without keeping the CPU busy.
+     */
+    if ((s->setup_flags & LURING_SETUP_IOPOLL) && s->io_q.in_flight) {
+        if (consumed) {
+            return;
+        }
+        if (!timer_pending(&s->iopoll_timer)) {
+            timer_mod(&s->iopoll_timer,
+                      qemu_clock_get_ns(QEMU_CLOCK_REALTIME) +
+                      IOPOLL_TIMER_NS);
+        }
+    }
     qemu_bh_cancel(s->completion_bh);
 }
 
@@ -282,6 +381,12 @@ static void qemu_luring_completion_bh(void *opaque)
     luring_process_completions_and_submit(s);
 }
 
+static void qemu_luring_iopoll_timer_cb(void *opaque)
+{
+    LuringState *s = opaque;
+    luring_process_completions_and_submit(s);
+}
+
 static void qemu_luring_completion_cb(void *opaque)
 {
     LuringState *s = opaque;
@@ -292,6 +397,8 @@ static bool qemu_luring_poll_cb(void *opaque)
 {
     LuringState *s = opaque;
 
+    /* Adaptive polling in aio_poll() reaps polled rings here */
+    luring_iopoll_reap(s);
     return io_uring_cq_ready(&s->ring);
 }
 
@@ -328,6 +435,48 @@ void luring_io_unplug(BlockDriverState *bs, LuringState *s)
     }
 }
 
+/* Returns the registered file slot for @fd, or -1 */
+static int luring_fixed_file(LuringState *s, int fd)
+{
+    int i;
+
+    if (!s->nb_fixed_fds) {
+        return -1;
+    }
+    for (i = 0; i < LURING_MAX_FIXED_FILES; i++) {
+        if (s->fixed_fds[i] == fd) {
+            return i;
+        }
+    }
+    return -1;
+}
+
+/*
+ * Returns the registered buffer slot that contains all of @qiov, or -1.
+ * Only single-element vectors can be submitted as fixed reads/writes.
+ */
+static int luring_fixed_buf(LuringState *s, QEMUIOVector *qiov)
+{
+    uintptr_t start, end;
+    int i;
+
+    if (!s->nb_fixed_bufs || qiov->niov != 1) {
+        return -1;
+    }
+
+    start = (uintptr_t)qiov->iov[0].iov_base;
+    end = start + qiov->iov[0].iov_len;
+    for (i = 0; i < s->nb_fixed_bufs; i++) {
+        uintptr_t buf = (uintptr_t)s->fixed_bufs[i].iov_base;
+
+        if (s->fixed_buf_refs[i] && start >= buf &&
+            end <= buf + s->fixed_bufs[i].iov_len) {
+            return i;
+        }
+    }
+    return -1;
+}
+
 /**
  * luring_do_submit:
  * @fd: file descriptor for I/O
@@ -338,21 +487,45 @@ void luring_io_unplug(BlockDriverState *bs, LuringState *s)
  *
  * Fetches sqes from ring, adds to pending queue and preps them
  *
+ * Registered files and buffers are used instead of @fd and the iovec array
+ * whenever possible, saving the kernel a file table lookup and page pinning
+ * for each request.
  */
 static int luring_do_submit(int fd, LuringAIOCB *luringcb, LuringState *s,
                             uint64_t offset, int type)
 {
     int ret;
     struct io_uring_sqe *sqes = &luringcb->sqeq;
+    int file_index = luring_fixed_file(s, fd);
+    int buf_index = -1;
+
+    if (file_index >= 0) {
+        fd = file_index;
+    }
+    if (type == QEMU_AIO_READ || type == QEMU_AIO_WRITE) {
+        buf_index = luring_fixed_buf(s, luringcb->qiov);
+    }
 
     switch (type) {
     case QEMU_AIO_WRITE:
-        io_uring_prep_writev(sqes, fd, luringcb->qiov->iov,
-                             luringcb->qiov->niov, offset);
+        if (buf_index >= 0) {
+            io_uring_prep_write_fixed(sqes, fd, luringcb->qiov->iov[0].iov_base,
+                                      luringcb->qiov->iov[0].iov_len, offset,
+                                      buf_index);
+        } else {
+            io_uring_prep_writev(sqes, fd, luringcb->qiov->iov,
+                                 luringcb->qiov->niov, offset);
+        }
         break;
     case QEMU_AIO_READ:
-        io_uring_prep_readv(sqes, fd, luringcb->qiov->iov,
-                            luringcb->qiov->niov, offset);
+        if (buf_index >= 0) {
+            io_uring_prep_read_fixed(sqes, fd, luringcb->qiov->iov[0].iov_base,
+                                     luringcb->qiov->iov[0].iov_len, offset,
+                                     buf_index);
+        } else {
+            io_uring_prep_readv(sqes, fd, luringcb->qiov->iov,
+                                luringcb->qiov->niov, offset);
+        }
         break;
     case QEMU_AIO_FLUSH:
         io_uring_prep_fsync(sqes, fd, IORING_FSYNC_DATASYNC);
@@ -362,6 +535,9 @@ static int luring_do_submit(int fd, LuringAIOCB *luringcb, LuringState *s,
                         __func__, type);
         abort();
     }
+    if (file_index >= 0) {
+        sqes->flags |= IOSQE_FIXED_FILE;
+    }
     io_uring_sqe_set_data(sqes, luringcb);
 
     QSIMPLEQ_INSERT_TAIL(&s->io_q.submit_queue, luringcb, next);
@@ -407,6 +583,7 @@ void luring_detach_aio_context(LuringState *s, AioContext *old_context)
     aio_set_fd_handler(old_context, s->ring.ring_fd, false,
                        NULL, NULL, NULL, NULL, s);
     qemu_bh_delete(s->completion_bh);
+    timer_del(&s->iopoll_timer);
     s->aio_context = NULL;
 }
 
@@ -414,25 +591,384 @@ void luring_attach_aio_context(LuringState *s, AioContext *new_context)
 {
     s->aio_context = new_context;
     s->completion_bh = aio_bh_new(new_context, qemu_luring_completion_bh, s);
+    aio_timer_init(new_context, &s->iopoll_timer, QEMU_CLOCK_REALTIME,
+                   SCALE_NS, qemu_luring_iopoll_timer_cb, s);
     aio_set_fd_handler(s->aio_context, s->ring.ring_fd, false,
                        qemu_luring_completion_cb, NULL,
                        qemu_luring_poll_cb, qemu_luring_poll_ready, s);
 }
 
-LuringState *luring_init(Error **errp)
+/**
+ * luring_register_fd:
+ * @s: AIO state
+ * @fd: file descriptor to register
+ *
+ * Adds @fd to the ring's registered file table so that requests on it are
+ * submitted with IOSQE_FIXED_FILE.  The caller must call
+ * luring_unregister_fd() before closing @fd.  Registering an fd twice is
+ * allowed and only uses one slot.
+ *
+ * Returns: the slot index on success, -errno on failure.  Failure is not
+ * fatal, requests on @fd then simply use the plain file descriptor.
+ */
+int luring_register_fd(LuringState *s, int fd)
+{
+    int i, ret;
+
+    if (!s->fixed_files_ok) {
+        return -ENOTSUP;
+    }
+
+    i = luring_fixed_file(s, fd);
+    if (i >= 0) {
+        return i;
+    }
+
+    for (i = 0; i < LURING_MAX_FIXED_FILES; i++) {
+        if (s->fixed_fds[i] == -1) {
+            break;
+        }
+    }
+    if (i == LURING_MAX_FIXED_FILES) {
+        return -ENOSPC;
+    }
+
+    ret = io_uring_register_files_update(&s->ring, i, &fd, 1);
+    trace_luring_register_fd(s, fd, i, ret);
+    if (ret < 0) {
+        return ret;
+    }
+
+    s->fixed_fds[i] = fd;
+    s->nb_fixed_fds++;
+    return i;
+}
+
+/**
+ * luring_unregister_fd:
+ * @s: AIO state
+ * @fd: file descriptor previously passed to luring_register_fd()
+ *
+ * Requests that are already queued keep using the slot, so this must only be
+ * called when no requests on @fd are in flight.
+ */
+void luring_unregister_fd(LuringState *s, int fd)
+{
+    int i = luring_fixed_file(s, fd);
+    int unused = -1;
+    int ret;
+
+    if (i < 0) {
+        return;
+    }
+
+    ret = io_uring_register_files_update(&s->ring, i, &unused, 1);
+    trace_luring_unregister_fd(s, fd, i, ret);
+    s->fixed_fds[i] = -1;
+    s->nb_fixed_fds--;
+}
+
+/* Replaces the kernel's registered buffer table with s->fixed_bufs */
+static int luring_update_fixed_bufs(LuringState *s)
+{
+    int ret;
+
+    /* -ENXIO just means that no table was registered yet */
+    io_uring_unregister_buffers(&s->ring);
+
+    if (!s->nb_fixed_bufs) {
+        return 0;
+    }
+
+    ret = io_uring_register_buffers(&s->ring, s->fixed_bufs, s->nb_fixed_bufs);
+    trace_luring_update_fixed_bufs(s, s->nb_fixed_bufs, ret);
+    return ret;
+}
+
+/* Updates slot @i of the kernel's registered buffer table */
+static int luring_update_fixed_buf(LuringState *s, unsigned int i)
+{
+#ifdef HAVE_IO_URING_REGISTER_BUFFERS_UPDATE_TAG
+    if (s->fixed_bufs_sparse) {
+        int ret = io_uring_register_buffers_update_tag(&s->ring, i,
+                                                       &s->fixed_bufs[i],
+                                                       NULL, 1);
+        trace_luring_update_fixed_buf(s, i, s->fixed_bufs[i].iov_base,
+                                      s->fixed_bufs[i].iov_len, ret);
+        return ret < 0 ? ret : 0;
+    }
+#endif
+    return luring_update_fixed_bufs(s);
+}
+
+/* Releases slot @i, which must not be used by queued requests anymore */
+static void luring_clear_fixed_buf(LuringState *s, unsigned int i)
+{
+    s->fixed_buf_refs[i] = 0;
+    if (s->fixed_bufs_sparse) {
+        s->fixed_bufs[i] = (struct iovec) {};
+    } else {
+        s->fixed_bufs[i] = (struct iovec) {
+            .iov_base = s->fixed_buf_dummy,
+            .iov_len = qemu_real_host_page_size,
+        };
+    }
+
+    /* Drop trailing unused slots, nobody can refer to them */
+    while (s->nb_fixed_bufs && !s->fixed_buf_refs[s->nb_fixed_bufs - 1]) {
+        s->nb_fixed_bufs--;
+    }
+}
+
+/**
+ * luring_register_buf:
+ * @s: AIO state
+ * @host: start of the buffer
+ * @size: length of the buffer in bytes
+ *
+ * Pins @host in the kernel so that requests whose single iovec lies in it are
+ * submitted as IORING_OP_READ_FIXED/IORING_OP_WRITE_FIXED.  Registrations of
+ * the same buffer are reference counted.
+ *
+ * Returns: 0 on success, -errno on failure.  Failure is not fatal, requests
+ * using @host then simply go through readv/writev.
+ */
+int luring_register_buf(LuringState *s, void *host, size_t size)
 {
-    int rc;
+    unsigned int i, free_slot = LURING_MAX_FIXED_BUFS;
+    int ret;
+
+    for (i = 0; i < s->nb_fixed_bufs; i++) {
+        if (!s->fixed_buf_refs[i]) {
+            free_slot = MIN(free_slot, i);
+        } else if (s->fixed_bufs[i].iov_base == host &&
+                   s->fixed_bufs[i].iov_len == size) {
+            s->fixed_buf_refs[i]++;
+            return 0;
+        }
+    }
+
+    if (free_slot == LURING_MAX_FIXED_BUFS) {
+        if (s->nb_fixed_bufs == LURING_MAX_FIXED_BUFS) {
+            return -ENOSPC;
+        }
+        free_slot = s->nb_fixed_bufs++;
+    }
+
+    s->fixed_bufs[free_slot] = (struct iovec) {
+        .iov_base = host,
+        .iov_len = size,
+    };
+    s->fixed_buf_refs[free_slot] = 1;
+
+    ret = luring_update_fixed_buf(s, free_slot);
+    if (ret < 0) {
+        /* Leave the table as it was before */
+        luring_clear_fixed_buf(s, free_slot);
+        luring_update_fixed_buf(s, free_slot);
+    }
+    return ret;
+}
+
+/**
+ * luring_unregister_buf:
+ * @s: AIO state
+ * @host: start of a buffer previously passed to luring_register_buf()
+ *
+ * Drops one reference to @host and releases its slot when the last one goes
+ * away.  No request using @host may be in flight.
+ */
+void luring_unregister_buf(LuringState *s, void *host)
+{
+    unsigned int i;
+
+    for (i = 0; i < s->nb_fixed_bufs; i++) {
+        if (s->fixed_buf_refs[i] && s->fixed_bufs[i].iov_base == host) {
+            break;
+        }
+    }
+    if (i == s->nb_fixed_bufs || --s->fixed_buf_refs[i]) {
+        return;
+    }
+
+    luring_clear_fixed_buf(s, i);
+    luring_update_fixed_buf(s, i);
+}
+
+static void luring_register_ram(LuringState *s, void *host, size_t size)
+{
+    size_t offset, len;
+    int ret;
+
+    for (offset = 0; offset < size; offset += len) {
+        len = MIN(size - offset, MAX_FIXED_BUF_SIZE);
+        ret = luring_register_buf(s, host + offset, len);
+        if (ret < 0) {
+            warn_report_once("io_uring: guest RAM at %p is only partially "
+                             "registered: %s", host, strerror(-ret));
+            return;
+        }
+    }
+}
+
+static void luring_unregister_ram(LuringState *s, void *host, size_t size)
+{
+    size_t offset;
+
+    for (offset = 0; offset < size; offset += MAX_FIXED_BUF_SIZE) {
+        luring_unregister_buf(s, host + offset);
+    }
+}
+
+static void luring_ram_block_added(RAMBlockNotifier *n, void *host,
+                                   size_t size, size_t max_size)
+{
+    LuringState *s = container_of(n, LuringState, ram_notifier);
+
+    aio_context_acquire(s->aio_context);
+    luring_register_ram(s, host, size);
+    aio_context_release(s->aio_context);
+}
+
+static void luring_ram_block_removed(RAMBlockNotifier *n, void *host,
+                                     size_t size, size_t max_size)
+{
+    LuringState *s = container_of(n, LuringState, ram_notifier);
+
+    aio_context_acquire(s->aio_context);
+    luring_unregister_ram(s, host, size);
+    aio_context_release(s->aio_context);
+}
+
+static void luring_ram_block_resized(RAMBlockNotifier *n, void *host,
+                                     size_t old_size, size_t new_size)
+{
+    LuringState *s = container_of(n, LuringState, ram_notifier);
+
+    aio_context_acquire(s->aio_context);
+    luring_unregister_ram(s, host, old_size);
+    luring_register_ram(s, host, new_size);
+    aio_context_release(s->aio_context);
+}
+
+static int luring_unregister_ram_block(RAMBlock *rb, void *opaque)
+{
+    void *host = qemu_ram_get_host_addr(rb);
+
+    if (host) {
+        luring_unregister_ram(opaque, host, qemu_ram_get_used_length(rb));
+    }
+    return 0;
+}
+
+/**
+ * luring_register_guest_ram:
+ * @s: AIO state
+ *
+ * Registers all guest RAM, and RAM blocks added later, as fixed buffers so
+ * that guest I/O is submitted as IORING_OP_READ_FIXED/IORING_OP_WRITE_FIXED.
+ * This pins guest RAM for as long as it stays registered, and fails if RAM
+ * discards (e.g. by virtio-mem) are required.  Calls nest, only the first
+ * one registers.  Must be called with the BQL held.
+ */
+void luring_register_guest_ram(LuringState *s)
+{
+    if (s->guest_ram_users++) {
+        return;
+    }
+
+    /* Discarding pinned pages would leave the kernel with stale ones */
+    if (ram_block_discard_disable(true)) {
+        warn_report("io_uring: guest RAM is not registered, because RAM "
+                    "discards are required");
+        return;
+    }
+    s->guest_ram_registered = true;
+    ram_block_notifier_add(&s->ram_notifier);
+}
+
+/**
+ * luring_unregister_guest_ram:
+ * @s: AIO state
+ *
+ * Undoes luring_register_guest_ram().  No guest request may be in flight.
+ * Must be called with the BQL held.
+ */
+void luring_unregister_guest_ram(LuringState *s)
+{
+    assert(s->guest_ram_users);
+    if (--s->guest_ram_users || !s->guest_ram_registered) {
+        return;
+    }
+
+    ram_block_notifier_remove(&s->ram_notifier);
+    qemu_ram_foreach_block(luring_unregister_ram_block, s);
+    ram_block_discard_disable(false);
+    s->guest_ram_registered = false;
+}
+
+unsigned int luring_get_setup_flags(LuringState *s)
+{
+    return s->setup_flags;
+}
+
+LuringState *luring_init(unsigned int setup_flags, Error **errp)
+{
+    int rc, i;
     LuringState *s = g_new0(LuringState, 1);
     struct io_uring *ring = &s->ring;
+    struct io_uring_params params = {};
 
     trace_luring_init_state(s, sizeof(*s));
 
-    rc = io_uring_queue_init(MAX_ENTRIES, ring, 0);
+    if (setup_flags & LURING_SETUP_SQPOLL) {
+        params.flags |= IORING_SETUP_SQPOLL;
+        params.sq_thread_idle = SQPOLL_IDLE_MS;
+    }
+    if (setup_flags & LURING_SETUP_IOPOLL) {
+        params.flags |= IORING_SETUP_IOPOLL;
+    }
+
+    rc = io_uring_queue_init_params(MAX_ENTRIES, ring, &params);
+    if (rc < 0 && (setup_flags & LURING_SETUP_SQPOLL)) {
+        /*
+         * Older kernels restrict SQPOLL to privileged users.  The ring is
+         * shared by everything in the AioContext, so fall back to a normal
+         * ring and let the caller check luring_get_setup_flags().
+         */
+        trace_luring_init_sqpoll_failed(s, rc);
+        setup_flags &= ~LURING_SETUP_SQPOLL;
+        params = (struct io_uring_params) {
+            .flags = params.flags & ~IORING_SETUP_SQPOLL,
+        };
+        rc = io_uring_queue_init_params(MAX_ENTRIES, ring, &params);
+    }
     if (rc < 0) {
-        error_setg_errno(errp, errno, "failed to init linux io_uring ring");
+        error_setg_errno(errp, -rc, "failed to init linux io_uring ring");
         g_free(s);
         return NULL;
     }
+    s->setup_flags = setup_flags;
+
+    /* Start with an empty sparse file table, filled by luring_register_fd() */
+    for (i = 0; i < LURING_MAX_FIXED_FILES; i++) {
+        s->fixed_fds[i] = -1;
+    }
+    rc = io_uring_register_files(ring, s->fixed_fds, LURING_MAX_FIXED_FILES);
+    s->fixed_files_ok = (rc == 0);
+
+#ifdef HAVE_IO_URING_REGISTER_BUFFERS_UPDATE_TAG
+    /* Likewise an empty buffer table, if the kernel allows empty slots */
+    rc = io_uring_register_buffers(ring, s->fixed_bufs, LURING_MAX_FIXED_BUFS);
+    s->fixed_bufs_sparse = (rc == 0);
+#endif
+
+    s->fixed_buf_dummy = qemu_memalign(qemu_real_host_page_size,
+                                       qemu_real_host_page_size);
+
+    s->ram_notifier.ram_block_added = luring_ram_block_added;
+    s->ram_notifier.ram_block_removed = luring_ram_block_removed;
+    s->ram_notifier.ram_block_resized = luring_ram_block_resized;
 
     ioq_init(&s->io_q);
     return s;
@@ -441,7 +977,9 @@ LuringState *luring_init(Error **errp)
 
 void luring_cleanup(LuringState *s)
 {
+    assert(!s->guest_ram_users);
     io_uring_queue_exit(&s->ring);
     trace_luring_cleanup_state(s);
+    qemu_vfree(s->fixed_buf_dummy);
     g_free(s);
 }
@@ -450,6 +450,16 @@ static void bdrv_query_blk_stats(BlockDeviceStats *ds, BlockBackend *blk)
     ds->rd_merged = stats->merged[BLOCK_ACCT_READ];
     ds->wr_merged = stats->merged[BLOCK_ACCT_WRITE];
     ds->unmap_merged = stats->merged[BLOCK_ACCT_UNMAP];
+    if (stats->batches[BLOCK_ACCT_READ]) {
+        ds->has_rd_batches = ds->has_rd_batched = true;
+        ds->rd_batches = stats->batches[BLOCK_ACCT_READ];
+        ds->rd_batched = stats->batched[BLOCK_ACCT_READ];
+    }
+    if (stats->batches[BLOCK_ACCT_WRITE]) {
+        ds->has_wr_batches = ds->has_wr_batched = true;
+        ds->wr_batches = stats->batches[BLOCK_ACCT_WRITE];
+        ds->wr_batched = stats->batched[BLOCK_ACCT_WRITE];
+    }
     ds->flush_operations = stats->nr_ops[BLOCK_ACCT_FLUSH];
     ds->wr_total_time_ns = stats->total_time_ns[BLOCK_ACCT_WRITE];
     ds->rd_total_time_ns = stats->total_time_ns[BLOCK_ACCT_READ];
@@ -24,14 +24,29 @@
 
 #include "qemu/osdep.h"
 #include "qemu/memalign.h"
+#include "qemu/queue.h"
 #include "qcow2.h"
 #include "trace.h"
 
+/* Maximum number of tables read ahead after a miss */
+#define QCOW2_CACHE_MAX_READAHEAD 8
+
+/*
+ * Loads that release the lock may reserve at most 1/QCOW2_CACHE_ASYNC_FRACTION
+ * of the cache entries, so that lock holders always find a free entry.
+ */
+#define QCOW2_CACHE_ASYNC_FRACTION 4
+
 typedef struct Qcow2CachedTable {
     int64_t  offset;
     uint64_t lru_counter;
     int      ref;
     bool     dirty;
+    /* Being read from disk by a coroutine that doesn't hold the lock */
+    bool     loading;
+    /* Discarded while loading, must not be published when the read ends */
+    bool     stale;
+    QTAILQ_ENTRY(Qcow2CachedTable) lru_entry;
 } Qcow2CachedTable;
 
 struct Qcow2Cache {
@@ -43,6 +58,29 @@ struct Qcow2Cache {
     void                   *table_array;
     uint64_t                lru_counter;
     uint64_t                cache_clean_lru_counter;
+
+    /* Maps the offset of every cached table to its Qcow2CachedTable */
+    GHashTable             *offset_index;
+
+    /*
+     * All entries with ref == 0, least recently used first. Entries that
+     * don't hold any table are kept at the head so they are reused first.
+     */
+    QTAILQ_HEAD(, Qcow2CachedTable) lru_list;
+
+    /*
+     * Coroutines waiting for a loading entry to become ready, or for all
+     * loads to be done, see qcow2_cache_wait_loads()
+     */
+    CoQueue                 load_queue;
+    /* Coroutines waiting for an entry to be released */
+    CoQueue                 free_queue;
+    /* Entries currently reserved by loads that run without the lock */
+    int                     async_refs;
+
+    uint64_t                hits;
+    uint64_t                misses;
+    uint64_t                evictions;
 };
 
 static inline void *qcow2_cache_get_table_addr(Qcow2Cache *c, int table)
@@ -58,6 +96,45 @@ static inline int qcow2_cache_get_table_idx(Qcow2Cache *c, void *table)
     return idx;
 }
 
+static inline int qcow2_cache_entry_idx(Qcow2Cache *c, Qcow2CachedTable *t)
+{
+    return t - c->entries;
+}
+
+/*
+ * Change the offset of entry i, keeping the offset index up to date.
+ * Passing 0 marks the entry as unused.
+ */
+static void qcow2_cache_set_offset(Qcow2Cache *c, int i, int64_t offset)
+{
+    Qcow2CachedTable *t = &c->entries[i];
+
+    if (t->offset) {
+        g_hash_table_remove(c->offset_index, &t->offset);
+    }
+    t->offset = offset;
+    if (offset) {
+        /* The key lives inside the entry, so no allocation is needed */
+        g_hash_table_insert(c->offset_index, &t->offset, t);
+    }
+}
+
+static inline Qcow2CachedTable *qcow2_cache_lookup(Qcow2Cache *c,
+                                                   int64_t offset)
+{
+    return g_hash_table_lookup(c->offset_index, &offset);
+}
+
+/* Move an unreferenced, now unused entry to the head of the LRU list */
+static void qcow2_cache_lru_make_free(Qcow2Cache *c, int i)
+{
+    Qcow2CachedTable *t = &c->entries[i];
+
+    assert(t->ref == 0);
+    QTAILQ_REMOVE(&c->lru_list, t, lru_entry);
+    QTAILQ_INSERT_HEAD(&c->lru_list, t, lru_entry);
+}
+
 static inline const char *qcow2_cache_get_name(BDRVQcow2State *s, Qcow2Cache *c)
 {
     if (c == s->refcount_block_cache) {
@@ -105,8 +182,9 @@ void qcow2_cache_clean_unused(Qcow2Cache *c)
 
         /* And count how many we can clean in a row */
         while (i < c->size && can_clean_entry(c, i)) {
-            c->entries[i].offset = 0;
+            qcow2_cache_set_offset(c, i, 0);
             c->entries[i].lru_counter = 0;
+            qcow2_cache_lru_make_free(c, i);
             i++;
             to_clean++;
         }
@@ -124,6 +202,7 @@ Qcow2Cache *qcow2_cache_create(BlockDriverState *bs, int num_tables,
 {
     BDRVQcow2State *s = bs->opaque;
     Qcow2Cache *c;
+    int i;
 
     assert(num_tables > 0);
     assert(is_power_of_2(table_size));
@@ -141,20 +220,49 @@ Qcow2Cache *qcow2_cache_create(BlockDriverState *bs, int num_tables,
         qemu_vfree(c->table_array);
         g_free(c->entries);
         g_free(c);
-        c = NULL;
+        return NULL;
+    }
+
+    c->offset_index = g_hash_table_new(g_int64_hash, g_int64_equal);
+    qemu_co_queue_init(&c->load_queue);
+    qemu_co_queue_init(&c->free_queue);
+    QTAILQ_INIT(&c->lru_list);
+    for (i = 0; i < num_tables; i++) {
+        QTAILQ_INSERT_TAIL(&c->lru_list, &c->entries[i], lru_entry);
     }
 
     return c;
 }
 
-int qcow2_cache_destroy(Qcow2Cache *c)
+/*
+ * Wait until no load runs without the lock anymore, so that the entries
+ * they reserved are released.  In a coroutine, the caller holds s->lock,
+ * which the loads need to finish.
+ */
+static void qcow2_cache_wait_loads(BlockDriverState *bs, Qcow2Cache *c)
+{
+    BDRVQcow2State *s = bs->opaque;
+
+    if (qemu_in_coroutine()) {
+        while (c->async_refs > 0) {
+            qemu_co_queue_wait(&c->load_queue, &s->lock);
+        }
+    } else {
+        BDRV_POLL_WHILE(bs, c->async_refs > 0);
+    }
+}
+
+int qcow2_cache_destroy(BlockDriverState *bs, Qcow2Cache *c)
 {
     int i;
 
+    qcow2_cache_wait_loads(bs, c);
+
     for (i = 0; i < c->size; i++) {
         assert(c->entries[i].ref == 0);
     }
 
+    g_hash_table_destroy(c->offset_index);
     qemu_vfree(c->table_array);
     g_free(c->entries);
     g_free(c);
@@ -299,15 +407,20 @@ int qcow2_cache_empty(BlockDriverState *bs, Qcow2Cache *c)
 {
     int ret, i;
 
+    qcow2_cache_wait_loads(bs, c);
+
     ret = qcow2_cache_flush(bs, c);
     if (ret < 0) {
         return ret;
     }
 
+    g_hash_table_remove_all(c->offset_index);
+    QTAILQ_INIT(&c->lru_list);
     for (i = 0; i < c->size; i++) {
         assert(c->entries[i].ref == 0);
         c->entries[i].offset = 0;
         c->entries[i].lru_counter = 0;
+        QTAILQ_INSERT_TAIL(&c->lru_list, &c->entries[i], lru_entry);
     }
 
     qcow2_cache_table_release(c, 0, c->size);
@@ -317,15 +430,178 @@ int qcow2_cache_empty(BlockDriverState *bs, Qcow2Cache *c)
     return 0;
 }
 
+/*
+ * Look up @offset in the cache. If the table is being loaded by another
+ * coroutine, wait for the load to finish; @lock (if non-NULL) is released
+ * while waiting. Outside of coroutines, poll until the load is done.
+ * Returns the entry index, or -1 if the table is not cached.
+ */
+static int qcow2_cache_find(BlockDriverState *bs, Qcow2Cache *c,
+                            int64_t offset, CoMutex *lock)
+{
+    Qcow2CachedTable *t;
+
+    while ((t = qcow2_cache_lookup(c, offset)) && t->loading) {
+        if (qemu_in_coroutine()) {
+            trace_qcow2_cache_load_wait(qemu_coroutine_self(), offset);
+            qemu_co_queue_wait(&c->load_queue, lock);
+        } else {
+            BDRV_POLL_WHILE(bs, t->loading);
+        }
+    }
+
+    return t ? qcow2_cache_entry_idx(c, t) : -1;
+}
+
+/* Take a reference to an entry on behalf of a load that drops the lock */
+static void qcow2_cache_reserve_async(Qcow2Cache *c, int i, int64_t offset)
+{
+    Qcow2CachedTable *t = &c->entries[i];
+
+    assert(t->ref == 0 && !t->dirty);
+    QTAILQ_REMOVE(&c->lru_list, t, lru_entry);
+    qcow2_cache_set_offset(c, i, offset);
+    t->ref = 1;
+    t->loading = true;
+    c->async_refs++;
+}
+
+/*
+ * Finish the load of entry i. Entries whose read failed or that were
+ * discarded in the meantime are detached from their offset. Returns
+ * whether the table contents are valid.
+ */
+static bool qcow2_cache_load_done(Qcow2Cache *c, int i, int ret)
+{
+    Qcow2CachedTable *t = &c->entries[i];
+    bool valid = ret >= 0 && !t->stale;
+
+    assert(t->loading);
+    t->loading = false;
+    t->stale = false;
+    if (!valid) {
+        qcow2_cache_set_offset(c, i, 0);
+    }
+    return valid;
+}
+
+/* Drop the reference taken by qcow2_cache_reserve_async() */
+static void qcow2_cache_release_async(Qcow2Cache *c, int i)
+{
+    Qcow2CachedTable *t = &c->entries[i];
+
+    assert(t->ref == 1 && c->async_refs > 0);
+    if (--c->async_refs == 0) {
+        qemu_co_queue_restart_all(&c->load_queue);
+    }
+    t->ref = 0;
+    if (t->offset) {
+        t->lru_counter = ++c->lru_counter;
+        QTAILQ_INSERT_TAIL(&c->lru_list, t, lru_entry);
+    } else {
+        t->lru_counter = 0;
+        QTAILQ_INSERT_HEAD(&c->lru_list, t, lru_entry);
+    }
+    qemu_co_queue_next(&c->free_queue);
+}
+
+/*
+ * Load the table at @offset into the (already written back) entry i, and
+ * up to @readahead following tables into other clean, unreferenced entries.
+ * @lock is released during the read, so that misses of other coroutines
+ * can be served in parallel.
+ *
+ * Returns 0 if entry i now holds the table with a reference taken,
+ * -EAGAIN if the table was discarded during the load, or -errno.
+ */
+static int coroutine_fn qcow2_cache_co_load(BlockDriverState *bs,
+                                            Qcow2Cache *c, int i,
+                                            int64_t offset, int readahead,
+                                            CoMutex *lock)
+{
+    BDRVQcow2State *s = bs->opaque;
+    int idx[QCOW2_CACHE_MAX_READAHEAD + 1];
+    int max_async = c->size / QCOW2_CACHE_ASYNC_FRACTION;
+    uint8_t *buf = NULL;
+    int n, k, ret;
+
+    qcow2_cache_reserve_async(c, i, offset);
+    idx[0] = i;
+
+    readahead = MIN(readahead, QCOW2_CACHE_MAX_READAHEAD);
+    for (n = 1; n <= readahead && c->async_refs < max_async; n++) {
+        int64_t ra_offset = offset + (int64_t) n * c->table_size;
+        Qcow2CachedTable *t = QTAILQ_FIRST(&c->lru_list);
+
+        /* Don't write back dirty tables just for readahead */
+        if (!t || t->dirty || qcow2_cache_lookup(c, ra_offset)) {
+            break;
+        }
+        idx[n] = qcow2_cache_entry_idx(c, t);
+        qcow2_cache_reserve_async(c, idx[n], ra_offset);
+    }
+
+    if (n > 1) {
+        buf = qemu_try_blockalign(bs->file->bs, (size_t) n * c->table_size);
+        if (!buf) {
+            for (k = 1; k < n; k++) {
+                qcow2_cache_load_done(c, idx[k], -ENOMEM);
+                qcow2_cache_release_async(c, idx[k]);
+            }
+            n = 1;
+        }
+    }
+
+    trace_qcow2_cache_load(qemu_coroutine_self(), c == s->l2_table_cache,
+                           i, offset, n - 1);
+
+    qemu_co_mutex_unlock(lock);
+    if (c == s->l2_table_cache) {
+        BLKDBG_EVENT(bs->file, BLKDBG_L2_LOAD);
+    }
+    ret = bdrv_pread(bs->file, offset,
+                     buf ?: qcow2_cache_get_table_addr(c, i),
+                     (int64_t) n * c->table_size);
+
+    /*
+     * Publish the result before taking the lock again: coroutines waiting
+     * for these tables may be holding it.
+     */
+    for (k = 0; k < n; k++) {
+        if (buf && ret >= 0) {
+            memcpy(qcow2_cache_get_table_addr(c, idx[k]),
+                   buf + (size_t) k * c->table_size, c->table_size);
+        }
+        if (!qcow2_cache_load_done(c, idx[k], ret) && k == 0 && ret >= 0) {
+            ret = -EAGAIN;
+        }
+        if (k > 0) {
+            qcow2_cache_release_async(c, idx[k]);
+        }
+    }
+    qemu_vfree(buf);
+    qemu_co_queue_restart_all(&c->load_queue);
+
+    qemu_co_mutex_lock(lock);
+    if (ret < 0) {
+        qcow2_cache_release_async(c, i);
+        return ret;
+    }
+
+    if (--c->async_refs == 0) {
+        qemu_co_queue_restart_all(&c->load_queue);
+    }
+    return 0;
+}
+
 static int qcow2_cache_do_get(BlockDriverState *bs, Qcow2Cache *c,
-    uint64_t offset, void **table, bool read_from_disk)
+    uint64_t offset, void **table, bool read_from_disk, int readahead,
+    CoMutex *lock)
 {
     BDRVQcow2State *s = bs->opaque;
+    Qcow2CachedTable *t;
     int i;
     int ret;
-    int lookup_index;
-    uint64_t min_lru_counter = UINT64_MAX;
-    int min_lru_index = -1;
 
     assert(offset != 0);
 
@@ -339,32 +615,41 @@ static int qcow2_cache_do_get(BlockDriverState *bs, Qcow2Cache *c,
         return -EIO;
     }
 
+retry:
     /* Check if the table is already cached */
-    i = lookup_index = (offset / c->table_size * 4) % c->size;
-    do {
-        const Qcow2CachedTable *t = &c->entries[i];
-        if (t->offset == offset) {
-            goto found;
-        }
-        if (t->ref == 0 && t->lru_counter < min_lru_counter) {
-            min_lru_counter = t->lru_counter;
-            min_lru_index = i;
-        }
-        if (++i == c->size) {
-            i = 0;
-        }
-    } while (i != lookup_index);
+    i = qcow2_cache_find(bs, c, offset, lock);
+    if (i >= 0) {
+        c->hits++;
+        trace_qcow2_cache_get_hit(qemu_coroutine_self(),
+                                  c == s->l2_table_cache, i, c->hits);
+        goto found;
+    }
 
-    if (min_lru_index == -1) {
-        /* This can't happen in current synchronous code, but leave the check
-         * here as a reminder for whoever starts using AIO with the cache */
-        abort();
+    /* Pick the least recently used unreferenced entry */
+    t = QTAILQ_FIRST(&c->lru_list);
+    if (!t) {
+        /*
+         * All entries are referenced. Loads that run without the lock only
+         * ever reserve a fraction of the cache, so this can't happen for
+         * callers that hold the lock all the time.
+         */
+        if (!lock) {
+            abort();
+        }
+        qemu_co_queue_wait(&c->free_queue, lock);
+        goto retry;
     }
 
     /* Cache miss: write a table back and replace it */
-    i = min_lru_index;
+    i = qcow2_cache_entry_idx(c, t);
+    c->misses++;
     trace_qcow2_cache_get_replace_entry(qemu_coroutine_self(),
                                         c == s->l2_table_cache, i);
+    if (t->offset) {
+        c->evictions++;
+        trace_qcow2_cache_evict(qemu_coroutine_self(), c == s->l2_table_cache,
+                                i, t->offset, c->misses, c->evictions);
+    }
 
     ret = qcow2_cache_entry_flush(bs, c, i);
     if (ret < 0) {
@@ -373,7 +658,21 @@ static int qcow2_cache_do_get(BlockDriverState *bs, Qcow2Cache *c,
 
     trace_qcow2_cache_get_read(qemu_coroutine_self(),
                                c == s->l2_table_cache, i);
-    c->entries[i].offset = 0;
+    qcow2_cache_set_offset(c, i, 0);
+
+    if (read_from_disk && lock &&
+        c->async_refs < c->size / QCOW2_CACHE_ASYNC_FRACTION)
+    {
+        ret = qcow2_cache_co_load(bs, c, i, offset, readahead, lock);
+        if (ret == -EAGAIN) {
+            goto retry;
+        } else if (ret < 0) {
+            return ret;
+        }
+        /* qcow2_cache_co_load() already took the reference */
+        goto done;
+    }
+
     if (read_from_disk) {
         if (c == s->l2_table_cache) {
             BLKDBG_EVENT(bs->file, BLKDBG_L2_LOAD);
@@ -383,15 +682,20 @@ static int qcow2_cache_do_get(BlockDriverState *bs, Qcow2Cache *c,
                          qcow2_cache_get_table_addr(c, i),
                          c->table_size);
         if (ret < 0) {
+            /* The entry is unused now, make sure it's reused first */
+            qcow2_cache_lru_make_free(c, i);
             return ret;
         }
     }
 
-    c->entries[i].offset = offset;
+    qcow2_cache_set_offset(c, i, offset);
 
     /* And return the right table */
 found:
-    c->entries[i].ref++;
+    if (c->entries[i].ref++ == 0) {
+        QTAILQ_REMOVE(&c->lru_list, &c->entries[i], lru_entry);
+    }
+done:
     *table = qcow2_cache_get_table_addr(c, i);
 
     trace_qcow2_cache_get_done(qemu_coroutine_self(),
@@ -403,13 +707,21 @@ found:
 int qcow2_cache_get(BlockDriverState *bs, Qcow2Cache *c, uint64_t offset,
     void **table)
 {
-    return qcow2_cache_do_get(bs, c, offset, table, true);
+    return qcow2_cache_do_get(bs, c, offset, table, true, 0, NULL);
+}
+
+int coroutine_fn qcow2_cache_co_get_unlocked(BlockDriverState *bs,
+                                             Qcow2Cache *c, uint64_t offset,
+                                             int readahead, void **table,
+                                             CoMutex *lock)
+{
+    return qcow2_cache_do_get(bs, c, offset, table, true, readahead, lock);
 }
 
 int qcow2_cache_get_empty(BlockDriverState *bs, Qcow2Cache *c, uint64_t offset,
     void **table)
 {
-    return qcow2_cache_do_get(bs, c, offset, table, false);
+    return qcow2_cache_do_get(bs, c, offset, table, false, 0, NULL);
 }
 
 void qcow2_cache_put(Qcow2Cache *c, void **table)
@@ -421,6 +733,8 @@ void qcow2_cache_put(Qcow2Cache *c, void **table)
 
     if (c->entries[i].ref == 0) {
         c->entries[i].lru_counter = ++c->lru_counter;
+        QTAILQ_INSERT_TAIL(&c->lru_list, &c->entries[i], lru_entry);
+        qemu_co_queue_next(&c->free_queue);
     }
 
     assert(c->entries[i].ref >= 0);
@@ -435,12 +749,10 @@ void qcow2_cache_entry_mark_dirty(Qcow2Cache *c, void *table)
 
 void *qcow2_cache_is_table_offset(Qcow2Cache *c, uint64_t offset)
 {
-    int i;
+    Qcow2CachedTable *t = qcow2_cache_lookup(c, offset);
 
-    for (i = 0; i < c->size; i++) {
-        if (c->entries[i].offset == offset) {
-            return qcow2_cache_get_table_addr(c, i);
-        }
+    if (t) {
+        return qcow2_cache_get_table_addr(c, qcow2_cache_entry_idx(c, t));
     }
     return NULL;
 }
@@ -449,11 +761,18 @@ void qcow2_cache_discard(Qcow2Cache *c, void *table)
 {
     int i = qcow2_cache_get_table_idx(c, table);
 
+    if (c->entries[i].loading) {
+        /* Dropped from the cache as soon as the read completes */
+        c->entries[i].stale = true;
+        return;
+    }
+
     assert(c->entries[i].ref == 0);
 
-    c->entries[i].offset = 0;
+    qcow2_cache_set_offset(c, i, 0);
     c->entries[i].lru_counter = 0;
     c->entries[i].dirty = false;
+    qcow2_cache_lru_make_free(c, i);
 
     qcow2_cache_table_release(c, i, 1);
 }
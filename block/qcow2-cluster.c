@@ -216,6 +216,29 @@ static int l2_load(BlockDriverState *bs, uint64_t offset,
                            (void **)l2_slice);
 }
 
+/*
+ * l2_load_unlocked
+ *
+ * Like l2_load(), but s->lock may be released while the slice is read from
+ * disk, and the remaining slices of the same L2 table are read ahead. The
+ * caller must revalidate anything it looked up before the call.
+ */
+static int coroutine_fn l2_load_unlocked(BlockDriverState *bs, uint64_t offset,
+                                         uint64_t l2_offset,
+                                         uint64_t **l2_slice)
+{
+    BDRVQcow2State *s = bs->opaque;
+    int l2_index = offset_to_l2_index(s, offset);
+    int slice_index = offset_to_l2_slice_index(s, offset);
+    int start_of_slice = l2_entry_size(s) * (l2_index - slice_index);
+    int readahead = (s->l2_size - (l2_index - slice_index)) / s->l2_slice_size
+                    - 1;
+
+    return qcow2_cache_co_get_unlocked(bs, s->l2_table_cache,
+                                       l2_offset + start_of_slice, readahead,
+                                       (void **)l2_slice, &s->lock);
+}
+
 /*
  * Writes an L1 entry to disk (note that depending on the alignment
  * requirements this function may write more that just one entry in
@@ -582,9 +605,10 @@ static int coroutine_fn do_perform_cow_write(BlockDriverState *bs,
  *
  * Returns 0 on success, -errno in error cases.
  */
-int qcow2_get_host_offset(BlockDriverState *bs, uint64_t offset,
-                          unsigned int *bytes, uint64_t *host_offset,
-                          QCow2SubclusterType *subcluster_type)
+static int do_get_host_offset(BlockDriverState *bs, uint64_t offset,
+                              unsigned int *bytes, uint64_t *host_offset,
+                              QCow2SubclusterType *subcluster_type,
+                              bool unlocked)
 {
     BDRVQcow2State *s = bs->opaque;
     unsigned int l2_index, sc_index;
@@ -613,6 +637,7 @@ int qcow2_get_host_offset(BlockDriverState *bs, uint64_t offset,
 
     /* seek to the l2 offset in the l1 table */
 
+retry:
     l1_index = offset_to_l1_index(s, offset);
     if (l1_index >= s->l1_size) {
         type = QCOW2_SUBCLUSTER_UNALLOCATED_PLAIN;
@@ -634,9 +659,24 @@ int qcow2_get_host_offset(BlockDriverState *bs, uint64_t offset,
 
     /* load the l2 slice in memory */
 
-    ret = l2_load(bs, offset, l2_offset, &l2_slice);
-    if (ret < 0) {
-        return ret;
+    if (unlocked) {
+        ret = l2_load_unlocked(bs, offset, l2_offset, &l2_slice);
+        if (ret < 0) {
+            return ret;
+        }
+
+        /* The L1 table may have changed while s->lock was released */
+        if (l1_index >= s->l1_size ||
+            (s->l1_table[l1_index] & L1E_OFFSET_MASK) != l2_offset)
+        {
+            qcow2_cache_put(s->l2_table_cache, (void **)&l2_slice);
+            goto retry;
+        }
+    } else {
+        ret = l2_load(bs, offset, l2_offset, &l2_slice);
+        if (ret < 0) {
+            return ret;
+        }
     }
 
     /* find the cluster offset for the given disk offset */
@@ -741,6 +781,30 @@ fail:
     return ret;
 }
 
+int qcow2_get_host_offset(BlockDriverState *bs, uint64_t offset,
+                          unsigned int *bytes, uint64_t *host_offset,
+                          QCow2SubclusterType *subcluster_type)
+{
+    return do_get_host_offset(bs, offset, bytes, host_offset, subcluster_type,
+                              false);
+}
+
+/*
+ * Like qcow2_get_host_offset(), but to be called with s->lock held from
+ * coroutines that only read guest data. s->lock may be released while L2
+ * slices are read from disk, so that concurrent cache misses don't
+ * serialise on each other.
+ */
+int coroutine_fn qcow2_co_get_host_offset(BlockDriverState *bs,
+                                          uint64_t offset,
+                                          unsigned int *bytes,
+                                          uint64_t *host_offset,
+                                          QCow2SubclusterType *subcluster_type)
+{
+    return do_get_host_offset(bs, offset, bytes, host_offset, subcluster_type,
+                              true);
+}
+
 /*
  * get_cluster_table
  *
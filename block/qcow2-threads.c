@@ -35,32 +35,47 @@
 
 #include "qcow2.h"
 #include "block/thread-pool.h"
+#include "block/aio_task.h"
 #include "crypto.h"
 
+/*
+ * Run @func in the thread pool, with at most @max_threads jobs of the same
+ * kind (accounted in @nb_threads and throttled by @queue) at a time.
+ */
 static int coroutine_fn
-qcow2_co_process(BlockDriverState *bs, ThreadPoolFunc *func, void *arg)
+qcow2_co_do_process(BlockDriverState *bs, CoQueue *queue, int *nb_threads,
+                    int max_threads, ThreadPoolFunc *func, void *arg)
 {
     int ret;
     BDRVQcow2State *s = bs->opaque;
     ThreadPool *pool = aio_get_thread_pool(bdrv_get_aio_context(bs));
 
     qemu_co_mutex_lock(&s->lock);
-    while (s->nb_threads >= QCOW2_MAX_THREADS) {
-        qemu_co_queue_wait(&s->thread_task_queue, &s->lock);
+    while (*nb_threads >= max_threads) {
+        qemu_co_queue_wait(queue, &s->lock);
     }
-    s->nb_threads++;
+    (*nb_threads)++;
     qemu_co_mutex_unlock(&s->lock);
 
     ret = thread_pool_submit_co(pool, func, arg);
 
     qemu_co_mutex_lock(&s->lock);
-    s->nb_threads--;
-    qemu_co_queue_next(&s->thread_task_queue);
+    (*nb_threads)--;
+    qemu_co_queue_next(queue);
     qemu_co_mutex_unlock(&s->lock);
 
     return ret;
 }
 
+static int coroutine_fn
+qcow2_co_process(BlockDriverState *bs, ThreadPoolFunc *func, void *arg)
+{
+    BDRVQcow2State *s = bs->opaque;
+
+    return qcow2_co_do_process(bs, &s->thread_task_queue, &s->nb_threads,
+                               s->compress_threads, func, arg);
+}
+
 
 /*
  * Compression
@@ -443,20 +458,65 @@ typedef struct Qcow2EncDecData {
     uint8_t *buf;
     size_t len;
 
+    /*
+     * If set, the data is copied from @src_qiov into @buf before encryption,
+     * or from @buf into @dst_qiov after decryption, in the worker thread.
+     */
+    QEMUIOVector *src_qiov;
+    QEMUIOVector *dst_qiov;
+    size_t qiov_offset;
+
     Qcow2EncDecFunc func;
 } Qcow2EncDecData;
 
+typedef struct Qcow2EncDecTask {
+    AioTask task;
+
+    BlockDriverState *bs;
+    Qcow2EncDecData data;
+} Qcow2EncDecTask;
+
 static int qcow2_encdec_pool_func(void *opaque)
 {
     Qcow2EncDecData *data = opaque;
+    int ret;
+
+    if (data->src_qiov) {
+        qemu_iovec_to_buf(data->src_qiov, data->qiov_offset,
+                          data->buf, data->len);
+    }
+
+    ret = data->func(data->block, data->offset, data->buf, data->len, NULL);
 
-    return data->func(data->block, data->offset, data->buf, data->len, NULL);
+    if (ret == 0 && data->dst_qiov) {
+        qemu_iovec_from_buf(data->dst_qiov, data->qiov_offset,
+                            data->buf, data->len);
+    }
+
+    return ret;
+}
+
+static int coroutine_fn
+qcow2_co_encdec_process(BlockDriverState *bs, Qcow2EncDecData *data)
+{
+    BDRVQcow2State *s = bs->opaque;
+
+    return qcow2_co_do_process(bs, &s->crypt_task_queue, &s->nb_crypt_threads,
+                               s->crypt_threads, qcow2_encdec_pool_func, data);
+}
+
+static coroutine_fn int qcow2_encdec_task_entry(AioTask *task)
+{
+    Qcow2EncDecTask *t = container_of(task, Qcow2EncDecTask, task);
+
+    return qcow2_co_encdec_process(t->bs, &t->data);
 }
 
 static int coroutine_fn
 qcow2_co_encdec(BlockDriverState *bs, uint64_t host_offset,
                 uint64_t guest_offset, void *buf, size_t len,
-                Qcow2EncDecFunc func)
+                QEMUIOVector *src_qiov, QEMUIOVector *dst_qiov,
+                size_t qiov_offset, Qcow2EncDecFunc func)
 {
     BDRVQcow2State *s = bs->opaque;
     Qcow2EncDecData arg = {
@@ -464,9 +524,15 @@ qcow2_co_encdec(BlockDriverState *bs, uint64_t host_offset,
         .offset = s->crypt_physical_offset ? host_offset : guest_offset,
         .buf = buf,
         .len = len,
+        .src_qiov = src_qiov,
+        .dst_qiov = dst_qiov,
+        .qiov_offset = qiov_offset,
         .func = func,
     };
+    AioTaskPool *aio;
     uint64_t sector_size;
+    size_t chunk, pos;
+    int ret;
 
     assert(s->crypto);
 
@@ -475,7 +541,42 @@ qcow2_co_encdec(BlockDriverState *bs, uint64_t host_offset,
     assert(QEMU_IS_ALIGNED(host_offset, sector_size));
     assert(QEMU_IS_ALIGNED(len, sector_size));
 
-    return len == 0 ? 0 : qcow2_co_process(bs, qcow2_encdec_pool_func, &arg);
+    if (len == 0) {
+        return 0;
+    }
+
+    /*
+     * Requests spanning several clusters are split into one job per crypto
+     * thread, each of them using its own cipher context.
+     */
+    chunk = QEMU_ALIGN_UP(DIV_ROUND_UP(len, s->crypt_threads), sector_size);
+    chunk = MAX(chunk, QCOW2_CRYPT_MIN_CHUNK);
+    if (s->crypt_threads == 1 || chunk >= len) {
+        return qcow2_co_encdec_process(bs, &arg);
+    }
+
+    aio = aio_task_pool_new(s->crypt_threads);
+    for (pos = 0; pos < len && aio_task_pool_status(aio) == 0; pos += chunk) {
+        Qcow2EncDecTask *t = g_new(Qcow2EncDecTask, 1);
+
+        *t = (Qcow2EncDecTask) {
+            .task.func = qcow2_encdec_task_entry,
+            .bs = bs,
+            .data = arg,
+        };
+        t->data.offset += pos;
+        t->data.buf += pos;
+        t->data.len = MIN(chunk, len - pos);
+        t->data.qiov_offset += pos;
+
+        aio_task_pool_start_task(aio, &t->task);
+    }
+
+    aio_task_pool_wait_all(aio);
+    ret = aio_task_pool_status(aio);
+    aio_task_pool_free(aio);
+
+    return ret;
 }
 
 /*
@@ -509,7 +610,23 @@ qcow2_co_encrypt(BlockDriverState *bs, uint64_t host_offset,
                  uint64_t guest_offset, void *buf, size_t len)
 {
     return qcow2_co_encdec(bs, host_offset, guest_offset, buf, len,
-                           qcrypto_block_encrypt);
+                           NULL, NULL, 0, qcrypto_block_encrypt);
+}
+
+/*
+ * qcow2_co_encrypt_from_qiov()
+ *
+ * Like qcow2_co_encrypt(), but first copies @len bytes at @qiov_offset of
+ * @qiov into @buf. The copy is done by the crypto threads right before
+ * encrypting, so that the data is still hot in the cache.
+ */
+int coroutine_fn
+qcow2_co_encrypt_from_qiov(BlockDriverState *bs, uint64_t host_offset,
+                           uint64_t guest_offset, void *buf, size_t len,
+                           QEMUIOVector *qiov, size_t qiov_offset)
+{
+    return qcow2_co_encdec(bs, host_offset, guest_offset, buf, len,
+                           qiov, NULL, qiov_offset, qcrypto_block_encrypt);
 }
 
 /*
@@ -523,5 +640,20 @@ qcow2_co_decrypt(BlockDriverState *bs, uint64_t host_offset,
                  uint64_t guest_offset, void *buf, size_t len)
 {
     return qcow2_co_encdec(bs, host_offset, guest_offset, buf, len,
-                           qcrypto_block_decrypt);
+                           NULL, NULL, 0, qcrypto_block_decrypt);
+}
+
+/*
+ * qcow2_co_decrypt_to_qiov()
+ *
+ * Like qcow2_co_decrypt(), but the crypto threads also copy the decrypted
+ * data into @qiov at @qiov_offset.
+ */
+int coroutine_fn
+qcow2_co_decrypt_to_qiov(BlockDriverState *bs, uint64_t host_offset,
+                         uint64_t guest_offset, void *buf, size_t len,
+                         QEMUIOVector *qiov, size_t qiov_offset)
+{
+    return qcow2_co_encdec(bs, host_offset, guest_offset, buf, len,
+                           NULL, qiov, qiov_offset, qcrypto_block_decrypt);
 }
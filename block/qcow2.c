@@ -317,7 +317,7 @@ static int qcow2_read_extensions(BlockDriverState *bs, uint64_t start_offset,
             }
             s->crypto = qcrypto_block_open(s->crypto_opts, "encrypt.",
                                            qcow2_crypto_hdr_read_func,
-                                           bs, cflags, QCOW2_MAX_THREADS, errp);
+                                           bs, cflags, s->crypt_threads, errp);
             if (!s->crypto) {
                 return -EINVAL;
             }
@@ -698,6 +698,8 @@ static const char *const mutable_opts[] = {
     QCOW2_OPT_L2_CACHE_ENTRY_SIZE,
     QCOW2_OPT_REFCOUNT_CACHE_SIZE,
     QCOW2_OPT_CACHE_CLEAN_INTERVAL,
+    QCOW2_OPT_CRYPT_THREADS,
+    QCOW2_OPT_COMPRESS_THREADS,
     NULL
 };
 
@@ -809,6 +811,16 @@ static QemuOptsList qcow2_runtime_opts = {
             .type = QEMU_OPT_NUMBER,
             .help = "Clean unused cache entries after this time (in seconds)",
         },
+        {
+            .name = QCOW2_OPT_CRYPT_THREADS,
+            .type = QEMU_OPT_NUMBER,
+            .help = "Number of threads used for encryption and decryption",
+        },
+        {
+            .name = QCOW2_OPT_COMPRESS_THREADS,
+            .type = QEMU_OPT_NUMBER,
+            .help = "Number of threads used for compression and decompression",
+        },
         BLOCK_CRYPTO_OPT_DEF_KEY_SECRET("encrypt.",
             "ID of secret providing qcow2 AES key or LUKS passphrase"),
         { /* end of list */ }
@@ -970,6 +982,8 @@ typedef struct Qcow2ReopenState {
     int overlap_check;
     bool discard_passthrough[QCOW2_DISCARD_MAX];
     uint64_t cache_clean_interval;
+    uint64_t crypt_threads;
+    uint64_t compress_threads;
     QCryptoBlockOpenOptions *crypto_opts; /* Disk encryption runtime options */
 } Qcow2ReopenState;
 
@@ -1071,6 +1085,36 @@ static int qcow2_update_options_prepare(BlockDriverState *bs,
         goto fail;
     }
 
+    /* The cipher contexts are created along with s->crypto */
+    r->crypt_threads =
+        qemu_opt_get_number(opts, QCOW2_OPT_CRYPT_THREADS,
+                            s->crypt_threads ?: QCOW2_DEFAULT_CRYPT_THREADS);
+    if (r->crypt_threads < 1 || r->crypt_threads > QCOW2_MAX_CRYPT_THREADS) {
+        error_setg(errp, QCOW2_OPT_CRYPT_THREADS " must be between 1 and %d",
+                   QCOW2_MAX_CRYPT_THREADS);
+        ret = -EINVAL;
+        goto fail;
+    }
+    if (s->crypto && r->crypt_threads != s->crypt_threads) {
+        error_setg(errp, "Cannot change " QCOW2_OPT_CRYPT_THREADS
+                   " of an open encrypted image");
+        ret = -EINVAL;
+        goto fail;
+    }
+
+    r->compress_threads =
+        qemu_opt_get_number(opts, QCOW2_OPT_COMPRESS_THREADS,
+                            s->compress_threads ?:
+                            QCOW2_DEFAULT_COMPRESS_THREADS);
+    if (r->compress_threads < 1 ||
+        r->compress_threads > QCOW2_MAX_COMPRESS_THREADS)
+    {
+        error_setg(errp, QCOW2_OPT_COMPRESS_THREADS
+                   " must be between 1 and %d", QCOW2_MAX_COMPRESS_THREADS);
+        ret = -EINVAL;
+        goto fail;
+    }
+
     /* lazy-refcounts; flush if going from enabled to disabled */
     r->use_lazy_refcounts = qemu_opt_get_bool(opts, QCOW2_OPT_LAZY_REFCOUNTS,
         (s->compatible_features & QCOW2_COMPAT_LAZY_REFCOUNTS));
@@ -1204,10 +1248,10 @@ static void qcow2_update_options_commit(BlockDriverState *bs,
     int i;
 
     if (s->l2_table_cache) {
-        qcow2_cache_destroy(s->l2_table_cache);
+        qcow2_cache_destroy(bs, s->l2_table_cache);
     }
     if (s->refcount_block_cache) {
-        qcow2_cache_destroy(s->refcount_block_cache);
+        qcow2_cache_destroy(bs, s->refcount_block_cache);
     }
     s->l2_table_cache = r->l2_table_cache;
     s->refcount_block_cache = r->refcount_block_cache;
@@ -1226,6 +1270,9 @@ static void qcow2_update_options_commit(BlockDriverState *bs,
         cache_clean_timer_init(bs, bdrv_get_aio_context(bs));
     }
 
+    s->crypt_threads = r->crypt_threads;
+    s->compress_threads = r->compress_threads;
+
     qapi_free_QCryptoBlockOpenOptions(s->crypto_opts);
     s->crypto_opts = r->crypto_opts;
 }
@@ -1234,10 +1281,10 @@ static void qcow2_update_options_abort(BlockDriverState *bs,
                                        Qcow2ReopenState *r)
 {
     if (r->l2_table_cache) {
-        qcow2_cache_destroy(r->l2_table_cache);
+        qcow2_cache_destroy(bs, r->l2_table_cache);
     }
     if (r->refcount_block_cache) {
-        qcow2_cache_destroy(r->refcount_block_cache);
+        qcow2_cache_destroy(bs, r->refcount_block_cache);
     }
     qapi_free_QCryptoBlockOpenOptions(r->crypto_opts);
 }
@@ -1673,7 +1720,7 @@ static int coroutine_fn qcow2_do_open(BlockDriverState *bs, QDict *options,
             }
             s->crypto = qcrypto_block_open(s->crypto_opts, "encrypt.",
                                            NULL, NULL, cflags,
-                                           QCOW2_MAX_THREADS, errp);
+                                           s->crypt_threads, errp);
             if (!s->crypto) {
                 ret = -EINVAL;
                 goto fail;
@@ -1834,6 +1881,8 @@ static int coroutine_fn qcow2_do_open(BlockDriverState *bs, QDict *options,
 #endif
 
     qemu_co_queue_init(&s->thread_task_queue);
+    qemu_co_queue_init(&s->crypt_task_queue);
+    qemu_co_queue_init(&s->compressed_alloc_queue);
 
     return ret;
 
@@ -1852,10 +1901,10 @@ static int coroutine_fn qcow2_do_open(BlockDriverState *bs, QDict *options,
     s->l1_table = NULL;
     cache_clean_timer_del(bs);
     if (s->l2_table_cache) {
-        qcow2_cache_destroy(s->l2_table_cache);
+        qcow2_cache_destroy(bs, s->l2_table_cache);
     }
     if (s->refcount_block_cache) {
-        qcow2_cache_destroy(s->refcount_block_cache);
+        qcow2_cache_destroy(bs, s->refcount_block_cache);
     }
     qcrypto_block_free(s->crypto);
     qapi_free_QCryptoBlockOpenOptions(s->crypto_opts);
@@ -2188,12 +2237,12 @@ qcow2_co_preadv_encrypted(BlockDriverState *bs,
         goto fail;
     }
 
-    if (qcow2_co_decrypt(bs, host_offset, offset, buf, bytes) < 0)
+    if (qcow2_co_decrypt_to_qiov(bs, host_offset, offset, buf, bytes,
+                                 qiov, qiov_offset) < 0)
     {
         ret = -EIO;
         goto fail;
     }
-    qemu_iovec_from_buf(qiov, qiov_offset, buf, bytes);
 
 fail:
     qemu_vfree(buf);
@@ -2332,8 +2381,8 @@ static coroutine_fn int qcow2_co_preadv_part(BlockDriverState *bs,
         }
 
         qemu_co_mutex_lock(&s->lock);
-        ret = qcow2_get_host_offset(bs, offset, &cur_bytes,
-                                    &host_offset, &type);
+        ret = qcow2_co_get_host_offset(bs, offset, &cur_bytes,
+                                       &host_offset, &type);
         qemu_co_mutex_unlock(&s->lock);
         if (ret < 0) {
             goto out;
@@ -2535,9 +2584,9 @@ static coroutine_fn int qcow2_co_pwritev_task(BlockDriverState *bs,
             ret = -ENOMEM;
             goto out_unlocked;
         }
-        qemu_iovec_to_buf(qiov, qiov_offset, crypt_buf, bytes);
 
-        if (qcow2_co_encrypt(bs, host_offset, offset, crypt_buf, bytes) < 0) {
+        if (qcow2_co_encrypt_from_qiov(bs, host_offset, offset, crypt_buf,
+                                       bytes, qiov, qiov_offset) < 0) {
             ret = -EIO;
             goto out_unlocked;
         }
@@ -2726,8 +2775,8 @@ static void qcow2_close(BlockDriverState *bs)
     }
 
     cache_clean_timer_del(bs);
-    qcow2_cache_destroy(s->l2_table_cache);
-    qcow2_cache_destroy(s->refcount_block_cache);
+    qcow2_cache_destroy(bs, s->l2_table_cache);
+    qcow2_cache_destroy(bs, s->refcount_block_cache);
 
     qcrypto_block_free(s->crypto);
     s->crypto = NULL;
@@ -4552,6 +4601,21 @@ fail:
     return ret;
 }
 
+/* Wait until all compressed write tasks started before @ticket allocated */
+static void coroutine_fn qcow2_compressed_alloc_wait(BDRVQcow2State *s,
+                                                     uint64_t ticket)
+{
+    while (s->compressed_alloc_next != ticket) {
+        qemu_co_queue_wait(&s->compressed_alloc_queue, NULL);
+    }
+}
+
+static void coroutine_fn qcow2_compressed_alloc_done(BDRVQcow2State *s)
+{
+    s->compressed_alloc_next++;
+    qemu_co_queue_restart_all(&s->compressed_alloc_queue);
+}
+
 static coroutine_fn int
 qcow2_co_pwritev_compressed_task(BlockDriverState *bs,
                                  uint64_t offset, uint64_t bytes,
@@ -4562,10 +4626,17 @@ qcow2_co_pwritev_compressed_task(BlockDriverState *bs,
     ssize_t out_len;
     uint8_t *buf, *out_buf;
     uint64_t cluster_offset;
+    uint64_t ticket;
 
     assert(bytes == s->cluster_size || (bytes < s->cluster_size &&
            (offset + bytes == bs->total_sectors << BDRV_SECTOR_BITS)));
 
+    /*
+     * Tasks are entered as soon as they are started, so taking the ticket
+     * before the first yield preserves the submission order.
+     */
+    ticket = s->compressed_alloc_tickets++;
+
     buf = qemu_blockalign(bs, s->cluster_size);
     if (bytes < s->cluster_size) {
         /* Zero-pad last write if image size is not cluster aligned */
@@ -4577,14 +4648,40 @@ qcow2_co_pwritev_compressed_task(BlockDriverState *bs,
 
     out_len = qcow2_co_compress(bs, out_buf, s->cluster_size - 1,
                                 buf, s->cluster_size);
+
+    qcow2_compressed_alloc_wait(s, ticket);
     if (out_len == -ENOMEM) {
         /* could not compress: write normal cluster */
-        ret = qcow2_co_pwritev_part(bs, offset, bytes, qiov, qiov_offset, 0);
+        unsigned int cur_bytes = bytes;
+        uint64_t host_offset;
+        QCowL2Meta *l2meta = NULL;
+
+        qemu_co_mutex_lock(&s->lock);
+        ret = qcow2_alloc_host_offset(bs, offset, &cur_bytes, &host_offset,
+                                      &l2meta);
+        if (ret == 0) {
+            assert(cur_bytes == bytes);
+            ret = qcow2_pre_write_overlap_check(bs, 0, host_offset, bytes,
+                                                true);
+        }
+        /* Only the allocation is ordered, the data may be written later */
+        qcow2_compressed_alloc_done(s);
+        if (ret < 0) {
+            qcow2_handle_l2meta(bs, &l2meta, false);
+            qemu_co_mutex_unlock(&s->lock);
+            goto fail;
+        }
+        qemu_co_mutex_unlock(&s->lock);
+
+        /* l2meta is consumed by qcow2_co_pwritev_task() */
+        ret = qcow2_co_pwritev_task(bs, host_offset, offset, bytes,
+                                    qiov, qiov_offset, l2meta);
         if (ret < 0) {
             goto fail;
         }
         goto success;
     } else if (out_len < 0) {
+        qcow2_compressed_alloc_done(s);
         ret = -EINVAL;
         goto fail;
     }
@@ -4592,6 +4689,7 @@ qcow2_co_pwritev_compressed_task(BlockDriverState *bs,
     qemu_co_mutex_lock(&s->lock);
     ret = qcow2_alloc_compressed_cluster_offset(bs, offset, out_len,
                                                 &cluster_offset);
+    qcow2_compressed_alloc_done(s);
     if (ret < 0) {
         qemu_co_mutex_unlock(&s->lock);
         goto fail;
@@ -4669,7 +4767,8 @@ qcow2_co_pwritev_compressed_part(BlockDriverState *bs,
         uint64_t chunk_size = MIN(bytes, s->cluster_size);
 
         if (!aio && chunk_size != bytes) {
-            aio = aio_task_pool_new(QCOW2_MAX_WORKERS);
+            aio = aio_task_pool_new(MAX(QCOW2_MAX_WORKERS,
+                                        s->compress_threads));
         }
 
         ret = qcow2_add_task(bs, aio, qcow2_co_pwritev_compressed_task_entry,
@@ -149,6 +149,8 @@
 #define QCOW2_OPT_L2_CACHE_ENTRY_SIZE "l2-cache-entry-size"
 #define QCOW2_OPT_REFCOUNT_CACHE_SIZE "refcount-cache-size"
 #define QCOW2_OPT_CACHE_CLEAN_INTERVAL "cache-clean-interval"
+#define QCOW2_OPT_CRYPT_THREADS "crypt-threads"
+#define QCOW2_OPT_COMPRESS_THREADS "compress-threads"
 
 typedef struct QCowHeader {
     uint32_t magic;
@@ -323,6 +325,17 @@ typedef struct Qcow2BitmapHeaderExt {
 
 #define QCOW2_MAX_THREADS 4
 
+/* Number of threads used for compression */
+#define QCOW2_DEFAULT_COMPRESS_THREADS QCOW2_MAX_THREADS
+#define QCOW2_MAX_COMPRESS_THREADS 64
+
+/* Number of threads (and cipher contexts) used for encryption */
+#define QCOW2_DEFAULT_CRYPT_THREADS QCOW2_MAX_THREADS
+#define QCOW2_MAX_CRYPT_THREADS 64
+
+/* Encryption jobs are not split into chunks smaller than this */
+#define QCOW2_CRYPT_MIN_CHUNK (64 * KiB)
+
 typedef struct BDRVQcow2State {
     int cluster_bits;
     int cluster_size;
@@ -407,6 +420,19 @@ typedef struct BDRVQcow2State {
 
     CoQueue thread_task_queue;
     int nb_threads;
+    int compress_threads;
+
+    /*
+     * Compressed clusters are allocated in the order in which their write
+     * tasks started, even though they are compressed in parallel
+     */
+    CoQueue compressed_alloc_queue;
+    uint64_t compressed_alloc_tickets;
+    uint64_t compressed_alloc_next;
+
+    CoQueue crypt_task_queue;
+    int nb_crypt_threads;
+    int crypt_threads;
 
     BdrvChild *data_file;
 
@@ -908,6 +934,11 @@ int qcow2_encrypt_sectors(BDRVQcow2State *s, int64_t sector_num,
 int qcow2_get_host_offset(BlockDriverState *bs, uint64_t offset,
                           unsigned int *bytes, uint64_t *host_offset,
                           QCow2SubclusterType *subcluster_type);
+int coroutine_fn qcow2_co_get_host_offset(BlockDriverState *bs,
+                                          uint64_t offset,
+                                          unsigned int *bytes,
+                                          uint64_t *host_offset,
+                                          QCow2SubclusterType *subcluster_type);
 int qcow2_alloc_host_offset(BlockDriverState *bs, uint64_t offset,
                             unsigned int *bytes, uint64_t *host_offset,
                             QCowL2Meta **m);
@@ -957,7 +988,7 @@ int coroutine_fn qcow2_check_fix_snapshot_table(BlockDriverState *bs,
 /* qcow2-cache.c functions */
 Qcow2Cache *qcow2_cache_create(BlockDriverState *bs, int num_tables,
                                unsigned table_size);
-int qcow2_cache_destroy(Qcow2Cache *c);
+int qcow2_cache_destroy(BlockDriverState *bs, Qcow2Cache *c);
 
 void qcow2_cache_entry_mark_dirty(Qcow2Cache *c, void *table);
 int qcow2_cache_flush(BlockDriverState *bs, Qcow2Cache *c);
@@ -973,6 +1004,10 @@ int qcow2_cache_get(BlockDriverState *bs, Qcow2Cache *c, uint64_t offset,
     void **table);
 int qcow2_cache_get_empty(BlockDriverState *bs, Qcow2Cache *c, uint64_t offset,
     void **table);
+int coroutine_fn qcow2_cache_co_get_unlocked(BlockDriverState *bs,
+                                             Qcow2Cache *c, uint64_t offset,
+                                             int readahead, void **table,
+                                             CoMutex *lock);
 void qcow2_cache_put(Qcow2Cache *c, void **table);
 void *qcow2_cache_is_table_offset(Qcow2Cache *c, uint64_t offset);
 void qcow2_cache_discard(Qcow2Cache *c, void *table);
@@ -1013,5 +1048,13 @@ qcow2_co_encrypt(BlockDriverState *bs, uint64_t host_offset,
 int coroutine_fn
 qcow2_co_decrypt(BlockDriverState *bs, uint64_t host_offset,
                  uint64_t guest_offset, void *buf, size_t len);
+int coroutine_fn
+qcow2_co_encrypt_from_qiov(BlockDriverState *bs, uint64_t host_offset,
+                           uint64_t guest_offset, void *buf, size_t len,
+                           QEMUIOVector *qiov, size_t qiov_offset);
+int coroutine_fn
+qcow2_co_decrypt_to_qiov(BlockDriverState *bs, uint64_t host_offset,
+                         uint64_t guest_offset, void *buf, size_t len,
+                         QEMUIOVector *qiov, size_t qiov_offset);
 
 #endif
@@ -26,14 +26,25 @@
 #include "hw/virtio/virtio-bus.h"
 #include "qom/object_interfaces.h"
 
+/*
+ * Guest notifications are raised by the IOThread that a virtqueue is mapped
+ * to, not by the thread that completed the request.
+ */
+typedef struct VirtIOBlockNotifier {
+    VirtIOBlockDataPlane *s;
+    AioContext *ctx;
+    QEMUBH *bh;                     /* bh for guest notification */
+    unsigned long *vqs;             /* virtqueues to notify, atomic */
+} VirtIOBlockNotifier;
+
 struct VirtIOBlockDataPlane {
     bool starting;
     bool stopping;
 
     VirtIOBlkConf *conf;
     VirtIODevice *vdev;
-    QEMUBH *bh;                     /* bh for guest notification */
-    unsigned long *batch_notify_vqs;
+    VirtIOBlockNotifier *notifiers; /* one per IOThread, or the main loop */
+    unsigned num_notifiers;
     bool batch_notifications;
 
     /* Note that these EventNotifiers are assigned by value.  This is
@@ -41,33 +52,46 @@ struct VirtIOBlockDataPlane {
      * (because you don't own the file descriptor or handle; you just
      * use it).
      */
-    IOThread *iothread;
-    AioContext *ctx;
+    IOThread **iothreads;           /* empty when running in the main loop */
+    unsigned num_iothreads;
+    AioContext *ctx;                /* home context of the BlockBackend */
+    AioContext **vq_aio_context;    /* virtqueue index -> AioContext */
 };
 
-/* Raise an interrupt to signal guest, if necessary */
+/*
+ * Raise an interrupt to signal guest, if necessary
+ *
+ * Context: any thread, with the BlockBackend's AioContext lock held
+ */
 void virtio_blk_data_plane_notify(VirtIOBlockDataPlane *s, VirtQueue *vq)
 {
-    if (s->batch_notifications) {
-        set_bit(virtio_get_queue_index(vq), s->batch_notify_vqs);
-        qemu_bh_schedule(s->bh);
-    } else {
+    unsigned i = virtio_get_queue_index(vq);
+    VirtIOBlockNotifier *n = &s->notifiers[i % s->num_notifiers];
+
+    if (!s->batch_notifications && n->ctx == qemu_get_current_aio_context()) {
         virtio_notify_irqfd(s->vdev, vq);
+    } else {
+        set_bit_atomic(i, n->vqs);
+        qemu_bh_schedule(n->bh);
     }
 }
 
+/*
+ * The virtqueue state that virtio_notify_irqfd() checks is protected by the
+ * BlockBackend's AioContext lock, like the rest of the virtqueue.
+ *
+ * Context: BH in the IOThread of the virtqueues, or the main loop on stop
+ */
 static void notify_guest_bh(void *opaque)
 {
-    VirtIOBlockDataPlane *s = opaque;
+    VirtIOBlockNotifier *n = opaque;
+    VirtIOBlockDataPlane *s = n->s;
     unsigned nvqs = s->conf->num_queues;
-    unsigned long bitmap[BITS_TO_LONGS(nvqs)];
     unsigned j;
 
-    memcpy(bitmap, s->batch_notify_vqs, sizeof(bitmap));
-    memset(s->batch_notify_vqs, 0, sizeof(bitmap));
-
+    aio_context_acquire(s->ctx);
     for (j = 0; j < nvqs; j += BITS_PER_LONG) {
-        unsigned long bits = bitmap[j / BITS_PER_LONG];
+        unsigned long bits = qatomic_xchg(&n->vqs[j / BITS_PER_LONG], 0);
 
         while (bits != 0) {
             unsigned i = j + ctzl(bits);
@@ -78,6 +102,46 @@ static void notify_guest_bh(void *opaque)
             bits &= bits - 1; /* clear right-most bit */
         }
     }
+    aio_context_release(s->ctx);
+}
+
+/*
+ * Parse the iothread-vq-mapping property, a colon-separated list of IOThread
+ * ids.  Virtqueue i is served by IOThread i % n, so listing fewer IOThreads
+ * than there are virtqueues assigns groups of virtqueues to each of them.
+ */
+static IOThread **virtio_blk_parse_vq_mapping(VirtIOBlkConf *conf,
+                                              unsigned *num_iothreads,
+                                              Error **errp)
+{
+    g_auto(GStrv) ids = g_strsplit(conf->iothread_vq_mapping, ":", -1);
+    unsigned n = g_strv_length(ids);
+    IOThread **iothreads;
+    unsigned i;
+
+    if (n == 0 || n > conf->num_queues) {
+        error_setg(errp, "iothread-vq-mapping must list between 1 and "
+                   "num-queues (%u) IOThreads", conf->num_queues);
+        return NULL;
+    }
+
+    iothreads = g_new0(IOThread *, n);
+    for (i = 0; i < n; i++) {
+        iothreads[i] = iothread_by_id(ids[i]);
+        if (!iothreads[i]) {
+            error_setg(errp, "iothread-vq-mapping: IOThread '%s' not found",
+                       ids[i]);
+            while (i--) {
+                object_unref(OBJECT(iothreads[i]));
+            }
+            g_free(iothreads);
+            return NULL;
+        }
+        object_ref(OBJECT(iothreads[i]));
+    }
+
+    *num_iothreads = n;
+    return iothreads;
 }
 
 /* Context: QEMU global mutex held */
@@ -88,10 +152,19 @@ bool virtio_blk_data_plane_create(VirtIODevice *vdev, VirtIOBlkConf *conf,
     VirtIOBlockDataPlane *s;
     BusState *qbus = BUS(qdev_get_parent_bus(DEVICE(vdev)));
     VirtioBusClass *k = VIRTIO_BUS_GET_CLASS(qbus);
+    IOThread **iothreads = NULL;
+    unsigned num_iothreads = 0;
+    unsigned i;
 
     *dataplane = NULL;
 
-    if (conf->iothread) {
+    if (conf->iothread && conf->iothread_vq_mapping) {
+        error_setg(errp, "iothread and iothread-vq-mapping properties "
+                   "cannot be set at the same time");
+        return false;
+    }
+
+    if (conf->iothread || conf->iothread_vq_mapping) {
         if (!k->set_guest_notifiers || !k->ioeventfd_assign) {
             error_setg(errp,
                        "device is incompatible with iothread "
@@ -116,19 +189,51 @@ bool virtio_blk_data_plane_create(VirtIODevice *vdev, VirtIOBlkConf *conf,
         return false;
     }
 
+    if (conf->iothread_vq_mapping) {
+        iothreads = virtio_blk_parse_vq_mapping(conf, &num_iothreads, errp);
+        if (!iothreads) {
+            return false;
+        }
+    } else if (conf->iothread) {
+        iothreads = g_new(IOThread *, 1);
+        iothreads[0] = conf->iothread;
+        object_ref(OBJECT(iothreads[0]));
+        num_iothreads = 1;
+    }
+
     s = g_new0(VirtIOBlockDataPlane, 1);
     s->vdev = vdev;
     s->conf = conf;
+    s->iothreads = iothreads;
+    s->num_iothreads = num_iothreads;
+    s->vq_aio_context = g_new(AioContext *, conf->num_queues);
 
-    if (conf->iothread) {
-        s->iothread = conf->iothread;
-        object_ref(OBJECT(s->iothread));
-        s->ctx = iothread_get_aio_context(s->iothread);
+    /*
+     * The BlockBackend lives in the first IOThread.  Virtqueues mapped to
+     * other IOThreads are processed there under its AioContext lock, and
+     * their requests are scheduled into the home context.
+     */
+    if (num_iothreads) {
+        s->ctx = iothread_get_aio_context(iothreads[0]);
     } else {
         s->ctx = qemu_get_aio_context();
     }
-    s->bh = aio_bh_new(s->ctx, notify_guest_bh, s);
-    s->batch_notify_vqs = bitmap_new(conf->num_queues);
+    for (i = 0; i < conf->num_queues; i++) {
+        s->vq_aio_context[i] = num_iothreads ?
+            iothread_get_aio_context(iothreads[i % num_iothreads]) : s->ctx;
+    }
+
+    /* Virtqueue i is notified by notifier i % num_notifiers */
+    s->num_notifiers = MAX(num_iothreads, 1);
+    s->notifiers = g_new0(VirtIOBlockNotifier, s->num_notifiers);
+    for (i = 0; i < s->num_notifiers; i++) {
+        VirtIOBlockNotifier *n = &s->notifiers[i];
+
+        n->s = s;
+        n->ctx = s->vq_aio_context[i];
+        n->bh = aio_bh_new(n->ctx, notify_guest_bh, n);
+        n->vqs = bitmap_new(conf->num_queues);
+    }
 
     *dataplane = s;
 
@@ -139,6 +244,7 @@ bool virtio_blk_data_plane_create(VirtIODevice *vdev, VirtIOBlkConf *conf,
 void virtio_blk_data_plane_destroy(VirtIOBlockDataPlane *s)
 {
     VirtIOBlock *vblk;
+    unsigned i;
 
     if (!s) {
         return;
@@ -146,11 +252,16 @@ void virtio_blk_data_plane_destroy(VirtIOBlockDataPlane *s)
 
     vblk = VIRTIO_BLK(s->vdev);
     assert(!vblk->dataplane_started);
-    g_free(s->batch_notify_vqs);
-    qemu_bh_delete(s->bh);
-    if (s->iothread) {
-        object_unref(OBJECT(s->iothread));
+    for (i = 0; i < s->num_notifiers; i++) {
+        g_free(s->notifiers[i].vqs);
+        qemu_bh_delete(s->notifiers[i].bh);
+    }
+    g_free(s->notifiers);
+    for (i = 0; i < s->num_iothreads; i++) {
+        object_unref(OBJECT(s->iothreads[i]));
     }
+    g_free(s->iothreads);
+    g_free(s->vq_aio_context);
     g_free(s);
 }
 
@@ -243,13 +354,14 @@ int virtio_blk_data_plane_start(VirtIODevice *vdev)
     }
 
     /* Get this show started by hooking up our callbacks */
-    aio_context_acquire(s->ctx);
     for (i = 0; i < nvqs; i++) {
         VirtQueue *vq = virtio_get_queue(s->vdev, i);
+        AioContext *ctx = s->vq_aio_context[i];
 
-        virtio_queue_aio_attach_host_notifier(vq, s->ctx);
+        aio_context_acquire(ctx);
+        virtio_queue_aio_attach_host_notifier(vq, ctx);
+        aio_context_release(ctx);
     }
-    aio_context_release(s->ctx);
     return 0;
 
   fail_aio_context:
@@ -278,19 +390,23 @@ int virtio_blk_data_plane_start(VirtIODevice *vdev)
     return -ENOSYS;
 }
 
-/* Stop notifications for new requests from guest.
+/* Stop notifications for new requests from guest on the virtqueues that are
+ * mapped to the current IOThread.
  *
  * Context: BH in IOThread
  */
 static void virtio_blk_data_plane_stop_bh(void *opaque)
 {
     VirtIOBlockDataPlane *s = opaque;
+    AioContext *ctx = qemu_get_current_aio_context();
     unsigned i;
 
     for (i = 0; i < s->conf->num_queues; i++) {
         VirtQueue *vq = virtio_get_queue(s->vdev, i);
 
-        virtio_queue_aio_detach_host_notifier(vq, s->ctx);
+        if (s->vq_aio_context[i] == ctx) {
+            virtio_queue_aio_detach_host_notifier(vq, ctx);
+        }
     }
 }
 
@@ -317,6 +433,15 @@ void virtio_blk_data_plane_stop(VirtIODevice *vdev)
     s->stopping = true;
     trace_virtio_blk_data_plane_stop(s);
 
+    /* Virtqueues in IOThreads other than the home one go first */
+    for (i = 1; i < s->num_iothreads; i++) {
+        AioContext *ctx = iothread_get_aio_context(s->iothreads[i]);
+
+        aio_context_acquire(ctx);
+        aio_wait_bh_oneshot(ctx, virtio_blk_data_plane_stop_bh, s);
+        aio_context_release(ctx);
+    }
+
     aio_context_acquire(s->ctx);
     aio_wait_bh_oneshot(s->ctx, virtio_blk_data_plane_stop_bh, s);
 
@@ -346,8 +471,10 @@ void virtio_blk_data_plane_stop(VirtIODevice *vdev)
         virtio_bus_cleanup_host_notifier(VIRTIO_BUS(qbus), i);
     }
 
-    qemu_bh_cancel(s->bh);
-    notify_guest_bh(s); /* final chance to notify guest */
+    for (i = 0; i < s->num_notifiers; i++) {
+        qemu_bh_cancel(s->notifiers[i].bh);
+        notify_guest_bh(&s->notifiers[i]); /* final chance to notify guest */
+    }
 
     /* Clean up guest notifier (irq) */
     k->set_guest_notifiers(qbus->parent, nvqs, false);
@@ -453,6 +453,13 @@ static void virtio_blk_submit_multireq(BlockBackend *blk, MultiReqBuffer *mrb)
     uint32_t max_transfer;
     int64_t sector_num = 0;
 
+    if (mrb == mrb->reqs[0]->dev->batch_mrb) {
+        block_acct_batch_done(blk_get_stats(blk),
+                              mrb->is_write ? BLOCK_ACCT_WRITE :
+                                              BLOCK_ACCT_READ,
+                              mrb->num_reqs);
+    }
+
     if (mrb->num_reqs == 1) {
         submit_requests(blk, mrb, 0, 1, -1);
         mrb->num_reqs = 0;
@@ -768,10 +775,87 @@ static int virtio_blk_handle_request(VirtIOBlockReq *req, MultiReqBuffer *mrb)
     return 0;
 }
 
+/* Submit the held back writes.  Called with the AioContext lock held. */
+static void virtio_blk_batch_flush(VirtIOBlock *s)
+{
+    if (s->batch_timer) {
+        timer_del(s->batch_timer);
+    }
+    if (s->batch_mrb && s->batch_mrb->num_reqs) {
+        virtio_blk_submit_multireq(s->blk, s->batch_mrb);
+    }
+}
+
+/*
+ * Give the held back writes to the device's queued requests, as if they had
+ * not been parsed yet.  Called with the AioContext lock held.
+ */
+static void virtio_blk_batch_requeue(VirtIOBlock *s)
+{
+    MultiReqBuffer *mrb = s->batch_mrb;
+    int i;
+
+    if (s->batch_timer) {
+        timer_del(s->batch_timer);
+    }
+    if (!mrb || !mrb->num_reqs) {
+        return;
+    }
+    for (i = mrb->num_reqs - 1; i >= 0; i--) {
+        VirtIOBlockReq *req = mrb->reqs[i];
+
+        iov_discard_undo(&req->inhdr_undo);
+        iov_discard_undo(&req->outhdr_undo);
+        req->mr_next = NULL;
+        req->next = s->rq;
+        s->rq = req;
+    }
+    mrb->num_reqs = 0;
+    s->batch_requeued = true;
+}
+
+static void virtio_blk_batch_timer_cb(void *opaque)
+{
+    VirtIOBlock *s = opaque;
+    AioContext *ctx = blk_get_aio_context(s->blk);
+
+    aio_context_acquire(ctx);
+    trace_virtio_blk_batch_timeout(s, s->batch_mrb->num_reqs);
+    blk_io_plug(s->blk);
+    virtio_blk_batch_flush(s);
+    blk_io_unplug(s->blk);
+    aio_context_release(ctx);
+}
+
+/*
+ * Hold back the writes in s->batch_mrb for at most batch-window-us, counted
+ * from the first notification that left them pending.  The timer lives in
+ * the BlockBackend's AioContext; draining flushes the batch, so the timer
+ * can be recreated whenever that context has changed.
+ */
+static void virtio_blk_batch_arm(VirtIOBlock *s)
+{
+    AioContext *ctx = blk_get_aio_context(s->blk);
+
+    if (s->batch_timer_ctx != ctx) {
+        if (s->batch_timer) {
+            timer_free(s->batch_timer);
+        }
+        s->batch_timer = aio_timer_new(ctx, QEMU_CLOCK_REALTIME, SCALE_US,
+                                       virtio_blk_batch_timer_cb, s);
+        s->batch_timer_ctx = ctx;
+    }
+    if (!timer_pending(s->batch_timer)) {
+        timer_mod(s->batch_timer, qemu_clock_get_us(QEMU_CLOCK_REALTIME) +
+                                  s->conf.batch_window_us);
+    }
+}
+
 void virtio_blk_handle_vq(VirtIOBlock *s, VirtQueue *vq)
 {
     VirtIOBlockReq *req;
-    MultiReqBuffer mrb = {};
+    MultiReqBuffer local_mrb = {};
+    MultiReqBuffer *mrb = s->batch_mrb ?: &local_mrb;
     bool suppress_notifications = virtio_queue_get_notification(vq);
 
     aio_context_acquire(blk_get_aio_context(s->blk));
@@ -783,11 +867,18 @@ void virtio_blk_handle_vq(VirtIOBlock *s, VirtQueue *vq)
         }
 
         while ((req = virtio_blk_get_request(s, vq))) {
-            if (virtio_blk_handle_request(req, &mrb)) {
+            if (virtio_blk_handle_request(req, mrb)) {
                 virtqueue_detach_element(req->vq, &req->elem, 0);
                 virtio_blk_free_request(req);
                 break;
             }
+
+            /* Do not wait for the queue to be empty once the batch is full */
+            if (mrb == s->batch_mrb &&
+                mrb->num_reqs >= s->conf.batch_max_reqs) {
+                trace_virtio_blk_batch_full(s, mrb->num_reqs);
+                virtio_blk_batch_flush(s);
+            }
         }
 
         if (suppress_notifications) {
@@ -795,8 +886,21 @@ void virtio_blk_handle_vq(VirtIOBlock *s, VirtQueue *vq)
         }
     } while (!virtio_queue_empty(vq));
 
-    if (mrb.num_reqs) {
-        virtio_blk_submit_multireq(s->blk, &mrb);
+    /*
+     * Reads are latency sensitive and go out right away.  Writes may wait
+     * for the next notifications to be merged with, until the batch is full
+     * or the window expires.
+     */
+    if (mrb->num_reqs) {
+        if (mrb == s->batch_mrb && mrb->is_write &&
+            mrb->num_reqs < s->conf.batch_max_reqs) {
+            trace_virtio_blk_batch_hold(s, mrb->num_reqs);
+            virtio_blk_batch_arm(s);
+        } else if (mrb == s->batch_mrb) {
+            virtio_blk_batch_flush(s);
+        } else {
+            virtio_blk_submit_multireq(s->blk, mrb);
+        }
     }
 
     blk_io_unplug(s->blk);
@@ -894,6 +998,7 @@ static void virtio_blk_reset(VirtIODevice *vdev)
 
     ctx = blk_get_aio_context(s->blk);
     aio_context_acquire(ctx);
+    virtio_blk_batch_flush(s);
     blk_drain(s->blk);
 
     /* We drop queued requests after blk_drain() because blk_drain() itself can
@@ -1131,8 +1236,37 @@ static void virtio_blk_resize(void *opaque)
     aio_bh_schedule_oneshot(qemu_get_aio_context(), virtio_resize_cb, vdev);
 }
 
+/*
+ * Requests submitted once the BlockBackend is quiesced would only wait for
+ * the end of the drained section, so held back writes are not submitted
+ * here.  They go back to s->rq, where they are migrated like requests
+ * stopped by an I/O error, and are submitted again when the drained
+ * section ends or the VM resumes.
+ */
+static void virtio_blk_drained_begin(void *opaque)
+{
+    VirtIOBlock *s = opaque;
+
+    virtio_blk_batch_requeue(s);
+}
+
+static void virtio_blk_drained_end(void *opaque)
+{
+    VirtIOBlock *s = opaque;
+
+    if (s->batch_requeued) {
+        s->batch_requeued = false;
+        /* Otherwise virtio_blk_dma_restart_cb() or dataplane start do it */
+        if (runstate_is_running() && s->rq) {
+            virtio_blk_process_queued_requests(s, false);
+        }
+    }
+}
+
 static const BlockDevOps virtio_block_ops = {
     .resize_cb = virtio_blk_resize,
+    .drained_begin = virtio_blk_drained_begin,
+    .drained_end = virtio_blk_drained_end,
 };
 
 static void virtio_blk_device_realize(DeviceState *dev, Error **errp)
@@ -1204,12 +1338,23 @@ static void virtio_blk_device_realize(DeviceState *dev, Error **errp)
         return;
     }
 
+    if (!conf->batch_max_reqs ||
+        conf->batch_max_reqs > VIRTIO_BLK_MAX_MERGE_REQS) {
+        error_setg(errp, "invalid batch-max-reqs property (%" PRIu32 "), "
+                   "must be between 1 and %d",
+                   conf->batch_max_reqs, VIRTIO_BLK_MAX_MERGE_REQS);
+        return;
+    }
+
     virtio_blk_set_config_size(s, s->host_features);
 
     virtio_init(vdev, "virtio-blk", VIRTIO_ID_BLOCK, s->config_size);
 
     s->blk = conf->conf.blk;
     s->rq = NULL;
+    if (conf->batch_window_us) {
+        s->batch_mrb = g_new0(MultiReqBuffer, 1);
+    }
     s->sector_mask = (s->conf.conf.logical_block_size / BDRV_SECTOR_SIZE) - 1;
 
     for (i = 0; i < conf->num_queues; i++) {
@@ -1223,6 +1368,8 @@ static void virtio_blk_device_realize(DeviceState *dev, Error **errp)
         for (i = 0; i < conf->num_queues; i++) {
             virtio_del_queue(vdev, i);
         }
+        g_free(s->batch_mrb);
+        s->batch_mrb = NULL;
         virtio_cleanup(vdev);
         return;
     }
@@ -1244,9 +1391,20 @@ static void virtio_blk_device_unrealize(DeviceState *dev)
     VirtIODevice *vdev = VIRTIO_DEVICE(dev);
     VirtIOBlock *s = VIRTIO_BLK(dev);
     VirtIOBlkConf *conf = &s->conf;
+    AioContext *ctx = blk_get_aio_context(s->blk);
     unsigned i;
 
+    aio_context_acquire(ctx);
+    virtio_blk_batch_flush(s);
+    aio_context_release(ctx);
     blk_drain(s->blk);
+    if (s->batch_timer) {
+        timer_free(s->batch_timer);
+        s->batch_timer = NULL;
+        s->batch_timer_ctx = NULL;
+    }
+    g_free(s->batch_mrb);
+    s->batch_mrb = NULL;
     del_boot_device_lchs(dev, "/disk@0,0");
     virtio_blk_data_plane_destroy(s->dataplane);
     s->dataplane = NULL;
@@ -1298,6 +1456,8 @@ static Property virtio_blk_properties[] = {
     DEFINE_PROP_BOOL("seg-max-adjust", VirtIOBlock, conf.seg_max_adjust, true),
     DEFINE_PROP_LINK("iothread", VirtIOBlock, conf.iothread, TYPE_IOTHREAD,
                      IOThread *),
+    DEFINE_PROP_STRING("iothread-vq-mapping", VirtIOBlock,
+                       conf.iothread_vq_mapping),
     DEFINE_PROP_BIT64("discard", VirtIOBlock, host_features,
                       VIRTIO_BLK_F_DISCARD, true),
     DEFINE_PROP_BOOL("report-discard-granularity", VirtIOBlock,
@@ -1308,6 +1468,10 @@ static Property virtio_blk_properties[] = {
                        conf.max_discard_sectors, BDRV_REQUEST_MAX_SECTORS),
     DEFINE_PROP_UINT32("max-write-zeroes-sectors", VirtIOBlock,
                        conf.max_write_zeroes_sectors, BDRV_REQUEST_MAX_SECTORS),
+    DEFINE_PROP_UINT32("batch-window-us", VirtIOBlock, conf.batch_window_us,
+                       0),
+    DEFINE_PROP_UINT32("batch-max-reqs", VirtIOBlock, conf.batch_max_reqs,
+                       VIRTIO_BLK_MAX_MERGE_REQS),
     DEFINE_PROP_BOOL("x-enable-wce-if-config-wce", VirtIOBlock,
                      conf.x_enable_wce_if_config_wce, true),
     DEFINE_PROP_END_OF_LIST(),
@@ -16,11 +16,13 @@
 #include "qapi/qmp/qobject.h"
 #include "qapi/qobject-input-visitor.h"
 #include "qapi/type-helpers.h"
+#include "qemu/bitmap.h"
 #include "qemu/main-loop.h"
 #include "qom/qom-qobject.h"
 #include "sysemu/hostmem.h"
 #include "sysemu/hw_accel.h"
 #include "sysemu/numa.h"
+#include "sysemu/iothread.h"
 #include "sysemu/runstate.h"
 
 static void cpustate_to_cpuinfo_s390(CpuInfoS390 *info, const CPUState *cpu)
@@ -206,6 +208,86 @@ MemdevList *qmp_query_memdev(Error **errp)
     return list;
 }
 
+typedef struct NumaAffinityIOThreads {
+    int64_t node_id;
+    strList **tail;
+} NumaAffinityIOThreads;
+
+static int query_numa_affinity_iothread(Object *obj, void *opaque)
+{
+    NumaAffinityIOThreads *state = opaque;
+    IOThread *iothread = (IOThread *)object_dynamic_cast(obj, TYPE_IOTHREAD);
+
+    if (iothread && iothread->numa_node == state->node_id) {
+        QAPI_LIST_APPEND(state->tail, iothread_get_id(iothread));
+    }
+    return 0;
+}
+
+NumaNodeAffinityList *qmp_query_numa_affinity(Error **errp)
+{
+    MachineState *ms = MACHINE(qdev_get_machine());
+    NumaNodeAffinityList *head = NULL, **tail = &head;
+    g_autofree unsigned long *cpus = bitmap_new(NUMA_MAX_HOST_CPUS);
+    int i, nb_numa_nodes;
+
+    nb_numa_nodes = ms->numa_state ? ms->numa_state->num_nodes : 0;
+    for (i = 0; i < nb_numa_nodes; i++) {
+        HostMemoryBackend *backend = ms->numa_state->nodes[i].node_memdev;
+        NumaNodeAffinity *info = g_new0(NumaNodeAffinity, 1);
+        uint16List **host_nodes = &info->host_nodes;
+        intList **host_cpus = &info->host_cpus;
+        intList **vcpus = &info->vcpus;
+        intList **thread_ids = &info->vcpu_thread_ids;
+        NumaAffinityIOThreads iothreads = {
+            .node_id = i,
+            .tail = &info->iothreads,
+        };
+        unsigned long bit;
+        bool have_cpus;
+        CPUState *cpu;
+
+        info->node_id = i;
+        if (backend) {
+            info->memdev =
+                g_strdup(object_get_canonical_path_component(OBJECT(backend)));
+            info->has_memdev = !!info->memdev;
+            if (backend->policy != HOST_MEM_POLICY_DEFAULT) {
+                for (bit = find_first_bit(backend->host_nodes, MAX_NODES);
+                     bit < MAX_NODES;
+                     bit = find_next_bit(backend->host_nodes, MAX_NODES,
+                                         bit + 1)) {
+                    QAPI_LIST_APPEND(host_nodes, bit);
+                }
+            }
+        }
+
+        have_cpus = numa_get_host_cpus(ms, i, cpus);
+        if (have_cpus) {
+            for (bit = find_first_bit(cpus, NUMA_MAX_HOST_CPUS);
+                 bit < NUMA_MAX_HOST_CPUS;
+                 bit = find_next_bit(cpus, NUMA_MAX_HOST_CPUS, bit + 1)) {
+                QAPI_LIST_APPEND(host_cpus, bit);
+            }
+        }
+
+        CPU_FOREACH(cpu) {
+            if (numa_get_cpu_node_id(cpu) == i) {
+                QAPI_LIST_APPEND(vcpus, cpu->cpu_index);
+                QAPI_LIST_APPEND(thread_ids, cpu->thread_id);
+            }
+        }
+
+        object_child_foreach(object_get_objects_root(),
+                             query_numa_affinity_iothread, &iothreads);
+
+        info->pinned = ms->numa_pin_threads && have_cpus;
+        QAPI_LIST_APPEND(tail, info);
+    }
+
+    return head;
+}
+
 HumanReadableText *qmp_x_query_numa(Error **errp)
 {
     g_autoptr(GString) buf = g_string_new("");
@@ -397,6 +397,21 @@ static void machine_set_mem_merge(Object *obj, bool value, Error **errp)
     ms->mem_merge = value;
 }
 
+static bool machine_get_numa_pin_threads(Object *obj, Error **errp)
+{
+    MachineState *ms = MACHINE(obj);
+
+    return ms->numa_pin_threads;
+}
+
+static void machine_set_numa_pin_threads(Object *obj, bool value,
+                                         Error **errp)
+{
+    MachineState *ms = MACHINE(obj);
+
+    ms->numa_pin_threads = value;
+}
+
 static bool machine_get_usb(Object *obj, Error **errp)
 {
     MachineState *ms = MACHINE(obj);
@@ -836,6 +851,12 @@ static void machine_class_init(ObjectClass *oc, void *data)
     object_class_property_set_description(oc, "mem-merge",
         "Enable/disable memory merge support");
 
+    object_class_property_add_bool(oc, "numa-pin-threads",
+        machine_get_numa_pin_threads, machine_set_numa_pin_threads);
+    object_class_property_set_description(oc, "numa-pin-threads",
+        "Pin vCPU threads and IOThreads to the host CPUs of the host NUMA "
+        "nodes that back their guest NUMA node's memory");
+
     object_class_property_add_bool(oc, "usb",
         machine_get_usb, machine_set_usb);
     object_class_property_set_description(oc, "usb",
@@ -42,6 +42,9 @@
 #include "qemu/option.h"
 #include "qemu/config-file.h"
 #include "qemu/cutils.h"
+#include "sysemu/iothread.h"
+#include "sysemu/sysemu.h"
+#include "sysemu/tcg.h"
 
 QemuOptsList qemu_numa_opts = {
     .name = "numa",
@@ -634,6 +637,170 @@ static void numa_init_memdev_container(MachineState *ms, MemoryRegion *ram)
     }
 }
 
+/* Add the CPUs listed in sysfs for @host_node to @cpus */
+static bool numa_host_node_add_cpus(int host_node, unsigned long *cpus)
+{
+#ifdef CONFIG_LINUX
+    g_autofree char *path =
+        g_strdup_printf("/sys/devices/system/node/node%d/cpulist", host_node);
+    g_autofree char *contents = NULL;
+    const char *p;
+
+    if (!g_file_get_contents(path, &contents, NULL, NULL)) {
+        return false;
+    }
+
+    /* The format is a list of ranges such as "0-7,16-23" */
+    p = contents;
+    while (*p && *p != '\n') {
+        unsigned long first, last;
+
+        if (qemu_strtoul(p, &p, 10, &first) < 0) {
+            return false;
+        }
+        last = first;
+        if (*p == '-' && qemu_strtoul(p + 1, &p, 10, &last) < 0) {
+            return false;
+        }
+        if (last < first || last >= NUMA_MAX_HOST_CPUS) {
+            return false;
+        }
+        bitmap_set(cpus, first, last - first + 1);
+        if (*p == ',') {
+            p++;
+        }
+    }
+    return true;
+#else
+    return false;
+#endif
+}
+
+/*
+ * Fill @cpus (NUMA_MAX_HOST_CPUS bits) with the host CPUs of the host nodes
+ * in @host_nodes (MAX_NODES bits).  Returns false if there are none or the
+ * host topology is not known.
+ */
+bool numa_host_nodes_get_cpus(const unsigned long *host_nodes,
+                              unsigned long *cpus)
+{
+    unsigned long host_node;
+
+    bitmap_zero(cpus, NUMA_MAX_HOST_CPUS);
+    for (host_node = find_first_bit(host_nodes, MAX_NODES);
+         host_node < MAX_NODES;
+         host_node = find_next_bit(host_nodes, MAX_NODES, host_node + 1)) {
+        if (!numa_host_node_add_cpus(host_node, cpus)) {
+            return false;
+        }
+    }
+    return !bitmap_empty(cpus, NUMA_MAX_HOST_CPUS);
+}
+
+/*
+ * Fill @cpus with the host CPUs of the host nodes that guest node
+ * @nodeid's memory backend is bound to, see numa_host_nodes_get_cpus().
+ */
+bool numa_get_host_cpus(MachineState *ms, int nodeid, unsigned long *cpus)
+{
+    HostMemoryBackend *backend = ms->numa_state->nodes[nodeid].node_memdev;
+
+    if (!backend || backend->policy == HOST_MEM_POLICY_DEFAULT) {
+        bitmap_zero(cpus, NUMA_MAX_HOST_CPUS);
+        return false;
+    }
+    return numa_host_nodes_get_cpus(backend->host_nodes, cpus);
+}
+
+/* Guest NUMA node of @cpu, or -1 if the target has no node-id property */
+int numa_get_cpu_node_id(CPUState *cpu)
+{
+    if (!object_property_find(OBJECT(cpu), "node-id")) {
+        return -1;
+    }
+    return object_property_get_int(OBJECT(cpu), "node-id", NULL);
+}
+
+static void numa_pin_thread(MachineState *ms, int nodeid, QemuThread *thread,
+                            const char *name)
+{
+    g_autofree unsigned long *cpus = bitmap_new(NUMA_MAX_HOST_CPUS);
+    int ret;
+
+    if (!numa_get_host_cpus(ms, nodeid, cpus)) {
+        warn_report("numa-pin-threads: not pinning %s, the memory of node %d "
+                    "is not bound to host nodes with known CPUs",
+                    name, nodeid);
+        return;
+    }
+
+    ret = qemu_thread_set_affinity(thread, cpus, NUMA_MAX_HOST_CPUS);
+    if (ret < 0) {
+        warn_report("numa-pin-threads: failed to pin %s to node %d: %s",
+                    name, nodeid, strerror(-ret));
+    }
+}
+
+/* Called once the thread of @cpu exists, see qemu_init_vcpu() */
+void numa_pin_vcpu_thread(CPUState *cpu)
+{
+    MachineState *ms = MACHINE(qdev_get_machine());
+    g_autofree char *name = NULL;
+    int nodeid;
+
+    if (!ms->numa_pin_threads || !ms->numa_state ||
+        !ms->numa_state->num_nodes) {
+        return;
+    }
+
+    /* Single-threaded TCG runs all vCPUs in one thread, leave it alone */
+    if (tcg_enabled() && !qemu_tcg_mttcg_enabled()) {
+        return;
+    }
+
+    nodeid = numa_get_cpu_node_id(cpu);
+    if (nodeid < 0) {
+        return;
+    }
+
+    name = g_strdup_printf("vCPU %d", cpu->cpu_index);
+    numa_pin_thread(ms, nodeid, cpu->thread, name);
+}
+
+static int numa_pin_one_iothread(Object *obj, void *opaque)
+{
+    MachineState *ms = opaque;
+    IOThread *iothread = (IOThread *)object_dynamic_cast(obj, TYPE_IOTHREAD);
+    g_autofree char *id = NULL;
+    g_autofree char *name = NULL;
+
+    if (!iothread || iothread->numa_node < 0) {
+        return 0;
+    }
+
+    id = iothread_get_id(iothread);
+    if (iothread->numa_node >= ms->numa_state->num_nodes) {
+        warn_report("numa-pin-threads: IOThread '%s' has numa-node %" PRId64
+                    " but the guest only has %d nodes", id,
+                    iothread->numa_node, ms->numa_state->num_nodes);
+        return 0;
+    }
+
+    name = g_strdup_printf("IOThread '%s'", id);
+    numa_pin_thread(ms, iothread->numa_node, &iothread->thread, name);
+    return 0;
+}
+
+static void numa_pin_iothreads(Notifier *notifier, void *data)
+{
+    object_child_foreach(object_get_objects_root(), numa_pin_one_iothread,
+                         qdev_get_machine());
+}
+
+static Notifier numa_pin_iothreads_notifier = {
+    .notify = numa_pin_iothreads,
+};
+
 void numa_complete_configuration(MachineState *ms)
 {
     int i;
@@ -725,6 +892,16 @@ void numa_complete_configuration(MachineState *ms)
             complete_init_numa_distance(ms);
         }
     }
+
+    if (ms->numa_pin_threads) {
+        if (ms->numa_state->num_nodes == 0) {
+            warn_report("numa-pin-threads=on has no effect without NUMA "
+                        "nodes");
+        } else {
+            /* vCPUs are pinned as they are created, IOThreads exist already */
+            qemu_add_machine_init_done_notifier(&numa_pin_iothreads_notifier);
+        }
+    }
 }
 
 void parse_numa_opts(MachineState *ms)
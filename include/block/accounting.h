@@ -86,6 +86,8 @@ struct BlockAcctStats {
     uint64_t failed_ops[BLOCK_MAX_IOTYPE];
     uint64_t total_time_ns[BLOCK_MAX_IOTYPE];
     uint64_t merged[BLOCK_MAX_IOTYPE];
+    uint64_t batches[BLOCK_MAX_IOTYPE];
+    uint64_t batched[BLOCK_MAX_IOTYPE];
     int64_t last_access_time_ns;
     QSLIST_HEAD(, BlockAcctTimedStats) intervals;
     bool account_invalid;
@@ -113,6 +115,8 @@ void block_acct_failed(BlockAcctStats *stats, BlockAcctCookie *cookie);
 void block_acct_invalid(BlockAcctStats *stats, enum BlockAcctType type);
 void block_acct_merge_done(BlockAcctStats *stats, enum BlockAcctType type,
                            int num_requests);
+void block_acct_batch_done(BlockAcctStats *stats, enum BlockAcctType type,
+                           int num_requests);
 int64_t block_acct_idle_time_ns(BlockAcctStats *stats);
 double block_acct_queue_depth(BlockAcctTimedStats *stats,
                               enum BlockAcctType type);
@@ -211,6 +211,12 @@ struct AioContext {
      */
     struct LuringState *linux_io_uring;
 
+    /*
+     * Separate ring with polled completions (LURING_SETUP_IOPOLL), which
+     * only supports O_DIRECT reads and writes.  Same locking as above.
+     */
+    struct LuringState *linux_io_uring_iopoll;
+
     /* State for file descriptor monitoring using Linux io_uring */
     struct io_uring fdmon_io_uring;
     AioHandlerSList submit_list;
@@ -517,11 +523,18 @@ struct LinuxAioState *aio_setup_linux_aio(AioContext *ctx, Error **errp);
 /* Return the LinuxAioState bound to this AioContext */
 struct LinuxAioState *aio_get_linux_aio(AioContext *ctx);
 
-/* Setup the LuringState bound to this AioContext */
-struct LuringState *aio_setup_linux_io_uring(AioContext *ctx, Error **errp);
+/*
+ * Setup the LuringState bound to this AioContext.  LURING_SETUP_IOPOLL in
+ * @setup_flags selects the polled ring, the other flags (LURING_SETUP_*)
+ * only take effect if the ring does not exist yet.
+ */
+struct LuringState *aio_setup_linux_io_uring(AioContext *ctx,
+                                             unsigned int setup_flags,
+                                             Error **errp);
 
-/* Return the LuringState bound to this AioContext */
-struct LuringState *aio_get_linux_io_uring(AioContext *ctx);
+/* Return the LuringState bound to this AioContext, see above for flags */
+struct LuringState *aio_get_linux_io_uring(AioContext *ctx,
+                                           unsigned int setup_flags);
 /**
  * aio_timer_new_with_attrs:
  * @ctx: the aio context
@@ -62,8 +62,24 @@ void laio_io_unplug(BlockDriverState *bs, LinuxAioState *s,
 /* io_uring.c - Linux io_uring implementation */
 #ifdef CONFIG_LINUX_IO_URING
 typedef struct LuringState LuringState;
-LuringState *luring_init(Error **errp);
+
+/* luring_init() setup flags */
+#define LURING_SETUP_SQPOLL     (1 << 0)
+#define LURING_SETUP_IOPOLL     (1 << 1)
+
+/* Sizes of the registered file and buffer tables of each ring */
+#define LURING_MAX_FIXED_FILES  64
+#define LURING_MAX_FIXED_BUFS   256
+
+LuringState *luring_init(unsigned int setup_flags, Error **errp);
 void luring_cleanup(LuringState *s);
+unsigned int luring_get_setup_flags(LuringState *s);
+int luring_register_fd(LuringState *s, int fd);
+void luring_unregister_fd(LuringState *s, int fd);
+int luring_register_buf(LuringState *s, void *host, size_t size);
+void luring_unregister_buf(LuringState *s, void *host);
+void luring_register_guest_ram(LuringState *s);
+void luring_unregister_guest_ram(LuringState *s);
 int coroutine_fn luring_co_submit(BlockDriverState *bs, LuringState *s, int fd,
                                 uint64_t offset, QEMUIOVector *qiov, int type);
 void luring_detach_aio_context(LuringState *s, AioContext *old_context);
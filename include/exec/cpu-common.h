@@ -66,6 +66,11 @@ typedef uintptr_t ram_addr_t;
 /* memory API */
 
 void qemu_ram_remap(ram_addr_t addr, ram_addr_t length);
+/*
+ * Give host memory that was mapped over guest RAM behind the back of
+ * qemu_ram_remap() the advice and locking that guest RAM has.
+ */
+void qemu_ram_remap_advise(void *addr, ram_addr_t length);
 /* This should not be used by devices.  */
 ram_addr_t qemu_ram_addr_from_host(void *ptr);
 RAMBlock *qemu_ram_block_by_name(const char *name);
@@ -490,6 +490,20 @@ struct TranslationBlock {
     uint16_t size;
     uint16_t icount;
 
+    /*
+     * Executions left before the TB is retranslated as the head of a
+     * hot trace.  Decremented by the generated code; see tb_gen_trace().
+     */
+    int32_t exec_count;
+
+    /*
+     * Set on TBs translated in the background until a vCPU checked that
+     * their guest code, whose crc32c is @worker_crc, did not change since;
+     * see tb_worker_check().
+     */
+    bool worker_unchecked;
+    uint32_t worker_crc;
+
     struct tb_tc tc;
 
     /* first and second physical page containing code. The lower bit
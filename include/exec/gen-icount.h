@@ -21,6 +21,16 @@ static inline void gen_tb_start(const TranslationBlock *tb)
 {
     TCGv_i32 count;
 
+    /*
+     * A block appended to a trace is entered by falling through from
+     * the previous one, not from the execution loop: the check has
+     * already been done at the start of the trace.
+     */
+    if (tcg_ctx->trace_cont) {
+        tcg_ctx->exitreq_label = NULL;
+        return;
+    }
+
     if (tb_cflags(tb) & CF_USE_ICOUNT) {
         count = tcg_temp_local_new_i32();
     } else {
@@ -53,6 +63,21 @@ static inline void gen_tb_start(const TranslationBlock *tb)
     } else {
         tcg_ctx->exitreq_label = gen_new_label();
         tcg_gen_brcondi_i32(TCG_COND_LT, count, 0, tcg_ctx->exitreq_label);
+
+        /*
+         * Count executions of the TB, and go back to the execution loop
+         * when it becomes hot so that it is retranslated as a trace.
+         */
+        if (tcg_ctx->trace_profile) {
+            TCGv_ptr ptr = tcg_const_ptr(&tb->exec_count);
+
+            tcg_gen_ld_i32(count, ptr, 0);
+            tcg_gen_subi_i32(count, count, 1);
+            tcg_gen_st_i32(count, ptr, 0);
+            tcg_gen_brcondi_i32(TCG_COND_LE, count, 0,
+                                tcg_ctx->exitreq_label);
+            tcg_temp_free_ptr(ptr);
+        }
     }
 
     if (tb_cflags(tb) & CF_USE_ICOUNT) {
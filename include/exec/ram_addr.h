@@ -264,6 +264,26 @@ static inline uint8_t cpu_physical_memory_range_includes_clean(ram_addr_t start,
     return ret;
 }
 
+/* Words of the DIRTY_MEMORY_MIGRATION bitmap per summary bit */
+#define DIRTY_MEMORY_SUMMARY_LONGS (DIRTY_MEMORY_SUMMARY_PAGES / BITS_PER_LONG)
+
+/* Summary of a block of the DIRTY_MEMORY_MIGRATION bitmap */
+static inline unsigned long *dirty_memory_summary(unsigned long *block)
+{
+    return block + BITS_TO_LONGS(DIRTY_MEMORY_BLOCK_SIZE);
+}
+
+/* Must be called after setting pages [offset, offset + nr) in @block */
+static inline void dirty_memory_summary_set(unsigned long *block,
+                                            unsigned long offset,
+                                            unsigned long nr)
+{
+    unsigned long first = offset / DIRTY_MEMORY_SUMMARY_PAGES;
+    unsigned long last = (offset + nr - 1) / DIRTY_MEMORY_SUMMARY_PAGES;
+
+    bitmap_set_atomic(dirty_memory_summary(block), first, last - first + 1);
+}
+
 static inline void cpu_physical_memory_set_dirty_flag(ram_addr_t addr,
                                                       unsigned client)
 {
@@ -281,6 +301,10 @@ static inline void cpu_physical_memory_set_dirty_flag(ram_addr_t addr,
     blocks = qatomic_rcu_read(&ram_list.dirty_memory[client]);
 
     set_bit_atomic(offset, blocks->blocks[idx]);
+    if (client == DIRTY_MEMORY_MIGRATION) {
+        set_bit_atomic(offset / DIRTY_MEMORY_SUMMARY_PAGES,
+                       dirty_memory_summary(blocks->blocks[idx]));
+    }
 }
 
 static inline void cpu_physical_memory_set_dirty_range(ram_addr_t start,
@@ -313,6 +337,9 @@ static inline void cpu_physical_memory_set_dirty_range(ram_addr_t start,
             if (likely(mask & (1 << DIRTY_MEMORY_MIGRATION))) {
                 bitmap_set_atomic(blocks[DIRTY_MEMORY_MIGRATION]->blocks[idx],
                                   offset, next - page);
+                dirty_memory_summary_set(
+                    blocks[DIRTY_MEMORY_MIGRATION]->blocks[idx],
+                    offset, next - page);
             }
             if (unlikely(mask & (1 << DIRTY_MEMORY_VGA))) {
                 bitmap_set_atomic(blocks[DIRTY_MEMORY_VGA]->blocks[idx],
@@ -375,6 +402,9 @@ static inline void cpu_physical_memory_set_dirty_lebitmap(unsigned long *bitmap,
                         qatomic_or(
                                 &blocks[DIRTY_MEMORY_MIGRATION][idx][offset],
                                 temp);
+                        set_bit_atomic(offset / DIRTY_MEMORY_SUMMARY_LONGS,
+                                       dirty_memory_summary(
+                                  blocks[DIRTY_MEMORY_MIGRATION][idx]));
                         if (unlikely(
                             global_dirty_tracking & GLOBAL_DIRTY_DIRTY_RATE)) {
                             total_dirty_pages += ctpopl(temp);
@@ -474,6 +504,29 @@ uint64_t cpu_physical_memory_sync_dirty_bitmap(RAMBlock *rb,
                 &ram_list.dirty_memory[DIRTY_MEMORY_MIGRATION])->blocks;
 
         for (k = page; k < page + nr; k++) {
+            /*
+             * Skip the words whose summary bit is clear.  Summary bits
+             * that also cover memory outside the range are left alone,
+             * and their words always looked at.
+             */
+            if (!(offset % DIRTY_MEMORY_SUMMARY_LONGS) &&
+                k + DIRTY_MEMORY_SUMMARY_LONGS <= page + nr) {
+                unsigned long *summary = dirty_memory_summary(src[idx]);
+                unsigned long group = offset / DIRTY_MEMORY_SUMMARY_LONGS;
+
+                if (!(qatomic_fetch_and(&summary[BIT_WORD(group)],
+                                        ~BIT_MASK(group)) &
+                      BIT_MASK(group))) {
+                    k += DIRTY_MEMORY_SUMMARY_LONGS - 1;
+                    offset += DIRTY_MEMORY_SUMMARY_LONGS;
+                    if (offset >= BITS_TO_LONGS(DIRTY_MEMORY_BLOCK_SIZE)) {
+                        offset = 0;
+                        idx++;
+                    }
+                    continue;
+                }
+            }
+
             if (src[idx][offset]) {
                 unsigned long bits = qatomic_xchg(&src[idx][offset], 0);
                 unsigned long new_dirty;
@@ -71,6 +71,15 @@ struct RAMBlock {
      * could not have been valid on the source.
      */
     ram_addr_t postcopy_length;
+
+    /*
+     * With the mapped-ram migration capability, bitmap of the pages that
+     * are in the migration file, and where the bitmap and the pages of the
+     * block are in the file.
+     */
+    unsigned long *file_bmap;
+    uint64_t bitmap_offset;
+    uint64_t pages_offset;
 };
 #endif
 #endif
@@ -39,6 +39,15 @@ typedef struct RAMBlockNotifier RAMBlockNotifier;
  * pointed to from the new DirtyMemoryBlocks).
  */
 #define DIRTY_MEMORY_BLOCK_SIZE ((ram_addr_t)256 * 1024 * 8)
+
+/*
+ * Each block of the DIRTY_MEMORY_MIGRATION bitmap is followed by a summary
+ * with one bit per DIRTY_MEMORY_SUMMARY_PAGES pages, set after any of them
+ * is marked dirty.  Syncing the migration bitmap only looks at the parts of
+ * memory whose summary bit is set, so its cost depends on how much memory
+ * was dirtied rather than on the size of memory.
+ */
+#define DIRTY_MEMORY_SUMMARY_PAGES 512
 typedef struct {
     struct rcu_head rcu;
     unsigned long *blocks[];
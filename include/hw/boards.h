@@ -332,6 +332,7 @@ struct MachineState {
     char *dt_compatible;
     bool dump_guest_core;
     bool mem_merge;
+    bool numa_pin_threads;
     bool usb;
     bool usb_disabled;
     char *firmware;
@@ -37,6 +37,18 @@ struct TCGCPUOps {
     void (*cpu_exec_exit)(CPUState *cpu);
     /** @debug_excp_handler: Callback for handling debug exceptions */
     void (*debug_excp_handler)(CPUState *cpu);
+    /**
+     * @copy_for_translation: Copy the CPU state that the translator
+     * reads from @src to @dst, so that TBs can be translated from @dst
+     * outside of the vCPU thread
+     *
+     * Only set if the translator depends on CPU state that does not
+     * change while a TB is chained to its successors with goto_tb, and
+     * reads guest code only with the cpu_ld*_code functions.  @dst is
+     * not a realized CPU: only its class, its env_ptr and its tracing
+     * state are set up.
+     */
+    void (*copy_for_translation)(CPUState *dst, CPUState *src);
 
 #ifdef NEED_CPU_H
 #if defined(CONFIG_USER_ONLY) && defined(TARGET_I386)
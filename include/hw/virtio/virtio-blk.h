@@ -36,6 +36,7 @@ struct VirtIOBlkConf
 {
     BlockConf conf;
     IOThread *iothread;
+    char *iothread_vq_mapping;
     char *serial;
     uint32_t request_merging;
     uint16_t num_queues;
@@ -45,11 +46,14 @@ struct VirtIOBlkConf
     uint32_t max_discard_sectors;
     uint32_t max_write_zeroes_sectors;
     bool x_enable_wce_if_config_wce;
+    uint32_t batch_window_us;
+    uint32_t batch_max_reqs;
 };
 
 struct VirtIOBlockDataPlane;
 
 struct VirtIOBlockReq;
+struct MultiReqBuffer;
 struct VirtIOBlock {
     VirtIODevice parent_obj;
     BlockBackend *blk;
@@ -64,6 +68,16 @@ struct VirtIOBlock {
     struct VirtIOBlockDataPlane *dataplane;
     uint64_t host_features;
     size_t config_size;
+
+    /*
+     * Write requests held back across virtqueue notifications so that they
+     * can be merged, see batch-window-us.  Protected by the AioContext lock
+     * of the BlockBackend.
+     */
+    struct MultiReqBuffer *batch_mrb;
+    QEMUTimer *batch_timer;
+    AioContext *batch_timer_ctx;
+    bool batch_requeued;        /* s->rq got held back writes on drain */
 };
 
 typedef struct VirtIOBlockReq {
@@ -32,12 +32,15 @@ OBJECT_DECLARE_TYPE(QIOChannel, QIOChannelClass,
 
 #define QIO_CHANNEL_ERR_BLOCK -2
 
+#define QIO_CHANNEL_WRITE_FLAG_ZERO_COPY 0x1
+
 typedef enum QIOChannelFeature QIOChannelFeature;
 
 enum QIOChannelFeature {
     QIO_CHANNEL_FEATURE_FD_PASS,
     QIO_CHANNEL_FEATURE_SHUTDOWN,
     QIO_CHANNEL_FEATURE_LISTEN,
+    QIO_CHANNEL_FEATURE_WRITE_ZERO_COPY,
 };
 
 
@@ -104,6 +107,7 @@ struct QIOChannelClass {
                          size_t niov,
                          int *fds,
                          size_t nfds,
+                         int flags,
                          Error **errp);
     ssize_t (*io_readv)(QIOChannel *ioc,
                         const struct iovec *iov,
@@ -136,6 +140,8 @@ struct QIOChannelClass {
                                   IOHandler *io_read,
                                   IOHandler *io_write,
                                   void *opaque);
+    int (*io_flush)(QIOChannel *ioc,
+                    Error **errp);
 };
 
 /* General I/O handling functions */
@@ -228,6 +234,7 @@ ssize_t qio_channel_readv_full(QIOChannel *ioc,
  * @niov: the length of the @iov array
  * @fds: an array of file handles to send
  * @nfds: number of file handles in @fds
+ * @flags: write flags (QIO_CHANNEL_WRITE_FLAG_*)
  * @errp: pointer to a NULL-initialized error object
  *
  * Write data to the IO channel, reading it from the
@@ -251,6 +258,13 @@ ssize_t qio_channel_readv_full(QIOChannel *ioc,
  * unless qio_channel_has_feature() returns a true
  * value for the QIO_CHANNEL_FEATURE_FD_PASS constant.
  *
+ * If @flags contains QIO_CHANNEL_WRITE_FLAG_ZERO_COPY, the
+ * data may be sent straight from the memory regions in @iov,
+ * after the function returns.  They must not be modified or
+ * freed until qio_channel_flush() has been called.  It is an
+ * error to pass that flag unless qio_channel_has_feature()
+ * returns a true value for QIO_CHANNEL_FEATURE_WRITE_ZERO_COPY.
+ *
  * Returns: the number of bytes sent, or -1 on error,
  * or QIO_CHANNEL_ERR_BLOCK if no data is can be sent
  * and the channel is non-blocking
@@ -260,6 +274,7 @@ ssize_t qio_channel_writev_full(QIOChannel *ioc,
                                 size_t niov,
                                 int *fds,
                                 size_t nfds,
+                                int flags,
                                 Error **errp);
 
 /**
@@ -837,6 +852,7 @@ int qio_channel_readv_full_all(QIOChannel *ioc,
  * @niov: the length of the @iov array
  * @fds: an array of file handles to send
  * @nfds: number of file handles in @fds
+ * @flags: write flags (QIO_CHANNEL_WRITE_FLAG_*)
  * @errp: pointer to a NULL-initialized error object
  *
  *
@@ -853,6 +869,23 @@ int qio_channel_writev_full_all(QIOChannel *ioc,
                                 const struct iovec *iov,
                                 size_t niov,
                                 int *fds, size_t nfds,
-                                Error **errp);
+                                int flags, Error **errp);
+
+/**
+ * qio_channel_flush:
+ * @ioc: the channel object
+ * @errp: pointer to a NULL-initialized error object
+ *
+ * Wait until all the data sent with QIO_CHANNEL_WRITE_FLAG_ZERO_COPY
+ * has been handed over by the kernel, so that the memory it was sent
+ * from can be modified or freed again.  Does nothing and returns 0
+ * on channels without the QIO_CHANNEL_FEATURE_WRITE_ZERO_COPY feature.
+ *
+ * Returns: -1 on error, 0 if there was nothing to flush or at least
+ * one of the writes since the last flush was done without copying,
+ * 1 if the kernel had to fall back to copying all of them
+ */
+int qio_channel_flush(QIOChannel *ioc,
+                      Error **errp);
 
 #endif /* QIO_CHANNEL_H */
@@ -548,9 +548,56 @@ unsigned long qemu_getauxval(unsigned long type);
 
 void qemu_set_tty_echo(int fd, bool echo);
 
+/**
+ * os_mem_prealloc:
+ * @fd: file descriptor backing @area, or -1
+ * @area: start of the memory to preallocate
+ * @sz: size of @area in bytes
+ * @smp_cpus: maximum number of threads to use
+ * @host_cpus: if not NULL, bitmap of the host CPUs the threads may run on
+ * @nbits: size of @host_cpus in bits
+ * @errp: pointer to a NULL-initialized error object
+ *
+ * Fault in all pages of @area, e.g. to reserve huge pages up front.
+ */
 void os_mem_prealloc(int fd, char *area, size_t sz, int smp_cpus,
+                     unsigned long *host_cpus, unsigned long nbits,
                      Error **errp);
 
+typedef struct MemPreallocJob MemPreallocJob;
+
+/**
+ * os_mem_prealloc_start:
+ * @done: called once all pages have been faulted in, possibly from
+ *        another thread
+ * @opaque: argument for @done
+ *
+ * Like os_mem_prealloc(), but return once the threads are started and let
+ * them fault in the pages in the background.  The memory may be used in
+ * the meantime; only the pages not faulted in yet are slower to access.
+ * If that is not possible on @area, preallocate synchronously.
+ *
+ * Returns: a job that must be passed to os_mem_prealloc_finish(), or NULL
+ * with @errp set on error.
+ */
+MemPreallocJob *os_mem_prealloc_start(int fd, char *area, size_t sz,
+                                      int smp_cpus, unsigned long *host_cpus,
+                                      unsigned long nbits,
+                                      void (*done)(void *opaque),
+                                      void *opaque, Error **errp);
+
+/**
+ * os_mem_prealloc_finish:
+ * @job: a job returned by os_mem_prealloc_start()
+ * @errp: pointer to a NULL-initialized error object
+ *
+ * Wait for @job to complete and free it.
+ *
+ * Returns: true on success, false with @errp set if some pages could not
+ * be faulted in.
+ */
+bool os_mem_prealloc_finish(MemPreallocJob *job, Error **errp);
+
 /**
  * qemu_get_pid_name:
  * @pid: pid of a process
@@ -0,0 +1,76 @@
+/*
+ * Per-vCPU dirty page rate limit
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or later.
+ * See the COPYING file in the top-level directory.
+ */
+
+#ifndef SYSEMU_DIRTYLIMIT_H
+#define SYSEMU_DIRTYLIMIT_H
+
+/**
+ * dirtylimit_in_service:
+ *
+ * Returns: %true if the dirty page rate of any vCPU is limited.
+ */
+bool dirtylimit_in_service(void);
+
+/**
+ * dirtylimit_vcpu_execute:
+ * @cpu: The vCPU whose dirty ring just got full.
+ *
+ * Throttle @cpu if it dirties memory faster than its limit.  Must be
+ * called from the vCPU thread, without the BQL.
+ */
+void dirtylimit_vcpu_execute(CPUState *cpu);
+
+/**
+ * dirtylimit_set_vcpu:
+ * @cpu_index: Index of the vCPU.
+ * @quota: Dirty page rate limit in MB/s.
+ * @enable: Whether to set or cancel the limit.
+ *
+ * Set or cancel the dirty page rate limit of a vCPU.  Must be called with
+ * the BQL held, and with the KVM dirty ring enabled.
+ */
+void dirtylimit_set_vcpu(int cpu_index, uint64_t quota, bool enable);
+
+/**
+ * dirtylimit_set_vcpu_migration:
+ * @cpu_index: Index of the vCPU.
+ * @quota: Dirty page rate limit in MB/s.
+ *
+ * Like dirtylimit_set_vcpu(), for a limit that migration applies on its
+ * own.  The limit counts as set by migration until it is set or canceled
+ * with dirtylimit_set_vcpu().
+ */
+void dirtylimit_set_vcpu_migration(int cpu_index, uint64_t quota);
+
+/**
+ * dirtylimit_vcpu_by_migration:
+ * @cpu_index: Index of the vCPU.
+ *
+ * Returns: %true if the current limit of the vCPU was set with
+ * dirtylimit_set_vcpu_migration().  Must be called with the BQL held.
+ */
+bool dirtylimit_vcpu_by_migration(int cpu_index);
+
+/**
+ * dirtylimit_vcpu_quota:
+ * @cpu_index: Index of the vCPU.
+ *
+ * Returns: The dirty page rate limit of the vCPU in MB/s, 0 if it is not
+ * limited.  Must be called with the BQL held.
+ */
+uint64_t dirtylimit_vcpu_quota(int cpu_index);
+
+/**
+ * dirtylimit_set_all:
+ * @quota: Dirty page rate limit in MB/s.
+ * @enable: Whether to set or cancel the limits.
+ *
+ * Like dirtylimit_set_vcpu(), for all vCPUs.
+ */
+void dirtylimit_set_all(uint64_t quota, bool enable);
+
+#endif
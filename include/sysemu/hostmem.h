@@ -56,6 +56,8 @@ struct HostMemoryBackendClass {
  * @size: amount of memory backend provides
  * @mr: MemoryRegion representing host memory belonging to backend
  * @prealloc_threads: number of threads to be used for preallocatining RAM
+ * @prealloc_async: let preallocation run in the background
+ * @prealloc_job: background preallocation in progress, if any
  */
 struct HostMemoryBackend {
     /* private */
@@ -66,6 +68,8 @@ struct HostMemoryBackend {
     bool merge, dump, use_canonical_path;
     bool prealloc, is_mapped, share, reserve;
     uint32_t prealloc_threads;
+    bool prealloc_async;
+    MemPreallocJob *prealloc_job;
     DECLARE_BITMAP(host_nodes, MAX_NODES + 1);
     HostMemPolicy policy;
 
@@ -79,5 +83,8 @@ void host_memory_backend_set_mapped(HostMemoryBackend *backend, bool mapped);
 bool host_memory_backend_is_mapped(HostMemoryBackend *backend);
 size_t host_memory_backend_pagesize(HostMemoryBackend *memdev);
 char *host_memory_backend_get_name(HostMemoryBackend *backend);
+bool host_memory_backend_prealloc_wait(HostMemoryBackend *backend,
+                                       Error **errp);
+bool host_memory_backend_prealloc_wait_all(Error **errp);
 
 #endif
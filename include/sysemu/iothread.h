@@ -40,6 +40,9 @@ struct IOThread {
 
     /* AioContext AIO engine parameters */
     int64_t aio_max_batch;
+
+    /* Guest NUMA node to pin to with numa-pin-threads, -1 for none */
+    int64_t numa_node;
 };
 typedef struct IOThread IOThread;
 
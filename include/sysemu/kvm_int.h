@@ -24,6 +24,14 @@ typedef struct KVMSlot
     /* Dirty bitmap cache for the slot */
     unsigned long *dirty_bmap;
     unsigned long dirty_bmap_size;
+    /*
+     * Pages set in dirty_bmap by the dirty ring since the last sync, if
+     * there were no more than dirty_queue_max of them
+     */
+    uint64_t *dirty_queue;
+    uint64_t dirty_queue_len;
+    uint64_t dirty_queue_size;
+    bool dirty_queue_overflow;
     /* Cache of the address space ID */
     int as_id;
     /* Cache of the offset in ram address space */
@@ -106,6 +106,14 @@ void parse_numa_hmat_cache(MachineState *ms, NumaHmatCacheOptions *node,
 void numa_complete_configuration(MachineState *ms);
 void query_numa_node_mem(NumaNodeMem node_mem[], MachineState *ms);
 extern QemuOptsList qemu_numa_opts;
+/* Size of the host CPU bitmaps used for thread pinning */
+#define NUMA_MAX_HOST_CPUS 8192
+
+bool numa_host_nodes_get_cpus(const unsigned long *host_nodes,
+                              unsigned long *cpus);
+bool numa_get_host_cpus(MachineState *ms, int nodeid, unsigned long *cpus);
+int numa_get_cpu_node_id(CPUState *cpu);
+void numa_pin_vcpu_thread(CPUState *cpu);
 void numa_cpu_pre_plug(const struct CPUArchId *slot, DeviceState *dev,
                        Error **errp);
 bool numa_uses_legacy_mem(void);
@@ -550,6 +550,11 @@ struct TCGContext {
 
     TCGRegSet reserved_regs;
     uint32_t tb_cflags; /* cflags of the current TB */
+
+    /* Persistent TB cache, see tcg_ir_save() */
+    bool ir_loaded;     /* the ops come from tcg_ir_load() */
+    bool ir_host_ptr;   /* the ops use a constant that may be a host address */
+    GByteArray *ir_save; /* if set, tcg_gen_code() saves the optimized ops */
     intptr_t current_frame_offset;
     intptr_t frame_start;
     intptr_t frame_end;
@@ -592,6 +597,14 @@ struct TCGContext {
 
     TCGLabel *exitreq_label;
 
+    /* Hot traces, see tb_gen_trace() */
+    bool trace_profile; /* gen_tb_start() counts executions of the TB */
+    bool trace_cont;    /* translating a block appended to a trace */
+
+    /* Direct jump destinations of the last block, see tb_worker_prefetch() */
+    uint64_t goto_tb_dest[2];
+    int nb_goto_tb_dest;
+
 #ifdef CONFIG_PLUGIN
     /*
      * We keep one plugin_tb struct per TCGContext. Note that on every TB
@@ -804,6 +817,7 @@ void tcg_pool_reset(TCGContext *s);
 TranslationBlock *tcg_tb_alloc(TCGContext *s);
 
 void tcg_region_reset_all(void);
+int tcg_region_evict(GTraverseFunc func, gpointer user_data);
 
 size_t tcg_code_size(void);
 size_t tcg_code_capacity(void);
@@ -840,6 +854,39 @@ void tcg_func_start(TCGContext *s);
 
 int tcg_gen_code(TCGContext *s, TranslationBlock *tb);
 
+/**
+ * tcg_ir_save:
+ * @s: TCG context
+ * @tb: translation block being generated
+ * @buf: buffer to fill
+ *
+ * Serialize the optimized ops of @tb into @buf, in a form that
+ * tcg_ir_load() can replay in another run of the same QEMU binary.
+ * Helpers are referred to by index and exits by number, so that the
+ * result does not depend on where the binary or the TB were placed.
+ *
+ * Returns false, with @buf emptied, if the ops refer to host state
+ * that cannot be relocated, such as plugin callbacks or host pointers
+ * passed as constants.
+ */
+bool tcg_ir_save(TCGContext *s, const TranslationBlock *tb, GByteArray *buf);
+
+/**
+ * tcg_ir_load:
+ * @s: TCG context, just after tcg_func_start()
+ * @tb: translation block being generated
+ * @buf: ops saved by tcg_ir_save()
+ * @len: length of @buf
+ *
+ * Recreate the temps, labels and ops saved in @buf for @tb, so that
+ * tcg_gen_code() can skip straight to liveness analysis.
+ *
+ * Returns false if @buf is malformed; the context must then be reset
+ * with tcg_func_start() before translating @tb from scratch.
+ */
+bool tcg_ir_load(TCGContext *s, const TranslationBlock *tb,
+                 const uint8_t *buf, size_t len);
+
 void tcg_set_frame(TCGContext *s, TCGReg reg, intptr_t start, intptr_t size);
 
 TCGTemp *tcg_global_mem_new_internal(TCGType, TCGv_ptr,
@@ -1051,12 +1098,29 @@ static inline TCGv_i64 tcg_constant_i64(int64_t val)
 TCGv_vec tcg_constant_vec(TCGType type, unsigned vece, int64_t val);
 TCGv_vec tcg_constant_vec_matching(TCGv_vec match, unsigned vece, int64_t val);
 
+/*
+ * Pointer constants may be host addresses, which keep the ops out of
+ * the persistent TB cache.  Nothing is mapped in the low 64KiB of the
+ * host address space, so smaller values are sizes or indexes.
+ */
+static inline intptr_t tcg_ptr_const(intptr_t val)
+{
+    if ((uintptr_t)val >= 0x10000) {
+        tcg_ctx->ir_host_ptr = true;
+    }
+    return val;
+}
+
 #if UINTPTR_MAX == UINT32_MAX
-# define tcg_const_ptr(x)        ((TCGv_ptr)tcg_const_i32((intptr_t)(x)))
-# define tcg_const_local_ptr(x)  ((TCGv_ptr)tcg_const_local_i32((intptr_t)(x)))
+# define tcg_const_ptr(x) \
+    ((TCGv_ptr)tcg_const_i32(tcg_ptr_const((intptr_t)(x))))
+# define tcg_const_local_ptr(x) \
+    ((TCGv_ptr)tcg_const_local_i32(tcg_ptr_const((intptr_t)(x))))
 #else
-# define tcg_const_ptr(x)        ((TCGv_ptr)tcg_const_i64((intptr_t)(x)))
-# define tcg_const_local_ptr(x)  ((TCGv_ptr)tcg_const_local_i64((intptr_t)(x)))
+# define tcg_const_ptr(x) \
+    ((TCGv_ptr)tcg_const_i64(tcg_ptr_const((intptr_t)(x))))
+# define tcg_const_local_ptr(x) \
+    ((TCGv_ptr)tcg_const_local_i64(tcg_ptr_const((intptr_t)(x))))
 #endif
 
 TCGLabel *gen_new_label(void);
@@ -106,6 +106,7 @@ static void iothread_instance_init(Object *obj)
     IOThread *iothread = IOTHREAD(obj);
 
     iothread->poll_max_ns = IOTHREAD_POLL_MAX_NS_DEFAULT;
+    iothread->numa_node = -1;
     iothread->thread_id = -1;
     qemu_sem_init(&iothread->init_done_sem, 0);
     /* By default, we don't run gcontext */
@@ -229,6 +230,9 @@ static IOThreadParamInfo poll_shrink_info = {
 static IOThreadParamInfo aio_max_batch_info = {
     "aio-max-batch", offsetof(IOThread, aio_max_batch),
 };
+static IOThreadParamInfo numa_node_info = {
+    "numa-node", offsetof(IOThread, numa_node),
+};
 
 static void iothread_get_param(Object *obj, Visitor *v,
         const char *name, IOThreadParamInfo *info, Error **errp)
@@ -313,6 +317,23 @@ static void iothread_set_aio_param(Object *obj, Visitor *v,
     }
 }
 
+static void iothread_get_numa_param(Object *obj, Visitor *v,
+        const char *name, void *opaque, Error **errp)
+{
+    IOThreadParamInfo *info = opaque;
+
+    iothread_get_param(obj, v, name, info, errp);
+}
+
+/* Only takes effect at machine creation, see numa_pin_iothreads() */
+static void iothread_set_numa_param(Object *obj, Visitor *v,
+        const char *name, void *opaque, Error **errp)
+{
+    IOThreadParamInfo *info = opaque;
+
+    iothread_set_param(obj, v, name, info, errp);
+}
+
 static void iothread_class_init(ObjectClass *klass, void *class_data)
 {
     UserCreatableClass *ucc = USER_CREATABLE_CLASS(klass);
@@ -334,6 +355,10 @@ static void iothread_class_init(ObjectClass *klass, void *class_data)
                               iothread_get_aio_param,
                               iothread_set_aio_param,
                               NULL, &aio_max_batch_info);
+    object_class_property_add(klass, "numa-node", "int",
+                              iothread_get_numa_param,
+                              iothread_set_numa_param,
+                              NULL, &numa_node_info);
 }
 
 static const TypeInfo iothread_info = {
@@ -0,0 +1,85 @@
+/*
+ * QEMU live migration to and from a file
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or later.
+ * See the COPYING file in the top-level directory.
+ */
+
+#include "qemu/osdep.h"
+#include "qapi/error.h"
+#include "channel.h"
+#include "file.h"
+#include "migration.h"
+#include "io/channel-file.h"
+#include "trace.h"
+
+static struct FileOutgoingArgs {
+    char *filename;
+} outgoing_args;
+
+/*
+ * The multifd channels of a migration to a file each open the file
+ * again, and write their pages at fixed offsets with the mapped-ram
+ * capability.
+ */
+void file_send_channel_create(QIOTaskFunc f, void *data)
+{
+    QIOChannelFile *ioc;
+    QIOTask *task;
+    Error *err = NULL;
+
+    ioc = qio_channel_file_new_path(outgoing_args.filename, O_WRONLY, 0, &err);
+    task = qio_task_new(OBJECT(ioc), f, data, NULL);
+    if (!ioc) {
+        qio_task_set_error(task, err);
+    }
+    qio_task_complete(task);
+}
+
+void file_start_outgoing_migration(MigrationState *s, const char *filename,
+                                   Error **errp)
+{
+    QIOChannelFile *ioc;
+
+    trace_migration_file_outgoing(filename);
+
+    ioc = qio_channel_file_new_path(filename, O_CREAT | O_WRONLY | O_TRUNC,
+                                    0600, errp);
+    if (!ioc) {
+        return;
+    }
+
+    g_free(outgoing_args.filename);
+    outgoing_args.filename = g_strdup(filename);
+
+    qio_channel_set_name(QIO_CHANNEL(ioc), "migration-file-outgoing");
+    migration_channel_connect(s, QIO_CHANNEL(ioc), NULL, NULL);
+    object_unref(OBJECT(ioc));
+}
+
+static gboolean file_accept_incoming_migration(QIOChannel *ioc,
+                                               GIOCondition condition,
+                                               gpointer opaque)
+{
+    migration_channel_process_incoming(ioc);
+    object_unref(OBJECT(ioc));
+    return G_SOURCE_REMOVE;
+}
+
+void file_start_incoming_migration(const char *filename, Error **errp)
+{
+    QIOChannelFile *ioc;
+
+    trace_migration_file_incoming(filename);
+
+    ioc = qio_channel_file_new_path(filename, O_RDONLY, 0, errp);
+    if (!ioc) {
+        return;
+    }
+
+    qio_channel_set_name(QIO_CHANNEL(ioc), "migration-file-incoming");
+    qio_channel_add_watch_full(QIO_CHANNEL(ioc), G_IO_IN,
+                               file_accept_incoming_migration,
+                               NULL, NULL,
+                               g_main_context_get_thread_default());
+}
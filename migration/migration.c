@@ -20,6 +20,7 @@
 #include "migration/blocker.h"
 #include "exec.h"
 #include "fd.h"
+#include "file.h"
 #include "socket.h"
 #include "sysemu/runstate.h"
 #include "sysemu/sysemu.h"
@@ -59,6 +60,7 @@
 #include "multifd.h"
 #include "qemu/yank.h"
 #include "sysemu/cpus.h"
+#include "sysemu/kvm.h"
 #include "yank_functions.h"
 #include "sysemu/qtest.h"
 
@@ -101,6 +103,7 @@
 #define DEFAULT_MIGRATE_MULTIFD_ZLIB_LEVEL 1
 /* 0: means nocompress, 1: best speed, ... 20: best compress ratio */
 #define DEFAULT_MIGRATE_MULTIFD_ZSTD_LEVEL 1
+#define DEFAULT_MIGRATE_POSTCOPY_THREADS 2
 
 /* Background transfer rate for postcopy, 0 means unlimited, note
  * that page requests can still exceed this limit.
@@ -153,11 +156,16 @@ INITIALIZE_MIGRATE_CAPS_SET(check_caps_background_snapshot,
     MIGRATION_CAPABILITY_POSTCOPY_RAM,
     MIGRATION_CAPABILITY_DIRTY_BITMAPS,
     MIGRATION_CAPABILITY_POSTCOPY_BLOCKTIME,
+    MIGRATION_CAPABILITY_POSTCOPY_PREEMPT,
+    MIGRATION_CAPABILITY_FAST_SNAPSHOT,
+    MIGRATION_CAPABILITY_MAPPED_RAM,
     MIGRATION_CAPABILITY_LATE_BLOCK_ACTIVATE,
     MIGRATION_CAPABILITY_RETURN_PATH,
     MIGRATION_CAPABILITY_MULTIFD,
+    MIGRATION_CAPABILITY_MULTIFD_ZERO_PAGE,
     MIGRATION_CAPABILITY_PAUSE_BEFORE_SWITCHOVER,
     MIGRATION_CAPABILITY_AUTO_CONVERGE,
+    MIGRATION_CAPABILITY_DIRTY_LIMIT,
     MIGRATION_CAPABILITY_RELEASE_RAM,
     MIGRATION_CAPABILITY_RDMA_PIN_ALL,
     MIGRATION_CAPABILITY_COMPRESS,
@@ -180,7 +188,8 @@ static int migration_maybe_pause(MigrationState *s,
                                  int new_state);
 static void migrate_fd_cancel(MigrationState *s);
 
-static gint page_request_addr_cmp(gconstpointer ap, gconstpointer bp)
+static gint page_request_addr_cmp(gconstpointer ap, gconstpointer bp,
+                                  gpointer opaque)
 {
     uintptr_t a = (uintptr_t) ap, b = (uintptr_t) bp;
 
@@ -189,6 +198,8 @@ static gint page_request_addr_cmp(gconstpointer ap, gconstpointer bp)
 
 void migration_object_init(void)
 {
+    int i;
+
     /* This can only be called once. */
     assert(!current_migration);
     current_migration = MIGRATION_OBJ(object_new(TYPE_MIGRATION));
@@ -206,8 +217,13 @@ void migration_object_init(void)
     qemu_event_init(&current_incoming->main_thread_load_event, false);
     qemu_sem_init(&current_incoming->postcopy_pause_sem_dst, 0);
     qemu_sem_init(&current_incoming->postcopy_pause_sem_fault, 0);
+    for (i = 0; i < POSTCOPY_THREADS_MAX; i++) {
+        qemu_sem_init(&current_incoming->postcopy_preempt[i].file_done, 0);
+    }
     qemu_mutex_init(&current_incoming->page_request_mutex);
-    current_incoming->page_requested = g_tree_new(page_request_addr_cmp);
+    /* The values are the times of the requests, see postcopy-ram.c */
+    current_incoming->page_requested = g_tree_new_full(page_request_addr_cmp,
+                                                       NULL, NULL, g_free);
 
     migration_object_check(current_migration, &error_fatal);
 
@@ -283,6 +299,7 @@ void migration_incoming_transport_cleanup(MigrationIncomingState *mis)
 void migration_incoming_state_destroy(void)
 {
     struct MigrationIncomingState *mis = migration_incoming_get_current();
+    int i;
 
     if (mis->to_src_file) {
         /* Tell source that we are done */
@@ -296,6 +313,15 @@ void migration_incoming_state_destroy(void)
         qemu_fclose(mis->from_src_file);
         mis->from_src_file = NULL;
     }
+    for (i = 0; i < mis->postcopy_preempt_connected; i++) {
+        PostcopyPreemptChannel *chan = &mis->postcopy_preempt[i];
+
+        /* The preempt threads have been joined already */
+        migration_ioc_unregister_yank_from_file(chan->file);
+        qemu_fclose(chan->file);
+        chan->file = NULL;
+    }
+    mis->postcopy_preempt_connected = 0;
     if (mis->postcopy_remote_fds) {
         g_array_free(mis->postcopy_remote_fds, TRUE);
         mis->postcopy_remote_fds = NULL;
@@ -331,16 +357,15 @@ static bool migrate_late_block_activate(void)
 
 /*
  * Send a message on the return channel back to the source
- * of the migration.
+ * of the migration.  Called with rp_mutex held.
  */
-static int migrate_send_rp_message(MigrationIncomingState *mis,
-                                   enum mig_rp_message_type message_type,
-                                   uint16_t len, void *data)
+static int migrate_send_rp_message_locked(MigrationIncomingState *mis,
+                                          enum mig_rp_message_type message_type,
+                                          uint16_t len, void *data)
 {
     int ret = 0;
 
     trace_migrate_send_rp_message((int)message_type, len);
-    QEMU_LOCK_GUARD(&mis->rp_mutex);
 
     /*
      * It's possible that the file handle got lost due to network
@@ -362,6 +387,19 @@ static int migrate_send_rp_message(MigrationIncomingState *mis,
     return ret;
 }
 
+/*
+ * Send a message on the return channel back to the source
+ * of the migration.
+ */
+static int migrate_send_rp_message(MigrationIncomingState *mis,
+                                   enum mig_rp_message_type message_type,
+                                   uint16_t len, void *data)
+{
+    QEMU_LOCK_GUARD(&mis->rp_mutex);
+
+    return migrate_send_rp_message_locked(mis, message_type, len, data);
+}
+
 /* Request one page from the source VM at the given start address.
  *   rb: the RAMBlock to request the page in
  *   Start: Address offset within the RB
@@ -381,10 +419,12 @@ int migrate_send_rp_message_req_pages(MigrationIncomingState *mis,
     *(uint32_t *)(bufc + 8) = cpu_to_be32((uint32_t)len);
 
     /*
-     * We maintain the last ramblock that we requested for page.  Note that we
-     * don't need locking because this function will only be called within the
-     * postcopy ram fault thread.
+     * We maintain the last ramblock that we requested for page.  There can
+     * be several fault threads, so it's protected by rp_mutex: the source
+     * must get the messages in the order last_rb was updated.
      */
+    QEMU_LOCK_GUARD(&mis->rp_mutex);
+
     if (rb != mis->last_rb) {
         mis->last_rb = rb;
 
@@ -401,7 +441,7 @@ int migrate_send_rp_message_req_pages(MigrationIncomingState *mis,
         msg_type = MIG_RP_MSG_REQ_PAGES;
     }
 
-    return migrate_send_rp_message(mis, msg_type, msglen, bufc);
+    return migrate_send_rp_message_locked(mis, msg_type, msglen, bufc);
 }
 
 int migrate_send_rp_req_pages(MigrationIncomingState *mis,
@@ -415,10 +455,13 @@ int migrate_send_rp_req_pages(MigrationIncomingState *mis,
         if (!received && !g_tree_lookup(mis->page_requested, aligned)) {
             /*
              * The page has not been received, and it's not yet in the page
-             * request list.  Queue it.  Set the value of element to 1, so that
-             * things like g_tree_lookup() will return TRUE (1) when found.
+             * request list.  Queue it, with the time of the request as value
+             * so that the fault latency can be accounted when it's placed.
              */
-            g_tree_insert(mis->page_requested, aligned, (gpointer)1);
+            int64_t *req_time = g_new(int64_t, 1);
+
+            *req_time = qemu_clock_get_us(QEMU_CLOCK_REALTIME);
+            g_tree_insert(mis->page_requested, aligned, req_time);
             mis->page_requested_count++;
             trace_postcopy_page_req_add(aligned, mis->page_requested_count);
         }
@@ -469,6 +512,11 @@ static void qemu_start_incoming_migration(const char *uri, Error **errp)
 {
     const char *p = NULL;
 
+    if (migrate_mapped_ram() && !strstart(uri, "file:", NULL)) {
+        error_setg(errp, "mapped-ram requires a file: migration URI");
+        return;
+    }
+
     migrate_protocol_allow_multifd(false); /* reset it anyway */
     qapi_event_send_migration(MIGRATION_STATUS_SETUP);
     if (strstart(uri, "tcp:", &p) ||
@@ -484,6 +532,10 @@ static void qemu_start_incoming_migration(const char *uri, Error **errp)
         exec_start_incoming_migration(p, errp);
     } else if (strstart(uri, "fd:", &p)) {
         fd_start_incoming_migration(p, errp);
+    } else if (strstart(uri, "file:", &p)) {
+        /* Only mapped-ram knows what to do with multifd and a file */
+        migrate_protocol_allow_multifd(migrate_mapped_ram());
+        file_start_incoming_migration(p, errp);
     } else {
         error_setg(errp, "unknown migration protocol: %s", uri);
     }
@@ -724,16 +776,29 @@ void migration_ioc_process_incoming(QIOChannel *ioc, Error **errp)
         /*
          * Common migration only needs one channel, so we can start
          * right now.  Multifd needs more than one channel, we wait.
+         * The postcopy preempt channels are only connected when postcopy
+         * starts, so they're not waited for.
          */
-        start_migration = !migrate_use_multifd();
-    } else {
+        start_migration = !migrate_use_multifd() || migrate_mapped_ram();
+    } else if (migrate_use_multifd() && !multifd_recv_all_channels_created()) {
         /* Multiple connections */
-        assert(migrate_use_multifd());
         start_migration = multifd_recv_new_channel(ioc, &local_err);
         if (local_err) {
             error_propagate(errp, local_err);
             return;
         }
+    } else if (migrate_postcopy_preempt() &&
+               mis->postcopy_preempt_connected < migrate_postcopy_threads()) {
+        /*
+         * The source connects them after all the multifd channels are up,
+         * when postcopy starts
+         */
+        postcopy_preempt_new_channel(mis, qemu_fopen_channel_input(ioc));
+        return;
+    } else {
+        migration_ioc_unregister_yank(ioc);
+        error_setg(errp, "Unexpected extra incoming migration channel");
+        return;
     }
 
     if (start_migration) {
@@ -753,6 +818,10 @@ bool migration_has_all_channels(void)
     bool all_channels;
 
     all_channels = multifd_recv_all_channels_created();
+    if (migrate_postcopy_preempt() &&
+        mis->postcopy_preempt_connected < migrate_postcopy_threads()) {
+        all_channels = false;
+    }
 
     return all_channels && mis->from_src_file != NULL;
 }
@@ -883,6 +952,8 @@ MigrationParameters *qmp_query_migrate_parameters(Error **errp)
     params->has_tls_authz = true;
     params->tls_authz = g_strdup(s->parameters.tls_authz ?
                                  s->parameters.tls_authz : "");
+    params->has_fast_snapshot_file = true;
+    params->fast_snapshot_file = g_strdup(s->parameters.fast_snapshot_file);
     params->has_max_bandwidth = true;
     params->max_bandwidth = s->parameters.max_bandwidth;
     params->has_downtime_limit = true;
@@ -899,6 +970,8 @@ MigrationParameters *qmp_query_migrate_parameters(Error **errp)
     params->multifd_zlib_level = s->parameters.multifd_zlib_level;
     params->has_multifd_zstd_level = true;
     params->multifd_zstd_level = s->parameters.multifd_zstd_level;
+    params->has_postcopy_threads = true;
+    params->postcopy_threads = s->parameters.postcopy_threads;
     params->has_xbzrle_cache_size = true;
     params->xbzrle_cache_size = s->parameters.xbzrle_cache_size;
     params->has_max_postcopy_bandwidth = true;
@@ -1226,6 +1299,72 @@ static bool migrate_caps_check(bool *cap_list,
         }
     }
 
+    if (cap_list[MIGRATION_CAPABILITY_POSTCOPY_PREEMPT]) {
+        if (!cap_list[MIGRATION_CAPABILITY_POSTCOPY_RAM]) {
+            error_setg(errp, "Postcopy preempt requires postcopy-ram");
+            return false;
+        }
+
+        /*
+         * The compression threads load pages in the order of the precopy
+         * stream only
+         */
+        if (cap_list[MIGRATION_CAPABILITY_COMPRESS]) {
+            error_setg(errp, "Postcopy preempt not compatible with compress");
+            return false;
+        }
+    }
+
+    if (cap_list[MIGRATION_CAPABILITY_FAST_SNAPSHOT]) {
+        /* RAM is only written once the VM is stopped */
+        if (cap_list[MIGRATION_CAPABILITY_POSTCOPY_RAM]) {
+            error_setg(errp, "Fast snapshot is not compatible with postcopy");
+            return false;
+        }
+
+        if (cap_list[MIGRATION_CAPABILITY_MULTIFD]) {
+            error_setg(errp, "Fast snapshot is not compatible with multifd");
+            return false;
+        }
+
+        if (cap_list[MIGRATION_CAPABILITY_X_COLO]) {
+            error_setg(errp, "Fast snapshot is not compatible with x-colo");
+            return false;
+        }
+    }
+
+    if (cap_list[MIGRATION_CAPABILITY_MAPPED_RAM]) {
+        MigrationState *s = migrate_get_current();
+
+        /* Each page has a single place in the file, and is stored as is */
+        if (cap_list[MIGRATION_CAPABILITY_XBZRLE] ||
+            cap_list[MIGRATION_CAPABILITY_COMPRESS] ||
+            (cap_list[MIGRATION_CAPABILITY_MULTIFD] &&
+             s->parameters.multifd_compression != MULTIFD_COMPRESSION_NONE)) {
+            error_setg(errp, "mapped-ram is not compatible with compression");
+            return false;
+        }
+
+        if (cap_list[MIGRATION_CAPABILITY_POSTCOPY_RAM]) {
+            error_setg(errp, "mapped-ram is not compatible with postcopy");
+            return false;
+        }
+
+        if (cap_list[MIGRATION_CAPABILITY_FAST_SNAPSHOT] ||
+            cap_list[MIGRATION_CAPABILITY_X_COLO]) {
+            error_setg(errp, "mapped-ram is not compatible with fast-snapshot "
+                       "and x-colo");
+            return false;
+        }
+
+#ifdef CONFIG_LINUX
+        if (cap_list[MIGRATION_CAPABILITY_ZERO_COPY_SEND]) {
+            error_setg(errp, "mapped-ram is not compatible with zero-copy-send");
+            return false;
+        }
+#endif
+    }
+
     if (cap_list[MIGRATION_CAPABILITY_BACKGROUND_SNAPSHOT]) {
         WriteTrackingSupport wt_support;
         int idx;
@@ -1259,6 +1398,39 @@ static bool migrate_caps_check(bool *cap_list,
         }
     }
 
+    if (cap_list[MIGRATION_CAPABILITY_MULTIFD_ZERO_PAGE] &&
+        !cap_list[MIGRATION_CAPABILITY_MULTIFD]) {
+        error_setg(errp, "Multifd zero page detection requires multifd");
+        return false;
+    }
+
+    if (cap_list[MIGRATION_CAPABILITY_DIRTY_LIMIT]) {
+        if (cap_list[MIGRATION_CAPABILITY_AUTO_CONVERGE]) {
+            error_setg(errp, "Dirty limit is not compatible with "
+                       "auto-converge");
+            return false;
+        }
+        if (!kvm_enabled() || !kvm_dirty_ring_enabled()) {
+            error_setg(errp, "Dirty limit requires KVM with the dirty ring "
+                       "enabled");
+            return false;
+        }
+    }
+
+#ifdef CONFIG_LINUX
+    if (cap_list[MIGRATION_CAPABILITY_ZERO_COPY_SEND]) {
+        MigrationState *s = migrate_get_current();
+
+        if (!cap_list[MIGRATION_CAPABILITY_MULTIFD] ||
+            s->parameters.multifd_compression != MULTIFD_COMPRESSION_NONE ||
+            (s->parameters.tls_creds && *s->parameters.tls_creds)) {
+            error_setg(errp, "Zero copy only available for non-compressed "
+                       "non-TLS multifd migration");
+            return false;
+        }
+    }
+#endif
+
     /* incoming side only */
     if (runstate_check(RUN_STATE_INMIGRATE) &&
         !migrate_multifd_is_allowed() &&
@@ -1428,6 +1600,14 @@ static bool migrate_params_check(MigrationParameters *params, Error **errp)
         return false;
     }
 
+    if (params->has_postcopy_threads &&
+        (params->postcopy_threads < 1 ||
+         params->postcopy_threads > POSTCOPY_THREADS_MAX)) {
+        error_setg(errp, QERR_INVALID_PARAMETER_VALUE, "postcopy_threads",
+                   "a value between 1 and " stringify(POSTCOPY_THREADS_MAX));
+        return false;
+    }
+
     if (params->has_xbzrle_cache_size &&
         (params->xbzrle_cache_size < qemu_target_page_size() ||
          !is_power_of_2(params->xbzrle_cache_size))) {
@@ -1482,6 +1662,20 @@ static bool migrate_params_check(MigrationParameters *params, Error **errp)
         return false;
     }
 
+    if (migrate_use_zero_copy_send() &&
+        ((params->has_multifd_compression && params->multifd_compression) ||
+         (params->tls_creds && *params->tls_creds))) {
+        error_setg(errp, "Zero copy only available for non-compressed "
+                   "non-TLS multifd migration");
+        return false;
+    }
+
+    if (migrate_mapped_ram() &&
+        params->has_multifd_compression && params->multifd_compression) {
+        error_setg(errp, "mapped-ram is not compatible with compression");
+        return false;
+    }
+
     return true;
 }
 
@@ -1534,6 +1728,11 @@ static void migrate_params_test_apply(MigrateSetParameters *params,
         dest->tls_hostname = params->tls_hostname->u.s;
     }
 
+    if (params->has_fast_snapshot_file) {
+        assert(params->fast_snapshot_file->type == QTYPE_QSTRING);
+        dest->fast_snapshot_file = params->fast_snapshot_file->u.s;
+    }
+
     if (params->has_max_bandwidth) {
         dest->max_bandwidth = params->max_bandwidth;
     }
@@ -1576,6 +1775,9 @@ static void migrate_params_test_apply(MigrateSetParameters *params,
     if (params->has_announce_step) {
         dest->announce_step = params->announce_step;
     }
+    if (params->has_postcopy_threads) {
+        dest->postcopy_threads = params->postcopy_threads;
+    }
 
     if (params->has_block_bitmap_mapping) {
         dest->has_block_bitmap_mapping = true;
@@ -1639,6 +1841,13 @@ static void migrate_params_apply(MigrateSetParameters *params, Error **errp)
         s->parameters.tls_authz = g_strdup(params->tls_authz->u.s);
     }
 
+    if (params->has_fast_snapshot_file) {
+        g_free(s->parameters.fast_snapshot_file);
+        assert(params->fast_snapshot_file->type == QTYPE_QSTRING);
+        s->parameters.fast_snapshot_file =
+            g_strdup(params->fast_snapshot_file->u.s);
+    }
+
     if (params->has_max_bandwidth) {
         s->parameters.max_bandwidth = params->max_bandwidth;
         if (s->to_dst_file && !migration_in_postcopy()) {
@@ -1693,6 +1902,9 @@ static void migrate_params_apply(MigrateSetParameters *params, Error **errp)
     if (params->has_announce_step) {
         s->parameters.announce_step = params->announce_step;
     }
+    if (params->has_postcopy_threads) {
+        s->parameters.postcopy_threads = params->postcopy_threads;
+    }
 
     if (params->has_block_bitmap_mapping) {
         qapi_free_BitmapMigrationNodeAliasList(
@@ -1723,6 +1935,12 @@ void qmp_migrate_set_parameters(MigrateSetParameters *params, Error **errp)
         params->tls_hostname->type = QTYPE_QSTRING;
         params->tls_hostname->u.s = strdup("");
     }
+    if (params->has_fast_snapshot_file
+        && params->fast_snapshot_file->type == QTYPE_QNULL) {
+        qobject_unref(params->fast_snapshot_file->u.n);
+        params->fast_snapshot_file->type = QTYPE_QSTRING;
+        params->fast_snapshot_file->u.s = strdup("");
+    }
 
     migrate_params_test_apply(params, &tmp);
 
@@ -1833,6 +2051,8 @@ static void migrate_fd_cleanup(MigrationState *s)
          */
         migration_ioc_unregister_yank_from_file(tmp);
         qemu_fclose(tmp);
+
+        postcopy_preempt_close_channels(s);
     }
 
     assert(!migration_is_active(s));
@@ -1898,6 +2118,7 @@ static void migrate_fd_cancel(MigrationState *s)
 {
     int old_state ;
     QEMUFile *f = migrate_get_current()->to_dst_file;
+    int i;
     trace_migrate_fd_cancel();
 
     WITH_QEMU_LOCK_GUARD(&s->qemu_file_lock) {
@@ -1905,6 +2126,10 @@ static void migrate_fd_cancel(MigrationState *s)
             /* shutdown the rp socket, so causing the rp thread to shutdown */
             qemu_file_shutdown(s->rp_state.from_dst_file);
         }
+        /* the migration thread may be blocked sending an urgent page */
+        for (i = 0; i < s->postcopy_qemufile_src_count; i++) {
+            qemu_file_shutdown(s->postcopy_qemufile_src[i]);
+        }
     }
 
     do {
@@ -2307,6 +2532,11 @@ void qmp_migrate(const char *uri, bool has_blk, bool blk,
     MigrationState *s = migrate_get_current();
     const char *p = NULL;
 
+    if (migrate_mapped_ram() && !strstart(uri, "file:", NULL)) {
+        error_setg(errp, "mapped-ram requires a file: migration URI");
+        return;
+    }
+
     if (!migrate_prepare(s, has_blk && blk, has_inc && inc,
                          has_resume && resume, errp)) {
         /* Error detected, put into errp */
@@ -2333,6 +2563,9 @@ void qmp_migrate(const char *uri, bool has_blk, bool blk,
         exec_start_outgoing_migration(s, p, &local_err);
     } else if (strstart(uri, "fd:", &p)) {
         fd_start_outgoing_migration(s, p, &local_err);
+    } else if (strstart(uri, "file:", &p)) {
+        migrate_protocol_allow_multifd(migrate_mapped_ram());
+        file_start_outgoing_migration(s, p, &local_err);
     } else {
         if (!(has_resume && resume)) {
             yank_unregister_instance(MIGRATION_YANK_INSTANCE);
@@ -2421,6 +2654,15 @@ bool migrate_postcopy_blocktime(void)
     return s->enabled_capabilities[MIGRATION_CAPABILITY_POSTCOPY_BLOCKTIME];
 }
 
+bool migrate_postcopy_preempt(void)
+{
+    MigrationState *s;
+
+    s = migrate_get_current();
+
+    return s->enabled_capabilities[MIGRATION_CAPABILITY_POSTCOPY_PREEMPT];
+}
+
 bool migrate_use_compression(void)
 {
     MigrationState *s;
@@ -2511,6 +2753,37 @@ bool migrate_use_multifd(void)
     return s->enabled_capabilities[MIGRATION_CAPABILITY_MULTIFD];
 }
 
+bool migrate_use_multifd_zero_page(void)
+{
+    MigrationState *s;
+
+    s = migrate_get_current();
+
+    return s->enabled_capabilities[MIGRATION_CAPABILITY_MULTIFD_ZERO_PAGE];
+}
+
+bool migrate_use_zero_copy_send(void)
+{
+#ifdef CONFIG_LINUX
+    MigrationState *s;
+
+    s = migrate_get_current();
+
+    return s->enabled_capabilities[MIGRATION_CAPABILITY_ZERO_COPY_SEND];
+#else
+    return false;
+#endif
+}
+
+bool migrate_dirty_limit(void)
+{
+    MigrationState *s;
+
+    s = migrate_get_current();
+
+    return s->enabled_capabilities[MIGRATION_CAPABILITY_DIRTY_LIMIT];
+}
+
 bool migrate_pause_before_switchover(void)
 {
     MigrationState *s;
@@ -2557,6 +2830,15 @@ int migrate_multifd_zstd_level(void)
     return s->parameters.multifd_zstd_level;
 }
 
+int migrate_postcopy_threads(void)
+{
+    MigrationState *s;
+
+    s = migrate_get_current();
+
+    return s->parameters.postcopy_threads;
+}
+
 int migrate_use_xbzrle(void)
 {
     MigrationState *s;
@@ -2620,6 +2902,24 @@ bool migrate_background_snapshot(void)
     return s->enabled_capabilities[MIGRATION_CAPABILITY_BACKGROUND_SNAPSHOT];
 }
 
+bool migrate_fast_snapshot(void)
+{
+    MigrationState *s;
+
+    s = migrate_get_current();
+
+    return s->enabled_capabilities[MIGRATION_CAPABILITY_FAST_SNAPSHOT];
+}
+
+bool migrate_mapped_ram(void)
+{
+    MigrationState *s;
+
+    s = migrate_get_current();
+
+    return s->enabled_capabilities[MIGRATION_CAPABILITY_MAPPED_RAM];
+}
+
 /* migration thread support */
 /*
  * Something bad happened to the RP stream, mark an error
@@ -2959,6 +3259,13 @@ static int postcopy_start(MigrationState *ms)
     int64_t bandwidth = migrate_max_postcopy_bandwidth();
     bool restart_block = false;
     int cur_state = MIGRATION_STATUS_ACTIVE;
+
+    /*
+     * Connect the preempt channel while the guest is still running; it
+     * is only used once the destination starts asking for pages.
+     */
+    postcopy_preempt_setup(ms);
+
     if (!migrate_pause_before_switchover()) {
         migrate_set_state(&ms->state, MIGRATION_STATUS_ACTIVE,
                           MIGRATION_STATUS_POSTCOPY_ACTIVE);
@@ -3404,6 +3711,12 @@ static MigThrError postcopy_pause(MigrationState *s)
         qemu_file_shutdown(file);
         qemu_fclose(file);
 
+        /*
+         * The preempt channel is most likely broken too; after a recovery
+         * the requested pages are sent on the main channel.
+         */
+        postcopy_preempt_close_channels(s);
+
         migrate_set_state(&s->state, s->state,
                           MIGRATION_STATUS_POSTCOPY_PAUSED);
 
@@ -4200,6 +4513,9 @@ static Property migration_properties[] = {
     DEFINE_PROP_UINT8("multifd-zstd-level", MigrationState,
                       parameters.multifd_zstd_level,
                       DEFAULT_MIGRATE_MULTIFD_ZSTD_LEVEL),
+    DEFINE_PROP_UINT8("postcopy-threads", MigrationState,
+                      parameters.postcopy_threads,
+                      DEFAULT_MIGRATE_POSTCOPY_THREADS),
     DEFINE_PROP_SIZE("xbzrle-cache-size", MigrationState,
                       parameters.xbzrle_cache_size,
                       DEFAULT_MIGRATE_XBZRLE_CACHE_SIZE),
@@ -4230,11 +4546,23 @@ static Property migration_properties[] = {
     DEFINE_PROP_MIG_CAP("x-compress", MIGRATION_CAPABILITY_COMPRESS),
     DEFINE_PROP_MIG_CAP("x-events", MIGRATION_CAPABILITY_EVENTS),
     DEFINE_PROP_MIG_CAP("x-postcopy-ram", MIGRATION_CAPABILITY_POSTCOPY_RAM),
+    DEFINE_PROP_MIG_CAP("x-postcopy-preempt",
+                        MIGRATION_CAPABILITY_POSTCOPY_PREEMPT),
+    DEFINE_PROP_MIG_CAP("x-fast-snapshot",
+                        MIGRATION_CAPABILITY_FAST_SNAPSHOT),
+    DEFINE_PROP_MIG_CAP("x-mapped-ram", MIGRATION_CAPABILITY_MAPPED_RAM),
     DEFINE_PROP_MIG_CAP("x-colo", MIGRATION_CAPABILITY_X_COLO),
     DEFINE_PROP_MIG_CAP("x-release-ram", MIGRATION_CAPABILITY_RELEASE_RAM),
     DEFINE_PROP_MIG_CAP("x-block", MIGRATION_CAPABILITY_BLOCK),
     DEFINE_PROP_MIG_CAP("x-return-path", MIGRATION_CAPABILITY_RETURN_PATH),
     DEFINE_PROP_MIG_CAP("x-multifd", MIGRATION_CAPABILITY_MULTIFD),
+    DEFINE_PROP_MIG_CAP("x-multifd-zero-page",
+                        MIGRATION_CAPABILITY_MULTIFD_ZERO_PAGE),
+    DEFINE_PROP_MIG_CAP("x-dirty-limit", MIGRATION_CAPABILITY_DIRTY_LIMIT),
+#ifdef CONFIG_LINUX
+    DEFINE_PROP_MIG_CAP("x-zero-copy-send",
+                        MIGRATION_CAPABILITY_ZERO_COPY_SEND),
+#endif
     DEFINE_PROP_MIG_CAP("x-background-snapshot",
             MIGRATION_CAPABILITY_BACKGROUND_SNAPSHOT),
 
@@ -4258,11 +4586,13 @@ static void migration_instance_finalize(Object *obj)
     qemu_mutex_destroy(&ms->qemu_file_lock);
     g_free(params->tls_hostname);
     g_free(params->tls_creds);
+    g_free(params->fast_snapshot_file);
     qemu_sem_destroy(&ms->wait_unplug_sem);
     qemu_sem_destroy(&ms->rate_limit_sem);
     qemu_sem_destroy(&ms->pause_sem);
     qemu_sem_destroy(&ms->postcopy_pause_sem);
     qemu_sem_destroy(&ms->postcopy_pause_rp_sem);
+    qemu_sem_destroy(&ms->postcopy_qemufile_src_sem);
     qemu_sem_destroy(&ms->rp_state.rp_sem);
     error_free(ms->error);
 }
@@ -4280,6 +4610,7 @@ static void migration_instance_init(Object *obj)
 
     params->tls_hostname = g_strdup("");
     params->tls_creds = g_strdup("");
+    params->fast_snapshot_file = g_strdup("");
 
     /* Set has_* up only for parameter checks */
     params->has_compress_level = true;
@@ -4297,6 +4628,7 @@ static void migration_instance_init(Object *obj)
     params->has_multifd_compression = true;
     params->has_multifd_zlib_level = true;
     params->has_multifd_zstd_level = true;
+    params->has_postcopy_threads = true;
     params->has_xbzrle_cache_size = true;
     params->has_max_postcopy_bandwidth = true;
     params->has_max_cpu_throttle = true;
@@ -4307,6 +4639,7 @@ static void migration_instance_init(Object *obj)
 
     qemu_sem_init(&ms->postcopy_pause_sem, 0);
     qemu_sem_init(&ms->postcopy_pause_rp_sem, 0);
+    qemu_sem_init(&ms->postcopy_qemufile_src_sem, 0);
     qemu_sem_init(&ms->rp_state.rp_sem, 0);
     qemu_sem_init(&ms->rate_limit_sem, 0);
     qemu_sem_init(&ms->wait_unplug_sem, 0);
@@ -45,6 +45,44 @@ struct PostcopyBlocktimeContext;
  */
 #define CLEAR_BITMAP_SHIFT_MAX            31
 
+/*
+ * Maximum of the postcopy-threads parameter: the number of fault threads
+ * on the destination, and of postcopy preempt channels.
+ */
+#define POSTCOPY_THREADS_MAX 8
+
+/*
+ * Postcopy channels: the main migration channel carries the precopy
+ * stream and, without postcopy-preempt, the requested pages too; with
+ * postcopy-preempt, the requested pages use channels of their own, from
+ * RAM_CHANNEL_POSTCOPY on, so that they don't queue up behind the
+ * background stream.
+ */
+enum {
+    RAM_CHANNEL_PRECOPY = 0,
+    RAM_CHANNEL_POSTCOPY = 1,
+    RAM_CHANNEL_MAX = RAM_CHANNEL_POSTCOPY + POSTCOPY_THREADS_MAX,
+};
+
+/* A postcopy preempt channel on the destination, and its loading thread */
+typedef struct {
+    /* Set once the source connected it */
+    QEMUFile *file;
+    /* Posted when file is set, or to give up on it */
+    QemuSemaphore file_done;
+    QemuThread thread;
+    bool thread_created;
+    /* Set to make the thread quit if it never got its channel */
+    bool quit;
+} PostcopyPreemptChannel;
+
+/*
+ * Postcopy page fault latencies are counted in buckets of powers of two
+ * microseconds: bucket N counts faults resolved in [2^N us, 2^(N+1) us),
+ * the last one everything above.
+ */
+#define POSTCOPY_LATENCY_BUCKETS 26
+
 /* This is an abstraction of a "temp huge page" for postcopy's purpose */
 typedef struct {
     /*
@@ -66,8 +104,8 @@ typedef struct {
 /* State for the incoming migration */
 struct MigrationIncomingState {
     QEMUFile *from_src_file;
-    /* Previously received RAM's RAMBlock pointer */
-    RAMBlock *last_recv_block;
+    /* Previously received RAM's RAMBlock pointer, for each channel */
+    RAMBlock *last_recv_block[RAM_CHANNEL_MAX];
     /* A hook to allow cleanup at the end of incoming migration */
     void *transport_data;
     void (*transport_cleanup)(void *data);
@@ -87,8 +125,10 @@ struct MigrationIncomingState {
 
     size_t         largest_page_size;
     bool           have_fault_thread;
-    QemuThread     fault_thread;
-    /* Set this when we want the fault thread to quit */
+    /* The fault threads all read the same userfaultfd */
+    QemuThread     fault_thread[POSTCOPY_THREADS_MAX];
+    int            fault_threads;
+    /* Set this when we want the fault threads to quit */
     bool           fault_thread_quit;
 
     bool           have_listen_thread;
@@ -96,11 +136,14 @@ struct MigrationIncomingState {
 
     /* For the kernel to send us notifications */
     int       userfault_fd;
-    /* To notify the fault_thread to wake, e.g., when need to quit */
+    /*
+     * To notify the fault threads to wake, e.g., when need to quit; it
+     * counts as a semaphore, each wakeup is for all the fault threads
+     */
     int       userfault_event_fd;
     QEMUFile *to_src_file;
     QemuMutex rp_mutex;    /* We send replies from multiple threads */
-    /* RAMBlock of last request sent to source */
+    /* RAMBlock of last request sent to source, protected by rp_mutex */
     RAMBlock *last_rb;
     /*
      * Number of postcopy channels including the default precopy channel, so
@@ -119,6 +162,10 @@ struct MigrationIncomingState {
     PostcopyTmpPage *postcopy_tmp_pages;
     /* This is shared for all postcopy channels */
     void     *postcopy_tmp_zero_page;
+    /* The postcopy preempt channels, postcopy_channels - 1 of them */
+    PostcopyPreemptChannel postcopy_preempt[POSTCOPY_THREADS_MAX];
+    /* Number of postcopy preempt channels connected by the source */
+    int postcopy_preempt_connected;
     /* PostCopyFD's for external userfaultfds & handlers of shared memory */
     GArray   *postcopy_remote_fds;
 
@@ -162,6 +209,15 @@ struct MigrationIncomingState {
      * contains valid information.
      */
     QemuMutex page_request_mutex;
+
+    /*
+     * Latency of the page faults resolved so far, from the request to the
+     * source to the placement of the page, in microseconds.  Protected by
+     * page_request_mutex.
+     */
+    uint64_t postcopy_latency_count;
+    uint64_t postcopy_latency_total;
+    uint64_t postcopy_latency_dist[POSTCOPY_LATENCY_BUCKETS];
 };
 
 MigrationIncomingState *migration_incoming_get_current(void);
@@ -311,6 +367,16 @@ struct MigrationState {
     /* Needed by postcopy-pause state */
     QemuSemaphore postcopy_pause_sem;
     QemuSemaphore postcopy_pause_rp_sem;
+
+    /*
+     * The postcopy preempt channels; written by the migration thread only,
+     * the pointers are protected by qemu_file_lock.
+     */
+    QEMUFile *postcopy_qemufile_src[POSTCOPY_THREADS_MAX];
+    /* Number of channels in postcopy_qemufile_src */
+    int postcopy_qemufile_src_count;
+    /* Posted once the connection of each preempt channel is done */
+    QemuSemaphore postcopy_qemufile_src_sem;
     /*
      * Whether we abort the migration if decompression errors are
      * detected at the destination. It is left at false for qemu
@@ -370,11 +436,15 @@ bool migrate_validate_uuid(void);
 
 bool migrate_auto_converge(void);
 bool migrate_use_multifd(void);
+bool migrate_use_multifd_zero_page(void);
+bool migrate_use_zero_copy_send(void);
+bool migrate_dirty_limit(void);
 bool migrate_pause_before_switchover(void);
 int migrate_multifd_channels(void);
 MultiFDCompression migrate_multifd_compression(void);
 int migrate_multifd_zlib_level(void);
 int migrate_multifd_zstd_level(void);
+int migrate_postcopy_threads(void);
 
 int migrate_use_xbzrle(void);
 uint64_t migrate_xbzrle_cache_size(void);
@@ -394,7 +464,10 @@ int migrate_compress_wait_thread(void);
 int migrate_decompress_threads(void);
 bool migrate_use_events(void);
 bool migrate_postcopy_blocktime(void);
+bool migrate_postcopy_preempt(void);
 bool migrate_background_snapshot(void);
+bool migrate_fast_snapshot(void);
+bool migrate_mapped_ram(void);
 
 /* Sending on the return path - generic and then for each message type */
 void migrate_send_rp_shut(MigrationIncomingState *mis,
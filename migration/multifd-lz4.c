@@ -0,0 +1,367 @@
+/*
+ * Multifd lz4 compression implementation
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or later.
+ * See the COPYING file in the top-level directory.
+ */
+
+#include "qemu/osdep.h"
+#include <lz4.h>
+#include "qemu/bswap.h"
+#include "qemu/rcu.h"
+#include "exec/ramblock.h"
+#include "exec/target_page.h"
+#include "qapi/error.h"
+#include "migration.h"
+#include "trace.h"
+#include "multifd.h"
+
+/*
+ * Each page goes on the wire as a 32-bit big endian length followed by
+ * the data.  A length equal to the page size means that the page is sent
+ * uncompressed.
+ *
+ * Pages are compressed with the data sent before them on the same channel
+ * as dictionary, up to the 64 KiB window of lz4.  To have that history
+ * identical on both sides, it is kept in a private buffer where each
+ * packet's pages are copied right after it:
+ *
+ *   buf: [ ... history | page 0 | page 1 | ... ]
+ *                      ^ LZ4_HISTORY_SIZE
+ *
+ * Once a packet is done, its tail becomes the history for the next one.
+ */
+#define LZ4_HISTORY_SIZE (64 * 1024)
+
+/* A page is only sent compressed if that saves at least 1/8 of it */
+#define LZ4_MIN_SAVING_SHIFT 3
+
+/*
+ * After a packet that compresses poorly, that many packets are sent
+ * uncompressed before trying again; it doubles up to LZ4_MAX_BACKOFF for
+ * each new failure, so that incompressible memory costs little CPU.
+ */
+#define LZ4_MAX_BACKOFF 64
+
+struct lz4_data {
+    /* stream for compression */
+    LZ4_stream_t *stream;
+    /* history and pages of the current packet */
+    uint8_t *buf;
+    /* bytes of history before the current packet */
+    uint32_t history_len;
+    /* compressed buffer */
+    uint8_t *zbuff;
+    /* size of compressed buffer */
+    uint32_t zbuff_len;
+    /* packets to send uncompressed before trying again */
+    uint32_t skip;
+    /* current value for skip after a poor packet */
+    uint32_t backoff;
+};
+
+static struct lz4_data *lz4_data_new(uint32_t zbuff_len)
+{
+    struct lz4_data *z = g_new0(struct lz4_data, 1);
+
+    z->buf = g_try_malloc(LZ4_HISTORY_SIZE + MULTIFD_PACKET_SIZE);
+    z->zbuff_len = zbuff_len;
+    z->zbuff = g_try_malloc(z->zbuff_len);
+    if (!z->buf || !z->zbuff) {
+        g_free(z->buf);
+        g_free(z->zbuff);
+        g_free(z);
+        return NULL;
+    }
+    return z;
+}
+
+static void lz4_data_free(struct lz4_data *z)
+{
+    if (z->stream) {
+        LZ4_freeStream(z->stream);
+    }
+    g_free(z->buf);
+    g_free(z->zbuff);
+    g_free(z);
+}
+
+/* Keep the last LZ4_HISTORY_SIZE bytes in front of the next packet */
+static void lz4_roll_history(struct lz4_data *z, uint32_t packet_len)
+{
+    uint32_t total = z->history_len + packet_len;
+    uint32_t len = MIN(total, LZ4_HISTORY_SIZE);
+
+    memmove(z->buf + LZ4_HISTORY_SIZE - len,
+            z->buf + LZ4_HISTORY_SIZE + packet_len - len, len);
+    z->history_len = len;
+}
+
+/* Multifd lz4 compression */
+
+/**
+ * lz4_send_setup: setup send side
+ *
+ * Setup each channel with lz4 compression.
+ *
+ * Returns 0 for success or -1 for error
+ *
+ * @p: Params for the channel that we are using
+ * @errp: pointer to an error
+ */
+static int lz4_send_setup(MultiFDSendParams *p, Error **errp)
+{
+    uint32_t page_count = MULTIFD_PACKET_SIZE / qemu_target_page_size();
+    struct lz4_data *z;
+
+    /* Worst case every page is sent uncompressed */
+    z = lz4_data_new(page_count * (sizeof(uint32_t) +
+                                   LZ4_compressBound(qemu_target_page_size())));
+    if (!z) {
+        error_setg(errp, "multifd %u: out of memory for lz4", p->id);
+        return -1;
+    }
+
+    z->stream = LZ4_createStream();
+    if (!z->stream) {
+        lz4_data_free(z);
+        error_setg(errp, "multifd %u: lz4 createStream failed", p->id);
+        return -1;
+    }
+    p->data = z;
+    return 0;
+}
+
+/**
+ * lz4_send_cleanup: cleanup send side
+ *
+ * Close the channel and return memory.
+ *
+ * @p: Params for the channel that we are using
+ * @errp: pointer to an error
+ */
+static void lz4_send_cleanup(MultiFDSendParams *p, Error **errp)
+{
+    lz4_data_free(p->data);
+    p->data = NULL;
+}
+
+/**
+ * lz4_send_prepare: prepare date to be able to send
+ *
+ * Create a buffer with all the pages that we are going to send, each of
+ * them compressed unless that does not save enough.
+ *
+ * Returns 0 for success or -1 for error
+ *
+ * @p: Params for the channel that we are using
+ * @errp: pointer to an error
+ */
+static int lz4_send_prepare(MultiFDSendParams *p, Error **errp)
+{
+    struct lz4_data *z = p->data;
+    size_t page_size = qemu_target_page_size();
+    int max_len = page_size - (page_size >> LZ4_MIN_SAVING_SHIFT);
+    int bound = LZ4_compressBound(page_size);
+    uint8_t *pages = z->buf + LZ4_HISTORY_SIZE;
+    bool compress = !z->skip;
+    uint32_t out = 0;
+    uint32_t i;
+
+    /*
+     * Compress from a copy, the guest may change the pages while they are
+     * being compressed and the history must match what the destination
+     * gets.
+     */
+    for (i = 0; i < p->normal_num; i++) {
+        memcpy(pages + i * page_size, p->pages->block->host + p->normal[i],
+               page_size);
+    }
+
+    if (compress) {
+        LZ4_resetStream_fast(z->stream);
+        LZ4_loadDict(z->stream,
+                     (const char *)z->buf + LZ4_HISTORY_SIZE - z->history_len,
+                     z->history_len);
+    } else {
+        z->skip--;
+    }
+
+    for (i = 0; i < p->normal_num; i++) {
+        uint8_t *src = pages + i * page_size;
+        uint8_t *dst = z->zbuff + out + sizeof(uint32_t);
+        int len = 0;
+
+        /*
+         * Every page of the packet goes through the stream, even if it is
+         * then sent uncompressed, so that the history stays contiguous.
+         */
+        if (compress) {
+            len = LZ4_compress_fast_continue(z->stream, (const char *)src,
+                                             (char *)dst, page_size, bound, 1);
+        }
+        if (len <= 0 || len > max_len) {
+            memcpy(dst, src, page_size);
+            len = page_size;
+        }
+        stl_be_p(z->zbuff + out, len);
+        out += sizeof(uint32_t) + len;
+    }
+
+    if (compress) {
+        if (out > p->normal_num * (sizeof(uint32_t) + max_len)) {
+            z->backoff = MIN(MAX(z->backoff * 2, 1), LZ4_MAX_BACKOFF);
+            z->skip = z->backoff;
+            trace_multifd_lz4_backoff(p->id, z->backoff);
+        } else {
+            z->backoff = 0;
+        }
+    }
+
+    lz4_roll_history(z, p->normal_num * page_size);
+
+    p->iov[p->iovs_num].iov_base = z->zbuff;
+    p->iov[p->iovs_num].iov_len = out;
+    p->iovs_num++;
+    p->next_packet_size = out;
+    p->flags |= MULTIFD_FLAG_LZ4;
+
+    return 0;
+}
+
+/**
+ * lz4_recv_setup: setup receive side
+ *
+ * Create the buffers.
+ *
+ * Returns 0 for success or -1 for error
+ *
+ * @p: Params for the channel that we are using
+ * @errp: pointer to an error
+ */
+static int lz4_recv_setup(MultiFDRecvParams *p, Error **errp)
+{
+    uint32_t page_count = MULTIFD_PACKET_SIZE / qemu_target_page_size();
+    struct lz4_data *z;
+
+    z = lz4_data_new(page_count * (sizeof(uint32_t) +
+                                   qemu_target_page_size()));
+    if (!z) {
+        error_setg(errp, "multifd %u: out of memory for lz4", p->id);
+        return -1;
+    }
+    p->data = z;
+    return 0;
+}
+
+/**
+ * lz4_recv_cleanup: cleanup receive side
+ *
+ * Return memory.
+ *
+ * @p: Params for the channel that we are using
+ */
+static void lz4_recv_cleanup(MultiFDRecvParams *p)
+{
+    lz4_data_free(p->data);
+    p->data = NULL;
+}
+
+/**
+ * lz4_recv_pages: read the data from the channel into actual pages
+ *
+ * Read the buffer, and uncompress each page in it into the actual pages.
+ *
+ * Returns 0 for success or -1 for error
+ *
+ * @p: Params for the channel that we are using
+ * @errp: pointer to an error
+ */
+static int lz4_recv_pages(MultiFDRecvParams *p, Error **errp)
+{
+    uint32_t in_size = p->next_packet_size;
+    uint32_t flags = p->flags & MULTIFD_FLAG_COMPRESSION_MASK;
+    size_t page_size = qemu_target_page_size();
+    struct lz4_data *z = p->data;
+    uint8_t *pages = z->buf + LZ4_HISTORY_SIZE;
+    uint32_t in = 0;
+    uint32_t i;
+    int ret;
+
+    if (flags != MULTIFD_FLAG_LZ4) {
+        error_setg(errp, "multifd %u: flags received %x flags expected %x",
+                   p->id, flags, MULTIFD_FLAG_LZ4);
+        return -1;
+    }
+    if (in_size > z->zbuff_len) {
+        error_setg(errp, "multifd %u: packet size received %u max size %u",
+                   p->id, in_size, z->zbuff_len);
+        return -1;
+    }
+
+    ret = qio_channel_read_all(p->c, (void *)z->zbuff, in_size, errp);
+    if (ret != 0) {
+        return ret;
+    }
+
+    for (i = 0; i < p->normal_num; i++) {
+        uint8_t *dst = pages + i * page_size;
+        uint32_t len;
+
+        if (in_size - in < sizeof(uint32_t)) {
+            break;
+        }
+        len = ldl_be_p(z->zbuff + in);
+        in += sizeof(uint32_t);
+        if (len > page_size || len > in_size - in) {
+            break;
+        }
+
+        if (len == page_size) {
+            memcpy(dst, z->zbuff + in, page_size);
+        } else {
+            /* The history and the previous pages end right before dst */
+            uint32_t dict_len = MIN(z->history_len + i * page_size,
+                                    LZ4_HISTORY_SIZE);
+
+            ret = LZ4_decompress_safe_usingDict((const char *)z->zbuff + in,
+                                                (char *)dst, len, page_size,
+                                                (const char *)dst - dict_len,
+                                                dict_len);
+            if (ret != page_size) {
+                error_setg(errp, "multifd %u: lz4 decompression of page %u "
+                           "failed (%d)", p->id, i, ret);
+                return -1;
+            }
+        }
+        in += len;
+    }
+    if (i != p->normal_num || in != in_size) {
+        error_setg(errp, "multifd %u: malformed lz4 packet of size %u",
+                   p->id, in_size);
+        return -1;
+    }
+
+    for (i = 0; i < p->normal_num; i++) {
+        memcpy(p->host + p->normal[i], pages + i * page_size, page_size);
+    }
+    lz4_roll_history(z, p->normal_num * page_size);
+
+    return 0;
+}
+
+static MultiFDMethods multifd_lz4_ops = {
+    .send_setup = lz4_send_setup,
+    .send_cleanup = lz4_send_cleanup,
+    .send_prepare = lz4_send_prepare,
+    .recv_setup = lz4_recv_setup,
+    .recv_cleanup = lz4_recv_cleanup,
+    .recv_pages = lz4_recv_pages
+};
+
+static void multifd_lz4_register(void)
+{
+    multifd_register_ops(MULTIFD_COMPRESSION_LZ4, &multifd_lz4_ops);
+}
+
+migration_init(multifd_lz4_register);
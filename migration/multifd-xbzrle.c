@@ -0,0 +1,407 @@
+/*
+ * Multifd XBZRLE delta encoding implementation
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or later.
+ * See the COPYING file in the top-level directory.
+ */
+
+#include "qemu/osdep.h"
+#include "qemu/bswap.h"
+#include "qemu/host-utils.h"
+#include "qemu/rcu.h"
+#include "exec/ramblock.h"
+#include "exec/target_page.h"
+#include "qapi/error.h"
+#include "migration.h"
+#include "ram.h"
+#include "page_cache.h"
+#include "xbzrle.h"
+#include "trace.h"
+#include "multifd.h"
+
+/*
+ * Each page goes on the wire as a 32-bit big endian length followed by
+ * the data.  A length equal to the page size means that the page is sent
+ * as is, any other length is an XBZRLE delta against the previous
+ * contents of the page on the destination, 0 meaning unchanged.
+ *
+ * Deltas are computed against a cache of the pages as last sent.  The
+ * cache is split in one shard per channel, each with its own lock; a page
+ * always lives in the same shard, whichever channel sends it, so the
+ * cached copy is always the one the destination has.
+ */
+
+typedef struct {
+    QemuMutex lock;
+    PageCache *cache;
+} XBZRLEShard;
+
+static struct {
+    XBZRLEShard *shards;
+    int num_shards;
+    /* channels using the shards */
+    int users;
+    uint8_t *zero_page;
+} *multifd_xbzrle;
+
+struct xbzrle_data {
+    /* copy of the page being encoded */
+    uint8_t *current_buf;
+    /* output buffer */
+    uint8_t *zbuff;
+    /* size of output buffer */
+    uint32_t zbuff_len;
+};
+
+/*
+ * Pages are spread over the shards by page number; within its shard a
+ * page is cached under its index there, so that the whole shard is used.
+ */
+static XBZRLEShard *xbzrle_shard(ram_addr_t addr, uint64_t *key)
+{
+    int bits = qemu_target_page_bits();
+    uint64_t page = addr >> bits;
+
+    *key = (page / multifd_xbzrle->num_shards) << bits;
+    return &multifd_xbzrle->shards[page % multifd_xbzrle->num_shards];
+}
+
+static void xbzrle_shards_cleanup(void)
+{
+    int i;
+
+    if (--multifd_xbzrle->users) {
+        return;
+    }
+    for (i = 0; i < multifd_xbzrle->num_shards; i++) {
+        cache_fini(multifd_xbzrle->shards[i].cache);
+        qemu_mutex_destroy(&multifd_xbzrle->shards[i].lock);
+    }
+    g_free(multifd_xbzrle->shards);
+    g_free(multifd_xbzrle->zero_page);
+    g_free(multifd_xbzrle);
+    multifd_xbzrle = NULL;
+}
+
+static int xbzrle_shards_init(Error **errp)
+{
+    int num_shards = migrate_multifd_channels();
+    size_t page_size = qemu_target_page_size();
+    uint64_t shard_pages = migrate_xbzrle_cache_size() / num_shards / page_size;
+    int i;
+
+    if (multifd_xbzrle) {
+        multifd_xbzrle->users++;
+        return 0;
+    }
+
+    multifd_xbzrle = g_new0(typeof(*multifd_xbzrle), 1);
+    multifd_xbzrle->shards = g_new0(XBZRLEShard, num_shards);
+    multifd_xbzrle->zero_page = g_malloc0(page_size);
+    multifd_xbzrle->users = 1;
+
+    for (i = 0; i < num_shards; i++) {
+        XBZRLEShard *shard = &multifd_xbzrle->shards[i];
+
+        /* The cache wants a power of two number of pages */
+        shard->cache = cache_init(pow2floor(shard_pages) * page_size,
+                                  page_size, errp);
+        if (!shard->cache) {
+            break;
+        }
+        qemu_mutex_init(&shard->lock);
+        multifd_xbzrle->num_shards++;
+    }
+
+    if (multifd_xbzrle->num_shards < num_shards) {
+        xbzrle_shards_cleanup();
+        return -1;
+    }
+    return 0;
+}
+
+/**
+ * multifd_xbzrle_cache_zero_page: record that a page was sent as zero
+ *
+ * Pages sent as zero pages do not go through the XBZRLE method, but the
+ * cache must still match what the destination has.
+ *
+ * @addr: ram address of the page
+ */
+void multifd_xbzrle_cache_zero_page(ram_addr_t addr)
+{
+    XBZRLEShard *shard;
+    uint64_t key;
+
+    if (!multifd_xbzrle) {
+        return;
+    }
+
+    shard = xbzrle_shard(addr, &key);
+    qemu_mutex_lock(&shard->lock);
+    /* We don't care if this fails as long as it updated an old entry */
+    cache_insert(shard->cache, key, multifd_xbzrle->zero_page,
+                 ram_counters.dirty_sync_count);
+    qemu_mutex_unlock(&shard->lock);
+}
+
+/* Multifd xbzrle encoding */
+
+/**
+ * xbzrle_send_setup: setup send side
+ *
+ * Setup the page cache shards and the channel buffers.
+ *
+ * Returns 0 for success or -1 for error
+ *
+ * @p: Params for the channel that we are using
+ * @errp: pointer to an error
+ */
+static int xbzrle_send_setup(MultiFDSendParams *p, Error **errp)
+{
+    uint32_t page_count = MULTIFD_PACKET_SIZE / qemu_target_page_size();
+    size_t page_size = qemu_target_page_size();
+    struct xbzrle_data *z;
+
+    if (xbzrle_shards_init(errp) < 0) {
+        return -1;
+    }
+
+    z = g_new0(struct xbzrle_data, 1);
+    z->current_buf = g_malloc(page_size);
+    /* Worst case every page is sent as is */
+    z->zbuff_len = page_count * (sizeof(uint32_t) + page_size);
+    z->zbuff = g_try_malloc(z->zbuff_len);
+    if (!z->zbuff) {
+        g_free(z->current_buf);
+        g_free(z);
+        xbzrle_shards_cleanup();
+        error_setg(errp, "multifd %u: out of memory for zbuff", p->id);
+        return -1;
+    }
+    p->data = z;
+    return 0;
+}
+
+/**
+ * xbzrle_send_cleanup: cleanup send side
+ *
+ * Return memory.
+ *
+ * @p: Params for the channel that we are using
+ * @errp: pointer to an error
+ */
+static void xbzrle_send_cleanup(MultiFDSendParams *p, Error **errp)
+{
+    struct xbzrle_data *z = p->data;
+
+    g_free(z->current_buf);
+    g_free(z->zbuff);
+    g_free(p->data);
+    p->data = NULL;
+    xbzrle_shards_cleanup();
+}
+
+/*
+ * Write page @offset of @block to @out, as a delta if it is cached.
+ * Returns the number of bytes written.
+ */
+static uint32_t xbzrle_encode_page(struct xbzrle_data *z, RAMBlock *block,
+                                   ram_addr_t offset, uint8_t *out)
+{
+    size_t page_size = qemu_target_page_size();
+    uint64_t age = ram_counters.dirty_sync_count;
+    uint64_t key;
+    XBZRLEShard *shard = xbzrle_shard(block->offset + offset, &key);
+    uint8_t *data = out + sizeof(uint32_t);
+    int len = -1;
+
+    /* The guest may change the page, encode and send a stable copy */
+    memcpy(z->current_buf, block->host + offset, page_size);
+
+    /*
+     * Like the single stream XBZRLE, don't fill the cache during the first
+     * pass where every page is sent once.
+     */
+    if (age > 1) {
+        qemu_mutex_lock(&shard->lock);
+        if (cache_is_cached(shard->cache, key, age)) {
+            uint8_t *cached = get_cached_data(shard->cache, key);
+
+            len = xbzrle_encode_buffer(cached, z->current_buf, page_size,
+                                       data, page_size - 1);
+            if (len != 0) {
+                memcpy(cached, z->current_buf, page_size);
+            }
+        } else {
+            cache_insert(shard->cache, key, z->current_buf, age);
+        }
+        qemu_mutex_unlock(&shard->lock);
+    }
+
+    if (len < 0) {
+        memcpy(data, z->current_buf, page_size);
+        len = page_size;
+    }
+    stl_be_p(out, len);
+    return sizeof(uint32_t) + len;
+}
+
+/**
+ * xbzrle_send_prepare: prepare date to be able to send
+ *
+ * Create a buffer with all the pages that we are going to send, as
+ * deltas against the cache where possible.
+ *
+ * Returns 0 for success or -1 for error
+ *
+ * @p: Params for the channel that we are using
+ * @errp: pointer to an error
+ */
+static int xbzrle_send_prepare(MultiFDSendParams *p, Error **errp)
+{
+    struct xbzrle_data *z = p->data;
+    uint32_t out = 0;
+    uint32_t i;
+
+    for (i = 0; i < p->normal_num; i++) {
+        out += xbzrle_encode_page(z, p->pages->block, p->normal[i],
+                                  z->zbuff + out);
+    }
+
+    p->iov[p->iovs_num].iov_base = z->zbuff;
+    p->iov[p->iovs_num].iov_len = out;
+    p->iovs_num++;
+    p->next_packet_size = out;
+    p->flags |= MULTIFD_FLAG_XBZRLE;
+
+    return 0;
+}
+
+/**
+ * xbzrle_recv_setup: setup receive side
+ *
+ * Create the receive buffer.  The destination needs no cache, deltas
+ * apply to the pages as they are.
+ *
+ * Returns 0 for success or -1 for error
+ *
+ * @p: Params for the channel that we are using
+ * @errp: pointer to an error
+ */
+static int xbzrle_recv_setup(MultiFDRecvParams *p, Error **errp)
+{
+    uint32_t page_count = MULTIFD_PACKET_SIZE / qemu_target_page_size();
+    struct xbzrle_data *z = g_new0(struct xbzrle_data, 1);
+
+    z->zbuff_len = page_count * (sizeof(uint32_t) + qemu_target_page_size());
+    z->zbuff = g_try_malloc(z->zbuff_len);
+    if (!z->zbuff) {
+        g_free(z);
+        error_setg(errp, "multifd %u: out of memory for zbuff", p->id);
+        return -1;
+    }
+    p->data = z;
+    return 0;
+}
+
+/**
+ * xbzrle_recv_cleanup: cleanup receive side
+ *
+ * Return memory.
+ *
+ * @p: Params for the channel that we are using
+ */
+static void xbzrle_recv_cleanup(MultiFDRecvParams *p)
+{
+    struct xbzrle_data *z = p->data;
+
+    g_free(z->zbuff);
+    g_free(p->data);
+    p->data = NULL;
+}
+
+/**
+ * xbzrle_recv_pages: read the data from the channel into actual pages
+ *
+ * Read the buffer, and apply each page or delta in it to the actual
+ * pages.
+ *
+ * Returns 0 for success or -1 for error
+ *
+ * @p: Params for the channel that we are using
+ * @errp: pointer to an error
+ */
+static int xbzrle_recv_pages(MultiFDRecvParams *p, Error **errp)
+{
+    uint32_t in_size = p->next_packet_size;
+    uint32_t flags = p->flags & MULTIFD_FLAG_COMPRESSION_MASK;
+    size_t page_size = qemu_target_page_size();
+    struct xbzrle_data *z = p->data;
+    uint32_t in = 0;
+    uint32_t i;
+    int ret;
+
+    if (flags != MULTIFD_FLAG_XBZRLE) {
+        error_setg(errp, "multifd %u: flags received %x flags expected %x",
+                   p->id, flags, MULTIFD_FLAG_XBZRLE);
+        return -1;
+    }
+    if (in_size > z->zbuff_len) {
+        error_setg(errp, "multifd %u: packet size received %u max size %u",
+                   p->id, in_size, z->zbuff_len);
+        return -1;
+    }
+
+    ret = qio_channel_read_all(p->c, (void *)z->zbuff, in_size, errp);
+    if (ret != 0) {
+        return ret;
+    }
+
+    for (i = 0; i < p->normal_num; i++) {
+        uint8_t *dst = p->host + p->normal[i];
+        uint32_t len;
+
+        if (in_size - in < sizeof(uint32_t)) {
+            break;
+        }
+        len = ldl_be_p(z->zbuff + in);
+        in += sizeof(uint32_t);
+        if (len > page_size || len > in_size - in) {
+            break;
+        }
+
+        if (len == page_size) {
+            memcpy(dst, z->zbuff + in, page_size);
+        } else if (len &&
+                   xbzrle_decode_buffer(z->zbuff + in, len, dst,
+                                        page_size) < 0) {
+            error_setg(errp, "multifd %u: failed to decode XBZRLE page %u",
+                       p->id, i);
+            return -1;
+        }
+        in += len;
+    }
+    if (i != p->normal_num || in != in_size) {
+        error_setg(errp, "multifd %u: malformed XBZRLE packet of size %u",
+                   p->id, in_size);
+        return -1;
+    }
+    return 0;
+}
+
+static MultiFDMethods multifd_xbzrle_ops = {
+    .send_setup = xbzrle_send_setup,
+    .send_cleanup = xbzrle_send_cleanup,
+    .send_prepare = xbzrle_send_prepare,
+    .recv_setup = xbzrle_recv_setup,
+    .recv_cleanup = xbzrle_recv_cleanup,
+    .recv_pages = xbzrle_recv_pages
+};
+
+static void multifd_xbzrle_register(void)
+{
+    multifd_register_ops(MULTIFD_COMPRESSION_XBZRLE, &multifd_xbzrle_ops);
+}
+
+migration_init(multifd_xbzrle_register);
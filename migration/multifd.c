@@ -12,6 +12,8 @@
 
 #include "qemu/osdep.h"
 #include "qemu/rcu.h"
+#include "qemu/cutils.h"
+#include "qemu/bitmap.h"
 #include "exec/target_page.h"
 #include "sysemu/sysemu.h"
 #include "exec/ramblock.h"
@@ -20,6 +22,7 @@
 #include "ram.h"
 #include "migration.h"
 #include "socket.h"
+#include "file.h"
 #include "tls.h"
 #include "qemu-file.h"
 #include "trace.h"
@@ -27,12 +30,15 @@
 
 #include "qemu/yank.h"
 #include "io/channel-socket.h"
+#include "io/channel-file.h"
 #include "yank_functions.h"
 
 /* Multiple fd's */
 
 #define MULTIFD_MAGIC 0x11223344U
 #define MULTIFD_VERSION 1
+/* Packets carry a list of zero pages, see multifd-zero-page */
+#define MULTIFD_VERSION_ZERO_PAGE 2
 
 typedef struct {
     uint32_t magic;
@@ -172,13 +178,24 @@ void multifd_register_ops(int method, MultiFDMethods *ops)
     multifd_ops[method] = ops;
 }
 
+/*
+ * Both sides must agree on multifd-zero-page: a destination that does not
+ * expect the zero page list would misparse the packets, so the version
+ * tells them apart and a mismatch fails the migration.
+ */
+static uint32_t multifd_version(void)
+{
+    return migrate_use_multifd_zero_page() ? MULTIFD_VERSION_ZERO_PAGE
+                                           : MULTIFD_VERSION;
+}
+
 static int multifd_send_initial_packet(MultiFDSendParams *p, Error **errp)
 {
     MultiFDInit_t msg = {};
     int ret;
 
     msg.magic = cpu_to_be32(MULTIFD_MAGIC);
-    msg.version = cpu_to_be32(MULTIFD_VERSION);
+    msg.version = cpu_to_be32(multifd_version());
     msg.id = p->id;
     memcpy(msg.uuid, &qemu_uuid.data, sizeof(msg.uuid));
 
@@ -208,9 +225,9 @@ static int multifd_recv_initial_packet(QIOChannel *c, Error **errp)
         return -1;
     }
 
-    if (msg.version != MULTIFD_VERSION) {
+    if (msg.version != multifd_version()) {
         error_setg(errp, "multifd: received packet version %u "
-                   "expected %u", msg.version, MULTIFD_VERSION);
+                   "expected %u", msg.version, multifd_version());
         return -1;
     }
 
@@ -226,8 +243,9 @@ static int multifd_recv_initial_packet(QIOChannel *c, Error **errp)
     }
 
     if (msg.id > migrate_multifd_channels()) {
-        error_setg(errp, "multifd: received channel version %u "
-                   "expected %u", msg.version, MULTIFD_VERSION);
+        error_setg(errp, "multifd: received channel id %u is greater "
+                   "than number of channels %u", msg.id,
+                   migrate_multifd_channels());
         return -1;
     }
 
@@ -265,6 +283,7 @@ static void multifd_send_fill_packet(MultiFDSendParams *p)
     packet->normal_pages = cpu_to_be32(p->normal_num);
     packet->next_packet_size = cpu_to_be32(p->next_packet_size);
     packet->packet_num = cpu_to_be64(p->packet_num);
+    packet->zero_pages = cpu_to_be32(p->zero_num);
 
     if (p->pages->block) {
         strncpy(packet->ramblock, p->pages->block->idstr, 256);
@@ -276,6 +295,12 @@ static void multifd_send_fill_packet(MultiFDSendParams *p)
 
         packet->offset[i] = cpu_to_be64(temp);
     }
+
+    for (i = 0; i < p->zero_num; i++) {
+        uint64_t temp = p->zero[i];
+
+        packet->offset[p->normal_num + i] = cpu_to_be64(temp);
+    }
 }
 
 static int multifd_recv_unfill_packet(MultiFDRecvParams *p, Error **errp)
@@ -295,10 +320,10 @@ static int multifd_recv_unfill_packet(MultiFDRecvParams *p, Error **errp)
     }
 
     packet->version = be32_to_cpu(packet->version);
-    if (packet->version != MULTIFD_VERSION) {
+    if (packet->version != multifd_version()) {
         error_setg(errp, "multifd: received packet "
                    "version %u and expected version %u",
-                   packet->version, MULTIFD_VERSION);
+                   packet->version, multifd_version());
         return -1;
     }
 
@@ -324,10 +349,23 @@ static int multifd_recv_unfill_packet(MultiFDRecvParams *p, Error **errp)
         return -1;
     }
 
+    p->zero_num = be32_to_cpu(packet->zero_pages);
+    if (p->zero_num && packet->version == MULTIFD_VERSION) {
+        error_setg(errp, "multifd: received %u zero pages without "
+                   "multifd-zero-page", p->zero_num);
+        return -1;
+    }
+    if (p->zero_num > packet->pages_alloc - p->normal_num) {
+        error_setg(errp, "multifd: received packet "
+                   "with %u zero pages and expected maximum pages are %u",
+                   p->zero_num, packet->pages_alloc - p->normal_num) ;
+        return -1;
+    }
+
     p->next_packet_size = be32_to_cpu(packet->next_packet_size);
     p->packet_num = be64_to_cpu(packet->packet_num);
 
-    if (p->normal_num == 0) {
+    if (p->normal_num == 0 && p->zero_num == 0) {
         return 0;
     }
 
@@ -353,6 +391,18 @@ static int multifd_recv_unfill_packet(MultiFDRecvParams *p, Error **errp)
         p->normal[i] = offset;
     }
 
+    for (i = 0; i < p->zero_num; i++) {
+        uint64_t offset = be64_to_cpu(packet->offset[p->normal_num + i]);
+
+        if (offset > (block->used_length - page_size)) {
+            error_setg(errp, "multifd: offset too long %" PRIu64
+                       " (max " RAM_ADDR_FMT ")",
+                       offset, block->used_length);
+            return -1;
+        }
+        p->zero[i] = offset;
+    }
+
     return 0;
 }
 
@@ -392,6 +442,28 @@ struct {
  * false.
  */
 
+/*
+ * Pages are accounted as sent when they are queued, give back the ones
+ * that the channel found to be zero pages and did not send.
+ *
+ * Called with p->mutex held.
+ */
+static void multifd_send_account_zero_pages(QEMUFile *f, MultiFDSendParams *p)
+{
+    uint64_t bytes = p->zero_pages_pending * qemu_target_page_size();
+
+    if (!p->zero_pages_pending) {
+        return;
+    }
+
+    qemu_file_update_transfer(f, -bytes);
+    ram_counters.multifd_bytes -= bytes;
+    ram_counters.transferred -= bytes;
+    ram_counters.normal -= p->zero_pages_pending;
+    ram_counters.duplicate += p->zero_pages_pending;
+    p->zero_pages_pending = 0;
+}
+
 static int multifd_send_pages(QEMUFile *f)
 {
     int i;
@@ -438,6 +510,7 @@ static int multifd_send_pages(QEMUFile *f)
     qemu_file_update_transfer(f, transferred);
     ram_counters.multifd_bytes += transferred;
     ram_counters.transferred += transferred;
+    multifd_send_account_zero_pages(f, p);
     qemu_mutex_unlock(&p->mutex);
     qemu_sem_post(&p->sem);
 
@@ -553,6 +626,8 @@ void multifd_save_cleanup(void)
         p->iov = NULL;
         g_free(p->normal);
         p->normal = NULL;
+        g_free(p->zero);
+        p->zero = NULL;
         multifd_send_state->ops->send_cleanup(p, &local_err);
         if (local_err) {
             migrate_set_error(migrate_get_current(), local_err);
@@ -570,6 +645,7 @@ void multifd_save_cleanup(void)
 
 void multifd_send_sync_main(QEMUFile *f)
 {
+    bool flush_zero_copy = migrate_use_zero_copy_send();
     int i;
 
     if (!migrate_use_multifd()) {
@@ -608,25 +684,112 @@ void multifd_send_sync_main(QEMUFile *f)
 
         trace_multifd_send_sync_main_wait(p->id);
         qemu_sem_wait(&p->sem_sync);
+
+        /*
+         * Wait for the kernel to be done with the pages sent so far: that
+         * bounds how much memory it keeps locked, reports errors of the
+         * zero copy sends, and after the last sync nothing references
+         * guest memory anymore.
+         */
+        if (flush_zero_copy && p->c) {
+            Error *err = NULL;
+
+            if (qio_channel_flush(p->c, &err) < 0) {
+                multifd_send_terminate_threads(err);
+                error_free(err);
+                return;
+            }
+        }
+
+        qemu_mutex_lock(&p->mutex);
+        multifd_send_account_zero_pages(f, p);
+        qemu_mutex_unlock(&p->mutex);
     }
     trace_multifd_send_sync_main(multifd_send_state->packet_num);
 }
 
+/*
+ * With mapped-ram, the channels write the pages at their place in the
+ * migration file instead of sending packets, and drop the zero pages from
+ * the bitmap of the pages that are in the file.
+ */
+static int multifd_file_write_pages(MultiFDSendParams *p, RAMBlock *block,
+                                    Error **errp)
+{
+    size_t page_size = qemu_target_page_size();
+    int fd = QIO_CHANNEL_FILE(p->c)->fd;
+    uint32_t i;
+
+    for (i = 0; i < p->zero_num; i++) {
+        clear_bit_atomic(p->zero[i] / page_size, block->file_bmap);
+    }
+
+    for (i = 0; i < p->normal_num; i++) {
+        ram_addr_t offset = p->normal[i];
+        uint8_t *buf = block->host + offset;
+        size_t len = page_size;
+        uint64_t pos = block->pages_offset + offset;
+
+        /* Consecutive pages are written at once */
+        while (i + 1 < p->normal_num && p->normal[i + 1] == offset + len) {
+            len += page_size;
+            i++;
+        }
+        bitmap_set_atomic(block->file_bmap, offset / page_size,
+                          len / page_size);
+
+        while (len) {
+            ssize_t ret = pwrite(fd, buf, len, pos);
+
+            if (ret < 0) {
+                if (errno == EINTR) {
+                    continue;
+                }
+                error_setg_errno(errp, errno, "multifd %u: failed to write "
+                                 "pages", p->id);
+                return -1;
+            }
+            buf += ret;
+            len -= ret;
+            pos += ret;
+        }
+    }
+    return 0;
+}
+
 static void *multifd_send_thread(void *opaque)
 {
     MultiFDSendParams *p = opaque;
+    size_t page_size = qemu_target_page_size();
+    bool detect_zero = migrate_use_multifd_zero_page();
+    bool use_zero_copy_send = migrate_use_zero_copy_send();
+    bool use_file = migrate_mapped_ram();
+    int write_flags = 0;
     Error *local_err = NULL;
     int ret = 0;
 
     trace_multifd_send_thread_start(p->id);
     rcu_register_thread();
 
-    if (multifd_send_initial_packet(p, &local_err) < 0) {
-        ret = -1;
-        goto out;
+    if (use_zero_copy_send) {
+        if (!qio_channel_has_feature(p->c,
+                                     QIO_CHANNEL_FEATURE_WRITE_ZERO_COPY)) {
+            error_setg(&local_err, "multifd %u: zero copy send is not "
+                       "supported by this channel", p->id);
+            ret = -1;
+            goto out;
+        }
+        write_flags = QIO_CHANNEL_WRITE_FLAG_ZERO_COPY;
+    }
+
+    if (!use_file) {
+        if (multifd_send_initial_packet(p, &local_err) < 0) {
+            ret = -1;
+            goto out;
+        }
+        /* initial packet */
+        p->num_packets = 1;
     }
-    /* initial packet */
-    p->num_packets = 1;
 
     while (true) {
         qemu_sem_wait(&p->sem);
@@ -639,37 +802,73 @@ static void *multifd_send_thread(void *opaque)
         if (p->pending_job) {
             uint64_t packet_num = p->packet_num;
             uint32_t flags = p->flags;
+            RAMBlock *block = p->pages->block;
             p->iovs_num = 1;
             p->normal_num = 0;
+            p->zero_num = 0;
 
             for (int i = 0; i < p->pages->num; i++) {
-                p->normal[p->normal_num] = p->pages->offset[i];
-                p->normal_num++;
+                ram_addr_t offset = p->pages->offset[i];
+
+                if (detect_zero &&
+                    buffer_is_zero(p->pages->block->host + offset,
+                                   page_size)) {
+                    p->zero[p->zero_num] = offset;
+                    p->zero_num++;
+                    multifd_xbzrle_cache_zero_page(p->pages->block->offset +
+                                                   offset);
+                } else {
+                    p->normal[p->normal_num] = offset;
+                    p->normal_num++;
+                }
             }
 
-            if (p->normal_num) {
+            if (p->normal_num && !use_file) {
                 ret = multifd_send_state->ops->send_prepare(p, &local_err);
                 if (ret != 0) {
                     qemu_mutex_unlock(&p->mutex);
                     break;
                 }
             }
-            multifd_send_fill_packet(p);
+            if (!use_file) {
+                multifd_send_fill_packet(p);
+            }
             p->flags = 0;
             p->num_packets++;
             p->total_normal_pages += p->normal_num;
+            p->total_zero_pages += p->zero_num;
+            p->zero_pages_pending += p->zero_num;
             p->pages->num = 0;
             p->pages->block = NULL;
             qemu_mutex_unlock(&p->mutex);
 
-            trace_multifd_send(p->id, packet_num, p->normal_num, flags,
-                               p->next_packet_size);
+            trace_multifd_send(p->id, packet_num, p->normal_num, p->zero_num,
+                               flags, p->next_packet_size);
 
-            p->iov[0].iov_len = p->packet_len;
-            p->iov[0].iov_base = p->packet;
+            if (use_file) {
+                ret = multifd_file_write_pages(p, block, &local_err);
+            } else if (use_zero_copy_send) {
+                /*
+                 * The packet header is rewritten for the next packet right
+                 * away, so it has to be copied; only the pages, which stay
+                 * in guest memory, are sent without copying.
+                 */
+                ret = qio_channel_write_all(p->c, (void *)p->packet,
+                                            p->packet_len, &local_err);
+                if (ret != 0) {
+                    break;
+                }
+                ret = qio_channel_writev_full_all(p->c, p->iov + 1,
+                                                  p->iovs_num - 1, NULL, 0,
+                                                  write_flags, &local_err);
+            } else {
+                /* Send header using the same writev call */
+                p->iov[0].iov_len = p->packet_len;
+                p->iov[0].iov_base = p->packet;
 
-            ret = qio_channel_writev_all(p->c, p->iov, p->iovs_num,
-                                         &local_err);
+                ret = qio_channel_writev_all(p->c, p->iov, p->iovs_num,
+                                             &local_err);
+            }
             if (ret != 0) {
                 break;
             }
@@ -712,7 +911,8 @@ out:
     qemu_mutex_unlock(&p->mutex);
 
     rcu_unregister_thread();
-    trace_multifd_send_thread_end(p->id, p->num_packets, p->total_normal_pages);
+    trace_multifd_send_thread_end(p->id, p->num_packets, p->total_normal_pages,
+                                  p->total_zero_pages);
 
     return NULL;
 }
@@ -907,13 +1107,20 @@ int multifd_save_setup(Error **errp)
                       + sizeof(uint64_t) * page_count;
         p->packet = g_malloc0(p->packet_len);
         p->packet->magic = cpu_to_be32(MULTIFD_MAGIC);
-        p->packet->version = cpu_to_be32(MULTIFD_VERSION);
+        p->packet->version = cpu_to_be32(multifd_version());
         p->name = g_strdup_printf("multifdsend_%d", i);
         p->tls_hostname = g_strdup(s->hostname);
         /* We need one extra place for the packet header */
         p->iov = g_new0(struct iovec, page_count + 1);
         p->normal = g_new0(ram_addr_t, page_count);
-        socket_send_channel_create(multifd_new_send_channel_async, p);
+        p->zero = g_new0(ram_addr_t, page_count);
+        if (migrate_mapped_ram()) {
+            /* Only the pages go to the file */
+            p->packet_len = 0;
+            file_send_channel_create(multifd_new_send_channel_async, p);
+        } else {
+            socket_send_channel_create(multifd_new_send_channel_async, p);
+        }
     }
 
     for (i = 0; i < thread_count; i++) {
@@ -980,7 +1187,8 @@ int multifd_load_cleanup(Error **errp)
 {
     int i;
 
-    if (!migrate_use_multifd() || !migrate_multifd_is_allowed()) {
+    if (!migrate_use_multifd() || !migrate_multifd_is_allowed() ||
+        migrate_mapped_ram()) {
         return 0;
     }
     multifd_recv_terminate_threads(NULL);
@@ -1014,6 +1222,8 @@ int multifd_load_cleanup(Error **errp)
         p->iov = NULL;
         g_free(p->normal);
         p->normal = NULL;
+        g_free(p->zero);
+        p->zero = NULL;
         multifd_recv_state->ops->recv_cleanup(p);
     }
     qemu_sem_destroy(&multifd_recv_state->sem_sync);
@@ -1029,7 +1239,7 @@ void multifd_recv_sync_main(void)
 {
     int i;
 
-    if (!migrate_use_multifd()) {
+    if (!migrate_use_multifd() || migrate_mapped_ram()) {
         return;
     }
     for (i = 0; i < migrate_multifd_channels(); i++) {
@@ -1087,10 +1297,11 @@ static void *multifd_recv_thread(void *opaque)
         flags = p->flags;
         /* recv methods don't know how to handle the SYNC flag */
         p->flags &= ~MULTIFD_FLAG_SYNC;
-        trace_multifd_recv(p->id, p->packet_num, p->normal_num, flags,
-                           p->next_packet_size);
+        trace_multifd_recv(p->id, p->packet_num, p->normal_num, p->zero_num,
+                           flags, p->next_packet_size);
         p->num_packets++;
         p->total_normal_pages += p->normal_num;
+        p->total_zero_pages += p->zero_num;
         qemu_mutex_unlock(&p->mutex);
 
         if (p->normal_num) {
@@ -1100,6 +1311,11 @@ static void *multifd_recv_thread(void *opaque)
             }
         }
 
+        for (int i = 0; i < p->zero_num; i++) {
+            ram_handle_compressed(p->host + p->zero[i], 0,
+                                  qemu_target_page_size());
+        }
+
         if (flags & MULTIFD_FLAG_SYNC) {
             qemu_sem_post(&multifd_recv_state->sem_sync);
             qemu_sem_wait(&p->sem_sync);
@@ -1115,7 +1331,8 @@ static void *multifd_recv_thread(void *opaque)
     qemu_mutex_unlock(&p->mutex);
 
     rcu_unregister_thread();
-    trace_multifd_recv_thread_end(p->id, p->num_packets, p->total_normal_pages);
+    trace_multifd_recv_thread_end(p->id, p->num_packets, p->total_normal_pages,
+                                  p->total_zero_pages);
 
     return NULL;
 }
@@ -1126,7 +1343,8 @@ int multifd_load_setup(Error **errp)
     uint32_t page_count = MULTIFD_PACKET_SIZE / qemu_target_page_size();
     uint8_t i;
 
-    if (!migrate_use_multifd()) {
+    /* With mapped-ram, the pages are read from the file in parallel */
+    if (!migrate_use_multifd() || migrate_mapped_ram()) {
         return 0;
     }
     if (!migrate_multifd_is_allowed()) {
@@ -1153,6 +1371,7 @@ int multifd_load_setup(Error **errp)
         p->name = g_strdup_printf("multifdrecv_%d", i);
         p->iov = g_new0(struct iovec, page_count);
         p->normal = g_new0(ram_addr_t, page_count);
+        p->zero = g_new0(ram_addr_t, page_count);
     }
 
     for (i = 0; i < thread_count; i++) {
@@ -1173,7 +1392,7 @@ bool multifd_recv_all_channels_created(void)
 {
     int thread_count = migrate_multifd_channels();
 
-    if (!migrate_use_multifd()) {
+    if (!migrate_use_multifd() || migrate_mapped_ram()) {
         return true;
     }
 
@@ -33,6 +33,12 @@
 #include "trace.h"
 #include "hw/boards.h"
 #include "exec/ramblock.h"
+#include "sysemu/hostmem.h"
+#include "qemu/host-utils.h"
+#include "socket.h"
+#include "qemu-file-channel.h"
+#include "yank_functions.h"
+#include "multifd.h"
 
 /* Arbitrary limit on size of each discard command,
  * keeps them around ~200 bytes
@@ -184,6 +190,22 @@ void fill_destination_postcopy_migration_info(MigrationInfo *info)
     MigrationIncomingState *mis = migration_incoming_get_current();
     PostcopyBlocktimeContext *bc = mis->blocktime_ctx;
 
+    WITH_QEMU_LOCK_GUARD(&mis->page_request_mutex) {
+        if (mis->postcopy_latency_count) {
+            uint64List *list = NULL;
+            int i;
+
+            for (i = POSTCOPY_LATENCY_BUCKETS - 1; i >= 0; i--) {
+                QAPI_LIST_PREPEND(list, mis->postcopy_latency_dist[i]);
+            }
+            info->has_postcopy_latency = true;
+            info->postcopy_latency = mis->postcopy_latency_total /
+                                     mis->postcopy_latency_count;
+            info->has_postcopy_latency_dist = true;
+            info->postcopy_latency_dist = list;
+        }
+    }
+
     if (!bc) {
         return;
     }
@@ -531,6 +553,14 @@ static int cleanup_range(RAMBlock *rb, void *opaque)
  */
 int postcopy_ram_incoming_init(MigrationIncomingState *mis)
 {
+    Error *local_err = NULL;
+
+    /* Background preallocation must not refill the discarded pages */
+    if (!host_memory_backend_prealloc_wait_all(&local_err)) {
+        error_report_err(local_err);
+        return -1;
+    }
+
     if (foreach_not_ignored_block(init_range, NULL)) {
         return -1;
     }
@@ -565,16 +595,33 @@ static void postcopy_temp_pages_cleanup(MigrationIncomingState *mis)
  */
 int postcopy_ram_incoming_cleanup(MigrationIncomingState *mis)
 {
+    int i;
+
     trace_postcopy_ram_incoming_cleanup_entry();
 
+    /* They must be done placing pages before the userfaultfd goes away */
+    postcopy_preempt_threads_join(mis, false);
+
+    for (i = 0; i < mis->postcopy_preempt_connected; i++) {
+        PostcopyPreemptChannel *chan = &mis->postcopy_preempt[i];
+
+        migration_ioc_unregister_yank_from_file(chan->file);
+        qemu_fclose(chan->file);
+        chan->file = NULL;
+    }
+    mis->postcopy_preempt_connected = 0;
+
     if (mis->have_fault_thread) {
         Error *local_err = NULL;
 
-        /* Let the fault thread quit */
+        /* Let the fault threads quit */
         qatomic_set(&mis->fault_thread_quit, 1);
         postcopy_fault_thread_notify(mis);
         trace_postcopy_ram_incoming_cleanup_join();
-        qemu_thread_join(&mis->fault_thread);
+        for (i = 0; i < mis->fault_threads; i++) {
+            qemu_thread_join(&mis->fault_thread[i]);
+        }
+        mis->fault_threads = 0;
 
         if (postcopy_notify(POSTCOPY_NOTIFY_INBOUND_END, &local_err)) {
             error_report_err(local_err);
@@ -900,22 +947,32 @@ static void postcopy_pause_fault_thread(MigrationIncomingState *mis)
 
 /*
  * Handle faults detected by the USERFAULT markings
+ *
+ * There are migrate_postcopy_threads() of these, all reading the same
+ * userfaultfd, so that faults of different vCPUs are handled in parallel.
+ * Only the first one handles the faults of the external processes on
+ * shared memory, their handlers don't expect to be called concurrently.
  */
 static void *postcopy_ram_fault_thread(void *opaque)
 {
     MigrationIncomingState *mis = opaque;
+    /* Set up by postcopy_ram_incoming_setup() while we start */
+    int thread_index = mis->fault_threads;
     struct uffd_msg msg;
     int ret;
     size_t index;
     RAMBlock *rb = NULL;
 
-    trace_postcopy_ram_fault_thread_entry();
+    trace_postcopy_ram_fault_thread_entry(thread_index);
     rcu_register_thread();
-    mis->last_rb = NULL; /* last RAMBlock we sent part of */
     qemu_sem_post(&mis->thread_sync_sem);
 
     struct pollfd *pfd;
-    size_t pfd_len = 2 + mis->postcopy_remote_fds->len;
+    size_t pfd_len = 2;
+
+    if (thread_index == 0) {
+        pfd_len += mis->postcopy_remote_fds->len;
+    }
 
     pfd = g_new0(struct pollfd, pfd_len);
 
@@ -924,7 +981,7 @@ static void *postcopy_ram_fault_thread(void *opaque)
     pfd[1].fd = mis->userfault_event_fd;
     pfd[1].events = POLLIN; /* Waiting for eventfd to go positive */
     trace_postcopy_ram_fault_thread_fds_core(pfd[0].fd, pfd[1].fd);
-    for (index = 0; index < mis->postcopy_remote_fds->len; index++) {
+    for (index = 0; index < pfd_len - 2; index++) {
         struct PostCopyFD *pcfd = &g_array_index(mis->postcopy_remote_fds,
                                                  struct PostCopyFD, index);
         pfd[2 + index].fd = pcfd->fd;
@@ -961,7 +1018,7 @@ static void *postcopy_ram_fault_thread(void *opaque)
         if (pfd[1].revents) {
             uint64_t tmp64 = 0;
 
-            /* Consume the signal */
+            /* Consume our part of the signal */
             if (read(mis->userfault_event_fd, &tmp64, 8) != 8) {
                 /* Nothing obviously nicer than posting this error. */
                 error_report("%s: read() failed", __func__);
@@ -1091,7 +1148,7 @@ retry:
         }
     }
     rcu_unregister_thread();
-    trace_postcopy_ram_fault_thread_exit();
+    trace_postcopy_ram_fault_thread_exit(thread_index);
     g_free(pfd);
     return NULL;
 }
@@ -1102,8 +1159,13 @@ static int postcopy_temp_pages_setup(MigrationIncomingState *mis)
     int err, i, channels;
     void *temp_page;
 
-    /* TODO: will be boosted when enable postcopy preemption */
-    mis->postcopy_channels = 1;
+    /* The preempt channels place pages concurrently with the main one */
+    if (migrate_postcopy_preempt()) {
+        mis->postcopy_channels = RAM_CHANNEL_POSTCOPY +
+                                 migrate_postcopy_threads();
+    } else {
+        mis->postcopy_channels = 1;
+    }
 
     channels = mis->postcopy_channels;
     mis->postcopy_tmp_pages = g_malloc0_n(sizeof(PostcopyTmpPage), channels);
@@ -1145,6 +1207,8 @@ static int postcopy_temp_pages_setup(MigrationIncomingState *mis)
 
 int postcopy_ram_incoming_setup(MigrationIncomingState *mis)
 {
+    int i;
+
     /* Open the fd for the kernel to give us userfaults */
     mis->userfault_fd = syscall(__NR_userfaultfd, O_CLOEXEC | O_NONBLOCK);
     if (mis->userfault_fd == -1) {
@@ -1161,8 +1225,11 @@ int postcopy_ram_incoming_setup(MigrationIncomingState *mis)
         return -1;
     }
 
-    /* Now an eventfd we use to tell the fault-thread to quit */
-    mis->userfault_event_fd = eventfd(0, EFD_CLOEXEC);
+    /*
+     * Now an eventfd we use to tell the fault threads to quit; each of them
+     * reads one from it, see postcopy_fault_thread_notify()
+     */
+    mis->userfault_event_fd = eventfd(0, EFD_CLOEXEC | EFD_SEMAPHORE);
     if (mis->userfault_event_fd == -1) {
         error_report("%s: Opening userfault_event_fd: %s", __func__,
                      strerror(errno));
@@ -1170,8 +1237,16 @@ int postcopy_ram_incoming_setup(MigrationIncomingState *mis)
         return -1;
     }
 
-    postcopy_thread_create(mis, &mis->fault_thread, "postcopy/fault",
-                           postcopy_ram_fault_thread, QEMU_THREAD_JOINABLE);
+    mis->last_rb = NULL; /* last RAMBlock we sent part of */
+    mis->fault_threads = 0;
+    for (i = 0; i < migrate_postcopy_threads(); i++) {
+        g_autofree char *name = g_strdup_printf("postcopy/fault%d", i);
+
+        postcopy_thread_create(mis, &mis->fault_thread[i], name,
+                               postcopy_ram_fault_thread,
+                               QEMU_THREAD_JOINABLE);
+        mis->fault_threads++;
+    }
     mis->have_fault_thread = true;
 
     /* Mark so that we get notified of accesses to unwritten areas */
@@ -1185,11 +1260,42 @@ int postcopy_ram_incoming_setup(MigrationIncomingState *mis)
         return -1;
     }
 
+    qemu_mutex_lock(&mis->page_request_mutex);
+    mis->postcopy_latency_count = 0;
+    mis->postcopy_latency_total = 0;
+    memset(mis->postcopy_latency_dist, 0, sizeof(mis->postcopy_latency_dist));
+    qemu_mutex_unlock(&mis->page_request_mutex);
+
+    if (migrate_postcopy_preempt()) {
+        postcopy_preempt_threads_create(mis);
+    }
+
     trace_postcopy_ram_enable_notify();
 
     return 0;
 }
 
+/*
+ * Account the time between the request of a page and its placement.
+ * Called with page_request_mutex held.
+ */
+static uint64_t postcopy_latency_record(MigrationIncomingState *mis,
+                                        int64_t req_time)
+{
+    int64_t now = qemu_clock_get_us(QEMU_CLOCK_REALTIME);
+    uint64_t latency = now > req_time ? now - req_time : 0;
+    int bucket = 0;
+
+    if (latency) {
+        bucket = MIN(63 - clz64(latency), POSTCOPY_LATENCY_BUCKETS - 1);
+    }
+    mis->postcopy_latency_dist[bucket]++;
+    mis->postcopy_latency_total += latency;
+    mis->postcopy_latency_count++;
+
+    return latency;
+}
+
 static int qemu_ufd_copy_ioctl(MigrationIncomingState *mis, void *host_addr,
                                void *from_addr, uint64_t pagesize, RAMBlock *rb)
 {
@@ -1218,10 +1324,15 @@ static int qemu_ufd_copy_ioctl(MigrationIncomingState *mis, void *host_addr,
          * If this page resolves a page fault for a previous recorded faulted
          * address, take a special note to maintain the requested page list.
          */
-        if (g_tree_lookup(mis->page_requested, host_addr)) {
+        int64_t *req_time = g_tree_lookup(mis->page_requested, host_addr);
+
+        if (req_time) {
+            uint64_t latency = postcopy_latency_record(mis, *req_time);
+
             g_tree_remove(mis->page_requested, host_addr);
             mis->page_requested_count--;
-            trace_postcopy_page_req_del(host_addr, mis->page_requested_count);
+            trace_postcopy_page_req_del(host_addr, mis->page_requested_count,
+                                        latency);
         }
         qemu_mutex_unlock(&mis->page_request_mutex);
         mark_postcopy_blocktime_end((uintptr_t)host_addr);
@@ -1381,11 +1492,12 @@ void postcopy_temp_page_reset(PostcopyTmpPage *tmp_page)
 
 void postcopy_fault_thread_notify(MigrationIncomingState *mis)
 {
-    uint64_t tmp64 = 1;
+    uint64_t tmp64 = MAX(mis->fault_threads, 1);
 
     /*
-     * Wakeup the fault_thread.  It's an eventfd that should currently
-     * be at 0, we're going to increment it to 1
+     * Wakeup the fault threads.  It's an eventfd in semaphore mode that
+     * should currently be at 0, we're going to increment it by one for
+     * each of them
      */
     if (write(mis->userfault_event_fd, &tmp64, 8) != 8) {
         /* Not much we can do here, but may as well report it */
@@ -1394,6 +1506,186 @@ void postcopy_fault_thread_notify(MigrationIncomingState *mis)
     }
 }
 
+/*
+ * Incoming side of postcopy preempt: urgent pages requested by the
+ * destination come on channels of their own, so that they don't queue up
+ * behind the background pages and device state of the main channel.  Each
+ * channel has a thread placing its pages, concurrently with the listen
+ * thread and with each other.
+ */
+void postcopy_preempt_new_channel(MigrationIncomingState *mis, QEMUFile *file)
+{
+    PostcopyPreemptChannel *chan =
+        &mis->postcopy_preempt[mis->postcopy_preempt_connected++];
+
+    trace_postcopy_preempt_new_channel(chan - mis->postcopy_preempt);
+    chan->file = file;
+    qemu_sem_post(&chan->file_done);
+}
+
+static void *postcopy_preempt_thread(void *opaque)
+{
+    PostcopyPreemptChannel *chan = opaque;
+    MigrationIncomingState *mis = migration_incoming_get_current();
+    int channel = RAM_CHANNEL_POSTCOPY + (chan - mis->postcopy_preempt);
+    int ret = 0;
+
+    rcu_register_thread();
+
+    /* The source connects the channel when it starts postcopy */
+    qemu_sem_wait(&chan->file_done);
+
+    if (!chan->quit) {
+        trace_postcopy_preempt_thread_entry(channel);
+        qemu_file_set_blocking(chan->file, true);
+        ret = ram_load_postcopy_preempt(chan->file, channel);
+        trace_postcopy_preempt_thread_exit(channel, ret);
+    }
+
+    if (ret < 0) {
+        error_report("%s: failed to load urgent pages on channel %d: %d",
+                     __func__, channel, ret);
+        /*
+         * Requested pages may have been lost with the channel; pause the
+         * main channel too, so that a recovery sends them again.  It
+         * shares its socket with the return path.
+         */
+        WITH_QEMU_LOCK_GUARD(&mis->rp_mutex) {
+            if (mis->state == MIGRATION_STATUS_POSTCOPY_ACTIVE &&
+                mis->to_src_file) {
+                qemu_file_shutdown(mis->to_src_file);
+            }
+        }
+    }
+
+    rcu_unregister_thread();
+    return NULL;
+}
+
+void postcopy_preempt_threads_create(MigrationIncomingState *mis)
+{
+    int i;
+
+    for (i = 0; i < migrate_postcopy_threads(); i++) {
+        PostcopyPreemptChannel *chan = &mis->postcopy_preempt[i];
+        g_autofree char *name = g_strdup_printf("postcopy/prio%d", i);
+
+        chan->quit = false;
+        qemu_thread_create(&chan->thread, name, postcopy_preempt_thread,
+                           chan, QEMU_THREAD_JOINABLE);
+        chan->thread_created = true;
+    }
+}
+
+/*
+ * Wait for the preempt threads to quit.  With @shutdown, the connected
+ * channels are shut down first, otherwise their threads quit on the EOS
+ * sent at the end, or on error.  Those whose channel never showed up are
+ * told not to wait for it any more.
+ *
+ * With @shutdown, this is how postcopy pauses stop them: they use their
+ * temporary pages, which are reset for the recovery, and the source only
+ * uses the main channel after a recovery anyway.
+ */
+void postcopy_preempt_threads_join(MigrationIncomingState *mis, bool shutdown)
+{
+    int i;
+
+    for (i = 0; i < POSTCOPY_THREADS_MAX; i++) {
+        PostcopyPreemptChannel *chan = &mis->postcopy_preempt[i];
+
+        if (!chan->thread_created) {
+            continue;
+        }
+
+        if (!chan->file) {
+            chan->quit = true;
+            qemu_sem_post(&chan->file_done);
+        } else if (shutdown) {
+            qemu_file_shutdown(chan->file);
+        }
+        qemu_thread_join(&chan->thread);
+        chan->thread_created = false;
+    }
+}
+
+static void postcopy_preempt_send_channel_new(QIOTask *task, gpointer opaque)
+{
+    MigrationState *s = opaque;
+    QIOChannel *ioc = QIO_CHANNEL(qio_task_get_source(task));
+    Error *local_err = NULL;
+
+    if (qio_task_propagate_error(task, &local_err)) {
+        warn_report_err(local_err);
+    } else {
+        migration_ioc_register_yank(ioc);
+        WITH_QEMU_LOCK_GUARD(&s->qemu_file_lock) {
+            trace_postcopy_preempt_new_channel(s->postcopy_qemufile_src_count);
+            s->postcopy_qemufile_src[s->postcopy_qemufile_src_count++] =
+                qemu_fopen_channel_output(ioc);
+        }
+    }
+
+    object_unref(OBJECT(ioc));
+    qemu_sem_post(&s->postcopy_qemufile_src_sem);
+}
+
+/*
+ * Connect the channels for urgent pages on the source.  Failing to do so
+ * is not fatal: the pages go on the channels that could be connected, or
+ * on the main channel like without preempt if none could; the destination
+ * threads of the missing channels just never get them.
+ */
+void postcopy_preempt_setup(MigrationState *s)
+{
+    int i;
+
+    if (!migrate_postcopy_preempt()) {
+        return;
+    }
+
+    if (!migrate_multifd_is_allowed() ||
+        (s->parameters.tls_creds && *s->parameters.tls_creds)) {
+        warn_report("postcopy-preempt: only supported on plain socket "
+                    "transports, requested pages will be sent on the main "
+                    "channel");
+        return;
+    }
+
+    for (i = 0; i < migrate_postcopy_threads(); i++) {
+        socket_send_channel_create(postcopy_preempt_send_channel_new, s);
+    }
+    for (i = 0; i < migrate_postcopy_threads(); i++) {
+        qemu_sem_wait(&s->postcopy_qemufile_src_sem);
+    }
+
+    if (!s->postcopy_qemufile_src_count) {
+        warn_report("postcopy-preempt: requested pages will be sent on the "
+                    "main channel");
+    }
+}
+
+void postcopy_preempt_close_channels(MigrationState *s)
+{
+    QEMUFile *files[POSTCOPY_THREADS_MAX];
+    int i, count;
+
+    WITH_QEMU_LOCK_GUARD(&s->qemu_file_lock) {
+        count = s->postcopy_qemufile_src_count;
+        for (i = 0; i < count; i++) {
+            files[i] = s->postcopy_qemufile_src[i];
+            s->postcopy_qemufile_src[i] = NULL;
+        }
+        s->postcopy_qemufile_src_count = 0;
+    }
+
+    for (i = 0; i < count; i++) {
+        qemu_file_shutdown(files[i]);
+        migration_ioc_unregister_yank_from_file(files[i]);
+        qemu_fclose(files[i]);
+    }
+}
+
 /**
  * postcopy_discard_send_init: Called at the start of each RAMBlock before
  *   asking to discard individual ranges.
@@ -139,6 +139,13 @@ void postcopy_thread_create(MigrationIncomingState *mis,
                             QemuThread *thread, const char *name,
                             void *(*fn)(void *), int joinable);
 
+/* Postcopy preempt: separate channels for the pages requested by faults */
+void postcopy_preempt_setup(MigrationState *s);
+void postcopy_preempt_close_channels(MigrationState *s);
+void postcopy_preempt_new_channel(MigrationIncomingState *mis, QEMUFile *file);
+void postcopy_preempt_threads_create(MigrationIncomingState *mis);
+void postcopy_preempt_threads_join(MigrationIncomingState *mis, bool shutdown);
+
 struct PostCopyFD;
 
 /* ufd is a pointer to the struct uffd_msg *TODO: more Portable! */
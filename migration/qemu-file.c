@@ -30,6 +30,7 @@
 #include "qemu-file.h"
 #include "trace.h"
 #include "qapi/error.h"
+#include "io/channel-file.h"
 
 #define IO_BUF_SIZE 32768
 #define MAX_IOV_SIZE MIN_CONST(IOV_MAX, 64)
@@ -867,3 +868,125 @@ QIOChannel *qemu_file_get_ioc(QEMUFile *file)
 {
     return file->has_ioc ? QIO_CHANNEL(file->opaque) : NULL;
 }
+
+/*
+ * The mapped-ram format stores RAM pages at fixed offsets of the migration
+ * file, next to the stream.  That needs the file descriptor of the channel,
+ * which must then be a file.
+ */
+int qemu_file_get_fd(QEMUFile *f)
+{
+    QIOChannel *ioc = qemu_file_get_ioc(f);
+
+    if (!ioc || !object_dynamic_cast(OBJECT(ioc), TYPE_QIO_CHANNEL_FILE)) {
+        Error *err = NULL;
+
+        error_setg(&err, "The migration channel is not a file");
+        qemu_file_set_error_obj(f, -EINVAL, err);
+        return -1;
+    }
+    return QIO_CHANNEL_FILE(ioc)->fd;
+}
+
+/*
+ * Return the offset in the file of the next byte of the stream, or -1 on
+ * error
+ */
+int64_t qemu_get_offset(QEMUFile *f)
+{
+    int fd = qemu_file_get_fd(f);
+    off_t pos;
+
+    if (fd < 0) {
+        return -1;
+    }
+    if (qemu_file_is_writable(f)) {
+        qemu_fflush(f);
+    }
+    pos = lseek(fd, 0, SEEK_CUR);
+    if (pos < 0) {
+        qemu_file_set_error(f, -errno);
+        return -1;
+    }
+    /* Reads are buffered ahead of the stream */
+    return pos - (f->buf_size - f->buf_index);
+}
+
+/* Continue the stream at @offset of the file */
+void qemu_set_offset(QEMUFile *f, int64_t offset)
+{
+    int fd = qemu_file_get_fd(f);
+
+    if (fd < 0) {
+        return;
+    }
+    if (qemu_file_is_writable(f)) {
+        qemu_fflush(f);
+    } else {
+        f->buf_index = 0;
+        f->buf_size = 0;
+    }
+    if (lseek(fd, offset, SEEK_SET) < 0) {
+        qemu_file_set_error(f, -errno);
+    }
+}
+
+/* Write @buf at @offset of the file, without moving the stream */
+void qemu_put_buffer_at(QEMUFile *f, const uint8_t *buf, size_t buflen,
+                        int64_t offset)
+{
+    int fd = qemu_file_get_fd(f);
+
+    if (fd < 0) {
+        return;
+    }
+    f->bytes_xfer += buflen;
+    while (buflen) {
+        ssize_t ret = pwrite(fd, buf, buflen, offset);
+
+        if (ret < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            qemu_file_set_error(f, -errno);
+            return;
+        }
+        buf += ret;
+        buflen -= ret;
+        offset += ret;
+    }
+}
+
+/*
+ * Read @buflen bytes at @offset of the file into @buf, without moving the
+ * stream
+ *
+ * Returns the number of bytes read, less than @buflen on error
+ */
+size_t qemu_get_buffer_at(QEMUFile *f, uint8_t *buf, size_t buflen,
+                          int64_t offset)
+{
+    int fd = qemu_file_get_fd(f);
+    size_t done = 0;
+
+    if (fd < 0) {
+        return 0;
+    }
+    while (done < buflen) {
+        ssize_t ret = pread(fd, buf + done, buflen - done, offset + done);
+
+        if (ret < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            qemu_file_set_error(f, -errno);
+            break;
+        }
+        if (ret == 0) {
+            qemu_file_set_error(f, -EIO);
+            break;
+        }
+        done += ret;
+    }
+    return done;
+}
@@ -181,5 +181,12 @@ size_t ram_control_save_page(QEMUFile *f, ram_addr_t block_offset,
                              ram_addr_t offset, size_t size,
                              uint64_t *bytes_sent);
 QIOChannel *qemu_file_get_ioc(QEMUFile *file);
+int qemu_file_get_fd(QEMUFile *f);
+int64_t qemu_get_offset(QEMUFile *f);
+void qemu_set_offset(QEMUFile *f, int64_t offset);
+void qemu_put_buffer_at(QEMUFile *f, const uint8_t *buf, size_t buflen,
+                        int64_t offset);
+size_t qemu_get_buffer_at(QEMUFile *f, uint8_t *buf, size_t buflen,
+                          int64_t offset);
 
 #endif
@@ -0,0 +1,640 @@
+/*
+ * Guest RAM saved to a file at fixed offsets
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or later.
+ * See the COPYING file in the top-level directory.
+ */
+
+#include "qemu/osdep.h"
+#include "qemu/atomic.h"
+#include "qemu/bitops.h"
+#include "qemu/bswap.h"
+#include "qemu/cutils.h"
+#include "qemu/rcu.h"
+#include "qemu/thread.h"
+#include "qemu/units.h"
+#include "qapi/error.h"
+#include "exec/memory.h"
+#include "exec/ramblock.h"
+#include "exec/target_page.h"
+#include "ram.h"
+#include "ram-file.h"
+#include "trace.h"
+
+#ifdef CONFIG_POSIX
+
+/*
+ * The file starts with a header page, each RAM block then has a region
+ * of its own, aligned so that it can be mapped:
+ *
+ *   [ header | block 0 ... | block 1 ... | ... ]
+ *             ^ RAM_FILE_ALIGN
+ *
+ * Where the regions are is sent in the migration stream, along with the
+ * identifier of the file.  The header is written last, once all of RAM is
+ * on disk, so a file with a valid header is complete.
+ */
+#define RAM_FILE_MAGIC          0x51454d5552414d46ULL /* "QEMURAMF" */
+#define RAM_FILE_VERSION        1
+#define RAM_FILE_HEADER_SIZE    4096
+#define RAM_FILE_ALIGN          (1 * MiB)
+
+/* Alignment of memory, offsets and lengths for O_DIRECT */
+#define RAM_FILE_DIRECT_ALIGN   4096
+
+/* Unit of work of the I/O threads */
+#define RAM_FILE_CHUNK          (8 * MiB)
+#define RAM_FILE_MAX_THREADS    16
+
+typedef struct QEMU_PACKED {
+    uint64_t magic;
+    uint32_t version;
+    uint32_t unused;
+    uint64_t id;
+    /* end of the last region */
+    uint64_t size;
+} RamFileHeader;
+
+typedef struct {
+    RAMBlock *block;
+    uint8_t *host;
+    uint64_t length;
+    uint64_t offset;
+} RamFileRegion;
+
+typedef struct {
+    uint8_t *host;
+    uint64_t length;
+    uint64_t offset;
+} RamFileChunk;
+
+struct RamFile {
+    int fd;
+    /* path that the file gets once it is complete, when saving */
+    char *path;
+    /* path of the file until then */
+    char *tmp_path;
+    /* whether fd was opened with O_DIRECT */
+    bool direct;
+    uint64_t id;
+    uint64_t size;
+    /* regions to save, or to read on load */
+    GArray *regions;
+
+    /* I/O threads state */
+    bool writing;
+    RamFileChunk *chunks;
+    uint64_t nr_chunks;
+    /* next chunk to process, atomic */
+    uint64_t next_chunk;
+    /* first error, as -errno, atomic */
+    int err;
+};
+
+static int ram_file_pwrite_all(int fd, const uint8_t *buf, uint64_t len,
+                               uint64_t offset)
+{
+    while (len) {
+        ssize_t ret = pwrite(fd, buf, len, offset);
+
+        if (ret < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            return -errno;
+        }
+        buf += ret;
+        len -= ret;
+        offset += ret;
+    }
+    return 0;
+}
+
+static int ram_file_pread_all(int fd, uint8_t *buf, uint64_t len,
+                              uint64_t offset)
+{
+    while (len) {
+        ssize_t ret = pread(fd, buf, len, offset);
+
+        if (ret < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            return -errno;
+        }
+        if (ret == 0) {
+            return -EIO;
+        }
+        buf += ret;
+        len -= ret;
+        offset += ret;
+    }
+    return 0;
+}
+
+static void *ram_file_io_thread(void *opaque)
+{
+    RamFile *rf = opaque;
+    uint64_t i;
+
+    while (!qatomic_read(&rf->err) &&
+           (i = qatomic_fetch_inc(&rf->next_chunk)) < rf->nr_chunks) {
+        RamFileChunk *c = &rf->chunks[i];
+        int ret;
+
+        if (rf->writing) {
+            ret = ram_file_pwrite_all(rf->fd, c->host, c->length, c->offset);
+        } else {
+            ret = ram_file_pread_all(rf->fd, c->host, c->length, c->offset);
+        }
+        if (ret < 0) {
+            qatomic_cmpxchg(&rf->err, 0, ret);
+        }
+    }
+    return NULL;
+}
+
+/*
+ * Copy the regions between guest memory and the file, split in chunks
+ * that a few threads share: a single thread is far from keeping a fast
+ * disk busy.
+ */
+static int ram_file_io(RamFile *rf, bool writing, Error **errp)
+{
+    long host_procs = sysconf(_SC_NPROCESSORS_ONLN);
+    QemuThread *threads;
+    uint64_t nr_threads;
+    uint64_t i, n = 0;
+
+    rf->nr_chunks = 0;
+    for (i = 0; i < rf->regions->len; i++) {
+        RamFileRegion *r = &g_array_index(rf->regions, RamFileRegion, i);
+
+        rf->nr_chunks += DIV_ROUND_UP(r->length, RAM_FILE_CHUNK);
+    }
+    if (!rf->nr_chunks) {
+        return 0;
+    }
+
+    rf->chunks = g_new(RamFileChunk, rf->nr_chunks);
+    for (i = 0; i < rf->regions->len; i++) {
+        RamFileRegion *r = &g_array_index(rf->regions, RamFileRegion, i);
+        uint64_t done;
+
+        for (done = 0; done < r->length; done += RAM_FILE_CHUNK) {
+            rf->chunks[n].host = r->host + done;
+            rf->chunks[n].length = MIN(r->length - done, RAM_FILE_CHUNK);
+            rf->chunks[n].offset = r->offset + done;
+            n++;
+        }
+    }
+
+    nr_threads = MIN(MAX(host_procs, 1), RAM_FILE_MAX_THREADS);
+    nr_threads = MIN(nr_threads, rf->nr_chunks);
+    trace_ram_file_io(writing, rf->nr_chunks, nr_threads, rf->direct);
+
+    rf->writing = writing;
+    rf->next_chunk = 0;
+    rf->err = 0;
+    threads = g_new(QemuThread, nr_threads);
+    for (i = 0; i < nr_threads; i++) {
+        qemu_thread_create(&threads[i], "ram_file_io", ram_file_io_thread,
+                           rf, QEMU_THREAD_JOINABLE);
+    }
+    for (i = 0; i < nr_threads; i++) {
+        qemu_thread_join(&threads[i]);
+    }
+    g_free(threads);
+    g_free(rf->chunks);
+    rf->chunks = NULL;
+
+    if (rf->err) {
+        error_setg_errno(errp, -rf->err, "Failed to %s RAM file",
+                         writing ? "write" : "read");
+        return -1;
+    }
+    return 0;
+}
+
+static RamFile *ram_file_new(int fd, bool direct)
+{
+    RamFile *rf = g_new0(RamFile, 1);
+
+    rf->fd = fd;
+    rf->direct = direct;
+    rf->regions = g_array_new(false, false, sizeof(RamFileRegion));
+    return rf;
+}
+
+/*
+ * The file is written under a temporary name and renamed over @path once
+ * complete: a VM restored from the previous file at @path may still map
+ * it, and would get SIGBUS if it were truncated.
+ */
+RamFile *ram_file_create(const char *path, Error **errp)
+{
+    g_autofree char *tmp_path = g_strdup_printf("%s.%08x.tmp", path,
+                                                g_random_int());
+    int flags = O_RDWR | O_EXCL;
+    bool direct = false;
+    RamFile *rf;
+    int fd;
+
+#ifdef O_DIRECT
+    Error *local_err = NULL;
+
+    fd = qemu_create(tmp_path, flags | O_DIRECT, 0600, &local_err);
+    if (fd >= 0) {
+        direct = true;
+    } else if (errno == EINVAL) {
+        /* Not supported by the file system, tmpfs for instance */
+        error_free(local_err);
+        fd = qemu_create(tmp_path, flags, 0600, errp);
+    } else {
+        error_propagate(errp, local_err);
+    }
+#else
+    fd = qemu_create(tmp_path, flags, 0600, errp);
+#endif
+    if (fd < 0) {
+        return NULL;
+    }
+
+    rf = ram_file_new(fd, direct);
+    rf->path = g_strdup(path);
+    rf->tmp_path = g_steal_pointer(&tmp_path);
+    rf->id = ((uint64_t)g_random_int() << 32) | g_random_int();
+    return rf;
+}
+
+int ram_file_prepare(RamFile *rf, Error **errp)
+{
+    RAMBlock *block;
+    uint64_t size = RAM_FILE_HEADER_SIZE;
+
+    g_array_set_size(rf->regions, 0);
+
+    WITH_RCU_READ_LOCK_GUARD() {
+        RAMBLOCK_FOREACH_NOT_IGNORED(block) {
+            RamFileRegion r = {
+                .block = block,
+                .host = block->host,
+                .length = block->used_length,
+                .offset = ROUND_UP(size, RAM_FILE_ALIGN),
+            };
+
+            size = r.offset + r.length;
+            g_array_append_val(rf->regions, r);
+        }
+    }
+    rf->size = size;
+
+    if (ftruncate(rf->fd, size) < 0) {
+        error_setg_errno(errp, errno, "Failed to resize RAM file");
+        return -1;
+    }
+#ifdef CONFIG_FALLOCATE
+    /* Fail now rather than halfway through the save if space is short */
+    if (fallocate(rf->fd, 0, 0, size) < 0 && errno != EOPNOTSUPP) {
+        error_setg_errno(errp, errno, "Failed to preallocate RAM file");
+        return -1;
+    }
+#endif
+    return 0;
+}
+
+/* O_DIRECT fails on unaligned I/O, which only tiny RAM blocks could need */
+static void ram_file_check_direct(RamFile *rf)
+{
+#ifdef O_DIRECT
+    int i;
+
+    if (!rf->direct) {
+        return;
+    }
+    for (i = 0; i < rf->regions->len; i++) {
+        RamFileRegion *r = &g_array_index(rf->regions, RamFileRegion, i);
+
+        if (((uintptr_t)r->host | r->length | r->offset) &
+            (RAM_FILE_DIRECT_ALIGN - 1)) {
+            int flags = fcntl(rf->fd, F_GETFL);
+
+            if (flags >= 0 && !fcntl(rf->fd, F_SETFL, flags & ~O_DIRECT)) {
+                rf->direct = false;
+            }
+            return;
+        }
+    }
+#endif
+}
+
+int64_t ram_file_save(RamFile *rf, Error **errp)
+{
+    RamFileHeader *hdr;
+    int64_t total = 0;
+    int i, ret;
+
+    ram_file_check_direct(rf);
+    if (ram_file_io(rf, true, errp)) {
+        return -1;
+    }
+    for (i = 0; i < rf->regions->len; i++) {
+        total += g_array_index(rf->regions, RamFileRegion, i).length;
+    }
+
+    /* The data must be on disk before the header that validates it */
+    if (qemu_fdatasync(rf->fd) < 0) {
+        error_setg_errno(errp, errno, "Failed to sync RAM file");
+        return -1;
+    }
+
+    hdr = qemu_memalign(RAM_FILE_DIRECT_ALIGN, RAM_FILE_HEADER_SIZE);
+    memset(hdr, 0, RAM_FILE_HEADER_SIZE);
+    hdr->magic = cpu_to_be64(RAM_FILE_MAGIC);
+    hdr->version = cpu_to_be32(RAM_FILE_VERSION);
+    hdr->id = cpu_to_be64(rf->id);
+    hdr->size = cpu_to_be64(rf->size);
+    ret = ram_file_pwrite_all(rf->fd, (uint8_t *)hdr, RAM_FILE_HEADER_SIZE, 0);
+    qemu_vfree(hdr);
+    if (ret < 0) {
+        error_setg_errno(errp, -ret, "Failed to write RAM file header");
+        return -1;
+    }
+    if (qemu_fdatasync(rf->fd) < 0) {
+        error_setg_errno(errp, errno, "Failed to sync RAM file");
+        return -1;
+    }
+
+    if (rename(rf->tmp_path, rf->path) < 0) {
+        error_setg_errno(errp, errno, "Failed to rename RAM file to '%s'",
+                         rf->path);
+        return -1;
+    }
+    g_free(rf->tmp_path);
+    rf->tmp_path = NULL;
+
+    return total;
+}
+
+uint64_t ram_file_id(RamFile *rf)
+{
+    return rf->id;
+}
+
+uint64_t ram_file_block_offset(RamFile *rf, RAMBlock *block)
+{
+    int i;
+
+    for (i = 0; i < rf->regions->len; i++) {
+        RamFileRegion *r = &g_array_index(rf->regions, RamFileRegion, i);
+
+        if (r->block == block) {
+            return r->offset;
+        }
+    }
+    return 0;
+}
+
+RamFile *ram_file_open(const char *path, uint64_t id, Error **errp)
+{
+    g_autofree RamFileHeader *hdr = g_malloc0(RAM_FILE_HEADER_SIZE);
+    struct stat st;
+    RamFile *rf;
+    int fd, ret;
+
+    fd = qemu_open(path, O_RDONLY, errp);
+    if (fd < 0) {
+        return NULL;
+    }
+
+    ret = ram_file_pread_all(fd, (uint8_t *)hdr, RAM_FILE_HEADER_SIZE, 0);
+    if (ret < 0) {
+        error_setg_errno(errp, -ret, "Failed to read the header of RAM file "
+                         "'%s'", path);
+        goto err;
+    }
+    if (be64_to_cpu(hdr->magic) != RAM_FILE_MAGIC) {
+        error_setg(errp, "'%s' is not a complete RAM file", path);
+        goto err;
+    }
+    if (be32_to_cpu(hdr->version) != RAM_FILE_VERSION) {
+        error_setg(errp, "RAM file '%s' has unsupported version %u", path,
+                   be32_to_cpu(hdr->version));
+        goto err;
+    }
+    if (be64_to_cpu(hdr->id) != id) {
+        error_setg(errp, "RAM file '%s' was saved with another snapshot",
+                   path);
+        goto err;
+    }
+    if (fstat(fd, &st) < 0 || st.st_size < be64_to_cpu(hdr->size)) {
+        error_setg(errp, "RAM file '%s' is truncated", path);
+        goto err;
+    }
+
+    rf = ram_file_new(fd, false);
+    rf->id = id;
+    rf->size = be64_to_cpu(hdr->size);
+    return rf;
+
+err:
+    close(fd);
+    return NULL;
+}
+
+/*
+ * Only private anonymous memory of the base page size can be replaced by a
+ * mapping of the file: other kinds of memory are shared with someone else,
+ * are not ours, or would lose their huge pages.
+ */
+static bool ram_file_can_map(RAMBlock *block)
+{
+    return block->fd < 0 && !(block->flags & (RAM_SHARED | RAM_PREALLOC)) &&
+           block->page_size == qemu_real_host_page_size;
+}
+
+static bool ram_file_map_block(RamFile *rf, RamFileRegion *r)
+{
+#ifdef CONFIG_LINUX
+    void *addr;
+
+    if (!ram_file_can_map(r->block)) {
+        return false;
+    }
+
+    /*
+     * A page discarded from the mapping would read back from the file
+     * rather than as zeroes.  Keep virtio-balloon from discarding pages
+     * for as long as the mapping lives, and don't map at all if discards
+     * are required, like virtio-mem's.
+     */
+    if (ram_block_discard_disable(true)) {
+        return false;
+    }
+
+    /*
+     * Map the region elsewhere first and move it over guest memory, so
+     * that guest memory stays as it is if anything fails.
+     */
+    addr = mmap(NULL, r->length, PROT_READ | PROT_WRITE, MAP_PRIVATE,
+                rf->fd, r->offset);
+    if (addr == MAP_FAILED) {
+        ram_block_discard_disable(false);
+        return false;
+    }
+    if (mremap(addr, r->length, r->length, MREMAP_MAYMOVE | MREMAP_FIXED,
+               r->host) == MAP_FAILED) {
+        munmap(addr, r->length);
+        ram_block_discard_disable(false);
+        return false;
+    }
+    /* The new mapping has none of the advice given to the old one */
+    qemu_ram_remap_advise(r->host, r->length);
+    return true;
+#else
+    return false;
+#endif
+}
+
+int ram_file_load_block(RamFile *rf, RAMBlock *block, uint64_t offset,
+                        Error **errp)
+{
+    RamFileRegion r = {
+        .block = block,
+        .host = block->host,
+        .length = block->used_length,
+        .offset = offset,
+    };
+    bool mapped;
+
+    if (!block->host) {
+        error_setg(errp, "RAM block %s cannot be loaded from a RAM file",
+                   block->idstr);
+        return -1;
+    }
+    if (offset < RAM_FILE_HEADER_SIZE ||
+        !QEMU_IS_ALIGNED(offset, qemu_real_host_page_size) ||
+        offset > rf->size || r.length > rf->size - offset) {
+        error_setg(errp, "Invalid region 0x%" PRIx64 " for RAM block %s in "
+                   "RAM file", offset, block->idstr);
+        return -1;
+    }
+
+    mapped = ram_file_map_block(rf, &r);
+    if (!mapped) {
+        g_array_append_val(rf->regions, r);
+    }
+    trace_ram_file_load_block(block->idstr, offset, r.length, mapped);
+    return 0;
+}
+
+int ram_file_load_finish(RamFile *rf, Error **errp)
+{
+    int ret = ram_file_io(rf, false, errp);
+
+    g_array_set_size(rf->regions, 0);
+    return ret;
+}
+
+void ram_file_close(RamFile *rf)
+{
+    if (!rf) {
+        return;
+    }
+    close(rf->fd);
+    /* The save did not complete */
+    if (rf->tmp_path) {
+        unlink(rf->tmp_path);
+        g_free(rf->tmp_path);
+    }
+    g_free(rf->path);
+    g_array_free(rf->regions, true);
+    g_free(rf);
+}
+
+int ram_file_read_pages(int fd, RAMBlock *block, const unsigned long *bitmap,
+                        uint64_t offset, Error **errp)
+{
+    unsigned int bits = qemu_target_page_bits();
+    unsigned long npages = block->used_length >> bits;
+    unsigned long start, end = 0;
+    RamFile rf = { .fd = fd };
+    int ret;
+
+    /* Each run of present pages is read at once */
+    rf.regions = g_array_new(false, false, sizeof(RamFileRegion));
+    for (start = find_first_bit(bitmap, npages); start < npages;
+         start = find_next_bit(bitmap, npages, end)) {
+        RamFileRegion r;
+
+        end = find_next_zero_bit(bitmap, npages, start);
+        r.block = block;
+        r.host = block->host + (start << bits);
+        r.length = (uint64_t)(end - start) << bits;
+        r.offset = offset + ((uint64_t)start << bits);
+        g_array_append_val(rf.regions, r);
+    }
+
+    ret = ram_file_io(&rf, false, errp);
+    g_array_free(rf.regions, true);
+    return ret;
+}
+
+#else
+
+RamFile *ram_file_create(const char *path, Error **errp)
+{
+    error_setg(errp, "RAM files are not supported on this host");
+    return NULL;
+}
+
+int ram_file_prepare(RamFile *rf, Error **errp)
+{
+    g_assert_not_reached();
+}
+
+int64_t ram_file_save(RamFile *rf, Error **errp)
+{
+    g_assert_not_reached();
+}
+
+uint64_t ram_file_id(RamFile *rf)
+{
+    g_assert_not_reached();
+}
+
+uint64_t ram_file_block_offset(RamFile *rf, RAMBlock *block)
+{
+    g_assert_not_reached();
+}
+
+RamFile *ram_file_open(const char *path, uint64_t id, Error **errp)
+{
+    error_setg(errp, "RAM files are not supported on this host");
+    return NULL;
+}
+
+int ram_file_load_block(RamFile *rf, RAMBlock *block, uint64_t offset,
+                        Error **errp)
+{
+    g_assert_not_reached();
+}
+
+int ram_file_load_finish(RamFile *rf, Error **errp)
+{
+    g_assert_not_reached();
+}
+
+void ram_file_close(RamFile *rf)
+{
+}
+
+int ram_file_read_pages(int fd, RAMBlock *block, const unsigned long *bitmap,
+                        uint64_t offset, Error **errp)
+{
+    error_setg(errp, "Reading RAM pages in parallel is not supported on "
+               "this host");
+    return -1;
+}
+
+#endif
@@ -0,0 +1,116 @@
+/*
+ * Guest RAM saved to a file at fixed offsets
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or later.
+ * See the COPYING file in the top-level directory.
+ */
+
+#ifndef QEMU_MIGRATION_RAM_FILE_H
+#define QEMU_MIGRATION_RAM_FILE_H
+
+#include "exec/cpu-common.h"
+
+typedef struct RamFile RamFile;
+
+/**
+ * ram_file_create: create a RAM file for saving
+ *
+ * Returns the RAM file, or NULL with @errp set
+ *
+ * @path: path of the file, replaced by ram_file_save() if it exists
+ * @errp: pointer to an error
+ */
+RamFile *ram_file_create(const char *path, Error **errp);
+
+/**
+ * ram_file_prepare: lay out the RAM blocks in the file
+ *
+ * Give a region of the file to each migratable RAM block that is not
+ * ignored, and preallocate the file for them.  Can be called again if
+ * the blocks changed since.
+ *
+ * Returns 0 for success or -1 with @errp set
+ *
+ * @rf: RAM file being saved
+ * @errp: pointer to an error
+ */
+int ram_file_prepare(RamFile *rf, Error **errp);
+
+/**
+ * ram_file_save: write the RAM blocks to their region of the file
+ *
+ * Called with the VM stopped, after ram_file_prepare().  Once it
+ * returns, the file is on stable storage at the path given to
+ * ram_file_create().
+ *
+ * Returns the number of bytes written, or -1 with @errp set
+ *
+ * @rf: RAM file being saved
+ * @errp: pointer to an error
+ */
+int64_t ram_file_save(RamFile *rf, Error **errp);
+
+/* Identifier of the RAM file, to check that the one loaded is the same */
+uint64_t ram_file_id(RamFile *rf);
+
+/* Offset of the region of @block, 0 if it has none */
+uint64_t ram_file_block_offset(RamFile *rf, RAMBlock *block);
+
+/**
+ * ram_file_open: open a RAM file for loading
+ *
+ * Returns the RAM file, or NULL with @errp set
+ *
+ * @path: path of the file
+ * @id: identifier that the file must have, see ram_file_id()
+ * @errp: pointer to an error
+ */
+RamFile *ram_file_open(const char *path, uint64_t id, Error **errp);
+
+/**
+ * ram_file_load_block: load a RAM block from its region of the file
+ *
+ * The region is mapped privately over the block when possible, so that
+ * guest memory is paged in from the file on demand; otherwise it is read
+ * by ram_file_load_finish().  Mapping disables uncoordinated RAM discards,
+ * such as virtio-balloon's, for good.
+ *
+ * Returns 0 for success or -1 with @errp set
+ *
+ * @rf: RAM file being loaded
+ * @block: RAM block to load
+ * @offset: offset of the region of @block in the file
+ * @errp: pointer to an error
+ */
+int ram_file_load_block(RamFile *rf, RAMBlock *block, uint64_t offset,
+                        Error **errp);
+
+/**
+ * ram_file_load_finish: read the RAM blocks that could not be mapped
+ *
+ * Returns 0 for success or -1 with @errp set
+ *
+ * @rf: RAM file being loaded
+ * @errp: pointer to an error
+ */
+int ram_file_load_finish(RamFile *rf, Error **errp);
+
+void ram_file_close(RamFile *rf);
+
+/**
+ * ram_file_read_pages: read the pages of a RAM block that are in a file
+ *
+ * The pages are read by several threads, like the regions of a RAM file.
+ *
+ * Returns 0 for success or -1 with @errp set
+ *
+ * @fd: file to read
+ * @block: RAM block to load
+ * @bitmap: pages of @block that are in the file, in target pages
+ * @offset: offset of the first page of @block in the file
+ * @errp: pointer to an error
+ */
+int ram_file_read_pages(int fd, RAMBlock *block, const unsigned long *bitmap,
+                        uint64_t offset, Error **errp);
+
+#endif
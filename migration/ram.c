@@ -32,6 +32,7 @@
 #include "qemu/bitmap.h"
 #include "qemu/madvise.h"
 #include "qemu/main-loop.h"
+#include "qemu/units.h"
 #include "xbzrle.h"
 #include "ram.h"
 #include "migration.h"
@@ -52,9 +53,12 @@
 #include "migration/colo.h"
 #include "block.h"
 #include "sysemu/cpu-throttle.h"
+#include "sysemu/dirtylimit.h"
+#include "hw/core/cpu.h"
 #include "savevm.h"
 #include "qemu/iov.h"
 #include "multifd.h"
+#include "ram-file.h"
 #include "sysemu/runstate.h"
 
 #include "hw/boards.h" /* for machine_dump_guest_core() */
@@ -81,6 +85,8 @@
 #define RAM_SAVE_FLAG_XBZRLE   0x40
 /* 0x80 is reserved in migration.h start with 0x100 next */
 #define RAM_SAVE_FLAG_COMPRESS_PAGE    0x100
+/* RAM was saved to a RAM file, see ram-file.c */
+#define RAM_SAVE_FLAG_FILE     0x200
 
 XBZRLECacheStats xbzrle_counters;
 
@@ -301,16 +307,26 @@ struct RAMState {
     QEMUFile *f;
     /* UFFD file descriptor, used in 'write-tracking' migration */
     int uffdio_fd;
+    /* RAM file of a fast snapshot, NULL otherwise */
+    RamFile *ram_file;
     /* Last block that we have visited searching for dirty pages */
     RAMBlock *last_seen_block;
     /* Last block from where we have sent data */
     RAMBlock *last_sent_block;
+    /* Same as last_sent_block, for each postcopy preempt channel */
+    RAMBlock *postcopy_last_sent_block[POSTCOPY_THREADS_MAX];
+    /* Postcopy preempt channel the next requested page goes on */
+    int postcopy_channel;
     /* Last dirty target page we have sent */
     ram_addr_t last_page;
     /* last ram version we have seen */
     uint32_t last_version;
     /* How many times we have dirty too many pages */
     int dirty_rate_high_cnt;
+    /* Per-vCPU dirty limit set by migration in MB/s, 0 if none */
+    uint64_t dirty_limit;
+    /* Limit of each vCPU before migration set one, 0 if it had none */
+    uint64_t *dirty_limit_saved;
     /* these variables are used for bitmap sync */
     /* last time we did a full bitmap_sync */
     int64_t time_last_bitmap_sync;
@@ -414,6 +430,8 @@ struct PageSearchStatus {
     unsigned long page;
     /* Set once we wrap around */
     bool         complete_round;
+    /* Whether the page was requested by the destination in postcopy */
+    bool         postcopy_requested;
 };
 typedef struct PageSearchStatus PageSearchStatus;
 
@@ -1082,6 +1100,73 @@ static void migration_update_rates(RAMState *rs, int64_t end_time)
     }
 }
 
+/*
+ * Limit the dirty page rate of each vCPU to its share of what could be
+ * sent in the last period, so that only the vCPUs dirtying more than that
+ * are slowed down.  If it was not enough, halve the limit.
+ */
+static void migration_dirty_limit_guest(RAMState *rs,
+                                        uint64_t bytes_dirty_threshold)
+{
+    int64_t period_ms = qemu_clock_get_ms(QEMU_CLOCK_REALTIME) -
+                        rs->time_last_bitmap_sync;
+    uint64_t limit;
+    CPUState *cpu;
+    int nr_cpus = 0;
+
+    CPU_FOREACH(cpu) {
+        nr_cpus++;
+    }
+
+    limit = bytes_dirty_threshold * 1000 / MAX(period_ms, 1) / MiB / nr_cpus;
+    if (rs->dirty_limit) {
+        limit = MIN(limit, rs->dirty_limit / 2);
+    }
+    if (!rs->dirty_limit) {
+        rs->dirty_limit_saved = g_new0(uint64_t, current_machine->smp.max_cpus);
+    }
+    rs->dirty_limit = MAX(limit, 1);
+
+    trace_migration_dirty_limit_guest(rs->dirty_limit);
+    CPU_FOREACH(cpu) {
+        uint64_t *saved = &rs->dirty_limit_saved[cpu->cpu_index];
+
+        /* Remember the user's limit, which may change during migration */
+        if (!dirtylimit_vcpu_by_migration(cpu->cpu_index)) {
+            *saved = dirtylimit_vcpu_quota(cpu->cpu_index);
+        }
+
+        /* Don't loosen a stricter limit set by the user */
+        if (!*saved || *saved > rs->dirty_limit) {
+            dirtylimit_set_vcpu_migration(cpu->cpu_index, rs->dirty_limit);
+        }
+    }
+}
+
+/*
+ * Give back the vCPUs the limits they had before migration limited them,
+ * unless the user changed them in the meantime.
+ */
+static void migration_dirty_limit_restore(RAMState *rs)
+{
+    CPUState *cpu;
+
+    if (!rs->dirty_limit) {
+        return;
+    }
+
+    CPU_FOREACH(cpu) {
+        uint64_t saved = rs->dirty_limit_saved[cpu->cpu_index];
+
+        if (dirtylimit_vcpu_by_migration(cpu->cpu_index)) {
+            dirtylimit_set_vcpu(cpu->cpu_index, saved, saved != 0);
+        }
+    }
+    g_free(rs->dirty_limit_saved);
+    rs->dirty_limit_saved = NULL;
+    rs->dirty_limit = 0;
+}
+
 static void migration_trigger_throttle(RAMState *rs)
 {
     MigrationState *s = migrate_get_current();
@@ -1094,7 +1179,8 @@ static void migration_trigger_throttle(RAMState *rs)
     /* During block migration the auto-converge logic incorrectly detects
      * that ram migration makes no progress. Avoid this by disabling the
      * throttling logic during the bulk phase of block migration. */
-    if (migrate_auto_converge() && !blk_mig_bulk_active()) {
+    if ((migrate_auto_converge() || migrate_dirty_limit()) &&
+        !blk_mig_bulk_active()) {
         /* The following detection logic can be refined later. For now:
            Check to see if the ratio between dirtied bytes and the approx.
            amount of bytes that just got transferred since the last time
@@ -1105,8 +1191,12 @@ static void migration_trigger_throttle(RAMState *rs)
             (++rs->dirty_rate_high_cnt >= 2)) {
             trace_migration_throttle();
             rs->dirty_rate_high_cnt = 0;
-            mig_throttle_guest_down(bytes_dirty_period,
-                                    bytes_dirty_threshold);
+            if (migrate_dirty_limit()) {
+                migration_dirty_limit_guest(rs, bytes_dirty_threshold);
+            } else {
+                mig_throttle_guest_down(bytes_dirty_period,
+                                        bytes_dirty_threshold);
+            }
         }
     }
 }
@@ -1223,8 +1313,19 @@ static int save_zero_page_to_file(RAMState *rs, QEMUFile *file,
  */
 static int save_zero_page(RAMState *rs, RAMBlock *block, ram_addr_t offset)
 {
-    int len = save_zero_page_to_file(rs, rs->f, block, offset);
+    int len;
+
+    if (migrate_mapped_ram()) {
+        /* Pages that are not in the file stay zero on the destination */
+        if (!buffer_is_zero(block->host + offset, TARGET_PAGE_SIZE)) {
+            return -1;
+        }
+        clear_bit_atomic(offset >> TARGET_PAGE_BITS, block->file_bmap);
+        ram_counters.duplicate++;
+        return 1;
+    }
 
+    len = save_zero_page_to_file(rs, rs->f, block, offset);
     if (len) {
         ram_counters.duplicate++;
         ram_transferred_add(len);
@@ -1285,14 +1386,20 @@ static bool control_save_page(RAMState *rs, RAMBlock *block, ram_addr_t offset,
 static int save_normal_page(RAMState *rs, RAMBlock *block, ram_addr_t offset,
                             uint8_t *buf, bool async)
 {
-    ram_transferred_add(save_page_header(rs, rs->f, block,
-                                         offset | RAM_SAVE_FLAG_PAGE));
-    if (async) {
-        qemu_put_buffer_async(rs->f, buf, TARGET_PAGE_SIZE,
-                              migrate_release_ram() &
-                              migration_in_postcopy());
+    if (migrate_mapped_ram()) {
+        qemu_put_buffer_at(rs->f, buf, TARGET_PAGE_SIZE,
+                           block->pages_offset + offset);
+        set_bit_atomic(offset >> TARGET_PAGE_BITS, block->file_bmap);
     } else {
-        qemu_put_buffer(rs->f, buf, TARGET_PAGE_SIZE);
+        ram_transferred_add(save_page_header(rs, rs->f, block,
+                                             offset | RAM_SAVE_FLAG_PAGE));
+        if (async) {
+            qemu_put_buffer_async(rs->f, buf, TARGET_PAGE_SIZE,
+                                  migrate_release_ram() &
+                                  migration_in_postcopy());
+        } else {
+            qemu_put_buffer(rs->f, buf, TARGET_PAGE_SIZE);
+        }
     }
     ram_transferred_add(TARGET_PAGE_SIZE);
     ram_counters.normal++;
@@ -1958,6 +2065,7 @@ static bool get_queued_page(RAMState *rs, PageSearchStatus *pss)
     ram_addr_t offset;
 
     block = unqueue_page(rs, &offset);
+    pss->postcopy_requested = !!block;
 
     if (!block) {
         /*
@@ -2147,6 +2255,12 @@ static int ram_save_target_page(RAMState *rs, PageSearchStatus *pss)
         return 1;
     }
 
+    /* The multifd channels detect zero pages themselves */
+    if (!save_page_use_compression(rs) && migrate_use_multifd_zero_page() &&
+        !migration_in_postcopy()) {
+        return ram_save_multifd_page(rs, block, offset);
+    }
+
     res = save_zero_page(rs, block, offset);
     if (res > 0) {
         /* Must let xbzrle know, otherwise a previous (now 0'd) cached
@@ -2156,6 +2270,7 @@ static int ram_save_target_page(RAMState *rs, PageSearchStatus *pss)
             XBZRLE_cache_lock();
             xbzrle_cache_zero_page(rs, block->offset + offset);
             XBZRLE_cache_unlock();
+            multifd_xbzrle_cache_zero_page(block->offset + offset);
         }
         return res;
     }
@@ -2233,6 +2348,55 @@ static int ram_save_host_page(RAMState *rs, PageSearchStatus *pss)
     return (res < 0 ? res : pages);
 }
 
+/**
+ * ram_save_host_page_urgent: send a host page requested by the destination
+ *
+ * Same as ram_save_host_page(), but the page goes on one of the postcopy
+ * preempt channels, so that it doesn't wait for what was already queued on
+ * the main one.  The channels are used in turn, so that the destination
+ * places the pages of different faults in parallel.  Each of them has its
+ * own last sent block, since the RAM_SAVE_FLAG_CONTINUE state is per
+ * stream.
+ *
+ * Returns the number of pages written or negative on error
+ *
+ * @rs: current RAM state
+ * @pss: data about the page we want to send
+ */
+static int ram_save_host_page_urgent(RAMState *rs, PageSearchStatus *pss)
+{
+    MigrationState *s = migrate_get_current();
+    QEMUFile *main_file = rs->f;
+    RAMBlock *main_last_sent_block = rs->last_sent_block;
+    int channel = rs->postcopy_channel;
+    QEMUFile *file = s->postcopy_qemufile_src[channel];
+    int pages, ret;
+
+    trace_ram_save_host_page_urgent(pss->block->idstr, pss->page, channel);
+
+    rs->postcopy_channel = (channel + 1) % s->postcopy_qemufile_src_count;
+
+    rs->f = file;
+    rs->last_sent_block = rs->postcopy_last_sent_block[channel];
+    pages = ram_save_host_page(rs, pss);
+    rs->postcopy_last_sent_block[channel] = rs->last_sent_block;
+    rs->last_sent_block = main_last_sent_block;
+    rs->f = main_file;
+
+    if (pages > 0) {
+        qemu_fflush(file);
+    }
+
+    /* Don't lose errors of the preempt channels, they fail the migration */
+    ret = qemu_file_get_error(file);
+    if (ret) {
+        qemu_file_set_error(rs->f, ret);
+        return ret;
+    }
+
+    return pages;
+}
+
 /**
  * ram_find_and_save_block: finds a dirty page and sends it to f
  *
@@ -2260,6 +2424,7 @@ static int ram_find_and_save_block(RAMState *rs)
     pss.block = rs->last_seen_block;
     pss.page = rs->last_page;
     pss.complete_round = false;
+    pss.postcopy_requested = false;
 
     if (!pss.block) {
         pss.block = QLIST_FIRST_RCU(&ram_list.blocks);
@@ -2275,7 +2440,12 @@ static int ram_find_and_save_block(RAMState *rs)
         }
 
         if (found) {
-            pages = ram_save_host_page(rs, &pss);
+            if (pss.postcopy_requested && migration_in_postcopy() &&
+                migrate_get_current()->postcopy_qemufile_src_count) {
+                pages = ram_save_host_page_urgent(rs, &pss);
+            } else {
+                pages = ram_save_host_page(rs, &pss);
+            }
         }
     } while (!pages && again);
 
@@ -2365,6 +2535,11 @@ static void ram_save_cleanup(void *opaque)
     RAMState **rsp = opaque;
     RAMBlock *block;
 
+    /* Setup failed before anything was allocated */
+    if (!*rsp) {
+        return;
+    }
+
     /* We don't use dirty log with background snapshots */
     if (!migrate_background_snapshot()) {
         /* caller have hold iothread lock or is in a bh, so there is
@@ -2380,11 +2555,18 @@ static void ram_save_cleanup(void *opaque)
         }
     }
 
+    migration_dirty_limit_restore(*rsp);
+
+    ram_file_close((*rsp)->ram_file);
+    (*rsp)->ram_file = NULL;
+
     RAMBLOCK_FOREACH_NOT_IGNORED(block) {
         g_free(block->clear_bmap);
         block->clear_bmap = NULL;
         g_free(block->bmap);
         block->bmap = NULL;
+        g_free(block->file_bmap);
+        block->file_bmap = NULL;
     }
 
     xbzrle_cleanup();
@@ -2396,6 +2578,9 @@ static void ram_state_reset(RAMState *rs)
 {
     rs->last_seen_block = NULL;
     rs->last_sent_block = NULL;
+    memset(rs->postcopy_last_sent_block, 0,
+           sizeof(rs->postcopy_last_sent_block));
+    rs->postcopy_channel = 0;
     rs->last_page = 0;
     rs->last_version = ram_list.version;
     rs->xbzrle_enabled = false;
@@ -2589,6 +2774,9 @@ void ram_postcopy_send_discard_bitmap(MigrationState *ms)
     /* Easiest way to make sure we don't resume in the middle of a host-page */
     rs->last_seen_block = NULL;
     rs->last_sent_block = NULL;
+    memset(rs->postcopy_last_sent_block, 0,
+           sizeof(rs->postcopy_last_sent_block));
+    rs->postcopy_channel = 0;
     rs->last_page = 0;
 
     postcopy_each_ram_send_discard(ms);
@@ -2771,8 +2959,11 @@ static void ram_init_bitmaps(RAMState *rs)
 
     WITH_RCU_READ_LOCK_GUARD() {
         ram_list_init_bitmaps();
-        /* We don't use dirty log with background snapshots */
-        if (!migrate_background_snapshot()) {
+        /*
+         * We don't use dirty log with background snapshots, nor with fast
+         * snapshots that write all of RAM at once
+         */
+        if (!migrate_background_snapshot() && !migrate_fast_snapshot()) {
             memory_global_dirty_log_start(GLOBAL_DIRTY_MIGRATION);
             migration_bitmap_sync_precopy(rs);
         }
@@ -2884,6 +3075,104 @@ void qemu_guest_free_page_hint(void *addr, size_t len)
     }
 }
 
+/*
+ * With mapped-ram, each page has a fixed place in the migration file, so
+ * that it is written there as many times as it is dirtied, and the file
+ * is loaded with positioned reads instead of replaying the stream.  After
+ * its name and length, each RAM block in the stream says where its pages
+ * are, and where the bitmap of the pages that were written is; the stream
+ * then goes on past the pages.  Pages that are not in the file, zero
+ * pages in particular, are left as they are by the load.
+ *
+ * The bitmap is in 64-bit little endian words, whatever the host.
+ */
+#define MAPPED_RAM_ALIGN    (1 * MiB)
+
+static unsigned long mapped_ram_bitmap_bits(ram_addr_t length)
+{
+    return ROUND_UP(length >> TARGET_PAGE_BITS, 64);
+}
+
+static int mapped_ram_setup_ramblock(QEMUFile *f, RAMBlock *block)
+{
+    unsigned long bits = mapped_ram_bitmap_bits(block->used_length);
+    int64_t pos = qemu_get_offset(f);
+
+    if (pos < 0) {
+        return -1;
+    }
+
+    block->file_bmap = bitmap_new(bits);
+    block->bitmap_offset = pos + 3 * sizeof(uint64_t);
+    block->pages_offset = ROUND_UP(block->bitmap_offset + bits / 8,
+                                   MAPPED_RAM_ALIGN);
+
+    qemu_put_be64(f, TARGET_PAGE_SIZE);
+    qemu_put_be64(f, block->bitmap_offset);
+    qemu_put_be64(f, block->pages_offset);
+    qemu_set_offset(f, block->pages_offset + block->used_length);
+
+    return qemu_file_get_error(f);
+}
+
+/* Called once all the pages are in the file */
+static void mapped_ram_save_bitmaps(QEMUFile *f)
+{
+    RAMBlock *block;
+
+    RCU_READ_LOCK_GUARD();
+
+    RAMBLOCK_FOREACH_NOT_IGNORED(block) {
+        unsigned long bits = mapped_ram_bitmap_bits(block->used_length);
+        g_autofree unsigned long *le_bmap = bitmap_new(bits);
+
+        bitmap_to_le(le_bmap, block->file_bmap, bits);
+        qemu_put_buffer_at(f, (uint8_t *)le_bmap, bits / 8,
+                           block->bitmap_offset);
+    }
+}
+
+static int mapped_ram_load_ramblock(QEMUFile *f, RAMBlock *block,
+                                    ram_addr_t length)
+{
+    unsigned long bits = mapped_ram_bitmap_bits(length);
+    g_autofree unsigned long *le_bmap = NULL;
+    g_autofree unsigned long *bitmap = NULL;
+    uint64_t page_size, bitmap_offset, pages_offset;
+    Error *local_err = NULL;
+
+    page_size = qemu_get_be64(f);
+    bitmap_offset = qemu_get_be64(f);
+    pages_offset = qemu_get_be64(f);
+    if (qemu_file_get_error(f)) {
+        return qemu_file_get_error(f);
+    }
+    if (page_size != TARGET_PAGE_SIZE) {
+        error_report("Mismatched page size of RAM block %s in the file: "
+                     "%" PRIu64, block->idstr, page_size);
+        return -EINVAL;
+    }
+
+    le_bmap = bitmap_new(bits);
+    bitmap = bitmap_new(bits);
+    if (qemu_get_buffer_at(f, (uint8_t *)le_bmap, bits / 8,
+                           bitmap_offset) != bits / 8) {
+        error_report("Failed to read the bitmap of RAM block %s",
+                     block->idstr);
+        return qemu_file_get_error(f);
+    }
+    bitmap_from_le(bitmap, le_bmap, bits);
+
+    if (ram_file_read_pages(qemu_file_get_fd(f), block, bitmap,
+                            pages_offset, &local_err)) {
+        error_report_err(local_err);
+        return -EIO;
+    }
+    qemu_set_offset(f, pages_offset + length);
+
+    return qemu_file_get_error(f);
+}
+
 /*
  * Each of ram_save_setup, ram_save_iterate and ram_save_complete has
  * long-running RCU critical section.  When rcu-reclaims in the code
@@ -2917,6 +3206,24 @@ static int ram_save_setup(QEMUFile *f, void *opaque)
     }
     (*rsp)->f = f;
 
+    if (migrate_fast_snapshot()) {
+        Error *local_err = NULL;
+        const char *path = migrate_get_current()->parameters.fast_snapshot_file;
+
+        /* Lay out the file now, so that it is preallocated before downtime */
+        if (!*path) {
+            error_setg(&local_err, "fast-snapshot requires the "
+                       "fast-snapshot-file parameter");
+        } else {
+            (*rsp)->ram_file = ram_file_create(path, &local_err);
+        }
+        if (!(*rsp)->ram_file ||
+            ram_file_prepare((*rsp)->ram_file, &local_err)) {
+            error_report_err(local_err);
+            return -1;
+        }
+    }
+
     WITH_RCU_READ_LOCK_GUARD() {
         qemu_put_be64(f, ram_bytes_total_common(true) | RAM_SAVE_FLAG_MEM_SIZE);
 
@@ -2931,6 +3238,10 @@ static int ram_save_setup(QEMUFile *f, void *opaque)
             if (migrate_ignore_shared()) {
                 qemu_put_be64(f, block->mr->addr);
             }
+            if (migrate_mapped_ram() && !ramblock_is_ignored(block) &&
+                mapped_ram_setup_ramblock(f, block)) {
+                return -1;
+            }
         }
     }
 
@@ -2968,6 +3279,12 @@ static int ram_save_iterate(QEMUFile *f, void *opaque)
         goto out;
     }
 
+    if (rs->ram_file) {
+        /* All of RAM goes to the RAM file on completion */
+        done = 1;
+        goto out;
+    }
+
     /*
      * We'll take this lock a little bit long, but it's okay for two reasons.
      * Firstly, the only possible other thread to take it is who calls
@@ -3060,6 +3377,59 @@ out:
     return done;
 }
 
+/**
+ * ram_save_file: save all of RAM to the RAM file of a fast snapshot
+ *
+ * Only where the RAM blocks are in the file goes in the migration stream.
+ *
+ * Returns zero to indicate success or negative on error
+ *
+ * Called on completion, with the VM stopped.
+ *
+ * @rs: current RAM state
+ * @f: QEMUFile where to send the data
+ */
+static int ram_save_file(RAMState *rs, QEMUFile *f)
+{
+    const char *path = migrate_get_current()->parameters.fast_snapshot_file;
+    Error *local_err = NULL;
+    RAMBlock *block;
+    uint32_t nr = 0;
+    int64_t bytes;
+
+    /* Blocks may have been resized since the setup */
+    if (ram_file_prepare(rs->ram_file, &local_err)) {
+        error_report_err(local_err);
+        return -1;
+    }
+    bytes = ram_file_save(rs->ram_file, &local_err);
+    if (bytes < 0) {
+        error_report_err(local_err);
+        return -1;
+    }
+    ram_counters.normal += bytes / TARGET_PAGE_SIZE;
+    ram_transferred_add(bytes);
+
+    qemu_put_be64(f, RAM_SAVE_FLAG_FILE);
+    qemu_put_be64(f, ram_file_id(rs->ram_file));
+    qemu_put_be32(f, strlen(path));
+    qemu_put_buffer(f, (uint8_t *)path, strlen(path));
+
+    WITH_RCU_READ_LOCK_GUARD() {
+        RAMBLOCK_FOREACH_NOT_IGNORED(block) {
+            nr++;
+        }
+        qemu_put_be32(f, nr);
+        RAMBLOCK_FOREACH_NOT_IGNORED(block) {
+            qemu_put_byte(f, strlen(block->idstr));
+            qemu_put_buffer(f, (uint8_t *)block->idstr, strlen(block->idstr));
+            qemu_put_be64(f, ram_file_block_offset(rs->ram_file, block));
+        }
+    }
+
+    return 0;
+}
+
 /**
  * ram_save_complete: function called to send the remaining amount of ram
  *
@@ -3078,6 +3448,11 @@ static int ram_save_complete(QEMUFile *f, void *opaque)
 
     rs->last_stage = !migration_in_colo_state();
 
+    if (rs->ram_file) {
+        ret = ram_save_file(rs, f);
+        goto out;
+    }
+
     WITH_RCU_READ_LOCK_GUARD() {
         if (!migration_in_postcopy()) {
             migration_bitmap_sync_precopy(rs);
@@ -3106,10 +3481,26 @@ static int ram_save_complete(QEMUFile *f, void *opaque)
         ram_control_after_iterate(f, RAM_CONTROL_FINISH);
     }
 
+out:
     if (ret >= 0) {
+        MigrationState *s = migrate_get_current();
+
         multifd_send_sync_main(rs->f);
+        if (migrate_mapped_ram()) {
+            mapped_ram_save_bitmaps(f);
+        }
         qemu_put_be64(f, RAM_SAVE_FLAG_EOS);
         qemu_fflush(f);
+
+        /* Let the preempt threads of the destination quit too */
+        if (migration_in_postcopy()) {
+            int i;
+
+            for (i = 0; i < s->postcopy_qemufile_src_count; i++) {
+                qemu_put_be64(s->postcopy_qemufile_src[i], RAM_SAVE_FLAG_EOS);
+                qemu_fflush(s->postcopy_qemufile_src[i]);
+            }
+        }
     }
 
     return ret;
@@ -3124,6 +3515,11 @@ static void ram_save_pending(QEMUFile *f, void *opaque, uint64_t max_size,
     RAMState *rs = *temp;
     uint64_t remaining_size;
 
+    if (rs->ram_file) {
+        /* Nothing to do before completion, see ram_save_file() */
+        return;
+    }
+
     remaining_size = rs->migration_dirty_pages * TARGET_PAGE_SIZE;
 
     if (!migration_in_postcopy() &&
@@ -3188,11 +3584,13 @@ static int load_xbzrle(QEMUFile *f, ram_addr_t addr, void *host)
  * @mis: the migration incoming state pointer
  * @f: QEMUFile where to read the data from
  * @flags: Page flags (mostly to see if it's a continuation of previous block)
+ * @channel: the channel we're using, see RAM_CHANNEL_*
  */
 static inline RAMBlock *ram_block_from_stream(MigrationIncomingState *mis,
-                                              QEMUFile *f, int flags)
+                                              QEMUFile *f, int flags,
+                                              int channel)
 {
-    RAMBlock *block = mis->last_recv_block;
+    RAMBlock *block = mis->last_recv_block[channel];
     char id[256];
     uint8_t len;
 
@@ -3219,7 +3617,7 @@ static inline RAMBlock *ram_block_from_stream(MigrationIncomingState *mis,
         return NULL;
     }
 
-    mis->last_recv_block = block;
+    mis->last_recv_block[channel] = block;
 
     return block;
 }
@@ -3634,19 +4032,21 @@ int ram_postcopy_incoming_init(MigrationIncomingState *mis)
  *
  * Returns 0 for success or -errno in case of error
  *
- * Called in postcopy mode by ram_load().
+ * Called in postcopy mode by ram_load(), and by the postcopy preempt
+ * thread for the pages of the preempt channel; in the latter case it
+ * returns as soon as a host page has been placed.
  * rcu_read_lock is taken prior to this being called.
  *
  * @f: QEMUFile where to send the data
+ * @channel: the channel to use for loading, see RAM_CHANNEL_*
  */
-static int ram_load_postcopy(QEMUFile *f)
+int ram_load_postcopy(QEMUFile *f, int channel)
 {
     int flags = 0, ret = 0;
     bool place_needed = false;
     bool matches_target_page_size = false;
     MigrationIncomingState *mis = migration_incoming_get_current();
-    /* Currently we only use channel 0.  TODO: use all the channels */
-    PostcopyTmpPage *tmp_page = &mis->postcopy_tmp_pages[0];
+    PostcopyTmpPage *tmp_page = &mis->postcopy_tmp_pages[channel];
 
     while (!ret && !(flags & RAM_SAVE_FLAG_EOS)) {
         ram_addr_t addr;
@@ -3673,7 +4073,7 @@ static int ram_load_postcopy(QEMUFile *f)
         trace_ram_load_postcopy_loop((uint64_t)addr, flags);
         if (flags & (RAM_SAVE_FLAG_ZERO | RAM_SAVE_FLAG_PAGE |
                      RAM_SAVE_FLAG_COMPRESS_PAGE)) {
-            block = ram_block_from_stream(mis, f, flags);
+            block = ram_block_from_stream(mis, f, flags, channel);
             if (!block) {
                 ret = -EINVAL;
                 break;
@@ -3778,7 +4178,9 @@ static int ram_load_postcopy(QEMUFile *f)
 
         case RAM_SAVE_FLAG_EOS:
             /* normal exit */
-            multifd_recv_sync_main();
+            if (channel == RAM_CHANNEL_PRECOPY) {
+                multifd_recv_sync_main();
+            }
             break;
         default:
             error_report("Unknown combination of migration flags: 0x%x"
@@ -3806,6 +4208,46 @@ static int ram_load_postcopy(QEMUFile *f)
             }
             place_needed = false;
             postcopy_temp_page_reset(tmp_page);
+            if (channel != RAM_CHANNEL_PRECOPY) {
+                break;
+            }
+        }
+    }
+
+    return ret;
+}
+
+/**
+ * ram_load_postcopy_preempt: load the pages of a postcopy preempt channel
+ *
+ * Returns 0 once the source ended the channel, -errno in case of error
+ *
+ * Called by the postcopy preempt threads.  The rcu_read_lock is only taken
+ * while a host page is being loaded, not while waiting for the next one,
+ * which may take as long as the guest doesn't fault.
+ *
+ * @f: QEMUFile of the preempt channel
+ * @channel: the channel to use for loading, RAM_CHANNEL_POSTCOPY or above
+ */
+int ram_load_postcopy_preempt(QEMUFile *f, int channel)
+{
+    int ret = 0;
+
+    while (!ret) {
+        uint8_t *buf;
+
+        if (qemu_peek_buffer(f, &buf, sizeof(uint64_t), 0) !=
+            sizeof(uint64_t)) {
+            ret = qemu_file_get_error(f);
+            return ret ? ret : -EIO;
+        }
+        if (ldq_be_p(buf) == RAM_SAVE_FLAG_EOS) {
+            qemu_file_skip(f, sizeof(uint64_t));
+            break;
+        }
+
+        WITH_RCU_READ_LOCK_GUARD() {
+            ret = ram_load_postcopy(f, channel);
         }
     }
 
@@ -3873,6 +4315,78 @@ void colo_flush_ram_cache(void)
     trace_colo_flush_ram_cache_end();
 }
 
+/**
+ * ram_load_file: load the RAM blocks from the RAM file of a fast snapshot
+ *
+ * Returns 0 for success or a negative error code
+ *
+ * Called with rcu_read_lock() held.
+ *
+ * @f: QEMUFile where the location of the blocks in the RAM file is
+ */
+static int ram_load_file(QEMUFile *f)
+{
+    const char *dest_path = migrate_get_current()->parameters.fast_snapshot_file;
+    g_autofree char *path = NULL;
+    Error *local_err = NULL;
+    RamFile *rf;
+    uint32_t len, nr, i;
+    uint64_t id;
+    int ret = 0;
+
+    id = qemu_get_be64(f);
+    len = qemu_get_be32(f);
+    if (len > PATH_MAX) {
+        error_report("Invalid RAM file path length %u", len);
+        return -EINVAL;
+    }
+    path = g_malloc0(len + 1);
+    qemu_get_buffer(f, (uint8_t *)path, len);
+    nr = qemu_get_be32(f);
+    ret = qemu_file_get_error(f);
+    if (ret) {
+        return ret;
+    }
+
+    /* The file may be at another path on this side */
+    rf = ram_file_open(*dest_path ? dest_path : path, id, &local_err);
+    if (!rf) {
+        error_report_err(local_err);
+        return -EINVAL;
+    }
+
+    for (i = 0; i < nr && !ret; i++) {
+        char idstr[256];
+        RAMBlock *block;
+        uint64_t offset;
+
+        len = qemu_get_byte(f);
+        qemu_get_buffer(f, (uint8_t *)idstr, len);
+        idstr[len] = 0;
+        offset = qemu_get_be64(f);
+        ret = qemu_file_get_error(f);
+        if (ret) {
+            break;
+        }
+
+        block = qemu_ram_block_by_name(idstr);
+        if (!block || ramblock_is_ignored(block)) {
+            error_report("Unknown RAM block \"%s\" in RAM file", idstr);
+            ret = -EINVAL;
+        } else if (ram_file_load_block(rf, block, offset, &local_err)) {
+            error_report_err(local_err);
+            ret = -EINVAL;
+        }
+    }
+
+    if (!ret && ram_file_load_finish(rf, &local_err)) {
+        error_report_err(local_err);
+        ret = -EIO;
+    }
+    ram_file_close(rf);
+    return ret;
+}
+
 /**
  * ram_load_precopy: load pages in precopy case
  *
@@ -3924,7 +4438,8 @@ static int ram_load_precopy(QEMUFile *f)
 
         if (flags & (RAM_SAVE_FLAG_ZERO | RAM_SAVE_FLAG_PAGE |
                      RAM_SAVE_FLAG_COMPRESS_PAGE | RAM_SAVE_FLAG_XBZRLE)) {
-            RAMBlock *block = ram_block_from_stream(mis, f, flags);
+            RAMBlock *block = ram_block_from_stream(mis, f, flags,
+                                                    RAM_CHANNEL_PRECOPY);
 
             host = host_from_ram_block_offset(block, addr);
             /*
@@ -4013,6 +4528,10 @@ static int ram_load_precopy(QEMUFile *f)
                             ret = -EINVAL;
                         }
                     }
+                    if (!ret && migrate_mapped_ram() &&
+                        !ramblock_is_ignored(block)) {
+                        ret = mapped_ram_load_ramblock(f, block, length);
+                    }
                     ram_control_load_hook(f, RAM_CONTROL_BLOCK_REG,
                                           block->idstr);
                 } else {
@@ -4052,6 +4571,9 @@ static int ram_load_precopy(QEMUFile *f)
                 break;
             }
             break;
+        case RAM_SAVE_FLAG_FILE:
+            ret = ram_load_file(f);
+            break;
         case RAM_SAVE_FLAG_EOS:
             /* normal exit */
             multifd_recv_sync_main();
@@ -4101,7 +4623,7 @@ static int ram_load(QEMUFile *f, void *opaque, int version_id)
      */
     WITH_RCU_READ_LOCK_GUARD() {
         if (postcopy_running) {
-            ret = ram_load_postcopy(f);
+            ret = ram_load_postcopy(f, RAM_CHANNEL_PRECOPY);
         } else {
             ret = ram_load_precopy(f);
         }
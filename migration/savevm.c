@@ -275,6 +275,7 @@ static bool should_validate_capability(int capability)
     /* Validate only new capabilities to keep compatibility. */
     switch (capability) {
     case MIGRATION_CAPABILITY_X_IGNORE_SHARED:
+    case MIGRATION_CAPABILITY_POSTCOPY_PREEMPT:
         return true;
     default:
         return false;
@@ -2107,6 +2108,8 @@ static void migrate_send_rp_req_pages_pending(MigrationIncomingState *mis)
 
 static int loadvm_postcopy_handle_resume(MigrationIncomingState *mis)
 {
+    int i;
+
     if (mis->state != MIGRATION_STATUS_POSTCOPY_RECOVER) {
         error_report("%s: illegal resume received", __func__);
         /* Don't fail the load, only for this. */
@@ -2145,12 +2148,15 @@ static int loadvm_postcopy_handle_resume(MigrationIncomingState *mis)
     migrate_send_rp_req_pages_pending(mis);
 
     /*
-     * It's time to switch state and release the fault thread to continue
+     * It's time to switch state and release the fault threads to continue
      * service page faults.  Note that this should be explicitly after the
-     * above call to migrate_send_rp_req_pages_pending().  In short:
-     * migrate_send_rp_message_req_pages() is not thread safe, yet.
+     * above call to migrate_send_rp_req_pages_pending(), so that the pages
+     * that were already waited for are requested first.  Each of the fault
+     * threads waits for the semaphore once.
      */
-    qemu_sem_post(&mis->postcopy_pause_sem_fault);
+    for (i = 0; i < mis->fault_threads; i++) {
+        qemu_sem_post(&mis->postcopy_pause_sem_fault);
+    }
 
     return 0;
 }
@@ -2575,6 +2581,9 @@ static bool postcopy_pause_incoming(MigrationIncomingState *mis)
 {
     int i;
 
+    /* Before their temporary pages get reset */
+    postcopy_preempt_threads_join(mis, true);
+
     /*
      * If network is interrupted, any temp page we received will be useless
      * because we didn't mark them as "received" in receivedmap.  After a
@@ -12,6 +12,7 @@
  */
 #include "qemu/osdep.h"
 #include "qemu/cutils.h"
+#include "qemu/host-utils.h"
 #include "xbzrle.h"
 
 /*
@@ -24,8 +25,8 @@
 
   length = uleb128 encoded integer
  */
-int xbzrle_encode_buffer(uint8_t *old_buf, uint8_t *new_buf, int slen,
-                         uint8_t *dst, int dlen)
+static int xbzrle_encode_buffer_int(uint8_t *old_buf, uint8_t *new_buf,
+                                    int slen, uint8_t *dst, int dlen)
 {
     uint32_t zrun_len = 0, nzrun_len = 0;
     int d = 0, i = 0;
@@ -126,6 +127,251 @@ int xbzrle_encode_buffer(uint8_t *old_buf, uint8_t *new_buf, int slen,
     return d;
 }
 
+/*
+ * The vector encoders compare 64 bytes at a time into a mask with one bit
+ * per byte that differs, and find the end of each run in it with a bit
+ * scan.  Their output is the same as xbzrle_encode_buffer_int()'s, down
+ * to when they report an overflow.
+ */
+#define XBZRLE_CHUNK 64
+
+#if defined(CONFIG_AVX512F_OPT) || defined(CONFIG_AVX2_OPT)
+#include <immintrin.h>
+
+typedef struct XBZRLEDiff {
+    const uint8_t *old_buf;
+    const uint8_t *new_buf;
+    int slen;
+    /* Offset and mask of the last chunk that was compared */
+    int base;
+    uint64_t mask;
+} XBZRLEDiff;
+
+/*
+ * Return the end of the run starting at @i, that is the first byte from
+ * @i on that differs if @same, or that is equal otherwise.  The chunk
+ * compare @diff_fn is inlined in each accelerated variant.
+ */
+static inline __attribute__((always_inline))
+int xbzrle_run_end(XBZRLEDiff *s, int i, bool same,
+                   uint64_t (*diff_fn)(const uint8_t *, const uint8_t *))
+{
+    int base = i & -XBZRLE_CHUNK;
+    uint64_t bits;
+
+    if (base != s->base) {
+        s->base = base;
+        s->mask = diff_fn(s->old_buf + base, s->new_buf + base);
+    }
+    bits = (same ? s->mask : ~s->mask) >> (i - base);
+    if (bits) {
+        return i + ctz64(bits);
+    }
+
+    for (base += XBZRLE_CHUNK; base < s->slen; base += XBZRLE_CHUNK) {
+        s->base = base;
+        s->mask = diff_fn(s->old_buf + base, s->new_buf + base);
+        bits = same ? s->mask : ~s->mask;
+        if (bits) {
+            return base + ctz64(bits);
+        }
+    }
+    return s->slen;
+}
+
+static inline __attribute__((always_inline))
+int xbzrle_encode_buffer_vec(uint8_t *old_buf, uint8_t *new_buf, int slen,
+                             uint8_t *dst, int dlen,
+                             uint64_t (*diff_fn)(const uint8_t *,
+                                                 const uint8_t *))
+{
+    XBZRLEDiff s = {
+        .old_buf = old_buf,
+        .new_buf = new_buf,
+        .slen = slen,
+        .base = -1,
+    };
+    uint32_t zrun_len, nzrun_len;
+    int d = 0, i = 0, end;
+
+    while (i < slen) {
+        /* overflow */
+        if (d + 2 > dlen) {
+            return -1;
+        }
+
+        end = xbzrle_run_end(&s, i, true, diff_fn);
+        zrun_len = end - i;
+        i = end;
+
+        /* buffer unchanged */
+        if (zrun_len == slen) {
+            return 0;
+        }
+
+        /* skip last zero run */
+        if (i == slen) {
+            return d;
+        }
+
+        d += uleb128_encode_small(dst + d, zrun_len);
+
+        /* overflow */
+        if (d + 2 > dlen) {
+            return -1;
+        }
+
+        end = xbzrle_run_end(&s, i, false, diff_fn);
+        nzrun_len = end - i;
+
+        d += uleb128_encode_small(dst + d, nzrun_len);
+        /* overflow */
+        if (d + nzrun_len > dlen) {
+            return -1;
+        }
+        memcpy(dst + d, new_buf + i, nzrun_len);
+        d += nzrun_len;
+        i = end;
+    }
+
+    return d;
+}
+#endif
+
+#ifdef CONFIG_AVX2_OPT
+#pragma GCC push_options
+#pragma GCC target("avx2")
+
+static inline uint64_t xbzrle_diff_avx2(const uint8_t *old_buf,
+                                        const uint8_t *new_buf)
+{
+    __m256i o0 = _mm256_loadu_si256((const __m256i *)old_buf);
+    __m256i o1 = _mm256_loadu_si256((const __m256i *)(old_buf + 32));
+    __m256i n0 = _mm256_loadu_si256((const __m256i *)new_buf);
+    __m256i n1 = _mm256_loadu_si256((const __m256i *)(new_buf + 32));
+    uint32_t eq0 = _mm256_movemask_epi8(_mm256_cmpeq_epi8(o0, n0));
+    uint32_t eq1 = _mm256_movemask_epi8(_mm256_cmpeq_epi8(o1, n1));
+
+    return ~(((uint64_t)eq1 << 32) | eq0);
+}
+
+static int xbzrle_encode_buffer_avx2(uint8_t *old_buf, uint8_t *new_buf,
+                                     int slen, uint8_t *dst, int dlen)
+{
+    return xbzrle_encode_buffer_vec(old_buf, new_buf, slen, dst, dlen,
+                                    xbzrle_diff_avx2);
+}
+#pragma GCC pop_options
+#endif /* CONFIG_AVX2_OPT */
+
+#ifdef CONFIG_AVX512F_OPT
+#pragma GCC push_options
+#pragma GCC target("avx512bw")
+
+static inline uint64_t xbzrle_diff_avx512(const uint8_t *old_buf,
+                                          const uint8_t *new_buf)
+{
+    return _mm512_cmpneq_epi8_mask(_mm512_loadu_si512(old_buf),
+                                   _mm512_loadu_si512(new_buf));
+}
+
+static int xbzrle_encode_buffer_avx512(uint8_t *old_buf, uint8_t *new_buf,
+                                       int slen, uint8_t *dst, int dlen)
+{
+    return xbzrle_encode_buffer_vec(old_buf, new_buf, slen, dst, dlen,
+                                    xbzrle_diff_avx512);
+}
+#pragma GCC pop_options
+#endif /* CONFIG_AVX512F_OPT */
+
+/* Note that for test_xbzrle_encode_next_accel, the most preferred
+ * ISA must have the least significant bit.
+ */
+#define CACHE_AVX512BW 1
+#define CACHE_AVX2     2
+
+static unsigned cpuid_cache;
+static int (*encode_accel)(uint8_t *, uint8_t *, int, uint8_t *, int) =
+    xbzrle_encode_buffer_int;
+static const char *encode_accel_name = "int";
+
+static void init_accel(unsigned cache)
+{
+    encode_accel = xbzrle_encode_buffer_int;
+    encode_accel_name = "int";
+#ifdef CONFIG_AVX2_OPT
+    if (cache & CACHE_AVX2) {
+        encode_accel = xbzrle_encode_buffer_avx2;
+        encode_accel_name = "avx2";
+    }
+#endif
+#ifdef CONFIG_AVX512F_OPT
+    if (cache & CACHE_AVX512BW) {
+        encode_accel = xbzrle_encode_buffer_avx512;
+        encode_accel_name = "avx512bw";
+    }
+#endif
+}
+
+#if defined(CONFIG_AVX512F_OPT) || defined(CONFIG_AVX2_OPT)
+#include "qemu/cpuid.h"
+
+static void __attribute__((constructor)) init_cpuid_cache(void)
+{
+    unsigned max = __get_cpuid_max(0, NULL);
+    int a, b, c, d;
+    unsigned cache = 0;
+
+    if (max >= 7) {
+        __cpuid(1, a, b, c, d);
+
+        /* We must check that AVX is not just available, but usable.  */
+        if ((c & bit_OSXSAVE) && (c & bit_AVX)) {
+            int bv;
+            __asm("xgetbv" : "=a"(bv), "=d"(d) : "c"(0));
+            __cpuid_count(7, 0, a, b, c, d);
+            if ((bv & 0x6) == 0x6 && (b & bit_AVX2)) {
+                cache |= CACHE_AVX2;
+            }
+            /* See init_cpuid_cache() in util/bufferiszero.c for 0xe6 */
+            if ((bv & 0xe6) == 0xe6 && (b & bit_AVX512F) &&
+                (b & bit_AVX512BW)) {
+                cache |= CACHE_AVX512BW;
+            }
+        }
+    }
+    cpuid_cache = cache;
+    init_accel(cache);
+}
+#endif
+
+bool test_xbzrle_encode_next_accel(void)
+{
+    /* If no bits set, we just tested the int version */
+    if (cpuid_cache == 0) {
+        return false;
+    }
+    /* Disable the accelerator we used before and select a new one.  */
+    cpuid_cache &= cpuid_cache - 1;
+    init_accel(cpuid_cache);
+    return true;
+}
+
+const char *test_xbzrle_encode_accel_name(void)
+{
+    return encode_accel_name;
+}
+
+int xbzrle_encode_buffer(uint8_t *old_buf, uint8_t *new_buf, int slen,
+                         uint8_t *dst, int dlen)
+{
+    /* The vector versions work on whole chunks */
+    if (unlikely(slen % XBZRLE_CHUNK)) {
+        return xbzrle_encode_buffer_int(old_buf, new_buf, slen, dst, dlen);
+    }
+    return encode_accel(old_buf, new_buf, slen, dst, dlen);
+}
+
 int xbzrle_decode_buffer(uint8_t *src, int slen, uint8_t *dst, int dlen)
 {
     int i = 0, d = 0;
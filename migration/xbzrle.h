@@ -18,4 +18,7 @@ int xbzrle_encode_buffer(uint8_t *old_buf, uint8_t *new_buf, int slen,
                          uint8_t *dst, int dlen);
 
 int xbzrle_decode_buffer(uint8_t *src, int slen, uint8_t *dst, int dlen);
+
+bool test_xbzrle_encode_next_accel(void);
+const char *test_xbzrle_encode_accel_name(void);
 #endif
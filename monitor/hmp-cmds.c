@@ -367,6 +367,21 @@ void hmp_info_migrate(Monitor *mon, const QDict *qdict)
         g_free(str);
         visit_free(v);
     }
+    if (info->has_postcopy_latency) {
+        monitor_printf(mon, "postcopy latency: %" PRIu64 " us\n",
+                       info->postcopy_latency);
+    }
+    if (info->has_postcopy_latency_dist) {
+        Visitor *v;
+        char *str;
+        v = string_output_visitor_new(false, &str);
+        visit_type_uint64List(v, NULL, &info->postcopy_latency_dist,
+                              &error_abort);
+        visit_complete(v, &str);
+        monitor_printf(mon, "postcopy latency distribution: %s\n", str);
+        g_free(str);
+        visit_free(v);
+    }
     if (info->has_socket_address) {
         SocketAddressList *addr;
 
@@ -499,6 +514,12 @@ void hmp_info_migrate_parameters(Monitor *mon, const QDict *qdict)
         monitor_printf(mon, "%s: '%s'\n",
             MigrationParameter_str(MIGRATION_PARAMETER_TLS_AUTHZ),
             params->tls_authz);
+        monitor_printf(mon, "%s: '%s'\n",
+            MigrationParameter_str(MIGRATION_PARAMETER_FAST_SNAPSHOT_FILE),
+            params->fast_snapshot_file);
+        monitor_printf(mon, "%s: %u\n",
+            MigrationParameter_str(MIGRATION_PARAMETER_POSTCOPY_THREADS),
+            params->postcopy_threads);
 
         if (params->has_block_bitmap_mapping) {
             const BitmapMigrationNodeAliasList *bmnal;
@@ -1266,6 +1287,12 @@ void hmp_migrate_set_parameter(Monitor *mon, const QDict *qdict)
         p->tls_authz->type = QTYPE_QSTRING;
         visit_type_str(v, param, &p->tls_authz->u.s, &err);
         break;
+    case MIGRATION_PARAMETER_FAST_SNAPSHOT_FILE:
+        p->has_fast_snapshot_file = true;
+        p->fast_snapshot_file = g_new0(StrOrNull, 1);
+        p->fast_snapshot_file->type = QTYPE_QSTRING;
+        visit_type_str(v, param, &p->fast_snapshot_file->u.s, &err);
+        break;
     case MIGRATION_PARAMETER_MAX_BANDWIDTH:
         p->has_max_bandwidth = true;
         /*
@@ -1309,6 +1336,10 @@ void hmp_migrate_set_parameter(Monitor *mon, const QDict *qdict)
         p->has_multifd_zstd_level = true;
         visit_type_uint8(v, param, &p->multifd_zstd_level, &err);
         break;
+    case MIGRATION_PARAMETER_POSTCOPY_THREADS:
+        p->has_postcopy_threads = true;
+        visit_type_uint8(v, param, &p->postcopy_threads, &err);
+        break;
     case MIGRATION_PARAMETER_XBZRLE_CACHE_SIZE:
         p->has_xbzrle_cache_size = true;
         if (!visit_type_size(v, param, &cache_size, &err)) {
@@ -84,6 +84,7 @@ enum {
     OPTION_BITMAPS = 275,
     OPTION_FORCE = 276,
     OPTION_SKIP_BROKEN = 277,
+    OPTION_COMPRESS_THREADS = 278,
 };
 
 typedef enum OutputFormat {
@@ -201,6 +202,8 @@ static void QEMU_NORETURN help(void)
            "  '-m' specifies how many coroutines work in parallel during the convert\n"
            "       process (defaults to 8)\n"
            "  '-W' allow to write to the target out of order rather than sequential\n"
+           "  '--compress-threads' specifies how many threads compress clusters in\n"
+           "       parallel when writing a compressed qcow2 image\n"
            "\n"
            "Parameters to snapshot subcommand:\n"
            "  'snapshot' is the name of the snapshot to create, apply or delete\n"
@@ -1637,7 +1640,18 @@ enum ImgConvertBlockStatus {
 };
 
 #define MAX_COROUTINES 16
+#define MAX_BUF_SECTORS 32768
+#define MAX_COMPRESS_THREADS 64
 #define CONVERT_THROTTLE_GROUP "img_convert"
+#define CONVERT_STATS_INTERVAL_US (1000 * 1000)
+
+/* Throughput accounting for one stage of the convert pipeline */
+typedef struct ImgConvertStageStats {
+    int64_t bytes;
+    int64_t busy_us;    /* time during which at least one request was busy */
+    int64_t start_us;
+    int inflight;
+} ImgConvertStageStats;
 
 typedef struct ImgConvertState {
     BlockBackend **src;
@@ -1666,6 +1680,11 @@ typedef struct ImgConvertState {
     size_t cluster_sectors;
     size_t buf_sectors;
     long num_coroutines;
+    long compress_threads;
+    ImgConvertStageStats read_stats;
+    ImgConvertStageStats write_stats;
+    bool print_stats;
+    int64_t stats_printed_us;
     int running_coroutines;
     Coroutine *co[MAX_COROUTINES];
     int64_t wait_sector_num[MAX_COROUTINES];
@@ -1673,6 +1692,68 @@ typedef struct ImgConvertState {
     int ret;
 } ImgConvertState;
 
+static void convert_stage_enter(ImgConvertStageStats *st)
+{
+    if (st->inflight++ == 0) {
+        st->start_us = g_get_monotonic_time();
+    }
+}
+
+static void convert_stage_leave(ImgConvertStageStats *st, int64_t bytes)
+{
+    st->bytes += bytes;
+    if (--st->inflight == 0) {
+        st->busy_us += g_get_monotonic_time() - st->start_us;
+    }
+}
+
+/* Busy time of @st so far, including the current busy period */
+static double convert_stage_secs(ImgConvertStageStats *st, int64_t now)
+{
+    int64_t busy_us = st->busy_us;
+
+    if (st->inflight) {
+        busy_us += now - st->start_us;
+    }
+    return busy_us / 1e6;
+}
+
+static double convert_stage_rate(ImgConvertStageStats *st, double secs)
+{
+    return secs > 0 ? (double)st->bytes / MiB / secs : 0.0;
+}
+
+static void convert_print_stage(const char *name, ImgConvertStageStats *st)
+{
+    double secs = convert_stage_secs(st, g_get_monotonic_time());
+
+    printf("    %-16s %10.1f MiB in %8.2f s, %10.2f MiB/s\n", name,
+           (double)st->bytes / MiB, secs, convert_stage_rate(st, secs));
+}
+
+/*
+ * Print the throughput of each stage so far, at most once per
+ * CONVERT_STATS_INTERVAL_US. The line overwrites the progress indicator,
+ * which is printed again below it on its next update.
+ */
+static void convert_print_stats(ImgConvertState *s)
+{
+    int64_t now = g_get_monotonic_time();
+
+    if (!s->print_stats ||
+        now - s->stats_printed_us < CONVERT_STATS_INTERVAL_US) {
+        return;
+    }
+    s->stats_printed_us = now;
+
+    printf("    read: %.2f MiB/s, %s: %.2f MiB/s\n",
+           convert_stage_rate(&s->read_stats,
+                              convert_stage_secs(&s->read_stats, now)),
+           s->compressed ? "compress+write" : "write",
+           convert_stage_rate(&s->write_stats,
+                              convert_stage_secs(&s->write_stats, now)));
+}
+
 static void convert_select_part(ImgConvertState *s, int64_t sector_num,
                                 int *src_cur, int64_t *src_cur_offset)
 {
@@ -1845,6 +1926,28 @@ static int coroutine_fn convert_co_read(ImgConvertState *s, int64_t sector_num,
 }
 
 
+/*
+ * Return the number of sectors at the start of @buf that consist of whole
+ * clusters which are either all zero or all non-zero, so that a buffer of
+ * several clusters can be written with one compressed write per run.
+ */
+static int convert_compressed_run(ImgConvertState *s, const uint8_t *buf,
+                                  int nb_sectors)
+{
+    int cs = s->cluster_sectors;
+    bool is_zero = buffer_is_zero(buf, MIN(cs, nb_sectors) * BDRV_SECTOR_SIZE);
+    int n = cs;
+
+    while (n < nb_sectors &&
+           buffer_is_zero(buf + n * BDRV_SECTOR_SIZE,
+                          MIN(cs, nb_sectors - n) * BDRV_SECTOR_SIZE) ==
+           is_zero) {
+        n += cs;
+    }
+
+    return MIN(n, nb_sectors);
+}
+
 static int coroutine_fn convert_co_write(ImgConvertState *s, int64_t sector_num,
                                          int nb_sectors, uint8_t *buf,
                                          enum ImgConvertBlockStatus status)
@@ -1870,6 +1973,9 @@ static int coroutine_fn convert_co_write(ImgConvertState *s, int64_t sector_num,
              * Compressed clusters need to be written as a whole, so in that
              * case we can only save the write if the buffer is completely
              * zeroed. */
+            if (s->compressed && s->min_sparse && n > s->cluster_sectors) {
+                n = convert_compressed_run(s, buf, n);
+            }
             if (!s->min_sparse ||
                 (!s->compressed &&
                  is_allocated_sectors_min(buf, n, &n, s->min_sparse,
@@ -1995,7 +2101,9 @@ static void coroutine_fn convert_co_do_copy(void *opaque)
 retry:
         copy_range = s->copy_range && s->status == BLK_DATA;
         if (status == BLK_DATA && !copy_range) {
+            convert_stage_enter(&s->read_stats);
             ret = convert_co_read(s, sector_num, n, buf);
+            convert_stage_leave(&s->read_stats, n * BDRV_SECTOR_SIZE);
             if (ret < 0) {
                 error_report("error while reading at byte %lld: %s",
                              sector_num * BDRV_SECTOR_SIZE, strerror(-ret));
@@ -2023,7 +2131,10 @@ retry:
                     goto retry;
                 }
             } else {
+                convert_stage_enter(&s->write_stats);
                 ret = convert_co_write(s, sector_num, n, buf, status);
+                convert_stage_leave(&s->write_stats, n * BDRV_SECTOR_SIZE);
+                convert_print_stats(s);
             }
             if (ret < 0) {
                 error_report("error while writing at byte %lld: %s",
@@ -2071,13 +2182,16 @@ static int convert_do_copy(ImgConvertState *s)
     }
 
     /* Allocate buffer for copied data. For compressed images, only one cluster
-     * can be copied at a time. */
+     * can be copied at a time, unless the target compresses the clusters of
+     * a request in parallel. */
     if (s->compressed) {
         if (s->cluster_sectors <= 0 || s->cluster_sectors > s->buf_sectors) {
             error_report("invalid cluster size");
             return -EINVAL;
         }
-        s->buf_sectors = s->cluster_sectors;
+        s->buf_sectors = s->cluster_sectors *
+                         MIN(MAX(s->compress_threads, 1),
+                             MAX_BUF_SECTORS / s->cluster_sectors);
     }
 
     while (sector_num < s->total_sectors) {
@@ -2181,8 +2295,6 @@ static int convert_copy_bitmaps(BlockDriverState *src, BlockDriverState *dst,
     return 0;
 }
 
-#define MAX_BUF_SECTORS 32768
-
 static void set_rate_limit(BlockBackend *blk, int64_t rate_limit)
 {
     ThrottleConfig cfg;
@@ -2238,6 +2350,8 @@ static int img_convert(int argc, char **argv)
             {"target-is-zero", no_argument, 0, OPTION_TARGET_IS_ZERO},
             {"bitmaps", no_argument, 0, OPTION_BITMAPS},
             {"skip-broken-bitmaps", no_argument, 0, OPTION_SKIP_BROKEN},
+            {"compress-threads", required_argument, 0,
+             OPTION_COMPRESS_THREADS},
             {0, 0, 0, 0}
         };
         c = getopt_long(argc, argv, ":hf:O:B:CcF:o:l:S:pt:T:qnm:WUr:",
@@ -2372,6 +2486,16 @@ static int img_convert(int argc, char **argv)
         case OPTION_SKIP_BROKEN:
             skip_broken = true;
             break;
+        case OPTION_COMPRESS_THREADS:
+            if (qemu_strtol(optarg, NULL, 0, &s.compress_threads) ||
+                s.compress_threads < 1 ||
+                s.compress_threads > MAX_COMPRESS_THREADS) {
+                error_report("Invalid number of compression threads. Allowed "
+                             "number of threads is between 1 and %d",
+                             MAX_COMPRESS_THREADS);
+                goto fail_getopt;
+            }
+            break;
         }
     }
 
@@ -2389,6 +2513,24 @@ static int img_convert(int argc, char **argv)
         goto fail_getopt;
     }
 
+    if (s.compress_threads && !s.compressed) {
+        error_report("Use of --compress-threads requires -c");
+        goto fail_getopt;
+    }
+
+    if (s.compress_threads && tgt_image_opts) {
+        error_report("--compress-threads cannot be used with "
+                     "--target-image-opts, use the compress-threads "
+                     "image option instead");
+        goto fail_getopt;
+    }
+
+    if (s.compress_threads && strcmp(out_fmt, "qcow2")) {
+        error_report("--compress-threads is only supported for qcow2 "
+                     "output");
+        goto fail_getopt;
+    }
+
     if (explict_min_sparse && s.copy_range) {
         error_report("Cannot enable copy offloading when -S is used");
         goto fail_getopt;
@@ -2445,6 +2587,8 @@ static int img_convert(int argc, char **argv)
     }
     qemu_progress_init(progress, 1.0);
     qemu_progress_print(0, 100);
+    s.print_stats = progress;
+    s.stats_printed_us = g_get_monotonic_time();
 
     s.src = g_new0(BlockBackend *, s.src_num);
     s.src_sectors = g_new(int64_t, s.src_num);
@@ -2629,6 +2773,9 @@ static int img_convert(int argc, char **argv)
     if (!skip_create) {
         open_opts = qdict_new();
         qemu_opt_foreach(opts, img_add_key_secrets, open_opts, &error_abort);
+        if (s.compress_threads) {
+            qdict_put_int(open_opts, "compress-threads", s.compress_threads);
+        }
 
         /* Create the new image */
         ret = bdrv_create(drv, out_filename, opts, &local_err);
@@ -2656,7 +2803,13 @@ static int img_convert(int argc, char **argv)
         flags |= BDRV_O_RESIZE;
     }
 
-    if (skip_create) {
+    if (skip_create && s.compress_threads) {
+        open_opts = qdict_new();
+        qdict_put_int(open_opts, "compress-threads", s.compress_threads);
+        s.target = img_open_file(out_filename, open_opts, out_fmt,
+                                 flags, writethrough, s.quiet, false);
+        open_opts = NULL; /* blk_new_open will have freed it */
+    } else if (skip_create) {
         s.target = img_open(tgt_image_opts, out_filename, out_fmt,
                             flags, writethrough, s.quiet, false);
     } else {
@@ -2756,6 +2909,12 @@ out:
         qemu_progress_print(100, 0);
     }
     qemu_progress_end();
+    if (!ret && progress) {
+        printf("Throughput per stage:\n");
+        convert_print_stage("read:", &s.read_stats);
+        convert_print_stage(s.compressed ? "compress+write:" : "write:",
+                            &s.write_stats);
+    }
     qemu_opts_del(opts);
     qemu_opts_free(create_opts);
     qobject_unref(open_opts);
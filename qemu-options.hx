@@ -151,6 +151,10 @@ DEF("accel", HAS_ARG, QEMU_OPTION_accel,
     "                kvm-shadow-mem=size of KVM shadow MMU in bytes\n"
     "                split-wx=on|off (enable TCG split w^x mapping)\n"
     "                tb-size=n (TCG translation block cache size)\n"
+    "                tb-cache=file (keep TCG translations in file across runs)\n"
+    "                trace-threshold=n (retranslate TCG blocks run n times as traces)\n"
+    "                translate-threads=n (TCG threads translating ahead of vCPUs)\n"
+    "                jmp-cache-bits=n (log2 of TCG per-vCPU jump cache entries)\n"
     "                dirty-ring-size=n (KVM dirty ring GFN count, default 0)\n"
     "                thread=single|multi (enable multi-threaded TCG)\n", QEMU_ARCH_ALL)
 SRST
@@ -185,6 +189,43 @@ SRST
     ``tb-size=n``
         Controls the size (in MiB) of the TCG translation block cache.
 
+    ``tb-cache=file``
+        Keeps TCG translations in ``file`` across runs. Guest code that
+        was translated by a previous run is not translated again, as
+        long as it did not change; only host code is generated for it.
+        The file is reset when it was written by a different QEMU
+        binary, or with a different machine or CPU configuration.
+        It is not used if another QEMU process already uses it. Once it
+        reaches 256 MiB, it is rewritten on exit with only the
+        translations used by that run.
+        It is only supported on Linux hosts and is not used when TCG
+        plugins are loaded.
+
+    ``trace-threshold=n``
+        Retranslates a TCG translation block once it has run ``n`` times,
+        together with the blocks it usually continues to, as a single
+        trace optimized as a whole. The default is 0, which disables
+        traces. Statistics are shown by the ``info jit`` monitor command.
+        Traces are not used with icount or when TCG plugins are loaded,
+        and translations that are counted are not saved by ``tb-cache``.
+
+    ``translate-threads=n``
+        Starts ``n`` threads that translate, in the background, the blocks
+        that newly translated TCG blocks jump to, so that vCPUs find them
+        translated when they get there. Only used with ``thread=multi``
+        and when TCG plugins are not loaded, and only for targets whose
+        translator supports it (currently x86). The default is 0.
+        Statistics are shown by the ``info jit`` monitor command.
+
+    ``jmp-cache-bits=n``
+        Sets the initial size of the per-vCPU cache that TCG looks up
+        translation blocks in, by guest virtual address, before going to
+        its hash table, to ``2^n`` entries. The cache is 2-way set
+        associative and doubles in size, up to ``2^16`` entries, while
+        too many lookups miss it. ``n`` must be between 8 and 16; the
+        default is 12. Hit rates are shown by the ``info jit`` monitor
+        command.
+
     ``thread=single|multi``
         Controls number of TCG threads. When the TCG is multi-threaded
         there will be one thread per vCPU therefore taking advantage of
@@ -4440,6 +4481,8 @@ DEF("incoming", HAS_ARG, QEMU_OPTION_incoming, \
     "-incoming exec:cmdline\n" \
     "                accept incoming migration on given file descriptor\n" \
     "                or from given external command\n" \
+    "-incoming file:filename\n" \
+    "                accept incoming migration from given file\n" \
     "-incoming defer\n" \
     "                wait for the URI to be specified via migrate_incoming\n",
     QEMU_ARCH_ALL)
@@ -4459,6 +4502,10 @@ SRST
     Accept incoming migration as an output from specified external
     command.
 
+``-incoming file:filename``
+    Accept incoming migration from a file that an outgoing migration to
+    ``file:filename`` wrote.
+
 ``-incoming defer``
     Wait for the URI to be specified via migrate\_incoming. The monitor
     can be used to change settings (such as migration parameters) prior
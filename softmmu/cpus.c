@@ -37,6 +37,7 @@
 #include "qemu/thread.h"
 #include "qemu/plugin.h"
 #include "sysemu/cpus.h"
+#include "sysemu/numa.h"
 #include "qemu/guest-random.h"
 #include "hw/nmi.h"
 #include "sysemu/replay.h"
@@ -642,6 +643,8 @@ void qemu_init_vcpu(CPUState *cpu)
     while (!cpu->created) {
         qemu_cond_wait(&qemu_cpu_cond, &qemu_global_mutex);
     }
+
+    numa_pin_vcpu_thread(cpu);
 }
 
 void cpu_stop_current(void)
@@ -0,0 +1,310 @@
+/*
+ * Per-vCPU dirty page rate limit
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or later.
+ * See the COPYING file in the top-level directory.
+ */
+
+#include "qemu/osdep.h"
+#include "qemu/main-loop.h"
+#include "qemu/rcu.h"
+#include "qemu/thread.h"
+#include "qemu/units.h"
+#include "qapi/error.h"
+#include "qapi/qapi-commands-migration.h"
+#include "hw/boards.h"
+#include "hw/core/cpu.h"
+#include "exec/memory.h"
+#include "exec/target_page.h"
+#include "sysemu/kvm.h"
+#include "sysemu/dirtylimit.h"
+#include "trace.h"
+
+/*
+ * A limited vCPU is made to sleep each time its dirty ring gets full.
+ * Every DIRTYLIMIT_CALC_TIME_MS, the dirty page rate of each vCPU is
+ * measured from the pages collected from its ring, and the time it sleeps
+ * adjusted so that the rate gets to its limit.  vCPUs that stay below
+ * their limit are not slowed down at all.
+ */
+#define DIRTYLIMIT_CALC_TIME_MS         1000
+
+/* Upper bound of the sleep per full dirty ring */
+#define DIRTYLIMIT_THROTTLE_MAX_US      (10 * 1000 * 1000)
+
+/* Sleep in slices of that much, so that a sleeping vCPU can be stopped */
+#define DIRTYLIMIT_SLEEP_SLICE_US       10000
+
+typedef struct VcpuDirtyLimitState {
+    /* Dirty page rate limit in MB/s, 0 if the vCPU is not limited */
+    uint64_t quota;
+    /* Whether @quota was set by migration rather than by the user */
+    bool by_migration;
+    /* Dirty page rate over the last period in MB/s */
+    uint64_t current;
+    /* Dirty pages of the vCPU at the beginning of the period */
+    uint64_t start_pages;
+} VcpuDirtyLimitState;
+
+/* Protected by the BQL */
+static struct {
+    VcpuDirtyLimitState *states;
+    int max_cpus;
+    /* Number of vCPUs with a limit */
+    int limited_nvcpu;
+    /* Whether the thread measuring the dirty page rates runs */
+    bool running;
+} dirtylimit_state;
+
+bool dirtylimit_in_service(void)
+{
+    return qatomic_read(&dirtylimit_state.limited_nvcpu) > 0;
+}
+
+void dirtylimit_vcpu_execute(CPUState *cpu)
+{
+    int64_t sleep_us = qatomic_read(&cpu->throttle_us_per_full);
+
+    if (!sleep_us) {
+        return;
+    }
+
+    trace_dirtylimit_vcpu_execute(cpu->cpu_index, sleep_us);
+    while (sleep_us > 0 && !qatomic_read(&cpu->stop) &&
+           !qatomic_read(&cpu->exit_request)) {
+        int64_t us = MIN(sleep_us, DIRTYLIMIT_SLEEP_SLICE_US);
+
+        g_usleep(us);
+        sleep_us -= us;
+    }
+}
+
+/*
+ * Filling the dirty ring takes ring / rate seconds, of which the vCPU
+ * spends throttle_us_per_full sleeping.  Sleep as much more, or less, as
+ * it takes for that to become ring / quota.  Only go half way there, as
+ * the rate of a vCPU varies from one period to the next.
+ */
+static void dirtylimit_adjust_throttle(CPUState *cpu, double rate)
+{
+    VcpuDirtyLimitState *state = &dirtylimit_state.states[cpu->cpu_index];
+    double ring_mb = (double)kvm_dirty_ring_size() *
+                     qemu_target_page_size() / MiB;
+    int64_t sleep_us = qatomic_read(&cpu->throttle_us_per_full);
+
+    if (!state->quota) {
+        sleep_us = 0;
+    } else if (rate == 0) {
+        /* Idle, or throttled too hard to tell */
+        sleep_us /= 2;
+    } else {
+        sleep_us += (ring_mb * 1000000 / state->quota -
+                     ring_mb * 1000000 / rate) / 2;
+        sleep_us = MIN(MAX(sleep_us, 0), DIRTYLIMIT_THROTTLE_MAX_US);
+    }
+
+    trace_dirtylimit_adjust_throttle(cpu->cpu_index, state->quota,
+                                     state->current, sleep_us);
+    qatomic_set(&cpu->throttle_us_per_full, sleep_us);
+}
+
+static void *dirtylimit_thread(void *opaque)
+{
+    CPUState *cpu;
+
+    rcu_register_thread();
+    qemu_mutex_lock_iothread();
+    memory_global_dirty_log_start(GLOBAL_DIRTY_LIMIT);
+
+    while (dirtylimit_state.limited_nvcpu) {
+        int64_t start = qemu_clock_get_ms(QEMU_CLOCK_REALTIME);
+        int64_t period_ms;
+
+        CPU_FOREACH(cpu) {
+            dirtylimit_state.states[cpu->cpu_index].start_pages =
+                cpu->dirty_pages;
+        }
+
+        qemu_mutex_unlock_iothread();
+        g_usleep(DIRTYLIMIT_CALC_TIME_MS * 1000);
+        qemu_mutex_lock_iothread();
+
+        /* Collect the pages that are still in the dirty rings */
+        memory_global_dirty_log_sync();
+        period_ms = MAX(qemu_clock_get_ms(QEMU_CLOCK_REALTIME) - start, 1);
+
+        CPU_FOREACH(cpu) {
+            VcpuDirtyLimitState *state =
+                &dirtylimit_state.states[cpu->cpu_index];
+            double rate = (double)(cpu->dirty_pages - state->start_pages) *
+                          qemu_target_page_size() / MiB * 1000 / period_ms;
+
+            state->current = rate;
+            dirtylimit_adjust_throttle(cpu, rate);
+        }
+    }
+
+    CPU_FOREACH(cpu) {
+        qatomic_set(&cpu->throttle_us_per_full, 0);
+    }
+    memory_global_dirty_log_stop(GLOBAL_DIRTY_LIMIT);
+    dirtylimit_state.running = false;
+
+    qemu_mutex_unlock_iothread();
+    rcu_unregister_thread();
+    return NULL;
+}
+
+static void dirtylimit_state_init(void)
+{
+    MachineState *ms = MACHINE(qdev_get_machine());
+
+    if (dirtylimit_state.states) {
+        return;
+    }
+    dirtylimit_state.max_cpus = ms->smp.max_cpus;
+    dirtylimit_state.states = g_new0(VcpuDirtyLimitState,
+                                     dirtylimit_state.max_cpus);
+}
+
+static void dirtylimit_do_set_vcpu(int cpu_index, uint64_t quota,
+                                   bool enable, bool by_migration)
+{
+    VcpuDirtyLimitState *state;
+
+    dirtylimit_state_init();
+    assert(cpu_index < dirtylimit_state.max_cpus);
+    state = &dirtylimit_state.states[cpu_index];
+
+    trace_dirtylimit_set_vcpu(cpu_index, enable ? quota : 0);
+    state->by_migration = enable && by_migration;
+    if (enable) {
+        if (!state->quota) {
+            qatomic_inc(&dirtylimit_state.limited_nvcpu);
+        }
+        state->quota = quota;
+    } else if (state->quota) {
+        state->quota = 0;
+        qatomic_dec(&dirtylimit_state.limited_nvcpu);
+    }
+
+    /* The thread stops by itself once no vCPU is limited */
+    if (dirtylimit_state.limited_nvcpu && !dirtylimit_state.running) {
+        QemuThread thread;
+
+        dirtylimit_state.running = true;
+        qemu_thread_create(&thread, "dirtylimit", dirtylimit_thread, NULL,
+                           QEMU_THREAD_DETACHED);
+    }
+}
+
+void dirtylimit_set_vcpu(int cpu_index, uint64_t quota, bool enable)
+{
+    dirtylimit_do_set_vcpu(cpu_index, quota, enable, false);
+}
+
+void dirtylimit_set_vcpu_migration(int cpu_index, uint64_t quota)
+{
+    dirtylimit_do_set_vcpu(cpu_index, quota, true, true);
+}
+
+bool dirtylimit_vcpu_by_migration(int cpu_index)
+{
+    if (!dirtylimit_state.states) {
+        return false;
+    }
+    assert(cpu_index < dirtylimit_state.max_cpus);
+    return dirtylimit_state.states[cpu_index].by_migration;
+}
+
+uint64_t dirtylimit_vcpu_quota(int cpu_index)
+{
+    if (!dirtylimit_state.states) {
+        return 0;
+    }
+    assert(cpu_index < dirtylimit_state.max_cpus);
+    return dirtylimit_state.states[cpu_index].quota;
+}
+
+void dirtylimit_set_all(uint64_t quota, bool enable)
+{
+    CPUState *cpu;
+
+    CPU_FOREACH(cpu) {
+        dirtylimit_set_vcpu(cpu->cpu_index, quota, enable);
+    }
+}
+
+static bool dirtylimit_check(bool has_cpu_index, int64_t cpu_index,
+                             Error **errp)
+{
+    if (!kvm_enabled() || !kvm_dirty_ring_enabled()) {
+        error_setg(errp, "dirty page limit requires KVM with accelerator "
+                   "property 'dirty-ring-size' set");
+        return false;
+    }
+    if (has_cpu_index && (cpu_index < 0 || !qemu_get_cpu(cpu_index))) {
+        error_setg(errp, "incorrect cpu index specified");
+        return false;
+    }
+    return true;
+}
+
+void qmp_set_vcpu_dirty_limit(bool has_cpu_index, int64_t cpu_index,
+                              uint64_t dirty_rate, Error **errp)
+{
+    if (!dirtylimit_check(has_cpu_index, cpu_index, errp)) {
+        return;
+    }
+    if (!dirty_rate) {
+        error_setg(errp, "dirty-rate must be greater than 0, use "
+                   "cancel-vcpu-dirty-limit to remove a limit");
+        return;
+    }
+
+    if (has_cpu_index) {
+        dirtylimit_set_vcpu(cpu_index, dirty_rate, true);
+    } else {
+        dirtylimit_set_all(dirty_rate, true);
+    }
+}
+
+void qmp_cancel_vcpu_dirty_limit(bool has_cpu_index, int64_t cpu_index,
+                                 Error **errp)
+{
+    if (!dirtylimit_check(has_cpu_index, cpu_index, errp)) {
+        return;
+    }
+
+    if (has_cpu_index) {
+        dirtylimit_set_vcpu(cpu_index, 0, false);
+    } else {
+        dirtylimit_set_all(0, false);
+    }
+}
+
+DirtyLimitInfoList *qmp_query_vcpu_dirty_limit(Error **errp)
+{
+    DirtyLimitInfoList *head = NULL, **tail = &head;
+    CPUState *cpu;
+
+    if (!dirtylimit_in_service()) {
+        return NULL;
+    }
+
+    CPU_FOREACH(cpu) {
+        VcpuDirtyLimitState *state = &dirtylimit_state.states[cpu->cpu_index];
+        DirtyLimitInfo *info;
+
+        if (!state->quota) {
+            continue;
+        }
+        info = g_new0(DirtyLimitInfo, 1);
+        info->cpu_index = cpu->cpu_index;
+        info->limit_rate = state->quota;
+        info->current_rate = state->current;
+        QAPI_LIST_APPEND(tail, info);
+    }
+
+    return head;
+}
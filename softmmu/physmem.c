@@ -41,6 +41,7 @@
 #include "qemu/timer.h"
 #include "qemu/config-file.h"
 #include "qemu/error-report.h"
+#include "sysemu/sysemu.h"
 #include "qemu/qemu-print.h"
 #include "qemu/log.h"
 #include "qemu/memalign.h"
@@ -1949,7 +1950,12 @@ static void dirty_memory_extend(ram_addr_t old_ram_size,
         }
 
         for (j = old_num_blocks; j < new_num_blocks; j++) {
-            new_blocks->blocks[j] = bitmap_new(DIRTY_MEMORY_BLOCK_SIZE);
+            ram_addr_t bits = DIRTY_MEMORY_BLOCK_SIZE;
+
+            if (i == DIRTY_MEMORY_MIGRATION) {
+                bits += DIRTY_MEMORY_BLOCK_SIZE / DIRTY_MEMORY_SUMMARY_PAGES;
+            }
+            new_blocks->blocks[j] = bitmap_new(bits);
         }
 
         qatomic_rcu_set(&ram_list.dirty_memory[i], new_blocks);
@@ -2278,6 +2284,20 @@ void qemu_ram_remap(ram_addr_t addr, ram_addr_t length)
         }
     }
 }
+
+void qemu_ram_remap_advise(void *addr, ram_addr_t length)
+{
+    memory_try_enable_merging(addr, length);
+    qemu_ram_setup_dump(addr, length);
+    qemu_madvise(addr, length, QEMU_MADV_HUGEPAGE);
+    if (!qtest_enabled()) {
+        qemu_madvise(addr, length, QEMU_MADV_DONTFORK);
+    }
+    if (enable_mlock && mlock(addr, length) < 0) {
+        warn_report("Failed to lock remapped guest memory: %s",
+                    strerror(errno));
+    }
+}
 #endif /* !_WIN32 */
 
 /* Return a host pointer to ram allocated with qemu_ram_alloc.
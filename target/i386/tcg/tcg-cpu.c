@@ -54,6 +54,21 @@ static void x86_cpu_synchronize_from_tb(CPUState *cs,
     cpu->env.eip = tb->pc - tb->cs_base;
 }
 
+/*
+ * The translator reads the CPU features and the vendor besides the TB
+ * flags, and the MMU index from hflags; see i386_tr_init_disas_context().
+ */
+static void x86_cpu_copy_for_translation(CPUState *dst, CPUState *src)
+{
+    CPUX86State *d = dst->env_ptr;
+    CPUX86State *s = src->env_ptr;
+
+    d->hflags = s->hflags;
+    d->hflags2 = s->hflags2;
+    memcpy(d->features, s->features, sizeof(d->features));
+    d->cpuid_vendor1 = s->cpuid_vendor1;
+}
+
 #ifndef CONFIG_USER_ONLY
 static bool x86_debug_check_breakpoint(CPUState *cs)
 {
@@ -72,6 +87,7 @@ static const struct TCGCPUOps x86_tcg_ops = {
     .synchronize_from_tb = x86_cpu_synchronize_from_tb,
     .cpu_exec_enter = x86_cpu_exec_enter,
     .cpu_exec_exit = x86_cpu_exec_exit,
+    .copy_for_translation = x86_cpu_copy_for_translation,
 #ifdef CONFIG_USER_ONLY
     .fake_user_interrupt = x86_cpu_do_interrupt,
     .record_sigsegv = x86_cpu_record_sigsegv,
@@ -60,6 +60,17 @@ struct tcg_region_state {
     /* fields protected by the lock */
     size_t current; /* current region index */
     size_t agg_size_full; /* aggregate size of full regions */
+
+    /*
+     * Regions that filled up, oldest first, and regions that were
+     * evicted and can be allocated again; see tcg_region_evict().
+     */
+    size_t *full; /* ring of region indexes, starting at .full_first */
+    size_t *full_size; /* size that each full region adds to agg_size_full */
+    size_t full_first;
+    size_t n_full;
+    size_t *free;
+    size_t n_free;
 };
 
 static struct tcg_region_state region;
@@ -167,10 +178,23 @@ static void tcg_region_trees_init(void)
     }
 }
 
-static struct tcg_region_tree *tc_ptr_to_region_tree(const void *p)
+/* Return the index of the region that @p, in the rw buffer, belongs to */
+static size_t tcg_region_index(const void *p)
 {
-    size_t region_idx;
+    ptrdiff_t offset;
+
+    if (p < region.start_aligned) {
+        return 0;
+    }
+    offset = p - region.start_aligned;
+    if (offset > region.stride * (region.n - 1)) {
+        return region.n - 1;
+    }
+    return offset / region.stride;
+}
 
+static struct tcg_region_tree *tc_ptr_to_region_tree(const void *p)
+{
     /*
      * Like tcg_splitwx_to_rw, with no assert.  The pc may come from
      * a signal handler over which the caller has no control.
@@ -181,19 +205,7 @@ static struct tcg_region_tree *tc_ptr_to_region_tree(const void *p)
             return NULL;
         }
     }
-
-    if (p < region.start_aligned) {
-        region_idx = 0;
-    } else {
-        ptrdiff_t offset = p - region.start_aligned;
-
-        if (offset > region.stride * (region.n - 1)) {
-            region_idx = region.n - 1;
-        } else {
-            region_idx = offset / region.stride;
-        }
-    }
-    return region_trees + region_idx * tree_size;
+    return region_trees + tcg_region_index(p) * tree_size;
 }
 
 void tcg_tb_insert(TranslationBlock *tb)
@@ -287,6 +299,14 @@ size_t tcg_nb_tbs(void)
     return nb_tbs;
 }
 
+/* Call with @rt->lock held */
+static void tcg_region_tree_reset(struct tcg_region_tree *rt)
+{
+    /* Increment the refcount first so that destroy acts as a reset */
+    g_tree_ref(rt->tree);
+    g_tree_destroy(rt->tree);
+}
+
 static void tcg_region_tree_reset_all(void)
 {
     size_t i;
@@ -295,9 +315,7 @@ static void tcg_region_tree_reset_all(void)
     for (i = 0; i < region.n; i++) {
         struct tcg_region_tree *rt = region_trees + i * tree_size;
 
-        /* Increment the refcount first so that destroy acts as a reset */
-        g_tree_ref(rt->tree);
-        g_tree_destroy(rt->tree);
+        tcg_region_tree_reset(rt);
     }
     tcg_region_tree_unlock_all();
 }
@@ -335,11 +353,15 @@ static void tcg_region_assign(TCGContext *s, size_t curr_region)
 
 static bool tcg_region_alloc__locked(TCGContext *s)
 {
-    if (region.current == region.n) {
+    if (region.current < region.n) {
+        tcg_region_assign(s, region.current);
+        region.current++;
+    } else if (region.n_free) {
+        /* Reuse the region that was evicted last */
+        tcg_region_assign(s, region.free[--region.n_free]);
+    } else {
         return true;
     }
-    tcg_region_assign(s, region.current);
-    region.current++;
     return false;
 }
 
@@ -352,11 +374,17 @@ bool tcg_region_alloc(TCGContext *s)
     bool err;
     /* read the region size now; alloc__locked will overwrite it on success */
     size_t size_full = s->code_gen_buffer_size;
+    size_t full = tcg_region_index(s->code_gen_buffer);
 
     qemu_mutex_lock(&region.lock);
     err = tcg_region_alloc__locked(s);
     if (!err) {
+        size_t i = (region.full_first + region.n_full) % region.n;
+
         region.agg_size_full += size_full - TCG_HIGHWATER;
+        region.full[i] = full;
+        region.full_size[full] = size_full - TCG_HIGHWATER;
+        region.n_full++;
     }
     qemu_mutex_unlock(&region.lock);
     return err;
@@ -388,6 +416,9 @@ void tcg_region_reset_all(void)
     qemu_mutex_lock(&region.lock);
     region.current = 0;
     region.agg_size_full = 0;
+    region.full_first = 0;
+    region.n_full = 0;
+    region.n_free = 0;
 
     for (i = 0; i < n_ctxs; i++) {
         TCGContext *s = qatomic_read(&tcg_ctxs[i]);
@@ -398,6 +429,51 @@ void tcg_region_reset_all(void)
     tcg_region_tree_reset_all();
 }
 
+/*
+ * Make room for more code without flushing all of it, by evicting the
+ * oldest regions that filled up: a quarter of them, and at least one.
+ * @func is called on each of their TBs, and must make sure that nothing
+ * refers to the TB anymore (hash table, page lists, jumps from other TBs).
+ * Regions in use by a TCG context are never evicted.
+ *
+ * Returns the number of regions evicted, 0 if a region was free already,
+ * or -1 if no region is free and there is none to evict.
+ * Call from a safe-work context.
+ */
+int tcg_region_evict(GTraverseFunc func, gpointer user_data)
+{
+    size_t i, n;
+
+    qemu_mutex_lock(&region.lock);
+    if (region.current < region.n || region.n_free) {
+        qemu_mutex_unlock(&region.lock);
+        return 0;
+    }
+    if (!region.n_full) {
+        qemu_mutex_unlock(&region.lock);
+        return -1;
+    }
+
+    n = MAX(region.n_full / 4, 1);
+    for (i = 0; i < n; i++) {
+        size_t r = region.full[region.full_first];
+        struct tcg_region_tree *rt = region_trees + r * tree_size;
+
+        region.full_first = (region.full_first + 1) % region.n;
+        region.n_full--;
+        region.agg_size_full -= region.full_size[r];
+
+        qemu_mutex_lock(&rt->lock);
+        g_tree_foreach(rt->tree, func, user_data);
+        tcg_region_tree_reset(rt);
+        qemu_mutex_unlock(&rt->lock);
+
+        region.free[region.n_free++] = r;
+    }
+    qemu_mutex_unlock(&region.lock);
+    return n;
+}
+
 static size_t tcg_n_regions(size_t tb_size, unsigned max_cpus)
 {
 #ifdef CONFIG_USER_ONLY
@@ -786,6 +862,9 @@ void tcg_region_init(size_t tb_size, int splitwx, unsigned max_cpus)
 
     /* init the region struct */
     qemu_mutex_init(&region.lock);
+    region.full = g_new(size_t, region.n);
+    region.full_size = g_new(size_t, region.n);
+    region.free = g_new(size_t, region.n);
 
     /*
      * Set guard pages in the rw buffer, as that's the one into which
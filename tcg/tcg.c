@@ -815,6 +815,10 @@ void tcg_func_start(TCGContext *s)
     s->nb_ops = 0;
     s->nb_labels = 0;
     s->current_frame_offset = s->frame_start;
+    s->ir_loaded = false;
+    s->ir_host_ptr = false;
+    s->trace_cont = false;
+    s->nb_goto_tb_dest = 0;
 
 #ifdef CONFIG_DEBUG_TCG
     s->goto_tb_issue_mask = 0;
@@ -2251,6 +2255,298 @@ TCGOp *tcg_op_insert_after(TCGContext *s, TCGOp *old_op, TCGOpcode opc)
     return new_op;
 }
 
+/* Position of the label argument of @opc, or -1 if it has none.  */
+static int tcg_op_label_arg(TCGOpcode opc)
+{
+    switch (opc) {
+    case INDEX_op_set_label:
+    case INDEX_op_br:
+        return 0;
+    case INDEX_op_brcond_i32:
+    case INDEX_op_brcond_i64:
+        return 3;
+    case INDEX_op_brcond2_i32:
+        return 5;
+    default:
+        return -1;
+    }
+}
+
+static void ir_put_uleb(GByteArray *buf, uint64_t val)
+{
+    do {
+        uint8_t byte = val & 0x7f;
+
+        val >>= 7;
+        if (val) {
+            byte |= 0x80;
+        }
+        g_byte_array_append(buf, &byte, 1);
+    } while (val);
+}
+
+/* Zigzag encoding keeps small negative offsets short.  */
+static void ir_put_sleb(GByteArray *buf, int64_t val)
+{
+    ir_put_uleb(buf, ((uint64_t)val << 1) ^ (uint64_t)(val >> 63));
+}
+
+typedef struct TCGIRReader {
+    const uint8_t *p;
+    const uint8_t *end;
+    bool error;
+} TCGIRReader;
+
+static uint64_t ir_get_uleb(TCGIRReader *r)
+{
+    uint64_t val = 0;
+    int shift;
+
+    for (shift = 0; r->p < r->end && shift < 64; shift += 7) {
+        uint8_t byte = *r->p++;
+
+        val |= (uint64_t)(byte & 0x7f) << shift;
+        if (!(byte & 0x80)) {
+            return val;
+        }
+    }
+    r->error = true;
+    return 0;
+}
+
+static int64_t ir_get_sleb(TCGIRReader *r)
+{
+    uint64_t val = ir_get_uleb(r);
+
+    return (val >> 1) ^ -(val & 1);
+}
+
+bool tcg_ir_save(TCGContext *s, const TranslationBlock *tb, GByteArray *buf)
+{
+    uintptr_t tb_rx = (uintptr_t)tcg_splitwx_to_rx((void *)tb);
+    TCGLabel *l;
+    TCGOp *op;
+    int i;
+
+    g_byte_array_set_size(buf, 0);
+    if (s->ir_host_ptr) {
+        return false;
+    }
+
+    ir_put_uleb(buf, s->nb_globals);
+    ir_put_uleb(buf, s->nb_temps);
+    for (i = s->nb_globals; i < s->nb_temps; i++) {
+        TCGTemp *ts = &s->temps[i];
+        uint8_t desc[4] = {
+            ts->base_type, ts->type, ts->kind, ts->temp_allocated
+        };
+
+        g_byte_array_append(buf, desc, sizeof(desc));
+        if (ts->kind == TEMP_CONST) {
+            ir_put_sleb(buf, ts->val);
+        }
+    }
+
+    ir_put_uleb(buf, s->nb_labels);
+    QSIMPLEQ_FOREACH(l, &s->labels, next) {
+        ir_put_uleb(buf, l->present | l->refs << 1);
+    }
+
+    ir_put_uleb(buf, s->nb_ops);
+    QTAILQ_FOREACH(op, &s->ops, link) {
+        const TCGOpDef *def = &tcg_op_defs[op->opc];
+        const TCGHelperInfo *info = NULL;
+        uint8_t head[2] = { op->opc, op->param1 | op->param2 << 4 };
+        int nb_targs, nb_cargs, label_pos;
+
+        switch (op->opc) {
+        case INDEX_op_call:
+            /* Plugin callbacks use a template info for their own code.  */
+            info = tcg_call_info(op);
+            if (info < all_helpers ||
+                info >= all_helpers + ARRAY_SIZE(all_helpers) ||
+                tcg_call_func(op) != info->func) {
+                goto fail;
+            }
+            nb_targs = TCGOP_CALLO(op) + TCGOP_CALLI(op);
+            nb_cargs = 0;
+            break;
+        case INDEX_op_plugin_cb_start:
+        case INDEX_op_plugin_cb_end:
+            goto fail;
+        default:
+            nb_targs = def->nb_oargs + def->nb_iargs;
+            nb_cargs = def->nb_cargs;
+            break;
+        }
+
+        g_byte_array_append(buf, head, sizeof(head));
+        for (i = 0; i < nb_targs; i++) {
+            TCGArg arg = op->args[i];
+
+            ir_put_uleb(buf, arg == TCG_CALL_DUMMY_ARG
+                        ? 0 : temp_idx(arg_temp(arg)) + 1);
+        }
+        if (info) {
+            ir_put_uleb(buf, info - all_helpers);
+        }
+
+        label_pos = tcg_op_label_arg(op->opc);
+        for (i = nb_targs; i < nb_targs + nb_cargs; i++) {
+            TCGArg arg = op->args[i];
+
+            if (i == label_pos) {
+                arg = arg_label(arg)->id;
+            } else if (op->opc == INDEX_op_exit_tb && arg) {
+                /* Exits from this TB are saved as the exit index plus 1.  */
+                arg -= tb_rx;
+                if (arg > TB_EXIT_MASK) {
+                    goto fail;
+                }
+                arg++;
+            }
+            ir_put_sleb(buf, arg);
+        }
+    }
+    return true;
+
+ fail:
+    g_byte_array_set_size(buf, 0);
+    return false;
+}
+
+bool tcg_ir_load(TCGContext *s, const TranslationBlock *tb,
+                 const uint8_t *buf, size_t len)
+{
+    uintptr_t tb_rx = (uintptr_t)tcg_splitwx_to_rx((void *)tb);
+    TCGIRReader r = { .p = buf, .end = buf + len };
+    uint64_t nb_temps, nb_labels, nb_ops, n;
+    TCGLabel **labels;
+    int i;
+
+    if (ir_get_uleb(&r) != s->nb_globals) {
+        return false;
+    }
+    nb_temps = ir_get_uleb(&r);
+    if (r.error || nb_temps < s->nb_globals || nb_temps > TCG_MAX_TEMPS) {
+        return false;
+    }
+    for (i = s->nb_globals; i < nb_temps; i++) {
+        TCGTemp *ts;
+
+        if (r.end - r.p < 4 ||
+            r.p[0] >= TCG_TYPE_COUNT || r.p[1] >= TCG_TYPE_COUNT ||
+            (r.p[2] != TEMP_NORMAL && r.p[2] != TEMP_LOCAL &&
+             r.p[2] != TEMP_CONST)) {
+            return false;
+        }
+        ts = tcg_temp_alloc(s);
+        ts->base_type = r.p[0];
+        ts->type = r.p[1];
+        ts->kind = r.p[2];
+        ts->temp_allocated = r.p[3] & 1;
+        r.p += 4;
+        if (ts->kind == TEMP_CONST) {
+            ts->val = ir_get_sleb(&r);
+        }
+    }
+
+    nb_labels = ir_get_uleb(&r);
+    if (r.error || nb_labels > r.end - r.p || nb_labels > 1 << 14) {
+        return false;
+    }
+    labels = tcg_malloc(sizeof(TCGLabel *) * nb_labels);
+    for (n = 0; n < nb_labels; n++) {
+        uint64_t desc = ir_get_uleb(&r);
+
+        labels[n] = gen_new_label();
+        labels[n]->present = desc & 1;
+        labels[n]->refs = desc >> 1;
+    }
+
+    nb_ops = ir_get_uleb(&r);
+    if (r.error || nb_ops > r.end - r.p) {
+        return false;
+    }
+    for (n = 0; n < nb_ops; n++) {
+        const TCGOpDef *def;
+        TCGOpcode opc;
+        TCGOp *op;
+        int nb_targs, nb_cargs, nb_args, label_pos;
+
+        if (r.end - r.p < 2 || r.p[0] >= NB_OPS) {
+            return false;
+        }
+        opc = r.p[0];
+        def = &tcg_op_defs[opc];
+        op = tcg_emit_op(opc);
+        op->param1 = r.p[1] & 15;
+        op->param2 = r.p[1] >> 4;
+        r.p += 2;
+
+        switch (opc) {
+        case INDEX_op_call:
+            nb_targs = TCGOP_CALLO(op) + TCGOP_CALLI(op);
+            nb_cargs = 0;
+            nb_args = nb_targs + 2;
+            break;
+        case INDEX_op_plugin_cb_start:
+        case INDEX_op_plugin_cb_end:
+            return false;
+        default:
+            nb_targs = def->nb_oargs + def->nb_iargs;
+            nb_cargs = def->nb_cargs;
+            nb_args = nb_targs + nb_cargs;
+            break;
+        }
+        if (nb_args > MAX_OPC_PARAM) {
+            return false;
+        }
+
+        for (i = 0; i < nb_targs; i++) {
+            uint64_t idx = ir_get_uleb(&r);
+
+            if (idx == 0 && opc == INDEX_op_call) {
+                op->args[i] = TCG_CALL_DUMMY_ARG;
+            } else if (idx == 0 || idx > nb_temps) {
+                return false;
+            } else {
+                op->args[i] = temp_arg(&s->temps[idx - 1]);
+            }
+        }
+        if (opc == INDEX_op_call) {
+            uint64_t idx = ir_get_uleb(&r);
+
+            if (idx >= ARRAY_SIZE(all_helpers)) {
+                return false;
+            }
+            op->args[nb_targs] = (uintptr_t)all_helpers[idx].func;
+            op->args[nb_targs + 1] = (uintptr_t)&all_helpers[idx];
+        }
+
+        label_pos = tcg_op_label_arg(opc);
+        for (i = nb_targs; i < nb_targs + nb_cargs; i++) {
+            TCGArg arg = ir_get_sleb(&r);
+
+            if (i == label_pos) {
+                if (arg >= nb_labels) {
+                    return false;
+                }
+                arg = label_arg(labels[arg]);
+            } else if (opc == INDEX_op_exit_tb && arg) {
+                arg = tb_rx + arg - 1;
+            }
+            op->args[i] = arg;
+        }
+    }
+
+    if (r.error || r.p != r.end) {
+        return false;
+    }
+    s->ir_loaded = true;
+    return true;
+}
+
 /* Reachable analysis : remove unreachable code.  */
 static void reachable_code_pass(TCGContext *s)
 {
@@ -4230,7 +4526,10 @@ int tcg_gen_code(TCGContext *s, TranslationBlock *tb)
 #endif
 
 #ifdef USE_TCG_OPTIMIZATIONS
-    tcg_optimize(s);
+    /* Ops loaded from the TB cache were optimized before being saved.  */
+    if (!s->ir_loaded) {
+        tcg_optimize(s);
+    }
 #endif
 
 #ifdef CONFIG_PROFILER
@@ -4238,7 +4537,12 @@ int tcg_gen_code(TCGContext *s, TranslationBlock *tb)
     qatomic_set(&prof->la_time, prof->la_time - profile_getclock());
 #endif
 
-    reachable_code_pass(s);
+    if (!s->ir_loaded) {
+        reachable_code_pass(s);
+        if (s->ir_save) {
+            tcg_ir_save(s, tb, s->ir_save);
+        }
+    }
     liveness_pass_1(s);
 
     if (s->nb_indirects > 0) {
@@ -0,0 +1,264 @@
+/*
+ * QEMU Crypto block (LUKS) multi-threaded throughput benchmark
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or
+ * (at your option) any later version.  See the COPYING file in the
+ * top-level directory.
+ *
+ * Models the qcow2 crypto thread pool: a submitter keeps @depth requests
+ * of one cluster each in flight, and a pool of "crypt-threads" workers
+ * encrypts them in parallel, each worker using its own cipher context of
+ * the QCryptoBlock. Throughput scales with @depth until the pool is busy.
+ *
+ * Usage: benchmark-crypto-block [--threads N] [--depth N] [GTest options]
+ * Without --depth, depths 1 to 128 are measured.
+ */
+#include "qemu/osdep.h"
+#include "qemu/units.h"
+#include "qemu/atomic.h"
+#include "qemu/buffer.h"
+#include "qemu/module.h"
+#include "qemu/thread.h"
+#include "qapi/error.h"
+#include "crypto/init.h"
+#include "crypto/block.h"
+#include "crypto/cipher.h"
+#include "crypto/secret.h"
+
+#define CLUSTER_SIZE (64 * KiB)
+#define MAX_THREADS 64
+#define MAX_DEPTH 128
+
+static int opt_threads;
+static int opt_depth;
+
+static QCryptoBlockCreateOptions luks_create_opts = {
+    .format = Q_CRYPTO_BLOCK_FORMAT_LUKS,
+    .u.luks = {
+        .has_key_secret = true,
+        .key_secret = (char *)"sec0",
+        .has_cipher_alg = true,
+        .cipher_alg = QCRYPTO_CIPHER_ALG_AES_256,
+        .has_cipher_mode = true,
+        .cipher_mode = QCRYPTO_CIPHER_MODE_XTS,
+        .has_ivgen_alg = true,
+        .ivgen_alg = QCRYPTO_IVGEN_ALG_PLAIN64,
+        .has_iter_time = true,
+        .iter_time = 10,
+    },
+};
+
+static QCryptoBlockOpenOptions luks_open_opts = {
+    .format = Q_CRYPTO_BLOCK_FORMAT_LUKS,
+    .u.luks = {
+        .has_key_secret = true,
+        .key_secret = (char *)"sec0",
+    },
+};
+
+typedef struct BenchJob {
+    QCryptoBlock *blk;
+    uint64_t nb_clusters;
+    bool decrypt;
+    /* Submitted cluster numbers plus one, 0 tells a worker to exit */
+    GAsyncQueue *queue;
+    /* Free request slots, initialized to the queue depth */
+    QemuSemaphore slots;
+} BenchJob;
+
+typedef struct BenchWorker {
+    QemuThread thread;
+    BenchJob *job;
+    uint8_t *buf;
+} BenchWorker;
+
+static ssize_t bench_block_read_func(QCryptoBlock *block, size_t offset,
+                                     uint8_t *buf, size_t buflen,
+                                     void *opaque, Error **errp)
+{
+    Buffer *header = opaque;
+
+    g_assert_cmpint(offset + buflen, <=, header->capacity);
+    memcpy(buf, header->buffer + offset, buflen);
+    return buflen;
+}
+
+static ssize_t bench_block_init_func(QCryptoBlock *block, size_t headerlen,
+                                     void *opaque, Error **errp)
+{
+    Buffer *header = opaque;
+
+    buffer_reserve(header, headerlen);
+    return headerlen;
+}
+
+static ssize_t bench_block_write_func(QCryptoBlock *block, size_t offset,
+                                      const uint8_t *buf, size_t buflen,
+                                      void *opaque, Error **errp)
+{
+    Buffer *header = opaque;
+
+    g_assert_cmpint(buflen + offset, <=, header->capacity);
+    memcpy(header->buffer + offset, buf, buflen);
+    header->offset = offset + buflen;
+    return buflen;
+}
+
+static void *bench_worker_thread(void *opaque)
+{
+    BenchWorker *w = opaque;
+    BenchJob *job = w->job;
+    uint64_t cluster;
+
+    while ((cluster = GPOINTER_TO_SIZE(g_async_queue_pop(job->queue)))) {
+        uint64_t offset = (cluster - 1) * CLUSTER_SIZE;
+        int ret;
+
+        if (job->decrypt) {
+            ret = qcrypto_block_decrypt(job->blk, offset, w->buf,
+                                        CLUSTER_SIZE, &error_abort);
+        } else {
+            ret = qcrypto_block_encrypt(job->blk, offset, w->buf,
+                                        CLUSTER_SIZE, &error_abort);
+        }
+        g_assert(ret == 0);
+        qemu_sem_post(&job->slots);
+    }
+
+    return NULL;
+}
+
+static double bench_run(QCryptoBlock *blk, int nb_workers, int depth,
+                        bool decrypt)
+{
+    const uint64_t total = 1 * GiB;
+    BenchWorker workers[MAX_THREADS];
+    BenchJob job = {
+        .blk = blk,
+        .nb_clusters = total / CLUSTER_SIZE,
+        .decrypt = decrypt,
+        .queue = g_async_queue_new(),
+    };
+    uint64_t cluster;
+    double elapsed;
+    int i;
+
+    qemu_sem_init(&job.slots, depth);
+    for (i = 0; i < nb_workers; i++) {
+        workers[i].job = &job;
+        workers[i].buf = g_malloc(CLUSTER_SIZE);
+        memset(workers[i].buf, g_test_rand_int(), CLUSTER_SIZE);
+    }
+
+    g_test_timer_start();
+    for (i = 0; i < nb_workers; i++) {
+        qemu_thread_create(&workers[i].thread, "bench-crypt",
+                           bench_worker_thread, &workers[i],
+                           QEMU_THREAD_JOINABLE);
+    }
+    for (cluster = 0; cluster < job.nb_clusters; cluster++) {
+        qemu_sem_wait(&job.slots);
+        g_async_queue_push(job.queue, GSIZE_TO_POINTER(cluster + 1));
+    }
+    /* Wait for the requests still in flight before stopping the clock */
+    for (i = 0; i < depth; i++) {
+        qemu_sem_wait(&job.slots);
+    }
+    elapsed = g_test_timer_elapsed();
+
+    for (i = 0; i < nb_workers; i++) {
+        g_async_queue_push(job.queue, GSIZE_TO_POINTER(0));
+    }
+    for (i = 0; i < nb_workers; i++) {
+        qemu_thread_join(&workers[i].thread);
+        g_free(workers[i].buf);
+    }
+    qemu_sem_destroy(&job.slots);
+    g_async_queue_unref(job.queue);
+
+    return (double)total / MiB / elapsed;
+}
+
+static void test_block_speed(const void *opaque)
+{
+    int depth = GPOINTER_TO_INT(opaque);
+    int nb_workers = opt_threads;
+    QCryptoBlock *blk;
+    Buffer header;
+    Object *sec;
+
+    sec = object_new_with_props(TYPE_QCRYPTO_SECRET,
+                                object_get_objects_root(),
+                                "sec0", &error_abort,
+                                "data", "123456", NULL);
+
+    memset(&header, 0, sizeof(header));
+    buffer_init(&header, "header");
+    blk = qcrypto_block_create(&luks_create_opts, NULL,
+                               bench_block_init_func,
+                               bench_block_write_func,
+                               &header, &error_abort);
+    qcrypto_block_free(blk);
+
+    /* One cipher context per worker, as qcow2 does with crypt-threads */
+    blk = qcrypto_block_open(&luks_open_opts, NULL,
+                             bench_block_read_func, &header,
+                             0, nb_workers, &error_abort);
+
+    g_test_message("enc(luks-aes-256-xts) depth %d threads %d %.2f MB/sec",
+                   depth, nb_workers, bench_run(blk, nb_workers, depth, false));
+    g_test_message("dec(luks-aes-256-xts) depth %d threads %d %.2f MB/sec",
+                   depth, nb_workers, bench_run(blk, nb_workers, depth, true));
+
+    qcrypto_block_free(blk);
+    buffer_free(&header);
+    object_unparent(sec);
+}
+
+int main(int argc, char **argv)
+{
+    GOptionEntry entries[] = {
+        { "threads", 0, 0, G_OPTION_ARG_INT, &opt_threads,
+          "number of crypto threads (default: number of host CPUs)", "N" },
+        { "depth", 0, 0, G_OPTION_ARG_INT, &opt_depth,
+          "number of requests in flight (default: 1 to 128)", "N" },
+        { NULL }
+    };
+    g_autoptr(GOptionContext) context = NULL;
+    g_autoptr(GError) err = NULL;
+    int depth;
+
+    module_call_init(MODULE_INIT_QOM);
+    g_test_init(&argc, &argv, NULL);
+    g_assert(qcrypto_init(NULL) == 0);
+
+    context = g_option_context_new(NULL);
+    g_option_context_add_main_entries(context, entries, NULL);
+    if (!g_option_context_parse(context, &argc, &argv, &err)) {
+        g_printerr("%s\n", err->message);
+        return 1;
+    }
+    if (!opt_threads) {
+        opt_threads = MIN(MAX_THREADS, g_get_num_processors());
+    }
+    if (opt_threads < 1 || opt_threads > MAX_THREADS ||
+        opt_depth < 0 || opt_depth > MAX_DEPTH) {
+        g_printerr("--threads must be between 1 and %d, "
+                   "--depth between 1 and %d\n", MAX_THREADS, MAX_DEPTH);
+        return 1;
+    }
+
+    if (!qcrypto_cipher_supports(QCRYPTO_CIPHER_ALG_AES_256,
+                                 QCRYPTO_CIPHER_MODE_XTS)) {
+        return 0;
+    }
+
+    for (depth = opt_depth ?: 1; depth <= (opt_depth ?: MAX_DEPTH);
+         depth *= 2) {
+        g_autofree char *path =
+            g_strdup_printf("/crypto/block/luks/depth-%d", depth);
+        g_test_add_data_func(path, GINT_TO_POINTER(depth), test_block_speed);
+    }
+
+    return g_test_run();
+}
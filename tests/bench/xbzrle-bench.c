@@ -0,0 +1,152 @@
+/*
+ * XBZRLE encoding and decoding speed benchmark
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or
+ * (at your option) any later version.  See the COPYING file in the
+ * top-level directory.
+ *
+ * Encodes a set of pages against an updated copy, for changes ranging
+ * from none to every other byte, with each encoder the host supports.
+ */
+#include "qemu/osdep.h"
+#include "qemu/units.h"
+#include "../migration/xbzrle.h"
+
+#define PAGE_SIZE 4096
+#define NB_PAGES 1024
+#define ROUNDS 64
+
+typedef struct XBZRLEPattern {
+    const char *name;
+    /* Change @len bytes every @stride bytes of each page */
+    int stride;
+    int len;
+} XBZRLEPattern;
+
+static const XBZRLEPattern patterns[] = {
+    { "unchanged", 0, 0 },
+    { "1-byte", PAGE_SIZE, 1 },
+    { "8x8-bytes", PAGE_SIZE / 8, 8 },
+    { "64x1-byte", PAGE_SIZE / 64, 1 },
+    { "1x512-bytes", PAGE_SIZE, 512 },
+    { "every-other-byte", 2, 1 },
+};
+
+typedef struct XBZRLEBench {
+    uint8_t *old_buf;
+    uint8_t *new_buf;
+    uint8_t *encoded;
+    int encoded_len[NB_PAGES];
+} XBZRLEBench;
+
+static void bench_init(XBZRLEBench *b, const XBZRLEPattern *pattern)
+{
+    int i, j;
+
+    b->old_buf = g_malloc(NB_PAGES * PAGE_SIZE);
+    b->new_buf = g_malloc(NB_PAGES * PAGE_SIZE);
+    b->encoded = g_malloc(NB_PAGES * PAGE_SIZE);
+
+    for (i = 0; i < NB_PAGES * PAGE_SIZE; i++) {
+        b->old_buf[i] = g_test_rand_int();
+    }
+    memcpy(b->new_buf, b->old_buf, NB_PAGES * PAGE_SIZE);
+
+    for (i = 0; pattern->stride && i < NB_PAGES; i++) {
+        /* Move the changes around so that they are not all aligned */
+        int start = g_test_rand_int_range(0, pattern->stride);
+
+        for (j = start; j + pattern->len <= PAGE_SIZE; j += pattern->stride) {
+            uint8_t *p = b->new_buf + i * PAGE_SIZE + j;
+            int k;
+
+            for (k = 0; k < pattern->len; k++) {
+                p[k] = ~p[k];
+            }
+        }
+    }
+}
+
+static void bench_free(XBZRLEBench *b)
+{
+    g_free(b->old_buf);
+    g_free(b->new_buf);
+    g_free(b->encoded);
+}
+
+static double bench_encode(XBZRLEBench *b)
+{
+    int i, round;
+
+    g_test_timer_start();
+    for (round = 0; round < ROUNDS; round++) {
+        for (i = 0; i < NB_PAGES; i++) {
+            b->encoded_len[i] =
+                xbzrle_encode_buffer(b->old_buf + i * PAGE_SIZE,
+                                     b->new_buf + i * PAGE_SIZE, PAGE_SIZE,
+                                     b->encoded + i * PAGE_SIZE, PAGE_SIZE);
+        }
+    }
+    return (double)ROUNDS * NB_PAGES * PAGE_SIZE / MiB /
+           g_test_timer_elapsed();
+}
+
+static double bench_decode(XBZRLEBench *b)
+{
+    int i, round;
+
+    g_test_timer_start();
+    for (round = 0; round < ROUNDS; round++) {
+        for (i = 0; i < NB_PAGES; i++) {
+            if (b->encoded_len[i] < 0) {
+                /* Migration sends the page as is on overflow */
+                memcpy(b->old_buf + i * PAGE_SIZE, b->new_buf + i * PAGE_SIZE,
+                       PAGE_SIZE);
+                continue;
+            } else if (!b->encoded_len[i]) {
+                continue;
+            }
+            g_assert(xbzrle_decode_buffer(b->encoded + i * PAGE_SIZE,
+                                          b->encoded_len[i],
+                                          b->old_buf + i * PAGE_SIZE,
+                                          PAGE_SIZE) > 0);
+        }
+    }
+    return (double)ROUNDS * NB_PAGES * PAGE_SIZE / MiB /
+           g_test_timer_elapsed();
+}
+
+static void test_xbzrle_speed(void)
+{
+    XBZRLEBench benchs[ARRAY_SIZE(patterns)];
+    int i;
+
+    for (i = 0; i < ARRAY_SIZE(patterns); i++) {
+        bench_init(&benchs[i], &patterns[i]);
+    }
+
+    /* The encoders can only be walked through once, from the best one */
+    do {
+        for (i = 0; i < ARRAY_SIZE(patterns); i++) {
+            g_test_message("encode(%s) %s: %.2f MB/sec",
+                           test_xbzrle_encode_accel_name(), patterns[i].name,
+                           bench_encode(&benchs[i]));
+        }
+    } while (test_xbzrle_encode_next_accel());
+
+    /* Decoding goes last as it turns old_buf into new_buf */
+    for (i = 0; i < ARRAY_SIZE(patterns); i++) {
+        g_test_message("decode %s: %.2f MB/sec", patterns[i].name,
+                       bench_decode(&benchs[i]));
+        g_assert(memcmp(benchs[i].old_buf, benchs[i].new_buf,
+                        NB_PAGES * PAGE_SIZE) == 0);
+        bench_free(&benchs[i]);
+    }
+}
+
+int main(int argc, char **argv)
+{
+    g_test_init(&argc, &argv, NULL);
+    g_test_add_func("/xbzrle/speed", test_xbzrle_speed);
+    return g_test_run();
+}
@@ -133,6 +133,11 @@ void qtest_set_expected_status(QTestState *s, int status)
     s->expected_status = status;
 }
 
+pid_t qtest_pid(QTestState *s)
+{
+    return s->qemu_pid;
+}
+
 void qtest_kill_qemu(QTestState *s)
 {
     pid_t pid = s->qemu_pid;
@@ -15,6 +15,7 @@
 #include "libqos/libqtest.h"
 #include "qapi/error.h"
 #include "qapi/qmp/qdict.h"
+#include "qapi/qmp/qlist.h"
 #include "qemu/module.h"
 #include "qemu/option.h"
 #include "qemu/range.h"
@@ -474,6 +475,8 @@ typedef struct {
     bool only_target;
     /* Use dirty ring if true; dirty logging otherwise */
     bool use_dirty_ring;
+    /* Send the requested pages on the postcopy preempt channels */
+    bool postcopy_preempt;
     char *opts_source;
     char *opts_target;
 } MigrateStart;
@@ -666,6 +669,7 @@ static int migrate_postcopy_prepare(QTestState **from_ptr,
                                     MigrateStart *args)
 {
     g_autofree char *uri = g_strdup_printf("unix:%s/migsocket", tmpfs);
+    bool postcopy_preempt = args->postcopy_preempt;
     QTestState *from, *to;
 
     if (test_migrate_start(&from, &to, uri, &args)) {
@@ -676,6 +680,13 @@ static int migrate_postcopy_prepare(QTestState **from_ptr,
     migrate_set_capability(to, "postcopy-ram", true);
     migrate_set_capability(to, "postcopy-blocktime", true);
 
+    if (postcopy_preempt) {
+        migrate_set_capability(from, "postcopy-preempt", true);
+        migrate_set_capability(to, "postcopy-preempt", true);
+        migrate_set_parameter_int(from, "postcopy-threads", 4);
+        migrate_set_parameter_int(to, "postcopy-threads", 4);
+    }
+
     /* We want to pick a speed slow enough that the test completes
      * quickly, but that it doesn't complete precopy even on a slow
      * machine, so also set the downtime.
@@ -722,6 +733,50 @@ static void test_postcopy(void)
     migrate_postcopy_complete(from, to);
 }
 
+static void test_postcopy_preempt(void)
+{
+    MigrateStart *args = migrate_start_new();
+    QTestState *from, *to;
+
+    args->postcopy_preempt = true;
+
+    if (migrate_postcopy_prepare(&from, &to, args)) {
+        return;
+    }
+    migrate_postcopy_start(from, to);
+    migrate_postcopy_complete(from, to);
+}
+
+static void test_postcopy_preempt_mismatch(void)
+{
+    g_autofree char *uri = g_strdup_printf("unix:%s/migsocket", tmpfs);
+    MigrateStart *args = migrate_start_new();
+    QTestState *from, *to;
+
+    if (test_migrate_start(&from, &to, uri, &args)) {
+        return;
+    }
+
+    /*
+     * Only the source has postcopy-preempt: the destination refuses the
+     * migration as soon as it gets the configuration.
+     */
+    migrate_set_capability(from, "postcopy-ram", true);
+    migrate_set_capability(to, "postcopy-ram", true);
+    migrate_set_capability(from, "postcopy-preempt", true);
+    migrate_set_parameter_int(from, "downtime-limit", 1000000);
+
+    /* Wait for the first serial output from the source */
+    wait_for_serial("src_serial");
+
+    migrate_qmp(from, uri, "{}");
+
+    qtest_set_expected_status(to, 1);
+    wait_for_migration_fail(from, true);
+
+    test_migrate_end(from, to, false);
+}
+
 static void test_postcopy_recovery(void)
 {
     MigrateStart *args = migrate_start_new();
@@ -853,6 +908,82 @@ static void test_precopy_unix_dirty_ring(void)
     test_precopy_unix_common(true);
 }
 
+static void test_vcpu_dirty_limit(void)
+{
+    g_autofree char *uri = g_strdup_printf("unix:%s/migsocket", tmpfs);
+    MigrateStart *args = migrate_start_new();
+    QTestState *from, *to;
+    QDict *rsp;
+    QList *limits;
+    QDict *limit;
+
+    args->use_dirty_ring = true;
+
+    if (test_migrate_start(&from, &to, uri, &args)) {
+        return;
+    }
+
+    /* Wait for the first serial output from the source */
+    wait_for_serial("src_serial");
+
+    qtest_qmp_assert_success(from, "{ 'execute': 'set-vcpu-dirty-limit',"
+                             "  'arguments': { 'dirty-rate': 1 } }");
+
+    rsp = qtest_qmp(from, "{ 'execute': 'query-vcpu-dirty-limit' }");
+    g_assert(qdict_haskey(rsp, "return"));
+    limits = qdict_get_qlist(rsp, "return");
+    g_assert(!qlist_empty(limits));
+    limit = qobject_to(QDict, qlist_peek(limits));
+    g_assert_cmpint(qdict_get_int(limit, "cpu-index"), ==, 0);
+    g_assert_cmpint(qdict_get_int(limit, "limit-rate"), ==, 1);
+    qobject_unref(rsp);
+
+    qtest_qmp_assert_success(from, "{ 'execute': 'cancel-vcpu-dirty-limit' }");
+
+    rsp = qtest_qmp(from, "{ 'execute': 'query-vcpu-dirty-limit' }");
+    g_assert(qdict_haskey(rsp, "return"));
+    g_assert(qlist_empty(qdict_get_qlist(rsp, "return")));
+    qobject_unref(rsp);
+
+    /*
+     * Now let migration apply the limits when it does not converge, over a
+     * limit of the user that is looser than them
+     */
+    qtest_qmp_assert_success(from, "{ 'execute': 'set-vcpu-dirty-limit',"
+                             "  'arguments': { 'dirty-rate': 100000 } }");
+    migrate_set_capability(from, "dirty-limit", true);
+    migrate_set_parameter_int(from, "downtime-limit", 1);
+    migrate_set_parameter_int(from, "max-bandwidth", 100000000);
+
+    migrate_qmp(from, uri, "{}");
+
+    wait_for_migration_pass(from);
+    wait_for_migration_pass(from);
+
+    migrate_set_parameter_int(from, "downtime-limit", CONVERGE_DOWNTIME);
+    migrate_set_parameter_int(from, "max-bandwidth", 1000000000);
+
+    if (!got_stop) {
+        qtest_qmp_eventwait(from, "STOP");
+    }
+
+    qtest_qmp_eventwait(to, "RESUME");
+
+    wait_for_serial("dest_serial");
+    wait_for_migration_complete(from);
+
+    /* The limits set by migration are gone with it, the user's are back */
+    rsp = qtest_qmp(from, "{ 'execute': 'query-vcpu-dirty-limit' }");
+    g_assert(qdict_haskey(rsp, "return"));
+    limits = qdict_get_qlist(rsp, "return");
+    g_assert(!qlist_empty(limits));
+    limit = qobject_to(QDict, qlist_peek(limits));
+    g_assert_cmpint(qdict_get_int(limit, "limit-rate"), ==, 100000);
+    qobject_unref(rsp);
+
+    test_migrate_end(from, to, true);
+}
+
 #if 0
 /* Currently upset on aarch64 TCG */
 static void test_ignore_shared(void)
@@ -1069,6 +1200,118 @@ static void test_migrate_fd_proto(void)
     test_migrate_end(from, to, true);
 }
 
+static void test_precopy_exec_fast_snapshot(void)
+{
+    MigrateStart *args = migrate_start_new();
+    g_autofree char *uri = g_strdup_printf("exec:cat > %s/migfile", tmpfs);
+    g_autofree char *uri2 = g_strdup_printf("exec:cat > %s/migfile2", tmpfs);
+    g_autofree char *in_uri = g_strdup_printf("exec:cat %s/migfile", tmpfs);
+    g_autofree char *ram_file = g_strdup_printf("%s/ramfile", tmpfs);
+    QTestState *from, *to;
+    QDict *rsp;
+
+    if (test_migrate_start(&from, &to, "defer", &args)) {
+        return;
+    }
+
+    migrate_set_capability(from, "fast-snapshot", true);
+    migrate_set_parameter_str(from, "fast-snapshot-file", ram_file);
+
+    /* Wait for the first serial output from the source */
+    wait_for_serial("src_serial");
+
+    migrate_qmp(from, uri, "{}");
+
+    if (!got_stop) {
+        qtest_qmp_eventwait(from, "STOP");
+    }
+    wait_for_migration_complete(from);
+
+    rsp = wait_command(to, "{ 'execute': 'migrate-incoming',"
+                           "  'arguments': { 'uri': %s }}", in_uri);
+    qobject_unref(rsp);
+    qtest_qmp_eventwait(to, "RESUME");
+    wait_for_serial("dest_serial");
+
+    /*
+     * Save the restored VM to the same RAM file, that its memory may still
+     * be mapped from: it must not lose its memory, and must keep running.
+     */
+    migrate_set_capability(to, "fast-snapshot", true);
+    migrate_set_parameter_str(to, "fast-snapshot-file", ram_file);
+    migrate_qmp(to, uri2, "{}");
+    wait_for_migration_complete(to);
+
+    /* test_migrate_end() checks that it goes on changing its memory */
+    rsp = wait_command(to, "{ 'execute': 'cont' }");
+    qobject_unref(rsp);
+
+    test_migrate_end(from, to, true);
+    cleanup("migfile");
+    cleanup("migfile2");
+    cleanup("ramfile");
+}
+
+static void test_precopy_file_mapped_ram_common(bool multifd)
+{
+    MigrateStart *args = migrate_start_new();
+    g_autofree char *uri = g_strdup_printf("file:%s/migfile", tmpfs);
+    QTestState *from, *to;
+    QDict *rsp;
+
+    if (test_migrate_start(&from, &to, "defer", &args)) {
+        return;
+    }
+
+    /* 1 ms should make it not converge, so that pages are written again */
+    migrate_set_parameter_int(from, "downtime-limit", 1);
+    /* 1GB/s */
+    migrate_set_parameter_int(from, "max-bandwidth", 1000000000);
+
+    migrate_set_capability(from, "mapped-ram", true);
+    migrate_set_capability(to, "mapped-ram", true);
+
+    /* Only the source writes with several channels */
+    if (multifd) {
+        migrate_set_parameter_int(from, "multifd-channels", 4);
+        migrate_set_capability(from, "multifd", true);
+    }
+
+    /* Wait for the first serial output from the source */
+    wait_for_serial("src_serial");
+
+    migrate_qmp(from, uri, "{}");
+
+    wait_for_migration_pass(from);
+
+    migrate_set_parameter_int(from, "downtime-limit", CONVERGE_DOWNTIME);
+
+    if (!got_stop) {
+        qtest_qmp_eventwait(from, "STOP");
+    }
+    wait_for_migration_complete(from);
+
+    /* The destination only starts reading once the file is complete */
+    rsp = wait_command(to, "{ 'execute': 'migrate-incoming',"
+                           "  'arguments': { 'uri': %s }}", uri);
+    qobject_unref(rsp);
+    qtest_qmp_eventwait(to, "RESUME");
+
+    wait_for_serial("dest_serial");
+    test_migrate_end(from, to, true);
+    cleanup("migfile");
+}
+
+static void test_precopy_file_mapped_ram(void)
+{
+    test_precopy_file_mapped_ram_common(false);
+}
+
+static void test_multifd_file_mapped_ram(void)
+{
+    test_precopy_file_mapped_ram_common(true);
+}
+
 static void do_test_validate_uuid(MigrateStart *args, bool should_fail)
 {
     g_autofree char *uri = g_strdup_printf("unix:%s/migsocket", tmpfs);
@@ -1228,7 +1471,7 @@ static void test_migrate_auto_converge(void)
     test_migrate_end(from, to, true);
 }
 
-static void test_multifd_tcp(const char *method)
+static void test_multifd_tcp(const char *method, bool zero_page)
 {
     MigrateStart *args = migrate_start_new();
     QTestState *from, *to;
@@ -1258,6 +1501,11 @@ static void test_multifd_tcp(const char *method)
     migrate_set_capability(from, "multifd", true);
     migrate_set_capability(to, "multifd", true);
 
+    if (zero_page) {
+        migrate_set_capability(from, "multifd-zero-page", true);
+        migrate_set_capability(to, "multifd-zero-page", true);
+    }
+
     /* Start incoming migration from the 1st socket */
     rsp = wait_command(to, "{ 'execute': 'migrate-incoming',"
                            "  'arguments': { 'uri': 'tcp:127.0.0.1:0' }}");
@@ -1286,21 +1534,80 @@ static void test_multifd_tcp(const char *method)
 
 static void test_multifd_tcp_none(void)
 {
-    test_multifd_tcp("none");
+    test_multifd_tcp("none", false);
+}
+
+static void test_multifd_tcp_zero_page(void)
+{
+    test_multifd_tcp("none", true);
+}
+
+/*
+ * The destination would misparse packets with zero pages if it did not
+ * expect them, so enabling multifd-zero-page on one side only must fail.
+ */
+static void test_multifd_tcp_zero_page_mismatch(void)
+{
+    MigrateStart *args = migrate_start_new();
+    QTestState *from, *to;
+    QDict *rsp;
+    g_autofree char *uri = NULL;
+
+    args->hide_stderr = true;
+
+    if (test_migrate_start(&from, &to, "defer", &args)) {
+        return;
+    }
+
+    migrate_set_parameter_int(from, "multifd-channels", 2);
+    migrate_set_parameter_int(to, "multifd-channels", 2);
+
+    migrate_set_capability(from, "multifd", true);
+    migrate_set_capability(to, "multifd", true);
+
+    migrate_set_capability(from, "multifd-zero-page", true);
+
+    rsp = wait_command(to, "{ 'execute': 'migrate-incoming',"
+                           "  'arguments': { 'uri': 'tcp:127.0.0.1:0' }}");
+    qobject_unref(rsp);
+
+    /* Wait for the first serial output from the source */
+    wait_for_serial("src_serial");
+
+    uri = migrate_get_socket_address(to, "socket-address");
+
+    migrate_qmp(from, uri, "{}");
+
+    qtest_set_expected_status(to, 1);
+    wait_for_migration_fail(from, true);
+
+    test_migrate_end(from, to, false);
 }
 
 static void test_multifd_tcp_zlib(void)
 {
-    test_multifd_tcp("zlib");
+    test_multifd_tcp("zlib", false);
 }
 
 #ifdef CONFIG_ZSTD
 static void test_multifd_tcp_zstd(void)
 {
-    test_multifd_tcp("zstd");
+    test_multifd_tcp("zstd", false);
 }
 #endif
 
+#ifdef CONFIG_LZ4
+static void test_multifd_tcp_lz4(void)
+{
+    test_multifd_tcp("lz4", false);
+}
+#endif
+
+static void test_multifd_tcp_xbzrle(void)
+{
+    test_multifd_tcp("xbzrle", true);
+}
+
 /*
  * This test does:
  *  source               target
@@ -1462,12 +1769,21 @@ int main(int argc, char **argv)
 
     qtest_add_func("/migration/postcopy/unix", test_postcopy);
     qtest_add_func("/migration/postcopy/recovery", test_postcopy_recovery);
+    qtest_add_func("/migration/postcopy/preempt/unix", test_postcopy_preempt);
+    qtest_add_func("/migration/postcopy/preempt/mismatch",
+                   test_postcopy_preempt_mismatch);
     qtest_add_func("/migration/bad_dest", test_baddest);
     qtest_add_func("/migration/precopy/unix", test_precopy_unix);
     qtest_add_func("/migration/precopy/tcp", test_precopy_tcp);
     /* qtest_add_func("/migration/ignore_shared", test_ignore_shared); */
     qtest_add_func("/migration/xbzrle/unix", test_xbzrle_unix);
     qtest_add_func("/migration/fd_proto", test_migrate_fd_proto);
+    qtest_add_func("/migration/precopy/exec/fast-snapshot",
+                   test_precopy_exec_fast_snapshot);
+    qtest_add_func("/migration/precopy/file/mapped-ram",
+                   test_precopy_file_mapped_ram);
+    qtest_add_func("/migration/multifd/file/mapped-ram",
+                   test_multifd_file_mapped_ram);
     qtest_add_func("/migration/validate_uuid", test_validate_uuid);
     qtest_add_func("/migration/validate_uuid_error", test_validate_uuid_error);
     qtest_add_func("/migration/validate_uuid_src_not_set",
@@ -1477,15 +1793,24 @@ int main(int argc, char **argv)
 
     qtest_add_func("/migration/auto_converge", test_migrate_auto_converge);
     qtest_add_func("/migration/multifd/tcp/none", test_multifd_tcp_none);
+    qtest_add_func("/migration/multifd/tcp/zero-page",
+                   test_multifd_tcp_zero_page);
+    qtest_add_func("/migration/multifd/tcp/zero-page/mismatch",
+                   test_multifd_tcp_zero_page_mismatch);
     qtest_add_func("/migration/multifd/tcp/cancel", test_multifd_tcp_cancel);
     qtest_add_func("/migration/multifd/tcp/zlib", test_multifd_tcp_zlib);
 #ifdef CONFIG_ZSTD
     qtest_add_func("/migration/multifd/tcp/zstd", test_multifd_tcp_zstd);
 #endif
+#ifdef CONFIG_LZ4
+    qtest_add_func("/migration/multifd/tcp/lz4", test_multifd_tcp_lz4);
+#endif
+    qtest_add_func("/migration/multifd/tcp/xbzrle", test_multifd_tcp_xbzrle);
 
     if (kvm_dirty_ring_supported()) {
         qtest_add_func("/migration/dirty_ring",
                        test_precopy_unix_dirty_ring);
+        qtest_add_func("/migration/dirty_limit", test_vcpu_dirty_limit);
     }
 
     ret = g_test_run();
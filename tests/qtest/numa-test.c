@@ -10,9 +10,13 @@
  */
 
 #include "qemu/osdep.h"
+#ifdef CONFIG_LINUX
+#include <sched.h>
+#endif
 #include "libqos/libqtest.h"
 #include "qapi/qmp/qdict.h"
 #include "qapi/qmp/qlist.h"
+#include "qapi/qmp/qnum.h"
 
 static char *make_cli(const GString *generic_cli, const char *test_cli)
 {
@@ -539,6 +543,243 @@ static void pc_hmat_erange_cfg(const void *data)
     qtest_quit(qs);
 }
 
+#if defined(CONFIG_LINUX) && defined(CONFIG_NUMA)
+/* Host CPUs a thread of the QEMU process may run on */
+static void get_thread_affinity(int64_t tid, cpu_set_t *set)
+{
+    CPU_ZERO(set);
+    g_assert_cmpint(sched_getaffinity(tid, sizeof(*set), set), ==, 0);
+}
+
+static QDict *get_node_affinity(QList *nodes, int64_t node_id)
+{
+    const QListEntry *e;
+
+    for (e = qlist_first(nodes); e; e = qlist_next(e)) {
+        QDict *node = qobject_to(QDict, qlist_entry_obj(e));
+
+        if (qdict_get_int(node, "node-id") == node_id) {
+            return node;
+        }
+    }
+    g_assert_not_reached();
+}
+
+static int64_t get_iothread_id(QTestState *qts, const char *id)
+{
+    QDict *resp;
+    const QListEntry *e;
+    int64_t thread_id = -1;
+
+    resp = qtest_qmp(qts, "{ 'execute': 'query-iothreads' }");
+    for (e = qlist_first(qdict_get_qlist(resp, "return")); e;
+         e = qlist_next(e)) {
+        QDict *iothread = qobject_to(QDict, qlist_entry_obj(e));
+
+        if (!strcmp(qdict_get_str(iothread, "id"), id)) {
+            thread_id = qdict_get_int(iothread, "thread-id");
+        }
+    }
+    qobject_unref(resp);
+    g_assert_cmpint(thread_id, >, 0);
+    return thread_id;
+}
+
+/* Check that thread @tid is restricted to the CPUs in @host_cpus */
+static void check_pinned(int64_t tid, QList *host_cpus)
+{
+    cpu_set_t allowed, set, in_allowed;
+    const QListEntry *e;
+
+    CPU_ZERO(&allowed);
+    for (e = qlist_first(host_cpus); e; e = qlist_next(e)) {
+        CPU_SET(qnum_get_int(qobject_to(QNum, qlist_entry_obj(e))), &allowed);
+    }
+
+    get_thread_affinity(tid, &set);
+    g_assert_cmpint(CPU_COUNT(&set), >, 0);
+    CPU_AND(&in_allowed, &set, &allowed);
+    g_assert(CPU_EQUAL(&in_allowed, &set));
+}
+
+/* Check that thread @tid kept the affinity it inherited from the test */
+static void check_not_pinned(int64_t tid)
+{
+    cpu_set_t inherited, set;
+
+    get_thread_affinity(0, &inherited);
+    get_thread_affinity(tid, &set);
+    g_assert(CPU_EQUAL(&set, &inherited));
+}
+
+/*
+ * Node 0 is bound to host node 0, node 1 is not bound.  Only the threads of
+ * node 0 are pinned, to the CPUs of host node 0, and only if each vCPU has a
+ * thread of its own.
+ */
+static void pc_numa_pin_threads(const void *data, const char *accel,
+                                bool vcpus_pinned)
+{
+    QTestState *qts;
+    QDict *resp, *node;
+    QList *nodes;
+    g_autofree char *cli = NULL;
+
+    cli = make_cli(data, "-machine smp.cpus=2,numa-pin-threads=on "
+                   "-object memory-backend-ram,id=m0,size=64M,"
+                   "host-nodes=0,policy=bind "
+                   "-object memory-backend-ram,id=m1,size=64M "
+                   "-numa node,nodeid=0,memdev=m0,cpus=0 "
+                   "-numa node,nodeid=1,memdev=m1,cpus=1 "
+                   "-object iothread,id=io0,numa-node=0 "
+                   "-object iothread,id=io1");
+    if (accel) {
+        char *tmp = cli;
+
+        cli = g_strdup_printf("%s -accel %s", tmp, accel);
+        g_free(tmp);
+    }
+    qts = qtest_init(cli);
+
+    resp = qtest_qmp(qts, "{ 'execute': 'query-numa-affinity' }");
+    nodes = qdict_get_qlist(resp, "return");
+    g_assert_cmpint(qlist_size(nodes), ==, 2);
+
+    node = get_node_affinity(nodes, 0);
+    g_assert(qdict_get_bool(node, "pinned"));
+    g_assert_cmpint(qlist_size(qdict_get_qlist(node, "host-nodes")), ==, 1);
+    g_assert_cmpint(qlist_size(qdict_get_qlist(node, "host-cpus")), >, 0);
+    g_assert_cmpint(qlist_size(qdict_get_qlist(node, "vcpu-thread-ids")), ==,
+                    1);
+    if (vcpus_pinned) {
+        check_pinned(qnum_get_int(qobject_to(QNum,
+                         qlist_peek(qdict_get_qlist(node, "vcpu-thread-ids")))),
+                     qdict_get_qlist(node, "host-cpus"));
+    } else {
+        check_not_pinned(qnum_get_int(qobject_to(QNum,
+                         qlist_peek(qdict_get_qlist(node, "vcpu-thread-ids")))));
+    }
+    check_pinned(get_iothread_id(qts, "io0"),
+                 qdict_get_qlist(node, "host-cpus"));
+
+    node = get_node_affinity(nodes, 1);
+    g_assert(!qdict_get_bool(node, "pinned"));
+    g_assert_cmpint(qlist_size(qdict_get_qlist(node, "host-cpus")), ==, 0);
+    check_not_pinned(qnum_get_int(qobject_to(QNum,
+                     qlist_peek(qdict_get_qlist(node, "vcpu-thread-ids")))));
+    check_not_pinned(get_iothread_id(qts, "io1"));
+
+    qobject_unref(resp);
+    qtest_quit(qts);
+}
+
+static void pc_numa_pin_threads_qtest(const void *data)
+{
+    pc_numa_pin_threads(data, NULL, true);
+}
+
+/* Round-robin TCG runs all vCPUs in one thread, which stays unpinned */
+static void pc_numa_pin_threads_tcg_rr(const void *data)
+{
+    pc_numa_pin_threads(data, "tcg,thread=single", false);
+}
+
+/*
+ * Bytes of the memory-backend-memfd mapping of the QEMU process that are
+ * populated, in total and on host node @node_id, from /proc/PID/numa_maps.
+ */
+static uint64_t get_memfd_populated(QTestState *qts, unsigned int node_id,
+                                    uint64_t *node_bytes)
+{
+    g_autofree char *path = g_strdup_printf("/proc/%d/numa_maps",
+                                            (int)qtest_pid(qts));
+    g_autofree char *maps = NULL;
+    g_auto(GStrv) lines = NULL;
+    uint64_t total = 0;
+    int i, j;
+
+    *node_bytes = 0;
+    g_assert(g_file_get_contents(path, &maps, NULL, NULL));
+    lines = g_strsplit(maps, "\n", -1);
+    for (i = 0; lines[i]; i++) {
+        g_auto(GStrv) fields = NULL;
+        uint64_t pages = 0, node_pages = 0, page_kb = 4;
+
+        if (!strstr(lines[i], "memfd:memory-backend-memfd")) {
+            continue;
+        }
+        fields = g_strsplit(lines[i], " ", -1);
+        for (j = 0; fields[j]; j++) {
+            unsigned int node;
+            uint64_t n;
+
+            if (sscanf(fields[j], "N%u=%" SCNu64, &node, &n) == 2) {
+                pages += n;
+                if (node == node_id) {
+                    node_pages += n;
+                }
+            } else {
+                sscanf(fields[j], "kernelpagesize_kB=%" SCNu64, &page_kb);
+            }
+        }
+        total += pages * page_kb * 1024;
+        *node_bytes += node_pages * page_kb * 1024;
+    }
+    return total;
+}
+
+/*
+ * Node 0 is bound to host node 0 and preallocated, optionally in the
+ * background.  Once preallocation is done, all of its memory is populated
+ * on host node 0.
+ */
+static void pc_numa_prealloc(const void *data, bool async)
+{
+    QTestState *qts;
+    uint64_t populated, on_node0;
+    g_autofree char *opts = NULL;
+    g_autofree char *cli = NULL;
+    gint64 deadline;
+
+    opts = g_strdup_printf("-machine smp.cpus=2 "
+                           "-object memory-backend-memfd,id=m0,size=64M,"
+                           "host-nodes=0,policy=bind,prealloc=on,"
+                           "prealloc-threads=2,prealloc-async=%s "
+                           "-object memory-backend-ram,id=m1,size=64M "
+                           "-numa node,nodeid=0,memdev=m0,cpus=0 "
+                           "-numa node,nodeid=1,memdev=m1,cpus=1",
+                           async ? "on" : "off");
+    cli = make_cli(data, opts);
+    qts = qtest_init(cli);
+
+    /* The monitor is up, but background preallocation may still be going */
+    deadline = g_get_monotonic_time() + 60 * G_USEC_PER_SEC;
+    do {
+        populated = get_memfd_populated(qts, 0, &on_node0);
+        if (populated >= 64 * 1024 * 1024) {
+            break;
+        }
+        g_assert(async);
+        g_usleep(10 * 1000);
+    } while (g_get_monotonic_time() < deadline);
+
+    g_assert_cmpuint(populated, ==, 64 * 1024 * 1024);
+    g_assert_cmpuint(on_node0, ==, populated);
+
+    qtest_quit(qts);
+}
+
+static void pc_numa_prealloc_sync(const void *data)
+{
+    pc_numa_prealloc(data, false);
+}
+
+static void pc_numa_prealloc_async(const void *data)
+{
+    pc_numa_prealloc(data, true);
+}
+#endif
+
 int main(int argc, char **argv)
 {
     g_autoptr(GString) args = g_string_new(NULL);
@@ -567,6 +808,21 @@ int main(int argc, char **argv)
         qtest_add_data_func("/numa/pc/hmat/build", args, pc_hmat_build_cfg);
         qtest_add_data_func("/numa/pc/hmat/off", args, pc_hmat_off_cfg);
         qtest_add_data_func("/numa/pc/hmat/erange", args, pc_hmat_erange_cfg);
+#if defined(CONFIG_LINUX) && defined(CONFIG_NUMA)
+        if (g_file_test("/sys/devices/system/node/node0/cpulist",
+                        G_FILE_TEST_EXISTS)) {
+            qtest_add_data_func("/numa/pc/pin-threads", args,
+                                pc_numa_pin_threads_qtest);
+            if (qtest_has_accel("tcg")) {
+                qtest_add_data_func("/numa/pc/pin-threads/tcg-rr", args,
+                                    pc_numa_pin_threads_tcg_rr);
+            }
+            qtest_add_data_func("/numa/pc/prealloc/local", args,
+                                pc_numa_prealloc_sync);
+            qtest_add_data_func("/numa/pc/prealloc/async", args,
+                                pc_numa_prealloc_async);
+        }
+#endif
     }
 
     if (!strcmp(arch, "ppc64")) {
@@ -16,6 +16,8 @@
 #include "standard-headers/linux/virtio_pci.h"
 #include "libqos/qgraph.h"
 #include "libqos/virtio-blk.h"
+#include "qapi/qmp/qdict.h"
+#include "qapi/qmp/qlist.h"
 
 /* TODO actually test the results and get rid of this */
 #define qmp_discard_response(...) qobject_unref(qmp(__VA_ARGS__))
@@ -23,6 +25,7 @@
 #define TEST_IMAGE_SIZE         (64 * 1024 * 1024)
 #define QVIRTIO_BLK_TIMEOUT_US  (30 * 1000 * 1000)
 #define PCI_SLOT_HP             0x06
+#define IOTHREAD_VQ_MAPPING_QUEUES 4
 
 typedef struct QVirtioBlkReq {
     uint32_t type;
@@ -766,6 +769,236 @@ static void resize(void *obj, void *data, QGuestAllocator *t_alloc)
 
 }
 
+/*
+ * Write and read back one sector through each virtqueue, with the
+ * virtqueues spread over two IOThreads.
+ */
+static void iothread_vq_mapping(void *obj, void *u_data,
+                                QGuestAllocator *t_alloc)
+{
+    QVirtioBlkPCI *blk = obj;
+    QVirtioPCIDevice *pdev = &blk->pci_vdev;
+    QVirtioDevice *dev = &pdev->vdev;
+    QVirtQueue *vq[IOTHREAD_VQ_MAPPING_QUEUES];
+    QVirtioBlkReq req;
+    QTestState *qts = global_qtest;
+    uint64_t req_addr;
+    uint64_t features;
+    uint32_t free_head;
+    uint8_t status;
+    char *data;
+    int i;
+
+    features = qvirtio_get_features(dev);
+    features = features & ~(QVIRTIO_F_BAD_FEATURE |
+                    (1u << VIRTIO_RING_F_INDIRECT_DESC) |
+                    (1u << VIRTIO_RING_F_EVENT_IDX) |
+                    (1u << VIRTIO_BLK_F_SCSI));
+    qvirtio_set_features(dev, features);
+
+    for (i = 0; i < IOTHREAD_VQ_MAPPING_QUEUES; i++) {
+        vq[i] = qvirtqueue_setup(dev, t_alloc, i);
+    }
+    qvirtio_set_driver_ok(dev);
+
+    for (i = 0; i < IOTHREAD_VQ_MAPPING_QUEUES; i++) {
+        /* Write request */
+        req.type = VIRTIO_BLK_T_OUT;
+        req.ioprio = 1;
+        req.sector = i;
+        req.data = g_malloc0(512);
+        sprintf(req.data, "TEST%d", i);
+
+        req_addr = virtio_blk_request(t_alloc, dev, &req, 512);
+
+        g_free(req.data);
+
+        free_head = qvirtqueue_add(qts, vq[i], req_addr, 16, false, true);
+        qvirtqueue_add(qts, vq[i], req_addr + 16, 512, false, true);
+        qvirtqueue_add(qts, vq[i], req_addr + 528, 1, true, false);
+        qvirtqueue_kick(qts, dev, vq[i], free_head);
+
+        qvirtio_wait_used_elem(qts, dev, vq[i], free_head, NULL,
+                               QVIRTIO_BLK_TIMEOUT_US);
+        status = readb(req_addr + 528);
+        g_assert_cmpint(status, ==, 0);
+
+        guest_free(t_alloc, req_addr);
+    }
+
+    for (i = 0; i < IOTHREAD_VQ_MAPPING_QUEUES; i++) {
+        char expected[512] = { };
+
+        /* Read request, on another virtqueue than the write */
+        req.type = VIRTIO_BLK_T_IN;
+        req.ioprio = 1;
+        req.sector = (i + 1) % IOTHREAD_VQ_MAPPING_QUEUES;
+        req.data = g_malloc0(512);
+
+        req_addr = virtio_blk_request(t_alloc, dev, &req, 512);
+
+        g_free(req.data);
+
+        free_head = qvirtqueue_add(qts, vq[i], req_addr, 16, false, true);
+        qvirtqueue_add(qts, vq[i], req_addr + 16, 512, true, true);
+        qvirtqueue_add(qts, vq[i], req_addr + 528, 1, true, false);
+        qvirtqueue_kick(qts, dev, vq[i], free_head);
+
+        qvirtio_wait_used_elem(qts, dev, vq[i], free_head, NULL,
+                               QVIRTIO_BLK_TIMEOUT_US);
+        status = readb(req_addr + 528);
+        g_assert_cmpint(status, ==, 0);
+
+        data = g_malloc0(512);
+        memread(req_addr + 16, data, 512);
+        sprintf(expected, "TEST%d", (i + 1) % IOTHREAD_VQ_MAPPING_QUEUES);
+        g_assert_cmpstr(data, ==, expected);
+        g_free(data);
+
+        guest_free(t_alloc, req_addr);
+    }
+
+    for (i = 0; i < IOTHREAD_VQ_MAPPING_QUEUES; i++) {
+        qvirtqueue_cleanup(dev->bus, vq[i], t_alloc);
+    }
+}
+
+/* Queue a one-sector request without kicking, return the request address */
+static uint64_t batch_request(QVirtioDevice *dev, QGuestAllocator *alloc,
+                              QVirtQueue *vq, uint32_t type, uint64_t sector,
+                              uint32_t *free_head)
+{
+    QTestState *qts = global_qtest;
+    QVirtioBlkReq req;
+    uint64_t req_addr;
+
+    req.type = type;
+    req.ioprio = 1;
+    req.sector = sector;
+    req.data = g_malloc0(512);
+    sprintf(req.data, "TEST%" PRIu64, sector);
+
+    req_addr = virtio_blk_request(alloc, dev, &req, 512);
+
+    g_free(req.data);
+
+    *free_head = qvirtqueue_add(qts, vq, req_addr, 16, false, true);
+    qvirtqueue_add(qts, vq, req_addr + 16, 512, type == VIRTIO_BLK_T_IN,
+                   true);
+    qvirtqueue_add(qts, vq, req_addr + 528, 1, true, false);
+
+    return req_addr;
+}
+
+/* Completion order is not fixed once requests are batched, poll the status */
+static void batch_wait(QVirtQueue *vq, uint64_t req_addr)
+{
+    gint64 start_time = g_get_monotonic_time();
+    uint32_t desc_idx;
+
+    while (readb(req_addr + 528) == 0xFF) {
+        qtest_clock_step(global_qtest, 100);
+        g_assert(g_get_monotonic_time() - start_time <=
+                 QVIRTIO_BLK_TIMEOUT_US);
+    }
+    g_assert_cmpint(readb(req_addr + 528), ==, 0);
+    while (qvirtqueue_get_buf(global_qtest, vq, &desc_idx, NULL)) {
+        /* Consume the used elements */
+    }
+}
+
+/*
+ * The batch window is longer than the test timeout, so requests only
+ * complete if something else than the window submits the batch.
+ */
+static void batch(void *obj, void *u_data, QGuestAllocator *t_alloc)
+{
+    QVirtioBlk *blk_if = obj;
+    QVirtioDevice *dev = blk_if->vdev;
+    QTestState *qts = global_qtest;
+    uint64_t addr[2];
+    uint32_t free_head;
+    uint64_t features;
+    QDict *resp, *stats;
+    const QListEntry *entry;
+    QVirtQueue *vq;
+    char *data;
+
+    features = qvirtio_get_features(dev);
+    features = features & ~(QVIRTIO_F_BAD_FEATURE |
+                    (1u << VIRTIO_RING_F_INDIRECT_DESC) |
+                    (1u << VIRTIO_RING_F_EVENT_IDX) |
+                    (1u << VIRTIO_BLK_F_SCSI));
+    qvirtio_set_features(dev, features);
+
+    vq = qvirtqueue_setup(dev, t_alloc, 0);
+    qvirtio_set_driver_ok(dev);
+
+    /* Two writes in separate notifications fill the batch */
+    addr[0] = batch_request(dev, t_alloc, vq, VIRTIO_BLK_T_OUT, 0, &free_head);
+    qvirtqueue_kick(qts, dev, vq, free_head);
+    addr[1] = batch_request(dev, t_alloc, vq, VIRTIO_BLK_T_OUT, 1, &free_head);
+    qvirtqueue_kick(qts, dev, vq, free_head);
+    batch_wait(vq, addr[0]);
+    batch_wait(vq, addr[1]);
+    guest_free(t_alloc, addr[0]);
+    guest_free(t_alloc, addr[1]);
+
+    /* A read submits the held write */
+    addr[0] = batch_request(dev, t_alloc, vq, VIRTIO_BLK_T_OUT, 2, &free_head);
+    qvirtqueue_kick(qts, dev, vq, free_head);
+    addr[1] = batch_request(dev, t_alloc, vq, VIRTIO_BLK_T_IN, 0, &free_head);
+    qvirtqueue_kick(qts, dev, vq, free_head);
+    batch_wait(vq, addr[0]);
+    batch_wait(vq, addr[1]);
+
+    data = g_malloc0(512);
+    memread(addr[1] + 16, data, 512);
+    g_assert_cmpstr(data, ==, "TEST0");
+    g_free(data);
+    guest_free(t_alloc, addr[0]);
+    guest_free(t_alloc, addr[1]);
+
+    /*
+     * A held write survives the drain of a VM stop, without being in flight
+     * during it, and completes once the VM runs again.
+     */
+    addr[0] = batch_request(dev, t_alloc, vq, VIRTIO_BLK_T_OUT, 3, &free_head);
+    qvirtqueue_kick(qts, dev, vq, free_head);
+    qmp_discard_response("{ 'execute': 'stop' }");
+    qmp_discard_response("{ 'execute': 'cont' }");
+    batch_wait(vq, addr[0]);
+    guest_free(t_alloc, addr[0]);
+
+    addr[0] = batch_request(dev, t_alloc, vq, VIRTIO_BLK_T_IN, 3, &free_head);
+    qvirtqueue_kick(qts, dev, vq, free_head);
+    batch_wait(vq, addr[0]);
+
+    data = g_malloc0(512);
+    memread(addr[0] + 16, data, 512);
+    g_assert_cmpstr(data, ==, "TEST3");
+    g_free(data);
+    guest_free(t_alloc, addr[0]);
+
+    /* The full batch and the read-flushed one were accounted */
+    resp = qmp("{ 'execute': 'query-blockstats' }");
+    stats = NULL;
+    for (entry = qlist_first(qdict_get_qlist(resp, "return")); entry;
+         entry = qlist_next(entry)) {
+        QDict *dev_stats = qobject_to(QDict, qlist_entry_obj(entry));
+
+        if (!strcmp(qdict_get_str(dev_stats, "device"), "drive0")) {
+            stats = qdict_get_qdict(dev_stats, "stats");
+        }
+    }
+    g_assert(stats);
+    g_assert_cmpint(qdict_get_int(stats, "wr_batches"), >=, 2);
+    g_assert_cmpint(qdict_get_int(stats, "wr_batched"), >=, 3);
+    qobject_unref(resp);
+
+    qvirtqueue_cleanup(dev->bus, vq, t_alloc);
+}
+
 static void *virtio_blk_test_setup(GString *cmd_line, void *arg)
 {
     char *tmp_path = drive_create();
@@ -780,6 +1013,15 @@ static void *virtio_blk_test_setup(GString *cmd_line, void *arg)
     return arg;
 }
 
+static void *virtio_blk_iothread_setup(GString *cmd_line, void *arg)
+{
+    g_string_append(cmd_line,
+                    " -object iothread,id=iothread0"
+                    " -object iothread,id=iothread1 ");
+
+    return virtio_blk_test_setup(cmd_line, arg);
+}
+
 static void register_virtio_blk_test(void)
 {
     QOSGraphTestOptions opts = {
@@ -791,12 +1033,23 @@ static void register_virtio_blk_test(void)
     qos_add_test("basic", "virtio-blk", basic, &opts);
     qos_add_test("resize", "virtio-blk", resize, &opts);
 
+    opts.edge.extra_device_opts = "batch-window-us=60000000,batch-max-reqs=2";
+    qos_add_test("batch", "virtio-blk", batch, &opts);
+    opts.edge.extra_device_opts = NULL;
+
     /* tests just for virtio-blk-pci */
     qos_add_test("msix", "virtio-blk-pci", msix, &opts);
     qos_add_test("idx", "virtio-blk-pci", idx, &opts);
     qos_add_test("nxvirtq", "virtio-blk-pci",
                       test_nonexistent_virtqueue, &opts);
     qos_add_test("hotplug", "virtio-blk-pci", pci_hotplug, &opts);
+
+    opts.before = virtio_blk_iothread_setup;
+    opts.edge.extra_device_opts = "num-queues="
+        stringify(IOTHREAD_VQ_MAPPING_QUEUES)
+        ",iothread-vq-mapping=iothread0:iothread1";
+    qos_add_test("iothread-vq-mapping", "virtio-blk-pci",
+                 iothread_vq_mapping, &opts);
 }
 
 libqos_init(register_virtio_blk_test);
@@ -0,0 +1,82 @@
+/*
+ * Jump cache test
+ *
+ * Call many small functions in turn, more than a small jump cache can
+ * hold, so that it misses a lot and grows.  Between rounds, toggle
+ * CR4.PGE to flush the TLB, which starts a new generation of the jump
+ * cache, and rewrite one of the functions; the calls of the next round
+ * must all run the current code.
+ *
+ * Run with "-accel tcg,jmp-cache-bits=8" to start with the smallest
+ * cache.  The code is the same in 32-bit and 64-bit mode.
+ */
+
+#include <inttypes.h>
+#include <stdbool.h>
+#include <minilib.h>
+
+#define MEM_PAGE_SIZE 4096
+#define FUNC_SIZE 16
+#define NR_FUNCS 2048
+#define ROUNDS 64
+
+#define CR4_PGE (1 << 7)
+
+__attribute__((aligned(MEM_PAGE_SIZE)))
+static uint8_t code[NR_FUNCS * FUNC_SIZE];
+
+static uint32_t values[NR_FUNCS];
+
+typedef uint32_t (*code_fn)(void);
+
+static void write_func(int i, uint32_t val)
+{
+    uint8_t *p = &code[i * FUNC_SIZE];
+
+    /* mov $imm32, %eax; ret */
+    p[0] = 0xb8;
+    p[1] = val;
+    p[2] = val >> 8;
+    p[3] = val >> 16;
+    p[4] = val >> 24;
+    p[5] = 0xc3;
+    values[i] = val;
+}
+
+static void flush_tlb(void)
+{
+    unsigned long cr4;
+
+    asm volatile("mov %%cr4, %0" : "=r" (cr4));
+    asm volatile("mov %0, %%cr4" : : "r" (cr4 ^ CR4_PGE) : "memory");
+    asm volatile("mov %0, %%cr4" : : "r" (cr4) : "memory");
+}
+
+int main(void)
+{
+    uint32_t round, got;
+    int i;
+
+    for (i = 0; i < NR_FUNCS; i++) {
+        write_func(i, i * 0x9e3779b9u);
+    }
+
+    for (round = 0; round < ROUNDS; round++) {
+        for (i = 0; i < NR_FUNCS; i++) {
+            code_fn fn = (code_fn)(uintptr_t)&code[i * FUNC_SIZE];
+
+            got = fn();
+            if (got != values[i]) {
+                ml_printf("round %d, function %d: got %x, expected %x\n",
+                          round, i, got, values[i]);
+                ml_printf("Test FAILED\n");
+                return -1;
+            }
+        }
+        flush_tlb();
+        write_func((round * 37) % NR_FUNCS, round);
+    }
+
+    ml_printf("Test PASSED\n");
+    return 0;
+}
@@ -0,0 +1,62 @@
+/*
+ * Self-modifying code test
+ *
+ * Rewrite a small function over and over, and check that each call runs
+ * the latest version.  The function starts with a jump, so that with
+ * "-accel tcg,thread=multi,translate-threads=n" its target is translated
+ * in the background while the next version is being written.
+ * Each version is translated anew, so this also fills up the code buffer
+ * quickly when it is small.
+ *
+ * The code is the same in 32-bit and 64-bit mode.
+ */
+
+#include <inttypes.h>
+#include <stdbool.h>
+#include <minilib.h>
+
+#define MEM_PAGE_SIZE 4096
+#define ITERATIONS 20000
+
+/* Where the jump at the start of the page goes */
+#define TARGET_OFFSET 64
+
+__attribute__((aligned(MEM_PAGE_SIZE)))
+static uint8_t code[MEM_PAGE_SIZE];
+
+typedef uint32_t (*code_fn)(void);
+
+static void write_imm32(uint8_t *p, uint32_t val)
+{
+    p[0] = val;
+    p[1] = val >> 8;
+    p[2] = val >> 16;
+    p[3] = val >> 24;
+}
+
+int main(void)
+{
+    code_fn fn = (code_fn)(uintptr_t)code;
+    uint32_t i, got;
+
+    /* jmp code + TARGET_OFFSET */
+    code[0] = 0xe9;
+    write_imm32(&code[1], TARGET_OFFSET - 5);
+
+    /* mov $imm32, %eax; ret */
+    code[TARGET_OFFSET] = 0xb8;
+    code[TARGET_OFFSET + 5] = 0xc3;
+
+    for (i = 0; i < ITERATIONS; i++) {
+        write_imm32(&code[TARGET_OFFSET + 1], i);
+        got = fn();
+        if (got != i) {
+            ml_printf("iteration %d: got %d\n", i, got);
+            ml_printf("Test FAILED\n");
+            return -1;
+        }
+    }
+
+    ml_printf("Test PASSED\n");
+    return 0;
+}
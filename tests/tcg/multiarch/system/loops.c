@@ -0,0 +1,97 @@
+/*
+ * Loops Test
+ *
+ * A few hot loops with data dependent branches, whose results are
+ * checked against known values.  Run with a low trace-threshold, their
+ * blocks get retranslated as traces while the loops are running, and
+ * must still compute the same thing.
+ */
+
+#include <inttypes.h>
+#include <stdbool.h>
+#include <minilib.h>
+
+#define SIEVE_SIZE 20000
+
+static bool composite[SIEVE_SIZE];
+
+static uint32_t collatz_steps(uint32_t n)
+{
+    uint32_t steps = 0;
+
+    while (n != 1) {
+        n = (n & 1) ? 3 * n + 1 : n / 2;
+        steps++;
+    }
+    return steps;
+}
+
+static uint32_t count_primes(void)
+{
+    uint32_t i, j, count = 0;
+
+    for (i = 2; i < SIEVE_SIZE; i++) {
+        if (composite[i]) {
+            continue;
+        }
+        count++;
+        for (j = i * i; j < SIEVE_SIZE; j += i) {
+            composite[j] = true;
+        }
+    }
+    return count;
+}
+
+static uint32_t hash_switch(void)
+{
+    uint32_t h = 2166136261u;
+    uint32_t i, x;
+
+    for (i = 0; i < 100000; i++) {
+        switch (i % 7) {
+        case 0:
+            x = i * 3;
+            break;
+        case 1:
+        case 2:
+            x = i ^ 0x5a5a;
+            break;
+        case 3:
+            x = i >> 2;
+            break;
+        default:
+            x = i + i % 7;
+            break;
+        }
+        h = (h ^ x) * 16777619u;
+    }
+    return h;
+}
+
+static bool check(const char *name, uint32_t got, uint32_t expected)
+{
+    if (got != expected) {
+        ml_printf("%s: got %x, expected %x\n", name, got, expected);
+        return false;
+    }
+    ml_printf("%s: ok\n", name);
+    return true;
+}
+
+int main(void)
+{
+    uint32_t steps = 0;
+    uint32_t n;
+    bool ok = true;
+
+    for (n = 1; n < 10000; n++) {
+        steps += collatz_steps(n);
+    }
+
+    ok &= check("collatz", steps, 849637);
+    ok &= check("sieve", count_primes(), 2262);
+    ok &= check("switch", hash_switch(), 0x53e2ae53);
+
+    ml_printf("Test %s\n", ok ? "PASSED" : "FAILED");
+    return ok ? 0 : -1;
+}
@@ -174,6 +174,67 @@ static void test_encode_decode(void)
     }
 }
 
+#define ACCEL_PAGES 1000
+
+/* Every accelerated encoder must produce the same output */
+static void test_encode_accel(void)
+{
+    uint8_t *old = g_malloc(XBZRLE_PAGE_SIZE * ACCEL_PAGES);
+    uint8_t *new = g_malloc(XBZRLE_PAGE_SIZE * ACCEL_PAGES);
+    uint8_t *ref = g_malloc(XBZRLE_PAGE_SIZE * ACCEL_PAGES);
+    uint8_t *compressed = g_malloc(XBZRLE_PAGE_SIZE);
+    int ref_len[ACCEL_PAGES], dlen[ACCEL_PAGES];
+    bool first = true;
+    int i, j;
+
+    for (i = 0; i < XBZRLE_PAGE_SIZE * ACCEL_PAGES; i++) {
+        old[i] = g_test_rand_int();
+    }
+    memcpy(new, old, XBZRLE_PAGE_SIZE * ACCEL_PAGES);
+
+    /* A few runs of changed bytes of random length in each page */
+    for (i = 0; i < ACCEL_PAGES; i++) {
+        int runs = g_test_rand_int_range(0, 64);
+        uint8_t *page = new + i * XBZRLE_PAGE_SIZE;
+
+        for (j = 0; j < runs; j++) {
+            int start = g_test_rand_int_range(0, XBZRLE_PAGE_SIZE);
+            int end = MIN(start + g_test_rand_int_range(1, 128),
+                          XBZRLE_PAGE_SIZE);
+
+            for (; start < end; start++) {
+                page[start] ^= g_test_rand_bit() ? 0xff : 0;
+            }
+        }
+        /* Exercise the overflow checks as well */
+        dlen[i] = g_test_rand_bit() ? XBZRLE_PAGE_SIZE :
+                  g_test_rand_int_range(1, XBZRLE_PAGE_SIZE);
+    }
+
+    do {
+        for (i = 0; i < ACCEL_PAGES; i++) {
+            int offset = i * XBZRLE_PAGE_SIZE;
+            int rc = xbzrle_encode_buffer(old + offset, new + offset,
+                                          XBZRLE_PAGE_SIZE, compressed,
+                                          dlen[i]);
+
+            if (first) {
+                ref_len[i] = rc;
+                memcpy(ref + offset, compressed, MAX(rc, 0));
+            } else {
+                g_assert_cmpint(rc, ==, ref_len[i]);
+                g_assert(memcmp(ref + offset, compressed, MAX(rc, 0)) == 0);
+            }
+        }
+        first = false;
+    } while (test_xbzrle_encode_next_accel());
+
+    g_free(old);
+    g_free(new);
+    g_free(ref);
+    g_free(compressed);
+}
+
 int main(int argc, char **argv)
 {
     g_test_init(&argc, &argv, NULL);
@@ -186,6 +247,7 @@ int main(int argc, char **argv)
     g_test_add_func("/xbzrle/encode_decode_overflow",
                     test_encode_decode_overflow);
     g_test_add_func("/xbzrle/encode_decode", test_encode_decode);
+    g_test_add_func("/xbzrle/encode_accel", test_encode_accel);
 
     return g_test_run();
 }
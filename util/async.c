@@ -336,6 +336,11 @@ aio_ctx_finalize(GSource     *source)
         luring_cleanup(ctx->linux_io_uring);
         ctx->linux_io_uring = NULL;
     }
+    if (ctx->linux_io_uring_iopoll) {
+        luring_detach_aio_context(ctx->linux_io_uring_iopoll, ctx);
+        luring_cleanup(ctx->linux_io_uring_iopoll);
+        ctx->linux_io_uring_iopoll = NULL;
+    }
 #endif
 
     assert(QSLIST_EMPTY(&ctx->scheduled_coroutines));
@@ -413,25 +418,39 @@ LinuxAioState *aio_get_linux_aio(AioContext *ctx)
 #endif
 
 #ifdef CONFIG_LINUX_IO_URING
-LuringState *aio_setup_linux_io_uring(AioContext *ctx, Error **errp)
+static LuringState **aio_linux_io_uring_ptr(AioContext *ctx,
+                                            unsigned int setup_flags)
 {
-    if (ctx->linux_io_uring) {
-        return ctx->linux_io_uring;
+    if (setup_flags & LURING_SETUP_IOPOLL) {
+        return &ctx->linux_io_uring_iopoll;
+    }
+    return &ctx->linux_io_uring;
+}
+
+LuringState *aio_setup_linux_io_uring(AioContext *ctx,
+                                      unsigned int setup_flags, Error **errp)
+{
+    LuringState **s = aio_linux_io_uring_ptr(ctx, setup_flags);
+
+    if (*s) {
+        return *s;
     }
 
-    ctx->linux_io_uring = luring_init(errp);
-    if (!ctx->linux_io_uring) {
+    *s = luring_init(setup_flags, errp);
+    if (!*s) {
         return NULL;
     }
 
-    luring_attach_aio_context(ctx->linux_io_uring, ctx);
-    return ctx->linux_io_uring;
+    luring_attach_aio_context(*s, ctx);
+    return *s;
 }
 
-LuringState *aio_get_linux_io_uring(AioContext *ctx)
+LuringState *aio_get_linux_io_uring(AioContext *ctx, unsigned int setup_flags)
 {
-    assert(ctx->linux_io_uring);
-    return ctx->linux_io_uring;
+    LuringState **s = aio_linux_io_uring_ptr(ctx, setup_flags);
+
+    assert(*s);
+    return *s;
 }
 #endif
 
@@ -550,6 +569,7 @@ AioContext *aio_context_new(Error **errp)
 
 #ifdef CONFIG_LINUX_IO_URING
     ctx->linux_io_uring = NULL;
+    ctx->linux_io_uring_iopoll = NULL;
 #endif
 
     ctx->thread_pool = NULL;
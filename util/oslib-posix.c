@@ -43,6 +43,7 @@
 #include "qemu/cutils.h"
 #include "qemu/compiler.h"
 #include "qemu/units.h"
+#include "qemu/bitmap.h"
 
 #ifdef CONFIG_LINUX
 #include <sys/syscall.h>
@@ -83,6 +84,10 @@ typedef struct MemsetContext {
     bool any_thread_failed;
     struct MemsetThread *threads;
     int num_threads;
+    /* Background preallocation only, see os_mem_prealloc_start() */
+    int threads_running;
+    void (*done)(void *opaque);
+    void *opaque;
 } MemsetContext;
 
 struct MemsetThread {
@@ -442,6 +447,14 @@ static void sigbus_handler(int signal)
     warn_report("os_mem_prealloc: unrelated SIGBUS detected and ignored");
 }
 
+/* Tell the owner of a background preallocation that all threads are done */
+static void memset_thread_done(MemsetContext *context)
+{
+    if (context->done && qatomic_fetch_dec(&context->threads_running) == 1) {
+        context->done(context->opaque);
+    }
+}
+
 static void *do_touch_pages(void *arg)
 {
     MemsetThread *memset_args = (MemsetThread *)arg;
@@ -485,6 +498,7 @@ static void *do_touch_pages(void *arg)
         }
     }
     pthread_sigmask(SIG_SETMASK, &oldset, NULL);
+    memset_thread_done(memset_args->context);
     return (void *)(uintptr_t)ret;
 }
 
@@ -505,15 +519,23 @@ static void *do_madv_populate_write_pages(void *arg)
     if (size && qemu_madvise(addr, size, QEMU_MADV_POPULATE_WRITE)) {
         ret = -errno;
     }
+    memset_thread_done(memset_args->context);
     return (void *)(uintptr_t)ret;
 }
 
 static inline int get_memset_num_threads(size_t hpagesize, size_t numpages,
-                                         int smp_cpus)
+                                         int smp_cpus,
+                                         const unsigned long *host_cpus,
+                                         unsigned long nbits)
 {
     long host_procs = sysconf(_SC_NPROCESSORS_ONLN);
     int ret = 1;
 
+    /* Threads bound to a set of CPUs gain nothing from outnumbering it */
+    if (host_cpus) {
+        host_procs = MIN(host_procs, bitmap_count_one(host_cpus, nbits));
+    }
+
     if (host_procs > 0) {
         ret = MIN(MIN(host_procs, MAX_MEM_PREALLOC_THREAD_COUNT), smp_cpus);
     }
@@ -527,17 +549,23 @@ static inline int get_memset_num_threads(size_t hpagesize, size_t numpages,
     return ret;
 }
 
-static int touch_all_pages(char *area, size_t hpagesize, size_t numpages,
-                           int smp_cpus, bool use_madv_populate_write)
+/*
+ * Start context->num_threads threads touching the pages of @area.  With
+ * @host_cpus, the threads only run on those host CPUs; pass the CPUs of
+ * the host nodes the memory is bound to so that pages are cleared by
+ * CPUs local to them.
+ */
+static void touch_all_pages_start(MemsetContext *context, char *area,
+                                  size_t hpagesize, size_t numpages,
+                                  bool use_madv_populate_write,
+                                  unsigned long *host_cpus,
+                                  unsigned long nbits)
 {
     static gsize initialized = 0;
-    MemsetContext context = {
-        .num_threads = get_memset_num_threads(hpagesize, numpages, smp_cpus),
-    };
     size_t numpages_per_thread, leftover;
     void *(*touch_fn)(void *);
-    int ret = 0, i = 0;
     char *addr = area;
+    int i;
 
     if (g_once_init_enter(&initialized)) {
         qemu_mutex_init(&page_mutex);
@@ -546,44 +574,47 @@ static int touch_all_pages(char *area, size_t hpagesize, size_t numpages,
     }
 
     if (use_madv_populate_write) {
-        /* Avoid creating a single thread for MADV_POPULATE_WRITE */
-        if (context.num_threads == 1) {
-            if (qemu_madvise(area, hpagesize * numpages,
-                             QEMU_MADV_POPULATE_WRITE)) {
-                return -errno;
-            }
-            return 0;
-        }
         touch_fn = do_madv_populate_write_pages;
     } else {
         touch_fn = do_touch_pages;
     }
 
-    context.threads = g_new0(MemsetThread, context.num_threads);
-    numpages_per_thread = numpages / context.num_threads;
-    leftover = numpages % context.num_threads;
-    for (i = 0; i < context.num_threads; i++) {
-        context.threads[i].addr = addr;
-        context.threads[i].numpages = numpages_per_thread + (i < leftover);
-        context.threads[i].hpagesize = hpagesize;
-        context.threads[i].context = &context;
-        qemu_thread_create(&context.threads[i].pgthread, "touch_pages",
-                           touch_fn, &context.threads[i],
+    context->threads = g_new0(MemsetThread, context->num_threads);
+    numpages_per_thread = numpages / context->num_threads;
+    leftover = numpages % context->num_threads;
+    for (i = 0; i < context->num_threads; i++) {
+        context->threads[i].addr = addr;
+        context->threads[i].numpages = numpages_per_thread + (i < leftover);
+        context->threads[i].hpagesize = hpagesize;
+        context->threads[i].context = context;
+        qemu_thread_create(&context->threads[i].pgthread, "touch_pages",
+                           touch_fn, &context->threads[i],
                            QEMU_THREAD_JOINABLE);
-        addr += context.threads[i].numpages * hpagesize;
+        /* Best effort: the threads wait for all_threads_created below */
+        if (host_cpus) {
+            qemu_thread_set_affinity(&context->threads[i].pgthread,
+                                     host_cpus, nbits);
+        }
+        addr += context->threads[i].numpages * hpagesize;
     }
 
     if (!use_madv_populate_write) {
-        sigbus_memset_context = &context;
+        sigbus_memset_context = context;
     }
 
     qemu_mutex_lock(&page_mutex);
-    context.all_threads_created = true;
+    context->all_threads_created = true;
     qemu_cond_broadcast(&page_cond);
     qemu_mutex_unlock(&page_mutex);
+}
+
+static int touch_all_pages_join(MemsetContext *context,
+                                bool use_madv_populate_write)
+{
+    int ret = 0, i;
 
-    for (i = 0; i < context.num_threads; i++) {
-        int tmp = (uintptr_t)qemu_thread_join(&context.threads[i].pgthread);
+    for (i = 0; i < context->num_threads; i++) {
+        int tmp = (uintptr_t)qemu_thread_join(&context->threads[i].pgthread);
 
         if (tmp) {
             ret = tmp;
@@ -593,11 +624,38 @@ static int touch_all_pages(char *area, size_t hpagesize, size_t numpages,
     if (!use_madv_populate_write) {
         sigbus_memset_context = NULL;
     }
-    g_free(context.threads);
+    g_free(context->threads);
+    context->threads = NULL;
 
     return ret;
 }
 
+static int touch_all_pages(char *area, size_t hpagesize, size_t numpages,
+                           int smp_cpus, bool use_madv_populate_write,
+                           unsigned long *host_cpus, unsigned long nbits)
+{
+    MemsetContext context = {
+        .num_threads = get_memset_num_threads(hpagesize, numpages, smp_cpus,
+                                              host_cpus, nbits),
+    };
+
+    /*
+     * Avoid creating a single thread for MADV_POPULATE_WRITE, unless the
+     * thread has to run elsewhere than the caller.
+     */
+    if (use_madv_populate_write && context.num_threads == 1 && !host_cpus) {
+        if (qemu_madvise(area, hpagesize * numpages,
+                         QEMU_MADV_POPULATE_WRITE)) {
+            return -errno;
+        }
+        return 0;
+    }
+
+    touch_all_pages_start(&context, area, hpagesize, numpages,
+                          use_madv_populate_write, host_cpus, nbits);
+    return touch_all_pages_join(&context, use_madv_populate_write);
+}
+
 static bool madv_populate_write_possible(char *area, size_t pagesize)
 {
     return !qemu_madvise(area, pagesize, QEMU_MADV_POPULATE_WRITE) ||
@@ -605,6 +663,7 @@ static bool madv_populate_write_possible(char *area, size_t pagesize)
 }
 
 void os_mem_prealloc(int fd, char *area, size_t memory, int smp_cpus,
+                     unsigned long *host_cpus, unsigned long nbits,
                      Error **errp)
 {
     static gsize initialized;
@@ -647,7 +706,7 @@ void os_mem_prealloc(int fd, char *area, size_t memory, int smp_cpus,
 
     /* touch pages simultaneously */
     ret = touch_all_pages(area, hpagesize, numpages, smp_cpus,
-                          use_madv_populate_write);
+                          use_madv_populate_write, host_cpus, nbits);
     if (ret) {
         error_setg_errno(errp, -ret,
                          "os_mem_prealloc: preallocating memory failed");
@@ -664,6 +723,69 @@ void os_mem_prealloc(int fd, char *area, size_t memory, int smp_cpus,
     }
 }
 
+struct MemPreallocJob {
+    MemsetContext context;
+    bool started;
+};
+
+MemPreallocJob *os_mem_prealloc_start(int fd, char *area, size_t memory,
+                                      int smp_cpus, unsigned long *host_cpus,
+                                      unsigned long nbits,
+                                      void (*done)(void *opaque),
+                                      void *opaque, Error **errp)
+{
+    ERRP_GUARD();
+    size_t hpagesize = qemu_fd_getpagesize(fd);
+    size_t numpages = DIV_ROUND_UP(memory, hpagesize);
+    MemPreallocJob *job;
+
+    /*
+     * Reading and writing back each page would race with the guest writing
+     * to it; only MADV_POPULATE_WRITE leaves the contents alone.  Without
+     * it, preallocate before returning.
+     */
+    if (!madv_populate_write_possible(area, hpagesize)) {
+        warn_report("os_mem_prealloc: MADV_POPULATE_WRITE is not available, "
+                    "preallocating in the foreground");
+        os_mem_prealloc(fd, area, memory, smp_cpus, host_cpus, nbits, errp);
+        if (*errp) {
+            return NULL;
+        }
+        job = g_new0(MemPreallocJob, 1);
+        done(opaque);
+        return job;
+    }
+
+    job = g_new0(MemPreallocJob, 1);
+    job->context.num_threads = get_memset_num_threads(hpagesize, numpages,
+                                                      smp_cpus, host_cpus,
+                                                      nbits);
+    job->context.threads_running = job->context.num_threads;
+    job->context.done = done;
+    job->context.opaque = opaque;
+    job->started = true;
+    touch_all_pages_start(&job->context, area, hpagesize, numpages, true,
+                          host_cpus, nbits);
+    return job;
+}
+
+bool os_mem_prealloc_finish(MemPreallocJob *job, Error **errp)
+{
+    int ret = 0;
+
+    if (job->started) {
+        ret = touch_all_pages_join(&job->context, true);
+    }
+    g_free(job);
+
+    if (ret) {
+        error_setg_errno(errp, -ret,
+                         "os_mem_prealloc: preallocating memory failed");
+        return false;
+    }
+    return true;
+}
+
 char *qemu_get_pid_name(pid_t pid)
 {
     char *name = NULL;
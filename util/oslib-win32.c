@@ -336,6 +336,7 @@ int getpagesize(void)
 }
 
 void os_mem_prealloc(int fd, char *area, size_t memory, int smp_cpus,
+                     unsigned long *host_cpus, unsigned long nbits,
                      Error **errp)
 {
     int i;
@@ -347,6 +348,32 @@ void os_mem_prealloc(int fd, char *area, size_t memory, int smp_cpus,
     }
 }
 
+struct MemPreallocJob {
+    int unused;
+};
+
+MemPreallocJob *os_mem_prealloc_start(int fd, char *area, size_t memory,
+                                      int smp_cpus, unsigned long *host_cpus,
+                                      unsigned long nbits,
+                                      void (*done)(void *opaque),
+                                      void *opaque, Error **errp)
+{
+    ERRP_GUARD();
+
+    os_mem_prealloc(fd, area, memory, smp_cpus, host_cpus, nbits, errp);
+    if (*errp) {
+        return NULL;
+    }
+    done(opaque);
+    return g_new0(MemPreallocJob, 1);
+}
+
+bool os_mem_prealloc_finish(MemPreallocJob *job, Error **errp)
+{
+    g_free(job);
+    return true;
+}
+
 char *qemu_get_pid_name(pid_t pid)
 {
     /* XXX Implement me */